@@ -9,6 +9,8 @@
 #include <pwd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
 #include "../src/lab.h"
 
 struct background_job {
@@ -16,13 +18,16 @@ struct background_job {
     pid_t pid;
     char *command;
     int done;
+    uint64_t started;
+    bool counted;              // perf holds counters for this job
+    struct perf_job perf;
     struct background_job *next;
 };
 
 struct background_job *bg_jobs = NULL;
 int job_counter = 1;
 
-void add_background_job(pid_t pid, char **cmd) {
+void add_background_job(pid_t pid, char **cmd, const struct perf_job *perf) {
     struct background_job *job = malloc(sizeof(struct background_job));
     job->job_number = job_counter++;
     job->pid = pid;
@@ -45,12 +50,15 @@ void add_background_job(pid_t pid, char **cmd) {
     }
 
     job->done = 0;
+    job->started = stats_now();
+    job->counted = perf != NULL;
+    if (perf) job->perf = *perf;
     job->next = bg_jobs;
     bg_jobs = job;
     printf("[%d] %d Running %s\n", job->job_number, job->pid, job->command);
 }
 
-void print_jobs() {
+int print_jobs(bool long_format) {
     // Count the number of jobs
     int job_count = 0;
     struct background_job *job = bg_jobs;
@@ -59,34 +67,50 @@ void print_jobs() {
         job = job->next;
     }
 
-    // Collect jobs into an array
+    // Jobs are added at the front with increasing numbers, so filling the
+    // array from the back leaves it sorted by job number
     struct background_job **job_array = malloc(job_count * sizeof(struct background_job *));
+    if (job_count && !job_array) {
+        perror("jobs");
+        return 1;
+    }
     job = bg_jobs;
-    for (int i = 0; i < job_count; i++) {
+    for (int i = job_count - 1; i >= 0; i--) {
         job_array[i] = job;
         job = job->next;
     }
 
-    // Sort the array by job number
-    for (int i = 0; i < job_count - 1; i++) {
-        for (int j = 0; j < job_count - i - 1; j++) {
-            if (job_array[j]->job_number > job_array[j + 1]->job_number) {
-                struct background_job *temp = job_array[j];
-                job_array[j] = job_array[j + 1];
-                job_array[j + 1] = temp;
-            }
-        }
-    }
-
     // Print the jobs in sorted order
-    for (int i = 0; i < job_count; i++) {
+    struct outbuf ob;
+    ob_init(&ob, STDOUT_FILENO);
+    for (int i = 0; i < job_count && !ob.error; i++) {
         job = job_array[i];
+        ob_write(&ob, "[", 1);
+        ob_putu(&ob, (unsigned)job->job_number);
         if (job->done) {
-            printf("[%d] Done    %s\n", job->job_number, job->command);
+            ob_write(&ob, "] ", 2);
+            if (long_format) {
+                ob_putu(&ob, (unsigned)job->pid);
+                ob_write(&ob, " ", 1);
+            }
+            ob_write(&ob, "Done    ", 8);
         } else {
-            printf("[%d] %d Running %s\n", job->job_number, job->pid, job->command);
+            ob_write(&ob, "] ", 2);
+            ob_putu(&ob, (unsigned)job->pid);
+            ob_write(&ob, " Running ", 9);
+        }
+        ob_puts(&ob, job->command ? job->command : "");
+        ob_write(&ob, "\n", 1);
+
+        // Running jobs show what they have counted so far
+        if (long_format && job->counted) {
+            if (!job->done) perf_read(&job->perf);
+            ob_write(&ob, "    ", 4);
+            perf_print(&ob, &job->perf);
+            ob_write(&ob, "\n", 1);
         }
     }
+    int rval = ob_flush(&ob) < 0 ? 1 : 0;
 
     // Remove and free done jobs
     struct background_job *prev = NULL;
@@ -110,11 +134,39 @@ void print_jobs() {
 
     // Free the job array
     free(job_array);
+    return rval;
+}
+
+// Count the background jobs and hand their numbers to tab completion
+int count_background_jobs(struct shell *sh) {
+    int count = 0;
+    for (struct background_job *job = bg_jobs; job != NULL; job = job->next) {
+        count++;
+    }
+    if (sh->completer && count > 0) {
+        int *ids = malloc(count * sizeof(int));
+        if (ids) {
+            int i = 0;
+            for (struct background_job *job = bg_jobs; job != NULL; job = job->next) {
+                ids[i++] = job->job_number;
+            }
+            comp_set_jobs(sh->completer, ids, (size_t)count);
+            free(ids);
+        }
+    } else {
+        comp_set_jobs(sh->completer, NULL, 0);
+    }
+    return count;
 }
 
 void check_background_jobs() {
     struct background_job *job = bg_jobs;
     while (job != NULL) {
+        // Already reaped, waiting again would only fail with ECHILD
+        if (job->done) {
+            job = job->next;
+            continue;
+        }
         int status;
         pid_t result = waitpid(job->pid, &status, WNOHANG);
         if (result == 0) {
@@ -125,8 +177,17 @@ void check_background_jobs() {
             perror("waitpid");
             job = job->next;
         } else {
-            // Process has finished
+            // Process has finished, SIGCHLD tells us roughly when
             job->done = 1;
+            uint64_t now = stats_now(), exited = stats_last_exit();
+            if (exited < job->started || exited > now) exited = now;
+            stats_record(STAT_RUN, exited - job->started);
+            stats_record(STAT_REAP_LAG, now - exited);
+            stats_add(STAT_REAPED, 1);
+            if (job->counted) {
+                perf_close(&job->perf);
+                perf_account(&job->perf);
+            }
             job = job->next;
         }
     }
@@ -136,6 +197,7 @@ void free_background_jobs() {
     struct background_job *job = bg_jobs;
     while (job != NULL) {
         struct background_job *next = job->next;
+        if (job->counted) perf_close(&job->perf);
         free(job->command);
         free(job);
         job = next;
@@ -171,24 +233,65 @@ void terminate_background_jobs() {
     }
 }
 
+int builtin_jobs(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    bool long_format = argv[1] && strcmp(argv[1], "-l") == 0;
+    if (argv[1] && (!long_format || argv[2])) {
+        fprintf(stderr, "Usage: jobs [-l]\n");
+        return 2;
+    }
+    int rval = print_jobs(long_format);
+    remove_done_jobs();
+    return rval;
+}
+
+// What perfstat prints when its command is done, perf stat style on stderr
+static void perfstat_report(struct perf_job *perf, uint64_t elapsed_ns) {
+    perf_close(perf);
+    perf_account(perf);
+    struct outbuf ob;
+    ob_init(&ob, STDERR_FILENO);
+    ob_puts(&ob, "perfstat: ");
+    perf_print(&ob, perf);
+    ob_printf(&ob, " elapsed=%.3fs\n", elapsed_ns / 1e9);
+    ob_flush(&ob);
+}
+
+static void child_exited(int sig) {
+    UNUSED(sig);
+    stats_child_exited();
+}
 
 int main(int argc, char **argv)
 {
     int opt;
 
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "v")) != -1) {
+    const char *trace_path = getenv("MY_TRACE");
+    bool perf_all = false;
+    while ((opt = getopt(argc, argv, "vt:p")) != -1) {
         switch (opt) {
             case 'v':
                 // Print version and exit
                 printf("Version: %d.%d\n", lab_VERSION_MAJOR, lab_VERSION_MINOR);
                 return 0;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'p':
+                perf_all = true;
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-v]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-v] [-p] [-t tracefile]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
+    // Tracing starts before anything else so the startup shows up as well
+    if (trace_path && *trace_path && trace_start(trace_path) < 0) {
+        perror(trace_path);
+    }
+
      // Ignore specific signals in the parent process
     signal(SIGINT, SIG_IGN);
     signal(SIGQUIT, SIG_IGN);
@@ -196,6 +299,18 @@ int main(int argc, char **argv)
     signal(SIGTTIN, SIG_IGN);
     signal(SIGTTOU, SIG_IGN);
 
+    // A reader that goes away shows up as EPIPE from write, builtins stop
+    // printing instead of the whole shell being killed
+    signal(SIGPIPE, SIG_IGN);
+
+    // Only to time how long finished background jobs wait to be reaped,
+    // interrupted calls carry on
+    struct sigaction sa = {0};
+    sa.sa_handler = child_exited;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
     // Initialize the shell
     struct shell sh;
     sh_init(&sh);
@@ -203,31 +318,57 @@ int main(int argc, char **argv)
     //Initialize history
     using_history();
 
-    // Get maximum argument length
-    long arg_max = sysconf(_SC_ARG_MAX);
-    if (arg_max == -1) {
-        perror("sysconf");
-        exit(EXIT_FAILURE);
+    // The job list lives here so jobs is registered like any other builtin
+    builtin_register("jobs", builtin_jobs);
+
+    // Say once what -p is not going to be able to count
+    if (perf_all) {
+        struct perf_job probe;
+        perf_open(&probe, 0, false);
+        perf_close(&probe);
+        perf_explain(argv[0], &probe);
     }
+    TRACE("startup");
 
     // Main loop for the shell
     while (1) {
 
+        // The last command's spans go out while nothing is being timed
+        trace_flush();
+        TRACE("flush");
+
         // Check for finished background jobs
         check_background_jobs();
-
-        char *line = readline(sh.prompt);
+        TRACE("reap");
+
+        // Pick up our last command and anything other shells added
+        sh_history_sync(&sh);
+
+        // The last command may have changed variables, moved us or
+        // touched the work tree. environ is built once here, before the
+        // next command or the git worker can use it.
+        sh_syncenv(&sh);
+        vcs_refresh(sh.vcs);
+        comp_refresh(sh.completer, getenv("PATH"));
+        comp_set_history(sh.completer, sh.history);
+        TRACE("refresh");
+
+        sh.job_count = count_background_jobs(&sh);
+        const char *prompt = prompt_render(sh.prompt_cache, &sh);
+        TRACE("prompt");
+        char *line = readline(prompt);
+        TRACE("readline");
+        uint64_t allocs = stats_allocs();
         if (!line) {
-             // Handle EOF or read error
-            if (feof(stdin)) {
-                printf("\n");
-                break;
-            }
-            continue;
+            // Handle EOF, readline reads the descriptor directly so the
+            // stdio EOF flag is never set when input is not a terminal
+            printf("\n");
+            break;
         }
 
         // Trim leading and trailing whitespace
         char *trimmed_line = trim_white(line);
+        TRACE("trim_white");
 
         // Skip empty commands
         if (*trimmed_line == '\0') {
@@ -235,24 +376,26 @@ int main(int argc, char **argv)
             continue;
         }
 
-        if (*trimmed_line) {
-            add_history(trimmed_line);
-        }
-
-         // Check if the command is "jobs"
-        if (strcmp(trimmed_line, "jobs") == 0) {
-            print_jobs();
-            remove_done_jobs();
+        // History references are resolved before anything else looks at
+        // the line, and bash style the result is echoed
+        char *expanded;
+        int rval = hist_expand(sh.history, trimmed_line, &expanded);
+        if (rval < 0) {
+            sh.last_status = 1;
             free(line);
             continue;
         }
-
-         // Check if the command is "exit"
-        if (strcmp(trimmed_line, "exit") == 0) {
+        if (rval > 0) {
+            printf("%s\n", expanded);
             free(line);
-            terminate_background_jobs(); // Terminate all background jobs
-            break;
+            line = expanded;
+            trimmed_line = line;
+        }
+
+        if (*trimmed_line) {
+            hist_add(sh.history, trimmed_line);
         }
+        TRACE("history");
 
         // Check if the command should run in the background
         int background = 0;
@@ -263,27 +406,95 @@ int main(int argc, char **argv)
             trimmed_line = trim_white(trimmed_line); // Trim any trailing whitespace
         }
 
+        // Aliases only touch the front of the line, before it is split
+        uint64_t parse_start = stats_now();
+        char *aliased = alias_expand(sh.aliases, trimmed_line);
+
         // Parse the command line
-        char **cmd = malloc(arg_max * sizeof(char *));
+        char **cmd = cmd_parse(aliased ? aliased : trimmed_line);
+        free(aliased);
+        stats_record(STAT_PARSE, stats_now() - parse_start);
+        TRACE("parse");
         if (cmd == NULL) {
-            perror("malloc");
+            perror("cmd_parse");
+            free(line);
+            continue;
+        }
+
+        // Variables first, then *, ? and [...] in what they expanded to
+        char **expanded_vars = vars_argv(&sh, cmd);
+        if (expanded_vars == NULL) {
+            perror("expand");
+            cmd_free(cmd);
+            free(line);
+            continue;
+        }
+        if (expanded_vars != cmd) {
+            cmd_free(cmd);
+            cmd = expanded_vars;
+        }
+        char **globbed = glob_argv(&sh, cmd);
+        if (globbed == NULL) {
+            perror("glob");
+            cmd_free(cmd);
             free(line);
             continue;
         }
+        if (globbed != cmd) {
+            cmd_free(cmd);
+            cmd = globbed;
+        }
+        TRACE("expand");
+
+        // perfstat in front counts just this command, -p counts every job
+        bool perfstat = cmd[0] && strcmp(cmd[0], "perfstat") == 0;
+        if (perfstat) {
+            size_t n = 0;
+            while (cmd[n]) n++;
+            free(cmd[0]);
+            memmove(cmd, cmd + 1, n * sizeof(char *));
+            if (!cmd[0]) {
+                fprintf(stderr, "Usage: perfstat command [args]\n");
+                sh.last_status = 2;
+            }
+        }
+        struct perf_job perf;
+        bool counted = false;
 
-        char *token;
-        int argc = 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-        token = strtok(trimmed_line, " ");
-        while (token != NULL && argc < arg_max - 1) {
-            cmd[argc++] = strdup(token);
-            token = strtok(NULL, " ");
+        // A builtin runs in the shell so the shell is what gets counted
+        uint64_t perf_start = stats_now();
+        if (perfstat && cmd[0] && builtin_lookup(cmd[0])) {
+            counted = perf_open(&perf, 0, false) > 0;
+            perf_explain("perfstat", &perf);
         }
-        cmd[argc] = NULL;
 
-        if (cmd[0] && !do_builtin(&sh, cmd)) {
+        if (cmd[0] && do_builtin(&sh, cmd)) {
+            TRACE("builtin");
+            stats_add(STAT_COMMANDS, 1);
+            stats_add(STAT_BUILTINS, 1);
+            if (counted) perfstat_report(&perf, stats_now() - perf_start);
+        } else if (cmd[0]) {
+            TRACE("dispatch");
+            stats_add(STAT_COMMANDS, 1);
+
+            // The child holds off exec until its counters are in place,
+            // closing the write end lets it go
+            int go[2] = {-1, -1};
+            if ((perfstat || perf_all) && pipe(go) < 0) {
+                perror("perfstat");
+                go[0] = go[1] = -1;
+            }
+            for (int i = 0; i < 2 && go[i] >= 0; i++) {
+                fcntl(go[i], F_SETFD, FD_CLOEXEC);
+            }
+
             // Execute external command
+            uint64_t fork_start = stats_now();
             pid_t pid = fork();
+            TRACE("fork");
             if (pid == 0) {
                 // This is the child process
                 pid_t child = getpid();
@@ -295,6 +506,8 @@ int main(int argc, char **argv)
                 signal(SIGTSTP, SIG_DFL);
                 signal(SIGTTIN, SIG_DFL);
                 signal(SIGTTOU, SIG_DFL);
+                signal(SIGPIPE, SIG_DFL);
+                signal(SIGCHLD, SIG_DFL);
 
                 if (background) {
                 // Redirect stdout and stderr to /dev/null for background processes
@@ -302,39 +515,86 @@ int main(int argc, char **argv)
                 freopen("/dev/null", "w", stderr);
                 }
 
+                if (go[0] >= 0) {
+                    char c;
+                    close(go[1]);
+                    while (read(go[0], &c, 1) < 0 && errno == EINTR)
+                        ;
+                    close(go[0]);
+                }
+
+                TRACE("exec");
                 execvp(cmd[0], cmd);
                 perror("execvp");
                 exit(EXIT_FAILURE);
             } else if (pid > 0) {
                 // This is the parent process
+                stats_record(STAT_FORK, stats_now() - fork_start);
+                stats_add(STAT_EXTERNAL, 1);
                 setpgid(pid, pid);
+                if (go[0] >= 0) {
+                    close(go[0]);
+                    counted = perf_open(&perf, pid, true) > 0;
+                    close(go[1]);
+                    if (perfstat) perf_explain("perfstat", &perf);
+                }
                 if (background) {
-                    add_background_job(pid, cmd);
+                    stats_add(STAT_BACKGROUND, 1);
+                    add_background_job(pid, cmd, counted ? &perf : NULL);
+                    sh.last_bg = pid;
+                    TRACE("background");
                 } else {
                     tcsetpgrp(STDIN_FILENO, pid);
 
                     // Wait for the child process to finish
                     int status;
                     waitpid(pid, &status, WUNTRACED);
+                    TRACE("wait");
+                    uint64_t run = stats_now() - fork_start;
+                    stats_record(STAT_RUN, run);
+                    if (counted && perfstat) {
+                        perfstat_report(&perf, run);
+                    } else if (counted) {
+                        perf_close(&perf);
+                        perf_account(&perf);
+                    }
+                    if (WIFEXITED(status)) {
+                        sh.last_status = WEXITSTATUS(status);
+                    } else if (WIFSIGNALED(status)) {
+                        sh.last_status = 128 + WTERMSIG(status);
+                    }
 
                     // Restore the shell as the foreground process group
                     tcsetpgrp(STDIN_FILENO, getpgrp());
                 }
             } else {
+                stats_add(STAT_FORK_FAILED, 1);
                 perror("fork");
+                if (go[0] >= 0) {
+                    close(go[0]);
+                    close(go[1]);
+                }
             }
         }
 
-        // Free the allocated memory for cmd
-        for (int i = 0; i < argc; i++) {
-            free(cmd[i]);
-        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        sh.last_elapsed_ns = (end.tv_sec - start.tv_sec) * 1000000000LL +
+                             (end.tv_nsec - start.tv_nsec);
 
-        free(cmd);
+        // Free the allocated memory for cmd
+        cmd_free(cmd);
         free(line);
+        // Unless stats --reset cleared the count under us
+        if (stats_allocs() >= allocs) stats_record(STAT_ALLOCS, stats_allocs() - allocs);
+
+        if (sh.should_exit) {
+            terminate_background_jobs(); // Terminate all background jobs
+            break;
+        }
     }
 
     free_background_jobs();
+    trace_stop();
     sh_destroy(&sh);
-    return 0;
+    return sh.last_status;
 }
\ No newline at end of file
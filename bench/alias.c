@@ -0,0 +1,61 @@
+// What alias expansion adds to every command with a thousand aliases
+// defined: a first word that is not an alias, one that is, and a chain of
+// aliases, next to cmd_parse on the same line for scale.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/lab.h"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void) {
+    static const char *lines[][2] = {
+        {"not an alias", "make -j8 all"},
+        {"one alias", "ll /var/log"},
+        {"chain of 3", "deploy --dry-run"},
+        {"self reference", "ls -a"},
+    };
+    const int reps = 1000000;
+    char name[32], value[64];
+
+    struct aliases *al = alias_new();
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "cmd%d", i);
+        snprintf(value, sizeof(value), "/usr/bin/tool%d --verbose", i);
+        if (alias_set(al, name, value) < 0) return 1;
+    }
+    alias_set(al, "ll", "ls -l");
+    alias_set(al, "ls", "ls --color=auto");
+    alias_set(al, "deploy", "run deploy.sh");
+    alias_set(al, "run", "sudo ");
+    alias_set(al, "sudo", "sudo -E ");
+
+    for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); l++) {
+        double start = now_ns();
+        size_t expanded = 0;
+        for (int r = 0; r < reps; r++) {
+            char *out = alias_expand(al, lines[l][1]);
+            if (out) expanded++;
+            free(out);
+        }
+        double alias_ns = (now_ns() - start) / reps;
+
+        start = now_ns();
+        for (int r = 0; r < reps / 10; r++) {
+            cmd_free(cmd_parse(lines[l][1]));
+        }
+        double parse_ns = (now_ns() - start) / (reps / 10);
+        char *out = alias_expand(al, lines[l][1]);
+        printf("%-15s alias=%6.1fns cmd_parse=%6.1fns -> %s\n", lines[l][0], alias_ns, parse_ns,
+               out ? out : lines[l][1]);
+        free(out);
+        if (expanded != 0 && expanded != (size_t)reps) return 1;
+    }
+    alias_free(al);
+    return 0;
+}
@@ -0,0 +1,189 @@
+// A small harness for the benchmarks that want more than one timing: each
+// case is calibrated until a sample takes BENCH_SAMPLE_NS, then run for
+// BENCH_SAMPLES samples, and the median, spread and a 95% confidence
+// interval of the mean are reported along with the allocations and bytes
+// the shell's own code asked for per operation (see stats_allocs).
+//
+// Results are printed as a table, and when BENCH_JSON_DIR is set (make
+// bench sets it to build/bench) also written to <dir>/<suite>.json so
+// runs can be kept and compared.
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include "../src/lab.h"
+
+#define BENCH_SAMPLES 15
+#define BENCH_SAMPLE_NS 5000000.0
+#define BENCH_MAX_RESULTS 64
+
+// What's timed is run, setup and teardown get the same iteration count
+// and are not timed or counted
+struct bench_case {
+    const char *name;
+    const char *corpus;
+    void (*setup)(void *arg, size_t iters);
+    void (*run)(void *arg, size_t iters);
+    void (*teardown)(void *arg, size_t iters);
+    void *arg;
+};
+
+struct bench_result {
+    const char *name;
+    const char *corpus;
+    size_t iters;          // Per sample
+    size_t samples;
+    double median, mean, min, max, stddev, ci95;  // ns per op
+    double allocs, bytes;  // Per op
+};
+
+struct bench_suite {
+    const char *name;
+    size_t n;
+    struct bench_result results[BENCH_MAX_RESULTS];
+};
+
+static inline double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline int bench_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Summarize samples in place, sorting them
+static inline void bench_summary(struct bench_result *r, double *v, size_t n) {
+    qsort(v, n, sizeof(double), bench_cmp);
+    double sum = 0, sq = 0;
+    for (size_t i = 0; i < n; i++) sum += v[i];
+    r->samples = n;
+    r->mean = sum / n;
+    for (size_t i = 0; i < n; i++) sq += (v[i] - r->mean) * (v[i] - r->mean);
+    r->stddev = n > 1 ? sqrt(sq / (n - 1)) : 0;
+    r->ci95 = 1.96 * r->stddev / sqrt((double)n);
+    r->median = n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+    r->min = v[0];
+    r->max = v[n - 1];
+}
+
+static inline double bench_sample(const struct bench_case *c, size_t iters) {
+    if (c->setup) c->setup(c->arg, iters);
+    double start = bench_now();
+    c->run(c->arg, iters);
+    double ns = bench_now() - start;
+    if (c->teardown) c->teardown(c->arg, iters);
+    return ns;
+}
+
+static inline void bench_run(struct bench_suite *s, const struct bench_case *c) {
+    if (s->n == BENCH_MAX_RESULTS) return;
+    struct bench_result *r = &s->results[s->n++];
+    memset(r, 0, sizeof(*r));
+    r->name = c->name;
+    r->corpus = c->corpus;
+
+    // Double until a sample is long enough to time, which warms up too
+    size_t iters = 1;
+    while (bench_sample(c, iters) < BENCH_SAMPLE_NS) iters *= 2;
+    r->iters = iters;
+
+    double v[BENCH_SAMPLES];
+    uint64_t allocs = 0, bytes = 0;
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        if (c->setup) c->setup(c->arg, iters);
+        uint64_t a = stats_allocs(), b = stats_alloc_bytes();
+        double start = bench_now();
+        c->run(c->arg, iters);
+        v[i] = (bench_now() - start) / iters;
+        allocs += stats_allocs() - a;
+        bytes += stats_alloc_bytes() - b;
+        if (c->teardown) c->teardown(c->arg, iters);
+    }
+    bench_summary(r, v, BENCH_SAMPLES);
+    r->allocs = (double)allocs / (iters * BENCH_SAMPLES);
+    r->bytes = (double)bytes / (iters * BENCH_SAMPLES);
+
+    printf("  %-14s %-12s %10.1fns ±%5.1f%% %9.2f allocs %10.1f bytes\n", r->name, r->corpus,
+           r->median, r->mean ? 100 * r->ci95 / r->mean : 0, r->allocs, r->bytes);
+}
+
+static inline void bench_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', fp);
+        if ((unsigned char)*s < 0x20) {
+            fprintf(fp, "\\u%04x", *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Start <BENCH_JSON_DIR>/<suite>.json with what was run where. NULL with
+// an empty path if BENCH_JSON_DIR is not set, or with the path if the file
+// can't be made. The caller adds its own members, each starting with a
+// comma.
+static inline FILE *bench_json_open(const char *suite, char *path, size_t len) {
+    const char *dir = getenv("BENCH_JSON_DIR");
+    *path = '\0';
+    if (!dir || !*dir) return NULL;
+    snprintf(path, len, "%s/%s.json", dir, suite);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+
+    struct utsname un;
+    if (uname(&un) < 0) memset(&un, 0, sizeof(un));
+    fprintf(fp, "{\"suite\":");
+    bench_json_string(fp, suite);
+    fprintf(fp, ",\"time\":%lld,\"host\":{\"machine\":", (long long)time(NULL));
+    bench_json_string(fp, un.machine);
+    fprintf(fp, ",\"release\":");
+    bench_json_string(fp, un.release);
+    fprintf(fp, ",\"cpus\":%ld}", sysconf(_SC_NPROCESSORS_ONLN));
+    return fp;
+}
+
+static inline int bench_json_close(FILE *fp, const char *path) {
+    fprintf(fp, "}\n");
+    if (fclose(fp) != 0) {
+        perror(path);
+        return -1;
+    }
+    printf("  results in %s\n", path);
+    return 0;
+}
+
+// Write the suite's results if BENCH_JSON_DIR is set
+static inline int bench_write_json(const struct bench_suite *s) {
+    char path[4096];
+    FILE *fp = bench_json_open(s->name, path, sizeof(path));
+    if (!fp) return *path ? -1 : 0;
+    fprintf(fp, ",\"samples\":%d,\"results\":[", BENCH_SAMPLES);
+    for (size_t i = 0; i < s->n; i++) {
+        const struct bench_result *r = &s->results[i];
+        fprintf(fp, "%s\n{\"name\":", i ? "," : "");
+        bench_json_string(fp, r->name);
+        fprintf(fp, ",\"corpus\":");
+        bench_json_string(fp, r->corpus);
+        fprintf(fp, ",\"iters\":%zu,\"ns_per_op\":{\"median\":%.2f,\"mean\":%.2f,\"min\":%.2f,"
+                "\"max\":%.2f,\"stddev\":%.2f,\"ci95\":%.2f},\"allocs_per_op\":%.3f,"
+                "\"bytes_per_op\":%.1f}", r->iters, r->median, r->mean, r->min, r->max,
+                r->stddev, r->ci95, r->allocs, r->bytes);
+    }
+    fprintf(fp, "\n]");
+    return bench_json_close(fp, path);
+}
+
+#endif
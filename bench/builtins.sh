@@ -0,0 +1,34 @@
+#!/bin/sh
+# Measure commands/second for a script of test -f and echo calls.
+#
+# Usage: bench/builtins.sh [shell]
+#
+# The shell defaults to ./myprogram, set N to change the number of lines
+# (default 1000000). Run it against a build from before the builtins were
+# added to compare fork+exec with the in-process versions.
+
+SHELL_BIN=${1:-./myprogram}
+N=${N:-1000000}
+
+# Keep the benchmark out of the saved history
+export MY_HISTFILE=
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+awk -v n="$N" 'BEGIN {
+    for (i = 0; i < n; i += 2) {
+        print "test -f /etc/passwd"
+        print "echo hello"
+    }
+    print "exit"
+}' > "$script"
+
+start=$(date +%s.%N)
+"$SHELL_BIN" < "$script" > /dev/null
+end=$(date +%s.%N)
+
+awk -v n="$N" -v s="$start" -v e="$end" -v sh="$SHELL_BIN" 'BEGIN {
+    t = e - s
+    printf "%s: %d commands in %.3fs, %.0f commands/s\n", sh, n, t, n / t
+}'
@@ -0,0 +1,74 @@
+// Command completion over a PATH with ten thousand executables: the scan
+// done by the worker, a refresh when nothing changed, and lookups of
+// prefixes of different lengths.
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/lab.h"
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void free_matches(char **m) {
+    for (size_t i = 0; m && m[i]; i++) free(m[i]);
+    free(m);
+}
+
+int main(void) {
+    static const char *prefixes[] = {"a", "ab", "abc", "abcd", "zzz"};
+    const size_t count = 10000;
+    const int reps = 1000;
+    char dirs[4][32];
+    char path[256] = "";
+    char file[64];
+
+    // Spread the programs over a few directories like a real PATH
+    srand(42);
+    for (int d = 0; d < 4; d++) {
+        snprintf(dirs[d], sizeof(dirs[d]), "/tmp/lab-bench-comp-XXXXXX");
+        if (!mkdtemp(dirs[d])) return 1;
+        strcat(path, d ? ":" : "");
+        strcat(path, dirs[d]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        char name[16];
+        for (int j = 0; j < 8; j++) name[j] = 'a' + rand() % 6;
+        name[8] = '\0';
+        snprintf(file, sizeof(file), "%s/%s", dirs[i % 4], name);
+        close(open(file, O_WRONLY | O_CREAT, 0755));
+    }
+
+    double start = now_ms();
+    struct completer *c = comp_start(path);
+    comp_wait(c);
+    printf("executables=%zu scan=%.2fms\n", count, now_ms() - start);
+
+    start = now_ms();
+    comp_refresh(c, NULL);
+    comp_wait(c);
+    printf("  refresh unchanged=%.3fms\n", now_ms() - start);
+
+    for (size_t p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]); p++) {
+        size_t matches = 0;
+        start = now_ms();
+        for (int r = 0; r < reps; r++) {
+            char **m = comp_command(c, prefixes[p]);
+            for (matches = 0; m && m[matches]; matches++)
+                ;
+            free_matches(m);
+        }
+        printf("  %-6s lookup=%.4fms matches=%zu\n", prefixes[p], (now_ms() - start) / reps,
+               matches > 1 ? matches - 1 : matches);
+    }
+    comp_stop(c);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s %s %s %s", dirs[0], dirs[1], dirs[2], dirs[3]);
+    return system(cmd) == 0 ? 0 : 1;
+}
@@ -0,0 +1,210 @@
+// The library's per command hot paths, cmd_parse, cmd_free, trim_white,
+// get_prompt and do_builtin, over short commands, long argument lists
+// and lines padded with whitespace. See bench.h for how it is measured.
+#include <fcntl.h>
+#include <unistd.h>
+#include "bench.h"
+
+struct corpus {
+    const char *name;
+    const char **lines;
+    size_t n;
+};
+
+static const char *short_lines[] = {
+    "ls -l", "cd /tmp", "git status", "echo hello world", "make -j8",
+    "cat /etc/hostname", "grep -rn TODO src", "vim README.md",
+};
+
+static const char *space_lines[] = {
+    "   \t  ls    -l   \t   /tmp    \t  ",
+    "\t\t\tgit     commit   -m    wip\t\t   ",
+    "      make                                        \t",
+    "  \t  \t  \t  \t  echo   a  \t b   \t  c  \t  \t  \t  ",
+};
+
+// A compiler line with a few hundred arguments, made once
+static char long_line[8192];
+static const char *long_lines[] = {long_line};
+
+static struct corpus corpora[] = {
+    {"short", short_lines, sizeof(short_lines) / sizeof(short_lines[0])},
+    {"long_args", long_lines, 1},
+    {"whitespace", space_lines, sizeof(space_lines) / sizeof(space_lines[0])},
+};
+
+// Parsed lines and anything else a case keeps between setup and teardown
+struct state {
+    const struct corpus *corpus;
+    char ***parsed;
+    char **copies;
+    size_t *cut;           // Where trim_white ends each copy
+    char **prompts;
+    struct shell *sh;
+    int saved;             // stdout while builtins write to /dev/null
+    size_t cap;
+};
+
+static void reserve(struct state *st, size_t iters) {
+    if (iters <= st->cap) return;
+    st->parsed = realloc(st->parsed, iters * sizeof(char **));
+    st->prompts = realloc(st->prompts, iters * sizeof(char *));
+    if (!st->parsed || !st->prompts) exit(1);
+    st->cap = iters;
+}
+
+static void parse_run(void *arg, size_t iters) {
+    struct state *st = arg;
+    const struct corpus *c = st->corpus;
+    for (size_t i = 0; i < iters; i++) st->parsed[i] = cmd_parse(c->lines[i % c->n]);
+}
+
+static void parse_setup(void *arg, size_t iters) {
+    reserve(arg, iters);
+}
+
+static void free_run(void *arg, size_t iters) {
+    struct state *st = arg;
+    for (size_t i = 0; i < iters; i++) cmd_free(st->parsed[i]);
+}
+
+static void free_setup(void *arg, size_t iters) {
+    reserve(arg, iters);
+    parse_run(arg, iters);
+}
+
+// trim_white cuts each copy at the same place every time, so putting that
+// one byte back makes the copy good for the next round
+static void trim_setup(void *arg, size_t iters) {
+    struct state *st = arg;
+    const struct corpus *c = st->corpus;
+    UNUSED(iters);
+    if (st->copies) return;
+    st->copies = calloc(c->n, sizeof(char *));
+    st->cut = calloc(c->n, sizeof(size_t));
+    for (size_t i = 0; i < c->n; i++) {
+        st->copies[i] = strdup(c->lines[i]);
+        char *t = trim_white(st->copies[i]);
+        st->cut[i] = (size_t)(t - st->copies[i]) + strlen(t);
+        strcpy(st->copies[i], c->lines[i]);
+    }
+}
+
+static void trim_run(void *arg, size_t iters) {
+    struct state *st = arg;
+    const struct corpus *c = st->corpus;
+    for (size_t i = 0; i < iters; i++) {
+        size_t k = i % c->n;
+        char *t = trim_white(st->copies[k]);
+        __asm__ volatile("" : : "r"(t) : "memory");
+        st->copies[k][st->cut[k]] = c->lines[k][st->cut[k]];
+    }
+}
+
+static void prompt_run(void *arg, size_t iters) {
+    struct state *st = arg;
+    for (size_t i = 0; i < iters; i++) st->prompts[i] = get_prompt("MY_PROMPT");
+}
+
+static void prompt_teardown(void *arg, size_t iters) {
+    struct state *st = arg;
+    for (size_t i = 0; i < iters; i++) free(st->prompts[i]);
+}
+
+static void parse_teardown(void *arg, size_t iters) {
+    free_run(arg, iters);
+}
+
+// The lines are parsed once, dispatch is what's timed. What the builtins
+// print goes to /dev/null while they run and the table goes to stdout.
+static void builtin_setup(void *arg, size_t iters) {
+    struct state *st = arg;
+    UNUSED(iters);
+    fflush(stdout);
+    st->saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    if (st->parsed) return;
+    st->cap = st->corpus->n;
+    st->parsed = calloc(st->cap, sizeof(char **));
+    for (size_t i = 0; i < st->corpus->n; i++) st->parsed[i] = cmd_parse(st->corpus->lines[i]);
+}
+
+static void builtin_teardown(void *arg, size_t iters) {
+    struct state *st = arg;
+    UNUSED(iters);
+    dup2(st->saved, STDOUT_FILENO);
+    close(st->saved);
+}
+
+static void builtin_run(void *arg, size_t iters) {
+    struct state *st = arg;
+    for (size_t i = 0; i < iters; i++) do_builtin(st->sh, st->parsed[i % st->corpus->n]);
+}
+
+static void state_free(struct state *st, bool parsed) {
+    for (size_t i = 0; parsed && i < st->cap; i++) cmd_free(st->parsed[i]);
+    for (size_t i = 0; st->copies && i < st->corpus->n; i++) free(st->copies[i]);
+    free(st->copies);
+    free(st->cut);
+    free(st->parsed);
+    free(st->prompts);
+}
+
+int main(void) {
+    size_t len = 0;
+    len += snprintf(long_line, sizeof(long_line), "cc -O2 -Wall -Wextra -Iinclude -o app");
+    for (int i = 0; i < 300 && len + 32 < sizeof(long_line); i++) {
+        len += snprintf(long_line + len, sizeof(long_line) - len, " src/module%03d.c", i);
+    }
+
+    struct bench_suite suite = {.name = "core"};
+    printf("core hot paths, median of %d samples with the 95%% CI of the mean\n",
+           BENCH_SAMPLES);
+
+    for (size_t k = 0; k < sizeof(corpora) / sizeof(corpora[0]); k++) {
+        struct state st = {.corpus = &corpora[k]};
+        struct bench_case parse = {"cmd_parse", corpora[k].name, parse_setup, parse_run,
+                                   parse_teardown, &st};
+        bench_run(&suite, &parse);
+        struct bench_case cfree = {"cmd_free", corpora[k].name, free_setup, free_run, NULL, &st};
+        bench_run(&suite, &cfree);
+        struct bench_case trim = {"trim_white", corpora[k].name, trim_setup, trim_run, NULL, &st};
+        bench_run(&suite, &trim);
+        state_free(&st, false);
+    }
+
+    static const char *prompt_lines[] = {""};
+    struct corpus none = {"default", prompt_lines, 1};
+    struct state st = {.corpus = &none};
+    struct bench_case prompt = {"get_prompt", "default", parse_setup, prompt_run,
+                                prompt_teardown, &st};
+    unsetenv("MY_PROMPT");
+    bench_run(&suite, &prompt);
+    setenv("MY_PROMPT", "\\u@\\h \\w \\$ ", 1);
+    prompt.corpus = "MY_PROMPT";
+    bench_run(&suite, &prompt);
+    state_free(&st, false);
+
+    // Builtins that do their work in memory
+    static const char *builtin_lines[] = {
+        "true", "test -f /etc/passwd", "[ 3 -lt 5 ]", "echo hello world", "printf %s\\n x",
+    };
+    static const char *miss_lines[] = {"ls -l", "git status", "make"};
+    struct corpus builtins = {"builtins", builtin_lines, 5};
+    struct corpus misses = {"not_builtin", miss_lines, 3};
+    struct shell sh = {0};
+    struct state bst = {.corpus = &builtins, .sh = &sh};
+    struct state mst = {.corpus = &misses, .sh = &sh};
+    struct bench_case hit = {"do_builtin", "builtins", builtin_setup, builtin_run,
+                             builtin_teardown, &bst};
+    struct bench_case miss = {"do_builtin", "not_builtin", builtin_setup, builtin_run,
+                              builtin_teardown, &mst};
+    bench_run(&suite, &hit);
+    bench_run(&suite, &miss);
+    state_free(&bst, true);
+    state_free(&mst, true);
+
+    return bench_write_json(&suite) < 0 ? 1 : 0;
+}
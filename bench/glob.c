@@ -0,0 +1,89 @@
+// Expanding **/*.c over a tree of half a million files, on one thread and
+// on the pool, without the listing cache and with it, and with bash
+// -O globstar doing the same. The file count can be given as the first
+// argument.
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/lab.h"
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double expand(const char *pattern, struct glob_cache *gc, size_t threads, size_t *n) {
+    char **m;
+    double start = now_ms();
+    if (glob_expand(pattern, gc, threads, &m, n) < 0) exit(1);
+    double ms = now_ms() - start;
+    for (size_t i = 0; i < *n; i++) free(m[i]);
+    free(m);
+    return ms;
+}
+
+int main(int argc, char **argv) {
+    static const char *exts[] = {".c", ".h", ".o", ".txt"};
+    size_t files = argc > 1 ? strtoul(argv[1], NULL, 10) : 500000;
+    const size_t per_dir = 100, fanout = 100;
+    char root[] = "/tmp/lab-bench-glob-XXXXXX";
+    char path[256];
+    if (!mkdtemp(root)) return 1;
+
+    // Two levels of directories with a hundred files in each leaf
+    double start = now_ms();
+    size_t dirs = (files + per_dir - 1) / per_dir;
+    for (size_t d = 0; d < dirs; d++) {
+        if (d % fanout == 0) {
+            snprintf(path, sizeof(path), "%s/mod%zu", root, d / fanout);
+            mkdir(path, 0755);
+        }
+        snprintf(path, sizeof(path), "%s/mod%zu/pkg%zu", root, d / fanout, d % fanout);
+        mkdir(path, 0755);
+        for (size_t f = 0; f < per_dir && d * per_dir + f < files; f++) {
+            snprintf(path, sizeof(path), "%s/mod%zu/pkg%zu/file%zu%s", root, d / fanout,
+                     d % fanout, f, exts[f % 4]);
+            close(open(path, O_WRONLY | O_CREAT, 0644));
+        }
+    }
+    printf("files=%zu dirs=%zu setup=%.0fms\n", files, dirs, now_ms() - start);
+
+    if (chdir(root) < 0) return 1;
+    size_t n;
+    size_t threads[] = {1, 4};
+    for (size_t t = 0; t < 2; t++) {
+        printf("  threads=%zu\n", threads[t]);
+        double ms = expand("**/*.c", NULL, threads[t], &n);
+        printf("    **/*.c no cache   %9.2fms matches=%zu\n", ms, n);
+        ms = expand("**/*.c", NULL, threads[t], &n);
+        printf("    **/*.c again      %9.2fms matches=%zu\n", ms, n);
+
+        struct glob_cache *gc = glob_cache_new(GLOB_CACHE_ENTRIES);
+        ms = expand("**/*.c", gc, threads[t], &n);
+        printf("    **/*.c cache fill %9.2fms matches=%zu\n", ms, n);
+        ms = expand("**/*.c", gc, threads[t], &n);
+        printf("    **/*.c cached     %9.2fms matches=%zu\n", ms, n);
+        ms = expand("mod1/pkg*/file1?.c", gc, threads[t], &n);
+        printf("    narrow cached     %9.2fms matches=%zu\n", ms, n);
+        glob_cache_free(gc);
+    }
+
+    // bash sorts with strcoll, the C locale keeps it to strcmp like us
+    if (access("/bin/bash", X_OK) == 0) {
+        start = now_ms();
+        FILE *p = popen("LC_ALL=C /bin/bash -O globstar -c 'x=(**/*.c); echo ${#x[@]}'", "r");
+        size_t bash_n = 0;
+        if (p && fscanf(p, "%zu", &bash_n) != 1) bash_n = 0;
+        if (p) pclose(p);
+        printf("  **/*.c bash       %9.2fms matches=%zu\n", now_ms() - start, bash_n);
+    }
+
+    char cmd[300];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    return system(cmd) == 0 ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+// Bang expansion on a 1M entry history, against walking the entries the
+// way a history_list() based expansion would.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define ENTRIES 1000000
+#define REPS 10000
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static long scan_prefix(struct history *h, const char *prefix) {
+    size_t len = strlen(prefix);
+    for (size_t i = hist_count(h); i-- > 0;) {
+        if (strncmp(hist_get(h, i), prefix, len) == 0) return (long)i;
+    }
+    return -1;
+}
+
+static void time_expand(struct history *h, const char *line) {
+    char *out;
+    double start = now_ms();
+    for (int r = 0; r < REPS; r++) {
+        if (hist_expand(h, line, &out) > 0) free(out);
+    }
+    printf("  %-28s %.3fus\n", line, (now_ms() - start) * 1e3 / REPS);
+}
+
+int main(void) {
+    struct history *h = hist_open(NULL);
+    char line[64];
+
+    for (int i = 0; i < ENTRIES; i++) {
+        snprintf(line, sizeof(line), "ssh deploy@host%d.example.com", i % 50000);
+        hist_add(h, line);
+    }
+    // Something only found far back in the history
+    hist_add(h, "make release");
+    for (int i = 0; i < ENTRIES / 10; i++) {
+        snprintf(line, sizeof(line), "vim src/file%d.c", i);
+        hist_add(h, line);
+    }
+
+    double start = now_ms();
+    hist_prefix(h, "x", 1);
+    printf("entries=%zu prefix_index_build=%.1fms\n", hist_count(h), now_ms() - start);
+
+    time_expand(h, "!!");
+    time_expand(h, "!12345");
+    time_expand(h, "!-500000");
+    time_expand(h, "!vim");
+    time_expand(h, "!make");
+    time_expand(h, "!ssh deploy@host4");
+    time_expand(h, "echo no references here");
+
+    start = now_ms();
+    for (int r = 0; r < 10; r++) scan_prefix(h, "make");
+    printf("  linear scan for make          %.3fus\n", (now_ms() - start) * 1e3 / 10);
+
+    hist_close(h);
+    return 0;
+}
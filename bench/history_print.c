@@ -0,0 +1,100 @@
+// The history builtin writing 1M entries to /dev/null and to a pipe,
+// against the printf loop it used to be.
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include "../src/lab.h"
+
+#define ENTRIES 1000000
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int printf_history(struct shell *sh, char **argv) {
+    UNUSED(argv);
+    size_t count = hist_count(sh->history);
+    for (size_t i = 0; i < count; i++) {
+        printf("%zu: %s\n", i + 1, hist_get(sh->history, i));
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// Run fn with stdout going to /dev/null, or to a child that reads limit
+// bytes (all of them when limit is 0) and exits
+static double run(builtin_fn fn, struct shell *sh, char **argv, bool piped, size_t limit) {
+    int fds[2] = {-1, -1};
+    pid_t reader = -1;
+    int target;
+
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    if (piped) {
+        if (pipe(fds) < 0) exit(1);
+        reader = fork();
+        if (reader == 0) {
+            close(fds[1]);
+            char buf[65536];
+            size_t got = 0;
+            ssize_t n;
+            while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+                got += (size_t)n;
+                if (limit && got >= limit) break;
+            }
+            _exit(0);
+        }
+        close(fds[0]);
+        target = fds[1];
+    } else {
+        target = open("/dev/null", O_WRONLY);
+    }
+    dup2(target, STDOUT_FILENO);
+    close(target);
+
+    double start = now_ms();
+    fn(sh, argv);
+    double elapsed = now_ms() - start;
+
+    // stdio may still hold output the reader no longer wants
+    fflush(stdout);
+    clearerr(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    if (reader > 0) waitpid(reader, NULL, 0);
+    return elapsed;
+}
+
+int main(void) {
+    struct shell sh = {0};
+    char line[64];
+
+    signal(SIGPIPE, SIG_IGN);
+    sh.history = hist_open(NULL);
+    for (int i = 0; i < ENTRIES; i++) {
+        snprintf(line, sizeof(line), "make -C src/module%d all", i % 5000);
+        hist_add(sh.history, line);
+    }
+
+    builtin_fn history = builtin_lookup("history");
+    char *all[] = {"history", NULL};
+    char *tail[] = {"history", "20", NULL};
+
+    printf("entries=%d\n", ENTRIES);
+    printf("  printf loop  > /dev/null  %.1fms\n", run(printf_history, &sh, all, false, 0));
+    printf("  history      > /dev/null  %.1fms\n", run(history, &sh, all, false, 0));
+    printf("  printf loop  | reader     %.1fms\n", run(printf_history, &sh, all, true, 0));
+    printf("  history      | reader     %.1fms\n", run(history, &sh, all, true, 0));
+    printf("  history      | head -c 4K %.1fms\n", run(history, &sh, all, true, 4096));
+    printf("  history 20   > /dev/null  %.3fms\n", run(history, &sh, tail, false, 0));
+
+    hist_close(sh.history);
+    return 0;
+}
@@ -0,0 +1,74 @@
+// Substring search over histories of different sizes, both the trigram
+// indexed path and the scan used for short patterns.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/lab.h"
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void fill(struct history *h, size_t n) {
+    static const char *templates[] = {
+        "git commit -m 'fix issue %u'",
+        "make -C src/module%u all",
+        "ls -la /var/log/app%u",
+        "ssh deploy@host%u.example.com",
+        "vim src/file%u.c",
+        "grep -rn pattern%u .",
+        "cd /srv/data/%u",
+        "kubectl logs pod-%u --tail 100",
+    };
+    char line[128];
+    srand(42);
+    for (size_t i = 0; i < n; i++) {
+        const char *t = templates[rand() % 8];
+        snprintf(line, sizeof(line), t, (unsigned)(rand() % 100000));
+        hist_add(h, line);
+    }
+}
+
+int main(void) {
+    static const size_t sizes[] = {1000, 10000, 100000, 1000000};
+    static const char *patterns[] = {
+        "host4242.example",  // rare
+        "file9",             // a few percent of entries
+        "commit -m",         // an eighth of the entries
+        "no-such-command",   // no match at all
+        "ls",                // too short for the index
+    };
+    const int reps = 200;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        struct history *h = hist_open(NULL);
+        fill(h, sizes[s]);
+
+        double start = now_ms();
+        hist_search(h, "warmup", hist_count(h));
+        printf("entries=%zu index_build=%.2fms\n", sizes[s], now_ms() - start);
+
+        for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+            start = now_ms();
+            for (int r = 0; r < reps; r++) {
+                hist_search(h, patterns[p], hist_count(h));
+            }
+            double newest = (now_ms() - start) / reps;
+
+            // Walk every match the way history -s does
+            start = now_ms();
+            size_t matches = 0;
+            long i = (long)hist_count(h);
+            while ((i = hist_search(h, patterns[p], (size_t)i)) >= 0) matches++;
+            double all = now_ms() - start;
+
+            printf("  %-18s newest=%.4fms all=%.3fms matches=%zu\n",
+                   patterns[p], newest, all, matches);
+        }
+        hist_close(h);
+    }
+    return 0;
+}
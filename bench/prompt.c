@@ -0,0 +1,50 @@
+// Prompt rendering when nothing changed, when one input changed and when
+// everything is rebuilt from the template every time.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define REPS 1000000
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void) {
+    const char *template = "\\[\\e[32m\\]\\u@\\h\\[\\e[0m\\] \\w \\t [\\? \\j \\E] \\$ ";
+    struct shell sh = {0};
+    struct prompt_cache *pc = prompt_compile(template);
+    size_t total = 0;
+
+    double start = now_ns();
+    for (int i = 0; i < REPS; i++) total += (size_t)prompt_render(pc, &sh)[0];
+    printf("unchanged       %.1fns\n", (now_ns() - start) / REPS);
+
+    start = now_ns();
+    for (int i = 0; i < REPS; i++) {
+        sh.last_status = i & 1;
+        total += (size_t)prompt_render(pc, &sh)[0];
+    }
+    printf("status changed  %.1fns\n", (now_ns() - start) / REPS);
+
+    start = now_ns();
+    for (int i = 0; i < REPS / 10; i++) {
+        sh.cwd_gen++;
+        total += (size_t)prompt_render(pc, &sh)[0];
+    }
+    printf("after cd        %.1fns\n", (now_ns() - start) / (REPS / 10));
+
+    start = now_ns();
+    for (int i = 0; i < REPS / 10; i++) {
+        struct prompt_cache *fresh = prompt_compile(template);
+        total += (size_t)prompt_render(fresh, &sh)[0];
+        prompt_free(fresh);
+    }
+    printf("uncached        %.1fns\n", (now_ns() - start) / (REPS / 10));
+
+    prompt_free(pc);
+    return total == 0;
+}
@@ -0,0 +1,289 @@
+// The whole interactive loop on a terminal: the shell runs on a pty, is
+// sent one command at a time and the next prompt is waited for, so
+// readline, terminal modes and handing the terminal to each job are all
+// paid for. Reports commands/second and the p50/p99/p99.9 latency from a
+// command being sent to the prompt coming back.
+//
+// Usage: pty [-n commands] [-c] [shell]
+//
+// The shell defaults to $BENCH_SHELL, which make bench points at an
+// optimized build, or ./myprogram. -c runs bash and dash the same way
+// when they are installed. Pipelines are only run on shells that have
+// them.
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bench.h"
+
+// Its first character appears only once, so a failed match can restart
+// at the character that broke it
+#define PROMPT "[lab-bench]> "
+#define WARMUP 20
+#define TIMEOUT_MS 10000
+
+struct subject {
+    const char *name;
+    const char *path;
+    const char *flags[4];      // Between argv[0] and NULL
+    bool pipes;
+};
+
+struct workload {
+    const char *name;
+    const char *lines[4];      // Sent in turn, NULL terminated
+    bool pipes;
+};
+
+static const struct workload workloads[] = {
+    {"builtin", {"echo hello", "cd /tmp", "pwd", NULL}, false},
+    {"true", {"/bin/true", NULL}, false},
+    {"pipeline", {"echo hello | cat", "ls / | wc -l", NULL}, true},
+    {"background", {"/bin/true &", "jobs", NULL}, false},
+};
+
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+struct pty_shell {
+    pid_t pid;
+    int fd;
+    size_t matched;            // How much of PROMPT the output ended with
+};
+
+struct pty_result {
+    const char *shell;
+    const char *workload;
+    size_t commands;
+    double startup, per_sec, mean, p50, p99, p999, max;
+};
+
+static int pty_spawn(struct pty_shell *ps, const struct subject *s, char *const envp[]) {
+    int fd = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int unlock = 0;
+    unsigned n;
+    struct winsize ws = {.ws_row = 24, .ws_col = 80};
+    if (ioctl(fd, TIOCSPTLCK, &unlock) < 0 || ioctl(fd, TIOCGPTN, &n) < 0 ||
+        ioctl(fd, TIOCSWINSZ, &ws) < 0) {
+        close(fd);
+        return -1;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/dev/pts/%u", n);
+
+    const char *argv[6] = {s->path};
+    for (size_t i = 0; i < 4 && s->flags[i]; i++) argv[i + 1] = s->flags[i];
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fd);
+        return -1;
+    }
+    if (pid == 0) {
+        // A session of its own with the pty as the controlling terminal,
+        // like a terminal emulator would set it up
+        setsid();
+        int tty = open(name, O_RDWR);
+        if (tty < 0) _exit(127);
+        ioctl(tty, TIOCSCTTY, 0);
+        dup2(tty, STDIN_FILENO);
+        dup2(tty, STDOUT_FILENO);
+        dup2(tty, STDERR_FILENO);
+        if (tty > STDERR_FILENO) close(tty);
+        execve(s->path, (char *const *)argv, envp);
+        _exit(127);
+    }
+    ps->pid = pid;
+    ps->fd = fd;
+    ps->matched = 0;
+    return 0;
+}
+
+// Read until the output shows the prompt, the match carries over reads
+static int pty_prompt(struct pty_shell *ps) {
+    const size_t plen = strlen(PROMPT);
+    char buf[4096];
+    for (;;) {
+        struct pollfd pfd = {.fd = ps->fd, .events = POLLIN};
+        int r = poll(&pfd, 1, TIMEOUT_MS);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        ssize_t n = read(ps->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] == PROMPT[ps->matched]) {
+                if (++ps->matched == plen) {
+                    ps->matched = 0;
+                    return 0;
+                }
+            } else {
+                ps->matched = buf[i] == PROMPT[0];
+            }
+        }
+    }
+}
+
+static int pty_send(struct pty_shell *ps, const char *line) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "%s\n", line);
+    return write(ps->fd, buf, len) == len ? 0 : -1;
+}
+
+static void pty_close(struct pty_shell *ps) {
+    pty_send(ps, "exit");
+    char buf[4096];
+    for (int i = 0; i < 100; i++) {
+        if (waitpid(ps->pid, NULL, WNOHANG) == ps->pid) {
+            close(ps->fd);
+            return;
+        }
+        // Keep draining so the shell is never stuck writing
+        struct pollfd pfd = {.fd = ps->fd, .events = POLLIN};
+        if (poll(&pfd, 1, 20) > 0 && read(ps->fd, buf, sizeof(buf)) < 0) usleep(20000);
+    }
+    kill(ps->pid, SIGKILL);
+    waitpid(ps->pid, NULL, 0);
+    close(ps->fd);
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    size_t i = (size_t)(p / 100.0 * n + 0.5);
+    if (i >= 1) i--;
+    return sorted[i < n ? i : n - 1];
+}
+
+static int run(const struct subject *s, const struct workload *w, size_t commands,
+               char *const envp[], struct pty_result *r) {
+    struct pty_shell ps;
+    double start = bench_now();
+    if (pty_spawn(&ps, s, envp) < 0) {
+        perror(s->name);
+        return -1;
+    }
+    if (pty_prompt(&ps) < 0) {
+        fprintf(stderr, "%s: no prompt\n", s->name);
+        pty_close(&ps);
+        return -1;
+    }
+    r->shell = s->name;
+    r->workload = w->name;
+    r->commands = commands;
+    r->startup = bench_now() - start;
+
+    size_t nlines = 0;
+    while (w->lines[nlines]) nlines++;
+    double *lat = malloc(commands * sizeof(double));
+    if (!lat) exit(1);
+    double sum = 0, begin = 0;
+    for (size_t i = 0; i < WARMUP + commands; i++) {
+        if (i == WARMUP) begin = bench_now();
+        double t = bench_now();
+        if (pty_send(&ps, w->lines[i % nlines]) < 0 || pty_prompt(&ps) < 0) {
+            fprintf(stderr, "%s: %s: no prompt after command %zu\n", s->name, w->name, i);
+            free(lat);
+            pty_close(&ps);
+            return -1;
+        }
+        if (i >= WARMUP) {
+            lat[i - WARMUP] = bench_now() - t;
+            sum += lat[i - WARMUP];
+        }
+    }
+    r->per_sec = commands / ((bench_now() - begin) / 1e9);
+    pty_close(&ps);
+
+    qsort(lat, commands, sizeof(double), bench_cmp);
+    r->mean = sum / commands;
+    r->p50 = percentile(lat, commands, 50);
+    r->p99 = percentile(lat, commands, 99);
+    r->p999 = percentile(lat, commands, 99.9);
+    r->max = lat[commands - 1];
+    free(lat);
+
+    printf("  %-10s %-11s %8.0f/s %9.1fus %9.1fus %9.1fus %9.1fus\n", r->shell, r->workload,
+           r->per_sec, r->p50 / 1e3, r->p99 / 1e3, r->p999 / 1e3, r->max / 1e3);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    size_t commands = 2000;
+    bool compare = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c")) != -1) {
+        switch (opt) {
+            case 'n':
+                commands = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                compare = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n commands] [-c] [shell]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (!commands) commands = 1;
+
+    const char *shell = argv[optind];
+    if (!shell) shell = getenv("BENCH_SHELL");
+    if (!shell || !*shell) shell = "./myprogram";
+    struct subject subjects[3] = {{"myprogram", shell, {NULL}, false}};
+    size_t nsubjects = 1;
+    if (compare && access("/bin/bash", X_OK) == 0) {
+        subjects[nsubjects++] = (struct subject){"bash", "/bin/bash",
+                                                 {"--norc", "--noprofile", "-i", NULL}, true};
+    }
+    if (compare && access("/bin/dash", X_OK) == 0) {
+        subjects[nsubjects++] = (struct subject){"dash", "/bin/dash", {"-i", NULL}, true};
+    }
+
+    // The same prompt everywhere and nothing read from or saved to home
+    char home[] = "/tmp/lab-bench-pty-XXXXXX";
+    if (!mkdtemp(home)) return 1;
+    char home_env[64], path_env[4096];
+    snprintf(home_env, sizeof(home_env), "HOME=%s", home);
+    const char *path = getenv("PATH");
+    snprintf(path_env, sizeof(path_env), "PATH=%s", path ? path : "/usr/bin:/bin");
+    char *envp[] = {home_env, path_env, "TERM=xterm", "MY_PROMPT=" PROMPT, "PS1=" PROMPT,
+                    "MY_HISTFILE=", "MY_ZFILE=", "HISTFILE=", "LC_ALL=C", NULL};
+
+    printf("pty round trips, %zu commands after %d to warm up\n", commands, WARMUP);
+    printf("  %-10s %-11s %10s %11s %11s %11s %11s\n", "shell", "workload", "cmds/s", "p50",
+           "p99", "p99.9", "max");
+    struct pty_result results[3 * NWORKLOADS];
+    size_t n = 0;
+    int rval = 0;
+    for (size_t i = 0; i < nsubjects; i++) {
+        for (size_t k = 0; k < NWORKLOADS; k++) {
+            if (workloads[k].pipes && !subjects[i].pipes) continue;
+            if (run(&subjects[i], &workloads[k], commands, envp, &results[n]) < 0) {
+                rval = 1;
+                continue;
+            }
+            n++;
+        }
+    }
+    rmdir(home);
+
+    char file[4096];
+    FILE *fp = bench_json_open("pty", file, sizeof(file));
+    if (!fp) return *file ? 1 : rval;
+    fprintf(fp, ",\"warmup\":%d,\"results\":[", WARMUP);
+    for (size_t i = 0; i < n; i++) {
+        const struct pty_result *r = &results[i];
+        fprintf(fp, "%s\n{\"shell\":", i ? "," : "");
+        bench_json_string(fp, r->shell);
+        fprintf(fp, ",\"workload\":");
+        bench_json_string(fp, r->workload);
+        fprintf(fp, ",\"commands\":%zu,\"startup_ns\":%.0f,\"cmds_per_sec\":%.1f,"
+                "\"latency_ns\":{\"mean\":%.0f,\"p50\":%.0f,\"p99\":%.0f,\"p999\":%.0f,"
+                "\"max\":%.0f}}", r->commands, r->startup, r->per_sec, r->mean, r->p50,
+                r->p99, r->p999, r->max);
+    }
+    fprintf(fp, "\n]");
+    return bench_json_close(fp, file) < 0 ? 1 : rval;
+}
@@ -0,0 +1,50 @@
+// What a trace point costs with tracing off, which has to be a branch and
+// nothing more, and with it on, when each one takes a clock read and a
+// slot in the ring.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/lab.h"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double per_mark(size_t iters) {
+    double start = now_ns();
+    for (size_t i = 0; i < iters; i++) {
+        TRACE("bench");
+        __asm__ volatile("" ::: "memory");
+    }
+    return (now_ns() - start) / iters;
+}
+
+int main(int argc, char **argv) {
+    size_t iters = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    printf("iters=%zu\n", iters);
+    double base = now_ns();
+    for (size_t i = 0; i < iters; i++) {
+        __asm__ volatile("" ::: "memory");
+    }
+    printf("  empty loop     %7.2fns\n", (now_ns() - base) / iters);
+    printf("  TRACE off      %7.2fns\n", per_mark(iters));
+
+    char path[] = "/tmp/lab-bench-trace-XXXXXX";
+    close(mkstemp(path));
+    if (trace_start(path) < 0) return 1;
+    // Flush as the shell would, every ring's worth is already far more
+    // than a command makes
+    size_t on = iters / 10, batch = TRACE_EVENTS / 2;
+    double total = 0;
+    for (size_t done = 0; done < on; done += batch) {
+        total += per_mark(batch) * batch;
+        trace_flush();
+    }
+    printf("  TRACE on       %7.2fns dropped=%zu\n", total / on, trace_dropped());
+    trace_stop();
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,77 @@
+// Prompt latency with the git segment, in a small and a large repository,
+// against what a prompt that ran git itself would pay.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/lab.h"
+
+#define BIG_REPO "/tmp/lab-bench-repo"
+#define BIG_FILES 20000
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int make_big_repo(void) {
+    struct stat st;
+    if (stat(BIG_REPO "/.git", &st) == 0) return 0;
+    if (mkdir(BIG_REPO, 0700) < 0 || chdir(BIG_REPO) < 0) return -1;
+    for (int i = 0; i < BIG_FILES; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "f%d.txt", i);
+        FILE *f = fopen(path, "w");
+        if (!f) return -1;
+        fprintf(f, "file %d\n", i);
+        fclose(f);
+    }
+    return system("git init -q && git add . && "
+                  "git -c user.name=bench -c user.email=bench@example.com "
+                  "commit -qm init && echo change >> f0.txt");
+}
+
+static void measure(const char *dir, struct shell *sh) {
+    if (chdir(dir) < 0) return;
+    sh->cwd_gen++;
+
+    double start = now_us();
+    if (system("git --no-optional-locks diff --quiet HEAD -- 2>/dev/null")) {
+        // Exits 1 when dirty, we only want the time
+    }
+    double sync = now_us() - start;
+
+    // Render while the worker is busy with the same check
+    vcs_refresh(sh->vcs);
+    double worst = 0;
+    start = now_us();
+    for (int i = 0; i < 1000; i++) {
+        double t = now_us();
+        prompt_render(sh->prompt_cache, sh);
+        if (now_us() - t > worst) worst = now_us() - t;
+    }
+    double avg = (now_us() - start) / 1000;
+
+    // Let it finish so the next directory starts clean
+    usleep((useconds_t)(sync * 2) + 100000);
+    printf("%-24s git diff %.1fms  render avg %.2fus worst %.1fus  -> %s\n",
+           dir, sync / 1e3, avg, worst, prompt_render(sh->prompt_cache, sh));
+}
+
+int main(void) {
+    char start[4096];
+    if (!getcwd(start, sizeof(start)) || make_big_repo() < 0) return 1;
+
+    struct shell sh = {0};
+    sh.prompt_cache = prompt_compile("\\W \\g \\$ ");
+    sh.vcs = vcs_start();
+
+    measure(start, &sh);
+    measure(BIG_REPO, &sh);
+
+    vcs_stop(sh.vcs);
+    prompt_free(sh.prompt_cache);
+    return 0;
+}
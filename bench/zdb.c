@@ -0,0 +1,77 @@
+// Ranking queries against directory databases of different sizes, and the
+// cost of recording a visit, which cd pays every time.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/lab.h"
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void fill(struct zdb *z, size_t n, time_t now) {
+    static const char *templates[] = {
+        "/home/user/src/project%u/src",
+        "/home/user/src/project%u/tests",
+        "/srv/data/%u/logs",
+        "/var/www/site%u/public",
+        "/home/user/notes/%u",
+        "/opt/tools/tool%u/bin",
+    };
+    char dir[128];
+    srand(42);
+    for (size_t i = 0; i < n; i++) {
+        snprintf(dir, sizeof(dir), templates[rand() % 6], (unsigned)i);
+        // Visits spread over a month so every frecency weight shows up
+        zdb_visit(z, dir, now - rand() % (30 * 86400));
+    }
+}
+
+int main(void) {
+    static const size_t sizes[] = {1000, 10000, 50000};
+    static char *queries[][3] = {
+        {"project4242", NULL},   // one directory
+        {"src", "tests", NULL},  // a sixth of them
+        {"site9", NULL},         // a few percent
+        {"nowhere", NULL},       // no match at all
+        {"bin", NULL},           // every tool directory
+    };
+    const int reps = 200;
+    time_t now = time(NULL);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char path[] = "/tmp/lab-bench-zdb-XXXXXX";
+        close(mkstemp(path));
+        unlink(path);
+        struct zdb *z = zdb_open(path);
+        if (!z) return 1;
+
+        double start = now_ms();
+        fill(z, sizes[s], now);
+        double visit = (now_ms() - start) / sizes[s];
+
+        const struct zdb_match *hits;
+        char *none[] = {NULL};
+        start = now_ms();
+        zdb_query(z, none, now, &hits);
+        printf("dirs=%zu visit=%.4fms index_build=%.2fms\n", sizes[s], visit, now_ms() - start);
+
+        for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+            size_t matches = 0;
+            start = now_ms();
+            for (int r = 0; r < reps; r++) {
+                matches = zdb_query(z, queries[q], now, &hits);
+            }
+            double ms = (now_ms() - start) / reps;
+            printf("  %-12s %-6s query=%.4fms matches=%zu\n", queries[q][0],
+                   queries[q][1] ? queries[q][1] : "", ms, matches);
+        }
+        zdb_close(z);
+        unlink(path);
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+// Example plugin, load it with "load build/plugins/hello.so" and then run
+// "hello" or "hello name..."
+#include <stdio.h>
+#include "../src/lab.h"
+
+static int hello(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    if (!argv[1]) {
+        printf("hello from a plugin\n");
+        return 0;
+    }
+    for (int i = 1; argv[i]; i++) {
+        printf("hello %s\n", argv[i]);
+    }
+    return 0;
+}
+
+static const struct builtin builtins[] = {
+    {"hello", hello},
+    {NULL, NULL},
+};
+
+const struct lab_plugin lab_plugin = {
+    .abi_version = LAB_PLUGIN_ABI,
+    .name = "hello",
+    .builtins = builtins,
+};
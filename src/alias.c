@@ -0,0 +1,197 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lab.h"
+
+// Aliases, in an open addressing table keyed by FNV-1a with the hash kept
+// in each slot like the builtin and variable tables. Lookups take the
+// word where it sits in the line, so checking the first word of a command
+// costs one hash and no copy when it is not an alias.
+//
+// Expansion only ever looks at the front of the line. The first word is
+// replaced by its value and the first word of that is looked at again,
+// unless it names an alias already expanded on the way, which is what
+// stops alias ls='ls -F' from going on forever. When a value ends with a
+// blank the word after it is looked at too, as in bash. The rest of the
+// line is copied once per expansion and never split into words.
+
+struct alias {
+    uint32_t hash;
+    size_t name_len;
+    char *name;
+    char *value;
+};
+
+struct aliases {
+    struct alias *slots;
+    size_t cap;
+    size_t used;
+};
+
+static bool alias_used(const void *slot, uint32_t *hash) {
+    const struct alias *a = slot;
+    *hash = a->hash;
+    return a->name != NULL;
+}
+
+static struct alias *alias_slot(struct alias *slots, size_t cap, const char *name, size_t len,
+                                uint32_t hash) {
+    size_t mask = cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct alias *a = &slots[i];
+        if (!a->name) return a;
+        if (a->hash == hash && a->name_len == len && memcmp(a->name, name, len) == 0) return a;
+    }
+}
+
+static const struct alias *alias_find(const struct aliases *al, const char *name, size_t len) {
+    if (!al || !al->cap) return NULL;
+    const struct alias *a = alias_slot(al->slots, al->cap, name, len, fnv1a(name, len));
+    return a->name ? a : NULL;
+}
+
+struct aliases *alias_new(void) {
+    return calloc(1, sizeof(struct aliases));
+}
+
+void alias_free(struct aliases *al) {
+    if (!al) return;
+    for (size_t i = 0; i < al->cap; i++) {
+        free(al->slots[i].name);
+        free(al->slots[i].value);
+    }
+    free(al->slots);
+    free(al);
+}
+
+static int alias_grow(struct aliases *al) {
+    size_t cap = al->cap ? al->cap * 2 : 64;
+    struct alias *slots = calloc(cap, sizeof(struct alias));
+    if (!slots) return -1;
+    for (size_t i = 0; i < al->cap; i++) {
+        struct alias *old = &al->slots[i];
+        if (old->name) *alias_slot(slots, cap, old->name, old->name_len, old->hash) = *old;
+    }
+    free(al->slots);
+    al->slots = slots;
+    al->cap = cap;
+    return 0;
+}
+
+bool alias_valid_name(const char *name) {
+    // Anything that could not be the first word of a command is out
+    if (!*name) return false;
+    for (const char *p = name; *p; p++) {
+        if (*p == ' ' || *p == '=' || *p == '/' || *p == '$' || *p == '\t') return false;
+    }
+    return true;
+}
+
+int alias_set(struct aliases *al, const char *name, const char *value) {
+    if (!alias_valid_name(name)) return -1;
+    if ((al->used + 1) * 2 > al->cap && alias_grow(al) < 0) return -1;
+    size_t len = strlen(name);
+    uint32_t hash = fnv1a(name, len);
+    struct alias *a = alias_slot(al->slots, al->cap, name, len, hash);
+    char *copy = strdup(value);
+    if (!copy) return -1;
+    if (!a->name) {
+        if (!(a->name = strdup(name))) {
+            free(copy);
+            return -1;
+        }
+        a->hash = hash;
+        a->name_len = len;
+        al->used++;
+    }
+    free(a->value);
+    a->value = copy;
+    return 0;
+}
+
+const char *alias_get(const struct aliases *al, const char *name) {
+    const struct alias *a = alias_find(al, name, strlen(name));
+    return a ? a->value : NULL;
+}
+
+int alias_remove(struct aliases *al, const char *name) {
+    size_t len = strlen(name);
+    struct alias *a = (struct alias *)alias_find(al, name, len);
+    if (!a) return -1;
+    free(a->name);
+    free(a->value);
+    al->used--;
+    hashtab_delete(al->slots, sizeof(struct alias), al->cap, (size_t)(a - al->slots), alias_used);
+    return 0;
+}
+
+void alias_clear(struct aliases *al) {
+    for (size_t i = 0; i < al->cap; i++) {
+        free(al->slots[i].name);
+        free(al->slots[i].value);
+        al->slots[i].name = al->slots[i].value = NULL;
+    }
+    al->used = 0;
+}
+
+size_t alias_list(const struct aliases *al, const char **names, size_t max) {
+    size_t n = 0;
+    for (size_t i = 0; al && i < al->cap; i++) {
+        if (!al->slots[i].name) continue;
+        if (n < max) names[n] = al->slots[i].name;
+        n++;
+    }
+    return n;
+}
+
+char *alias_expand(const struct aliases *al, const char *line) {
+    if (!al || !al->used) return NULL;
+    const struct alias *seen[ALIAS_MAX_DEPTH];
+    size_t depth = 0;
+    char *text = NULL;      // The line so far, NULL while it is still line
+    size_t pos = 0;         // Where the word to look at starts
+    size_t after = 0;       // The word after a value that ended with a blank
+    bool more = false;
+
+    while (depth < ALIAS_MAX_DEPTH) {
+        const char *cur = text ? text : line;
+        size_t w = pos;
+        while (cur[w] == ' ' || cur[w] == '\t') w++;
+        size_t len = 0;
+        while (cur[w + len] && cur[w + len] != ' ' && cur[w + len] != '\t') len++;
+
+        const struct alias *a = len ? alias_find(al, cur + w, len) : NULL;
+        for (size_t i = 0; a && i < depth; i++) {
+            if (seen[i] == a) a = NULL;
+        }
+        if (!a) {
+            if (!more) break;
+            more = false;
+            pos = after;
+            continue;
+        }
+
+        // The value takes the place of the word, the rest is copied as is
+        size_t vlen = strlen(a->value);
+        size_t rest = strlen(cur + w + len);
+        char *next = malloc(w + vlen + rest + 1);
+        if (!next) {
+            free(text);
+            return NULL;
+        }
+        memcpy(next, cur, w);
+        memcpy(next + w, a->value, vlen);
+        memcpy(next + w + vlen, cur + w + len, rest + 1);
+        free(text);
+        text = next;
+
+        if (more) after = after + vlen - len;
+        if (vlen && (a->value[vlen - 1] == ' ' || a->value[vlen - 1] == '\t')) {
+            more = true;
+            after = w + vlen;
+        }
+        seen[depth++] = a;
+        pos = w;
+    }
+    return text;
+}
@@ -0,0 +1,1116 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <readline/history.h>
+#include "lab.h"
+
+extern char **environ;
+
+// Expand one backslash escape starting just after the backslash. The
+// result goes to out and the number of input chars used is returned. When
+// stop is not NULL a \c escape sets it, echo -e and printf %b use that to
+// end all output.
+static size_t unescape_one(const char *s, char *out, bool octal_zero, bool *stop) {
+    size_t used = 1;
+    switch (*s) {
+        case 'a': *out = '\a'; break;
+        case 'b': *out = '\b'; break;
+        case 'e': *out = 033; break;
+        case 'f': *out = '\f'; break;
+        case 'n': *out = '\n'; break;
+        case 'r': *out = '\r'; break;
+        case 't': *out = '\t'; break;
+        case 'v': *out = '\v'; break;
+        case '\\': *out = '\\'; break;
+        case 'c':
+            if (stop) *stop = true;
+            return 1;
+        case 'x': {
+            int val = 0;
+            while (used < 3 && isxdigit((unsigned char)s[used])) {
+                char c = s[used++];
+                val = val * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+            }
+            if (used == 1) {
+                // Not really an escape, keep the text as is
+                out[0] = '\\';
+                out[1] = 'x';
+                return 0;
+            }
+            *out = (char)val;
+            break;
+        }
+        default:
+            if (*s >= '0' && *s <= '7') {
+                // echo spells octal \0nnn, printf spells it \nnn
+                size_t start = (octal_zero && *s == '0') ? 1 : 0;
+                int val = 0;
+                used = start;
+                while (used < start + 3 && s[used] >= '0' && s[used] <= '7') {
+                    val = val * 8 + (s[used++] - '0');
+                }
+                *out = (char)val;
+                break;
+            }
+            out[0] = '\\';
+            out[1] = *s;
+            return 0;
+    }
+    return used;
+}
+
+// Append s with its escapes expanded, returns false if \c was seen
+static bool ob_unescape(struct outbuf *ob, const char *s, bool octal_zero) {
+    bool stop = false;
+    while (*s && !stop) {
+        const char *bs = strchr(s, '\\');
+        if (!bs) {
+            ob_puts(ob, s);
+            break;
+        }
+        ob_write(ob, s, bs - s);
+        if (bs[1] == '\0') {
+            ob_write(ob, "\\", 1);
+            break;
+        }
+        char tmp[2];
+        size_t used = unescape_one(bs + 1, tmp, octal_zero, &stop);
+        if (stop) break;
+        if (used == 0) {
+            ob_write(ob, tmp, 2);
+            used = 1;
+        } else {
+            ob_write(ob, tmp, 1);
+        }
+        s = bs + 1 + used;
+    }
+    return !stop;
+}
+
+int builtin_echo(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    struct outbuf ob;
+    bool newline = true;
+    bool escapes = false;
+    int i = 1;
+
+    // Like coreutils an argument is only an option if every letter is one
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) break;
+        for (const char *c = argv[i] + 1; *c; c++) {
+            if (*c == 'n') newline = false;
+            if (*c == 'e') escapes = true;
+            if (*c == 'E') escapes = false;
+        }
+    }
+
+    ob_init(&ob, STDOUT_FILENO);
+    for (int first = i; argv[i]; i++) {
+        if (i > first) ob_write(&ob, " ", 1);
+        if (escapes) {
+            if (!ob_unescape(&ob, argv[i], true)) {
+                newline = false;
+                break;
+            }
+        } else {
+            // argv outlives the flush below so point at it instead of copying
+            ob_ref(&ob, argv[i], strlen(argv[i]));
+        }
+    }
+    if (newline) ob_write(&ob, "\n", 1);
+    return ob_flush(&ob) == 0 ? 0 : 1;
+}
+
+static long long printf_number(const char *arg, int *status) {
+    if (!arg) return 0;
+    // A leading quote gives the value of the next character
+    if (arg[0] == '\'' || arg[0] == '"') return (unsigned char)arg[1];
+
+    char *end;
+    errno = 0;
+    long long val = strtoll(arg, &end, 0);
+    if (end == arg || *end || errno) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return val;
+}
+
+int builtin_printf(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    struct outbuf ob;
+    int status = 0;
+
+    if (!argv[1]) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    ob_init(&ob, STDOUT_FILENO);
+    const char *format = argv[1];
+    char **args = argv + 2;
+    bool stop = false;
+
+    // The format is reused until every argument has been consumed
+    do {
+        char **start = args;
+        for (const char *f = format; *f && !stop; f++) {
+            if (*f == '\\') {
+                char tmp[2];
+                if (!f[1]) {
+                    ob_write(&ob, f, 1);
+                    continue;
+                }
+                size_t used = unescape_one(f + 1, tmp, false, &stop);
+                if (stop) break;
+                if (used == 0) {
+                    ob_write(&ob, tmp, 2);
+                    used = 1;
+                } else {
+                    ob_write(&ob, tmp, 1);
+                }
+                f += used;
+                continue;
+            }
+            if (*f != '%') {
+                const char *next = f + strcspn(f, "\\%");
+                ob_write(&ob, f, next - f);
+                f = next - 1;
+                continue;
+            }
+            if (f[1] == '%') {
+                ob_write(&ob, "%", 1);
+                f++;
+                continue;
+            }
+
+            // Copy the flags, width and precision into a format of our own
+            char spec[32];
+            size_t n = 0;
+            spec[n++] = '%';
+            f++;
+            while (*f && strchr("-+ #0123456789.", *f) && n < sizeof(spec) - 4) {
+                spec[n++] = *f++;
+            }
+            char conv = *f;
+            const char *arg = *args;
+            if (arg) args++;
+
+            switch (conv) {
+                case 'd':
+                case 'i':
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = conv;
+                    spec[n] = '\0';
+                    ob_printf(&ob, spec, printf_number(arg, &status));
+                    break;
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = conv;
+                    spec[n] = '\0';
+                    ob_printf(&ob, spec, (unsigned long long)printf_number(arg, &status));
+                    break;
+                case 'c':
+                    spec[n++] = 'c';
+                    spec[n] = '\0';
+                    ob_printf(&ob, spec, arg ? arg[0] : '\0');
+                    break;
+                case 's':
+                    spec[n++] = 's';
+                    spec[n] = '\0';
+                    ob_printf(&ob, spec, arg ? arg : "");
+                    break;
+                case 'b':
+                    if (arg && !ob_unescape(&ob, arg, true)) stop = true;
+                    break;
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid conversion\n", conv ? conv : ' ');
+                    ob_flush(&ob);
+                    return 1;
+            }
+            if (!*f) break;
+        }
+        // A format with no conversions would loop forever
+        if (args == start) break;
+    } while (*args && !stop);
+
+    if (ob_flush(&ob) != 0) status = 1;
+    return status;
+}
+
+static bool test_unary(const char *op, const char *arg, bool *ok) {
+    struct stat st;
+
+    switch (op[1]) {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 't': return isatty((int)strtol(arg, NULL, 10));
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+        case 'h':
+        case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) != 0) return false;
+    switch (op[1]) {
+        case 'e': return true;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        case 'O': return st.st_uid == geteuid();
+        case 'G': return st.st_gid == getegid();
+    }
+    *ok = false;
+    return false;
+}
+
+static bool is_unary(const char *op) {
+    return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghkLnOGprsStuwxz", op[1]);
+}
+
+static bool is_binary(const char *op) {
+    static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt",
+                                "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+    for (int i = 0; ops[i]; i++) {
+        if (strcmp(op, ops[i]) == 0) return true;
+    }
+    return false;
+}
+
+static long long test_integer(const char *arg, bool *ok) {
+    char *end;
+    errno = 0;
+    long long val = strtoll(arg, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == arg || *end || errno) {
+        fprintf(stderr, "test: %s: integer expression expected\n", arg);
+        *ok = false;
+    }
+    return val;
+}
+
+static bool test_binary(const char *a, const char *op, const char *b, bool *ok) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+
+    if (op[1] == 'n' && op[2] == 't') {
+        struct stat sa, sb;
+        if (stat(a, &sa) != 0) return false;
+        if (stat(b, &sb) != 0) return true;
+        return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+               (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec);
+    }
+    if (op[1] == 'o' && op[2] == 't') return test_binary(b, "-nt", a, ok);
+    if (op[1] == 'e' && op[2] == 'f') {
+        struct stat sa, sb;
+        return stat(a, &sa) == 0 && stat(b, &sb) == 0 &&
+               sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+
+    long long x = test_integer(a, ok);
+    long long y = test_integer(b, ok);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+struct test_parser {
+    char **argv;
+    int pos;
+    int argc;
+    bool ok;
+};
+
+static bool test_or(struct test_parser *p);
+
+static bool test_primary(struct test_parser *p) {
+    int left = p->argc - p->pos;
+    if (left <= 0) {
+        p->ok = false;
+        return false;
+    }
+    char **a = p->argv + p->pos;
+
+    if (strcmp(a[0], "!") == 0) {
+        p->pos++;
+        return !test_primary(p);
+    }
+    if (strcmp(a[0], "(") == 0 && left >= 2) {
+        p->pos++;
+        bool val = test_or(p);
+        if (p->pos >= p->argc || strcmp(p->argv[p->pos], ")") != 0) {
+            fprintf(stderr, "test: missing ')'\n");
+            p->ok = false;
+            return false;
+        }
+        p->pos++;
+        return val;
+    }
+    if (left >= 3 && is_binary(a[1])) {
+        p->pos += 3;
+        return test_binary(a[0], a[1], a[2], &p->ok);
+    }
+    if (left >= 2 && is_unary(a[0])) {
+        p->pos += 2;
+        return test_unary(a[0], a[1], &p->ok);
+    }
+    p->pos++;
+    return a[0][0] != '\0';
+}
+
+static bool test_and(struct test_parser *p) {
+    bool val = test_primary(p);
+    while (p->pos < p->argc && strcmp(p->argv[p->pos], "-a") == 0) {
+        p->pos++;
+        bool rhs = test_primary(p);
+        val = val && rhs;
+    }
+    return val;
+}
+
+static bool test_or(struct test_parser *p) {
+    bool val = test_and(p);
+    while (p->pos < p->argc && strcmp(p->argv[p->pos], "-o") == 0) {
+        p->pos++;
+        bool rhs = test_and(p);
+        val = val || rhs;
+    }
+    return val;
+}
+
+int builtin_test(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    struct test_parser p = {.argv = argv + 1, .pos = 0, .ok = true};
+    int argc = 0;
+    while (argv[argc]) argc++;
+
+    if (strcmp(argv[0], "[") == 0) {
+        if (argc < 2 || strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    p.argc = argc - 1;
+
+    bool val;
+    char **a = p.argv;
+    // POSIX settles the short forms by argument count alone, which is what
+    // makes things like [ "$x" = -n ] do the right thing
+    switch (p.argc) {
+        case 0:
+            return 1;
+        case 1:
+            return a[0][0] != '\0' ? 0 : 1;
+        case 2:
+            if (strcmp(a[0], "!") == 0) return a[1][0] == '\0' ? 0 : 1;
+            if (!is_unary(a[0])) {
+                fprintf(stderr, "test: %s: unary operator expected\n", a[0]);
+                return 2;
+            }
+            val = test_unary(a[0], a[1], &p.ok);
+            break;
+        case 3:
+            if (is_binary(a[1])) {
+                val = test_binary(a[0], a[1], a[2], &p.ok);
+                break;
+            }
+            /* fall through */
+        default:
+            val = test_or(&p);
+            if (p.pos != p.argc) {
+                fprintf(stderr, "test: %s: unexpected argument\n", p.argv[p.pos < p.argc ? p.pos : p.argc - 1]);
+                return 2;
+            }
+            break;
+    }
+    if (!p.ok) return 2;
+    return val ? 0 : 1;
+}
+
+int builtin_pwd(struct shell *sh, char **argv) {
+    // -P asks the kernel, otherwise the directory the shell has cached
+    bool physical = argv[1] && strcmp(argv[1], "-P") == 0;
+    const char *cwd = sh && !physical ? sh_cwd(sh) : NULL;
+    if (!cwd) return print_working_directory() == 0 ? 0 : 1;
+    printf("%s\n", cwd);
+    return 0;
+}
+
+// Join path onto base and resolve . and .. by name, the way cd does
+// without -P, so cd .. after following a symlink goes back where it came
+// from. Returns a new string or NULL.
+static char *path_logical(const char *base, const char *path) {
+    size_t blen = path[0] == '/' ? 0 : strlen(base);
+    char *out = malloc(blen + strlen(path) + 2);
+    if (!out) return NULL;
+
+    size_t len = 0;
+    for (int part = path[0] == '/' ? 1 : 0; part < 2; part++) {
+        const char *s = part == 0 ? base : path;
+        while (*s) {
+            while (*s == '/') s++;
+            size_t n = strcspn(s, "/");
+            if (n == 0 || (n == 1 && s[0] == '.')) {
+                // Nothing to add
+            } else if (n == 2 && s[0] == '.' && s[1] == '.') {
+                while (len > 0 && out[len - 1] != '/') len--;
+                if (len > 0) len--;
+            } else {
+                out[len++] = '/';
+                memcpy(out + len, s, n);
+                len += n;
+            }
+            s += n;
+        }
+    }
+    if (len == 0) out[len++] = '/';
+    out[len] = '\0';
+    return out;
+}
+
+// Change directory for cd and the builtins that work like it. The shell's
+// idea of the working directory and PWD and OLDPWD follow, the prompt is
+// told and the directory is recorded for z, except for the home directory
+// which z has no use for.
+static int shell_chdir(struct shell *sh, const char *name, const char *path) {
+    if (!sh) {
+        if (chdir(path) == 0) return 0;
+        perror(name);
+        return 1;
+    }
+
+    // When the logical path does not work, say a .. past a directory
+    // that is gone, fall back to the path as given like bash does
+    const char *old = sh_cwd(sh);
+    char *dir = old ? path_logical(old, path) : NULL;
+    if (!dir || chdir(dir) != 0) {
+        free(dir);
+        if (chdir(path) != 0) {
+            perror(name);
+            return 1;
+        }
+        dir = getcwd(NULL, 0);
+    }
+    if (old) sh_setvar(sh, "OLDPWD", old, true);
+    if (dir) sh_setvar(sh, "PWD", dir, true);
+    free(sh->cwd);
+    sh->cwd = dir;
+    sh->cwd_gen++;
+
+    if (sh->zdb && dir && !(sh->home && strcmp(dir, sh->home) == 0)) {
+        zdb_visit(sh->zdb, dir, time(NULL));
+    }
+    return 0;
+}
+
+static int builtin_cd(struct shell *sh, char **argv) {
+    const char *path = argv[1];
+    bool back = path && strcmp(path, "-") == 0;
+    if (!path) {
+        path = sh && sh->home ? sh->home : home_dir();
+        if (!path) {
+            fprintf(stderr, "cd: HOME not set\n");
+            return 1;
+        }
+    } else if (back) {
+        path = sh_getvar(sh, "OLDPWD");
+        if (!path || !*path) {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+    }
+
+    // OLDPWD is about to change under path
+    char *copy = strdup(path);
+    if (!copy) return 1;
+    int rval = shell_chdir(sh, "cd", copy);
+    free(copy);
+
+    // cd - says where it went
+    if (rval == 0 && back) {
+        const char *cwd = sh ? sh_cwd(sh) : NULL;
+        if (cwd) printf("%s\n", cwd);
+    }
+    return rval;
+}
+
+static int env_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// export with no names lists the environment sorted
+static int export_print(struct shell *sh) {
+    sh_syncenv(sh);
+    char **env = environ;
+    size_t n = 0;
+    while (env[n]) n++;
+    char **sorted = malloc((n + 1) * sizeof(char *));
+    if (!sorted) return 1;
+    memcpy(sorted, env, n * sizeof(char *));
+    qsort(sorted, n, sizeof(char *), env_cmp);
+
+    struct outbuf ob;
+    ob_init(&ob, STDOUT_FILENO);
+    for (size_t i = 0; i < n; i++) {
+        ob_puts(&ob, "export ");
+        ob_puts(&ob, sorted[i]);
+        ob_write(&ob, "\n", 1);
+    }
+    free(sorted);
+    return ob_flush(&ob) < 0 ? 1 : 0;
+}
+
+static int builtin_export(struct shell *sh, char **argv) {
+    size_t i = 1;
+    if (argv[i] && strcmp(argv[i], "-p") == 0) i++;
+    if (!argv[i]) return export_print(sh);
+
+    int rval = 0;
+    for (; argv[i]; i++) {
+        char *eq = strchr(argv[i], '=');
+        size_t len = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+        if (!vars_valid_name(argv[i], len)) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", argv[i]);
+            rval = 1;
+            continue;
+        }
+        if (eq) *eq = '\0';
+        if (sh_setvar(sh, argv[i], eq ? eq + 1 : NULL, true) < 0) {
+            perror("export");
+            rval = 1;
+        }
+        if (eq) *eq = '=';
+    }
+    return rval;
+}
+
+static int builtin_unset(struct shell *sh, char **argv) {
+    int rval = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        if (!vars_valid_name(argv[i], strlen(argv[i]))) {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", argv[i]);
+            rval = 1;
+            continue;
+        }
+        sh_unsetvar(sh, argv[i]);
+    }
+    return rval;
+}
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void alias_print(struct outbuf *ob, const char *name, const char *value) {
+    ob_puts(ob, "alias ");
+    ob_puts(ob, name);
+    ob_puts(ob, "='");
+    ob_puts(ob, value);
+    ob_puts(ob, "'\n");
+}
+
+// alias with no arguments lists them all sorted by name
+static int alias_print_all(struct aliases *al) {
+    size_t n = alias_list(al, NULL, 0);
+    const char **names = malloc((n + 1) * sizeof(char *));
+    if (!names) return 1;
+    alias_list(al, names, n);
+    qsort(names, n, sizeof(char *), name_cmp);
+    struct outbuf ob;
+    ob_init(&ob, STDOUT_FILENO);
+    for (size_t i = 0; i < n; i++) {
+        alias_print(&ob, names[i], alias_get(al, names[i]));
+    }
+    free(names);
+    return ob_flush(&ob) < 0 ? 1 : 0;
+}
+
+// The parser has no quotes, so alias ll='ls -l' arrives as two words. A
+// definition takes every word after it, and one pair of quotes around the
+// whole value is dropped.
+static int alias_define(struct aliases *al, char **argv) {
+    char *eq = strchr(argv[0], '=');
+    size_t len = strlen(eq + 1);
+    for (size_t i = 1; argv[i]; i++) len += strlen(argv[i]) + 1;
+    char *value = malloc(len + 1);
+    if (!value) return 1;
+    strcpy(value, eq + 1);
+    for (size_t i = 1; argv[i]; i++) {
+        strcat(value, " ");
+        strcat(value, argv[i]);
+    }
+    len = strlen(value);
+    char *v = value;
+    if (len >= 2 && (v[0] == '\'' || v[0] == '"') && v[len - 1] == v[0]) {
+        v[len - 1] = '\0';
+        v++;
+    }
+
+    *eq = '\0';
+    int rval = 0;
+    if (!alias_valid_name(argv[0])) {
+        fprintf(stderr, "alias: `%s': invalid alias name\n", argv[0]);
+        rval = 1;
+    } else if (alias_set(al, argv[0], v) < 0) {
+        perror("alias");
+        rval = 1;
+    }
+    *eq = '=';
+    free(value);
+    return rval;
+}
+
+static int builtin_alias(struct shell *sh, char **argv) {
+    if (!sh || !sh->aliases) {
+        fprintf(stderr, "alias: not available\n");
+        return 1;
+    }
+    if (!argv[1]) return alias_print_all(sh->aliases);
+
+    struct outbuf ob;
+    ob_init(&ob, STDOUT_FILENO);
+    int rval = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        if (strchr(argv[i], '=')) {
+            if (alias_define(sh->aliases, argv + i)) rval = 1;
+            break;
+        }
+        const char *value = alias_get(sh->aliases, argv[i]);
+        if (value) {
+            alias_print(&ob, argv[i], value);
+        } else {
+            fprintf(stderr, "alias: %s: not found\n", argv[i]);
+            rval = 1;
+        }
+    }
+    if (ob_flush(&ob) < 0) rval = 1;
+    return rval;
+}
+
+static int builtin_unalias(struct shell *sh, char **argv) {
+    if (!argv[1]) {
+        fprintf(stderr, "Usage: unalias [-a] name...\n");
+        return 2;
+    }
+    if (!sh || !sh->aliases) return 1;
+    if (strcmp(argv[1], "-a") == 0) {
+        alias_clear(sh->aliases);
+        return 0;
+    }
+    int rval = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        if (alias_remove(sh->aliases, argv[i]) < 0) {
+            fprintf(stderr, "unalias: %s: not found\n", argv[i]);
+            rval = 1;
+        }
+    }
+    return rval;
+}
+
+// A directory the way dirs shows it, with the home directory as ~
+static void dirs_entry(struct outbuf *ob, const char *home, const char *dir) {
+    size_t hlen = home ? strlen(home) : 0;
+    if (hlen > 1 && strncmp(dir, home, hlen) == 0 && (dir[hlen] == '/' || dir[hlen] == '\0')) {
+        ob_write(ob, "~", 1);
+        dir += hlen;
+    }
+    ob_puts(ob, dir);
+}
+
+// The working directory followed by the stack from the top down
+static int dirs_print(struct shell *sh) {
+    const char *cwd = sh_cwd(sh);
+    struct outbuf ob;
+    ob_init(&ob, STDOUT_FILENO);
+    dirs_entry(&ob, sh->home, cwd ? cwd : ".");
+    for (size_t i = sh->dir_depth; i-- > 0;) {
+        ob_write(&ob, " ", 1);
+        dirs_entry(&ob, sh->home, sh->dir_stack[i]);
+    }
+    ob_write(&ob, "\n", 1);
+    return ob_flush(&ob) < 0 ? 1 : 0;
+}
+
+static void dirs_clear(struct shell *sh) {
+    for (size_t i = 0; i < sh->dir_depth; i++) {
+        free(sh->dir_stack[i]);
+    }
+    free(sh->dir_stack);
+    sh->dir_stack = NULL;
+    sh->dir_depth = sh->dir_cap = 0;
+}
+
+static int builtin_dirs(struct shell *sh, char **argv) {
+    if (argv[1] && strcmp(argv[1], "-c") == 0) {
+        dirs_clear(sh);
+        return 0;
+    }
+    if (argv[1]) {
+        fprintf(stderr, "Usage: dirs [-c]\n");
+        return 2;
+    }
+    return dirs_print(sh);
+}
+
+static int builtin_pushd(struct shell *sh, char **argv) {
+    const char *cwd = sh_cwd(sh);
+    if (!cwd) {
+        perror("pushd");
+        return 1;
+    }
+
+    // With no argument the top of the stack and the working directory
+    // trade places
+    if (!argv[1]) {
+        if (sh->dir_depth == 0) {
+            fprintf(stderr, "pushd: no other directory\n");
+            return 1;
+        }
+        char *top = sh->dir_stack[sh->dir_depth - 1];
+        char *old = strdup(cwd);
+        if (!old || shell_chdir(sh, "pushd", top) != 0) {
+            free(old);
+            return 1;
+        }
+        free(top);
+        sh->dir_stack[sh->dir_depth - 1] = old;
+        return dirs_print(sh);
+    }
+
+    if (sh->dir_depth == sh->dir_cap) {
+        size_t cap = sh->dir_cap ? sh->dir_cap * 2 : 8;
+        char **tmp = realloc(sh->dir_stack, cap * sizeof(char *));
+        if (!tmp) return 1;
+        sh->dir_stack = tmp;
+        sh->dir_cap = cap;
+    }
+    char *old = strdup(cwd);
+    if (!old || shell_chdir(sh, "pushd", argv[1]) != 0) {
+        free(old);
+        return 1;
+    }
+    sh->dir_stack[sh->dir_depth++] = old;
+    return dirs_print(sh);
+}
+
+static int builtin_popd(struct shell *sh, char **argv) {
+    UNUSED(argv);
+    if (sh->dir_depth == 0) {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return 1;
+    }
+    char *top = sh->dir_stack[sh->dir_depth - 1];
+    if (shell_chdir(sh, "popd", top) != 0) return 1;
+    free(top);
+    sh->dir_depth--;
+    return dirs_print(sh);
+}
+
+// z [-l] [-x] [word...], jump to the best ranked directory matching the
+// words. -l lists the matches instead, lowest score first so the best one
+// ends up next to the prompt, and -x forgets the working directory.
+static int builtin_z(struct shell *sh, char **argv) {
+    const struct zdb_match *hits;
+    bool list = false;
+    int i = 1;
+
+    if (!sh->zdb) {
+        fprintf(stderr, "z: no directory database\n");
+        return 1;
+    }
+    if (argv[1] && strcmp(argv[1], "-x") == 0) {
+        const char *cwd = sh_cwd(sh);
+        if (!cwd || zdb_remove(sh->zdb, cwd) < 0) return 1;
+        return 0;
+    }
+    if (argv[1] && strcmp(argv[1], "-l") == 0) {
+        list = true;
+        i++;
+    }
+
+    size_t n = zdb_query(sh->zdb, argv + i, time(NULL), &hits);
+    if (list || !argv[i]) {
+        struct outbuf ob;
+        ob_init(&ob, STDOUT_FILENO);
+        while (n-- > 0 && !ob.error) {
+            ob_printf(&ob, "%-10.1f %s\n", hits[n].score, hits[n].path);
+        }
+        return ob_flush(&ob) < 0 ? 1 : 0;
+    }
+
+    // A directory that is gone is dropped and the next best one tried.
+    // The path is copied first, a visit may move the mapping under it.
+    while (n > 0) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", hits[0].path);
+        struct stat st;
+        if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) return shell_chdir(sh, "z", dir);
+        if (zdb_remove(sh->zdb, dir) < 0) break;
+        n = zdb_query(sh->zdb, argv + i, time(NULL), &hits);
+    }
+    fprintf(stderr, "z: no match\n");
+    return 1;
+}
+
+static int builtin_exit(struct shell *sh, char **argv) {
+    // The main loop sees the flag and shuts down after freeing the line
+    sh->should_exit = true;
+    return argv[1] ? (int)strtol(argv[1], NULL, 10) & 0xff : sh->last_status;
+}
+
+// One entry the way history prints it. Lines are copied, referencing them
+// in place would use up the iovecs every couple dozen entries.
+static void history_entry(struct outbuf *ob, size_t i, const char *line) {
+    ob_putu(ob, i + 1);
+    ob_write(ob, ": ", 2);
+    ob_puts(ob, line);
+    ob_write(ob, "\n", 1);
+}
+
+static int history_matches(struct shell *sh, const char *pattern) {
+    size_t cap = 64, n = 0;
+    size_t *found = malloc(cap * sizeof(size_t));
+    if (!found) return 1;
+
+    // Matches come back newest first, print them in history order
+    long i = (long)hist_count(sh->history);
+    while ((i = hist_search(sh->history, pattern, (size_t)i)) >= 0) {
+        if (n == cap) {
+            cap *= 2;
+            size_t *tmp = realloc(found, cap * sizeof(size_t));
+            if (!tmp) break;
+            found = tmp;
+        }
+        found[n++] = (size_t)i;
+    }
+
+    struct outbuf ob;
+    ob_init(&ob, STDOUT_FILENO);
+    while (n-- > 0 && !ob.error) {
+        history_entry(&ob, found[n], hist_get(sh->history, found[n]));
+    }
+    free(found);
+    return ob_flush(&ob) < 0 ? 1 : 0;
+}
+
+// Work out which entries to list from "N" for the newest N or "FIRST-LAST"
+// counted from 1 like the numbers history prints
+static bool history_range(const char *arg, size_t count, size_t *first, size_t *last) {
+    char *end;
+    if (!isdigit((unsigned char)*arg)) return false;
+    unsigned long long a = strtoull(arg, &end, 10);
+    if (*end == '\0') {
+        *first = a < count ? count - a : 0;
+        *last = count;
+        return true;
+    }
+    if (*end != '-' || !isdigit((unsigned char)end[1])) return false;
+    unsigned long long b = strtoull(end + 1, &end, 10);
+    if (*end != '\0' || a == 0 || b < a) return false;
+    *first = a - 1 < count ? a - 1 : count;
+    *last = b < count ? b : count;
+    return true;
+}
+
+static int history_memory(struct shell *sh) {
+    struct hist_stats st;
+    hist_stats(sh->history, &st);
+    printf("entries: %zu of %zu records\n", st.entries, st.records);
+    printf("log: %zu bytes\n", st.log_bytes);
+    printf("index: %zu bytes\n", st.index_bytes);
+    printf("search: %zu bytes\n", st.search_bytes);
+    printf("readline: %zu bytes in %d entries\n",
+           (size_t)history_total_bytes() + (size_t)history_length * sizeof(HIST_ENTRY),
+           history_length);
+    return 0;
+}
+
+static int builtin_history(struct shell *sh, char **argv) {
+    if (argv[1] && strcmp(argv[1], "-m") == 0) {
+        return history_memory(sh);
+    }
+    if (argv[1] && strcmp(argv[1], "-s") == 0) {
+        if (!argv[2]) {
+            fprintf(stderr, "Usage: history -s pattern\n");
+            return 2;
+        }
+        return history_matches(sh, argv[2]);
+    }
+
+    size_t count = hist_count(sh->history);
+    size_t first = 0, last = count;
+    if (argv[1] && !history_range(argv[1], count, &first, &last)) {
+        fprintf(stderr, "Usage: history [N | FIRST-LAST | -s pattern | -m]\n");
+        return 2;
+    }
+
+    // Walk the mapped log in place rather than building a list of entries,
+    // and stop as soon as the reader goes away
+    struct outbuf ob;
+    ob_init(&ob, STDOUT_FILENO);
+    for (size_t i = first; i < last && !ob.error; i++) {
+        history_entry(&ob, i, hist_get(sh->history, i));
+    }
+    return ob_flush(&ob) < 0 ? 1 : 0;
+}
+
+static int builtin_true(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    UNUSED(argv);
+    return 0;
+}
+
+static int builtin_false(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    UNUSED(argv);
+    return 1;
+}
+
+// The builtins every shell gets, loaded into the dispatch table the first
+// time it is used
+static const struct builtin core_builtins[] = {
+    {"[", builtin_test},
+    {"alias", builtin_alias},
+    {"cd", builtin_cd},
+    {"dirs", builtin_dirs},
+    {"echo", builtin_echo},
+    {"exit", builtin_exit},
+    {"export", builtin_export},
+    {"false", builtin_false},
+    {"history", builtin_history},
+    {"load", builtin_load},
+    {"parallel", builtin_parallel},
+    {"popd", builtin_popd},
+    {"printf", builtin_printf},
+    {"pushd", builtin_pushd},
+    {"pwd", builtin_pwd},
+    {"stats", builtin_stats},
+    {"test", builtin_test},
+    {"true", builtin_true},
+    {"unalias", builtin_unalias},
+    {"unset", builtin_unset},
+    {"xargs", builtin_xargs},
+    {"z", builtin_z},
+};
+
+// Open addressing table keyed by the FNV-1a hash of the name. The hash is
+// stored with each slot so a probe only calls strcmp on a real candidate,
+// a command that is not a builtin usually costs one hash and one compare.
+struct builtin_slot {
+    uint32_t hash;
+    char *name;
+    builtin_fn fn;
+};
+
+static struct builtin_slot *builtin_table;
+static size_t builtin_cap;
+static size_t builtin_count;
+
+static struct builtin_slot *builtin_find(const char *name, uint32_t hash) {
+    size_t mask = builtin_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct builtin_slot *slot = &builtin_table[i];
+        if (!slot->name) return slot;
+        if (slot->hash == hash && strcmp(slot->name, name) == 0) return slot;
+    }
+}
+
+static int builtin_grow(void) {
+    size_t cap = builtin_cap ? builtin_cap * 2 : 32;
+    struct builtin_slot *old = builtin_table;
+    size_t old_cap = builtin_cap;
+
+    builtin_table = calloc(cap, sizeof(struct builtin_slot));
+    if (!builtin_table) {
+        builtin_table = old;
+        return -1;
+    }
+    builtin_cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name) *builtin_find(old[i].name, old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static int builtin_insert(const char *name, builtin_fn fn) {
+    // Keep the load factor under a half so probe chains stay short
+    if ((builtin_count + 1) * 2 > builtin_cap && builtin_grow() < 0) {
+        return -1;
+    }
+    uint32_t hash = fnv1a_str(name);
+    struct builtin_slot *slot = builtin_find(name, hash);
+    if (!slot->name) {
+        slot->name = strdup(name);
+        if (!slot->name) return -1;
+        slot->hash = hash;
+        builtin_count++;
+    }
+    slot->fn = fn;
+    return 0;
+}
+
+static void builtin_init(void) {
+    static bool loaded = false;
+    if (loaded) return;
+    loaded = true;
+    for (size_t i = 0; i < sizeof(core_builtins) / sizeof(core_builtins[0]); i++) {
+        builtin_insert(core_builtins[i].name, core_builtins[i].fn);
+    }
+}
+
+int builtin_register(const char *name, builtin_fn fn) {
+    if (!name || !*name || !fn) {
+        errno = EINVAL;
+        return -1;
+    }
+    builtin_init();
+    if (builtin_insert(name, fn) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+size_t builtin_names(const char **names, size_t max) {
+    builtin_init();
+    size_t n = 0;
+    for (size_t i = 0; i < builtin_cap; i++) {
+        if (!builtin_table[i].name) continue;
+        if (n < max) names[n] = builtin_table[i].name;
+        n++;
+    }
+    return n;
+}
+
+builtin_fn builtin_lookup(const char *name) {
+    builtin_init();
+    if (!builtin_table) return NULL;
+    struct builtin_slot *slot = builtin_find(name, fnv1a_str(name));
+    return slot->name ? slot->fn : NULL;
+}
@@ -0,0 +1,548 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "lab.h"
+
+// Tab completion. Executable names are gathered by a thread so the shell
+// never waits on a directory scan. Each PATH directory keeps its own
+// sorted list of names along with the mtime it was read at, a refresh
+// only reads the directories whose mtime moved and then merges the lists
+// into one sorted table without duplicates. The table works as a flat
+// trie: everything starting with a prefix is one contiguous run, found
+// with a binary search, so a lookup costs the same with ten thousand
+// names as with ten.
+struct comp_dir {
+    char *path;
+    struct timespec mtime;
+    char **names;        // Sorted, the strings live in arena
+    size_t count;
+    char *arena;
+    bool taken;          // Moved to the new list by the refresh under way
+};
+
+struct completer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    bool requested;
+    bool busy;           // A refresh is under way
+    bool stop;
+    bool ready;          // The first scan has finished
+    char *path;          // PATH as the shell last handed it over
+    unsigned scans;      // Directories read so far, for the tests
+    struct comp_dir *dirs;
+    size_t ndirs;
+    char **table;        // Every executable name, sorted and unique
+    size_t table_len;
+    char *hist_text;     // Newest history entries waiting to be split
+    char **words;        // Their words, sorted and unique
+    size_t nwords;
+    char *words_text;    // What words point into
+    // Only used by the shell's thread
+    int *jobs;
+    size_t njobs;
+    struct history *words_from;
+    size_t words_seen;   // History records when hist_text was taken
+};
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Read the executables in one directory into dir. Runs without the lock,
+// dir is not reachable from the table until it is merged.
+static void dir_scan(struct comp_dir *dir) {
+    DIR *d = opendir(dir->path);
+    size_t cap = 0, used = 0, arena_cap = 0, arena_used = 0;
+    char **names = NULL;
+    char *arena = NULL;
+    struct dirent *ent;
+
+    dir->names = NULL;
+    dir->arena = NULL;
+    dir->count = 0;
+    if (!d) return;
+
+    // Names are stored as offsets into the arena until it stops moving
+    size_t *offs = NULL;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        if (ent->d_type != DT_REG && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN) continue;
+        struct stat st;
+        if (fstatat(dirfd(d), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode) ||
+            !(st.st_mode & 0111)) {
+            continue;
+        }
+
+        size_t len = strlen(ent->d_name) + 1;
+        if (arena_used + len > arena_cap) {
+            size_t ncap = arena_cap ? arena_cap * 2 : 4096;
+            while (arena_used + len > ncap) ncap *= 2;
+            char *tmp = realloc(arena, ncap);
+            if (!tmp) break;
+            arena = tmp;
+            arena_cap = ncap;
+        }
+        if (used == cap) {
+            size_t ncap = cap ? cap * 2 : 64;
+            size_t *tmp = realloc(offs, ncap * sizeof(size_t));
+            if (!tmp) break;
+            offs = tmp;
+            cap = ncap;
+        }
+        memcpy(arena + arena_used, ent->d_name, len);
+        offs[used++] = arena_used;
+        arena_used += len;
+    }
+    closedir(d);
+
+    names = used ? malloc(used * sizeof(char *)) : NULL;
+    if (used && !names) used = 0;
+    for (size_t i = 0; i < used; i++) {
+        names[i] = arena + offs[i];
+    }
+    free(offs);
+    qsort(names, used, sizeof(char *), name_cmp);
+    dir->names = names;
+    dir->count = used;
+    dir->arena = arena;
+}
+
+static void dir_free(struct comp_dir *dir) {
+    free(dir->path);
+    free(dir->names);
+    free(dir->arena);
+}
+
+// Bring the directories in line with path. Unchanged directories are
+// moved over as they are, the rest are read again. Returns the new list,
+// the old one is left with only what was not reused.
+static struct comp_dir *dirs_refresh(struct completer *c, const char *path, size_t *ndirs,
+                                     bool *changed, unsigned *scans) {
+    size_t cap = 1;
+    for (const char *p = path; *p; p++) {
+        if (*p == ':') cap++;
+    }
+    struct comp_dir *dirs = calloc(cap, sizeof(struct comp_dir));
+    if (!dirs) return NULL;
+    size_t n = 0;
+
+    for (const char *p = path; ; p++) {
+        size_t len = strcspn(p, ":");
+        // An empty entry means the working directory, which is not worth
+        // keeping a table for
+        if (len > 0) {
+            struct comp_dir *dir = &dirs[n];
+            dir->path = strndup(p, len);
+            struct stat st;
+            if (dir->path && stat(dir->path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                struct comp_dir *old = NULL;
+                for (size_t i = 0; i < c->ndirs && !old; i++) {
+                    if (c->dirs[i].path && !c->dirs[i].taken &&
+                        strcmp(c->dirs[i].path, dir->path) == 0) {
+                        old = &c->dirs[i];
+                    }
+                }
+                if (old && old->mtime.tv_sec == st.st_mtim.tv_sec &&
+                    old->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                    free(dir->path);
+                    *dir = *old;
+                    memset(old, 0, sizeof(*old));
+                    old->taken = true;
+                } else {
+                    dir->mtime = st.st_mtim;
+                    dir_scan(dir);
+                    (*scans)++;
+                    *changed = true;
+                }
+                n++;
+            } else {
+                free(dir->path);
+                dir->path = NULL;
+            }
+        }
+        p += len;
+        if (!*p) break;
+    }
+
+    // A directory that left PATH changes the table too
+    for (size_t i = 0; i < c->ndirs; i++) {
+        if (!c->dirs[i].taken) *changed = true;
+    }
+    *ndirs = n;
+    return dirs;
+}
+
+// One sorted table out of all the directories, the first directory on
+// PATH wins but the name is the same either way
+static char **table_build(struct comp_dir *dirs, size_t ndirs, size_t *len) {
+    size_t total = 0;
+    for (size_t i = 0; i < ndirs; i++) total += dirs[i].count;
+    char **table = malloc((total ? total : 1) * sizeof(char *));
+    if (!table) return NULL;
+
+    size_t n = 0;
+    for (size_t i = 0; i < ndirs; i++) {
+        if (dirs[i].count) memcpy(table + n, dirs[i].names, dirs[i].count * sizeof(char *));
+        n += dirs[i].count;
+    }
+    qsort(table, n, sizeof(char *), name_cmp);
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (out == 0 || strcmp(table[out - 1], table[i]) != 0) table[out++] = table[i];
+    }
+    *len = out;
+    return table;
+}
+
+// The words of the history entries in text, split in place, sorted and
+// without duplicates
+static char **words_build(char *text, size_t *len) {
+    size_t cap = 256, n = 0;
+    char **words = malloc(cap * sizeof(char *));
+    if (!words) return NULL;
+    for (char *p = text;;) {
+        p += strspn(p, " \t\n");
+        size_t wlen = strcspn(p, " \t\n");
+        if (wlen == 0) break;
+        if (n == cap) {
+            char **tmp = realloc(words, cap * 2 * sizeof(char *));
+            if (!tmp) break;
+            words = tmp;
+            cap *= 2;
+        }
+        words[n++] = p;
+        p += wlen;
+        if (*p) *p++ = '\0';
+    }
+    qsort(words, n, sizeof(char *), name_cmp);
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (out == 0 || strcmp(words[out - 1], words[i]) != 0) words[out++] = words[i];
+    }
+    *len = out;
+    return words;
+}
+
+static void *comp_worker(void *arg) {
+    struct completer *c = arg;
+    for (;;) {
+        pthread_mutex_lock(&c->lock);
+        while (!c->requested && !c->stop) {
+            pthread_cond_wait(&c->wake, &c->lock);
+        }
+        if (c->stop) {
+            pthread_mutex_unlock(&c->lock);
+            break;
+        }
+        c->requested = false;
+        c->busy = true;
+        char *path = strdup(c->path);
+        char *text = c->hist_text;
+        c->hist_text = NULL;
+        for (size_t i = 0; i < c->ndirs; i++) c->dirs[i].taken = false;
+        pthread_mutex_unlock(&c->lock);
+
+        // The directories only change here, so reading them without the
+        // lock is safe. The lock is only needed to swap the table.
+        size_t ndirs = 0, len = 0;
+        unsigned scans = 0;
+        bool changed = !c->ready;
+        struct comp_dir *dirs = path ? dirs_refresh(c, path, &ndirs, &changed, &scans) : NULL;
+        char **table = dirs && changed ? table_build(dirs, ndirs, &len) : NULL;
+        free(path);
+        size_t nwords = 0;
+        char **words = text ? words_build(text, &nwords) : NULL;
+
+        // Out of memory before anything was touched keeps what we had.
+        // Without memory for the table there is nothing to complete until
+        // the next refresh, the old one points at names that are gone.
+        pthread_mutex_lock(&c->lock);
+        struct comp_dir *old = NULL;
+        size_t old_n = 0;
+        char **old_table = NULL;
+        if (dirs) {
+            old = c->dirs;
+            old_n = c->ndirs;
+            c->dirs = dirs;
+            c->ndirs = ndirs;
+            if (changed) {
+                old_table = c->table;
+                c->table = table;
+                c->table_len = table ? len : 0;
+            }
+        }
+        char **old_words = NULL;
+        char *old_text = text;
+        if (words) {
+            old_words = c->words;
+            old_text = c->words_text;
+            c->words = words;
+            c->nwords = nwords;
+            c->words_text = text;
+        }
+        c->scans += scans;
+        c->busy = false;
+        c->ready = true;
+        pthread_cond_broadcast(&c->done);
+        pthread_mutex_unlock(&c->lock);
+
+        // Nothing can reach the old names any more
+        for (size_t i = 0; old && i < old_n; i++) dir_free(&old[i]);
+        free(old);
+        free(old_table);
+        free(old_words);
+        free(old_text);
+    }
+    return NULL;
+}
+
+struct completer *comp_start(const char *path) {
+    struct completer *c = calloc(1, sizeof(struct completer));
+    if (!c) return NULL;
+    c->path = strdup(path ? path : "");
+    if (!c->path) {
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+    pthread_cond_init(&c->done, NULL);
+    c->requested = true;
+    if (pthread_create(&c->thread, NULL, comp_worker, c) != 0) {
+        pthread_mutex_destroy(&c->lock);
+        pthread_cond_destroy(&c->wake);
+        pthread_cond_destroy(&c->done);
+        free(c->path);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void comp_stop(struct completer *c) {
+    if (!c) return;
+    pthread_mutex_lock(&c->lock);
+    c->stop = true;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+
+    for (size_t i = 0; i < c->ndirs; i++) dir_free(&c->dirs[i]);
+    free(c->dirs);
+    free(c->table);
+    free(c->path);
+    free(c->jobs);
+    free(c->hist_text);
+    free(c->words);
+    free(c->words_text);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->wake);
+    pthread_cond_destroy(&c->done);
+    free(c);
+}
+
+void comp_refresh(struct completer *c, const char *path) {
+    if (!c) return;
+    pthread_mutex_lock(&c->lock);
+    if (path && strcmp(path, c->path) != 0) {
+        char *copy = strdup(path);
+        if (copy) {
+            free(c->path);
+            c->path = copy;
+        }
+    }
+    c->requested = true;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void comp_wait(struct completer *c) {
+    if (!c) return;
+    pthread_mutex_lock(&c->lock);
+    while (c->requested || c->busy || !c->ready) {
+        pthread_cond_wait(&c->done, &c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+unsigned comp_scans(struct completer *c) {
+    if (!c) return 0;
+    pthread_mutex_lock(&c->lock);
+    unsigned scans = c->scans;
+    pthread_mutex_unlock(&c->lock);
+    return scans;
+}
+
+void comp_set_history(struct completer *c, struct history *h) {
+    if (!c || !h) return;
+    size_t seq = hist_records(h);
+    if (c->words_from == h && c->words_seen == seq) return;
+
+    // Only a copy of the text crosses over, the thread never touches the
+    // history itself
+    size_t count = hist_count(h);
+    size_t first = count > COMP_HISTORY_LINES ? count - COMP_HISTORY_LINES : 0;
+    size_t len = 1;
+    for (size_t i = first; i < count; i++) len += strlen(hist_get(h, i)) + 1;
+    char *text = malloc(len);
+    if (!text) return;
+    char *p = text;
+    for (size_t i = first; i < count; i++) {
+        const char *line = hist_get(h, i);
+        size_t n = strlen(line);
+        memcpy(p, line, n);
+        p += n;
+        *p++ = '\n';
+    }
+    *p = '\0';
+    c->words_from = h;
+    c->words_seen = seq;
+
+    pthread_mutex_lock(&c->lock);
+    free(c->hist_text);
+    c->hist_text = text;
+    c->requested = true;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void comp_set_jobs(struct completer *c, const int *ids, size_t n) {
+    if (!c) return;
+    int *jobs = n ? malloc(n * sizeof(int)) : NULL;
+    if (n && !jobs) return;
+    if (n) memcpy(jobs, ids, n * sizeof(int));
+    free(c->jobs);
+    c->jobs = jobs;
+    c->njobs = n;
+}
+
+// The matches the way readline wants them: the text to put in place of
+// the word first, then each match, then NULL. With a single match the
+// first entry is that match and there is nothing after it.
+struct matches {
+    char **list;
+    size_t len;
+    size_t cap;
+};
+
+static int matches_add(struct matches *m, const char *s, size_t len) {
+    // Two spare slots, one for the replacement and one for the NULL
+    if (m->len + 2 >= m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 16;
+        char **tmp = realloc(m->list, cap * sizeof(char *));
+        if (!tmp) return -1;
+        m->list = tmp;
+        m->cap = cap;
+    }
+    char *copy = strndup(s, len);
+    if (!copy) return -1;
+    m->list[1 + m->len++] = copy;
+    return 0;
+}
+
+static char **matches_done(struct matches *m) {
+    if (m->len == 0) {
+        free(m->list);
+        return NULL;
+    }
+    if (m->len == 1) {
+        m->list[0] = m->list[1];
+        m->list[1] = NULL;
+        return m->list;
+    }
+
+    // The longest prefix they all share
+    size_t common = strlen(m->list[1]);
+    for (size_t i = 2; i <= m->len; i++) {
+        size_t j = 0;
+        while (j < common && m->list[i][j] == m->list[1][j]) j++;
+        common = j;
+    }
+    m->list[0] = strndup(m->list[1], common);
+    if (!m->list[0]) {
+        for (size_t i = 1; i <= m->len; i++) free(m->list[i]);
+        free(m->list);
+        return NULL;
+    }
+    m->list[m->len + 1] = NULL;
+    return m->list;
+}
+
+#define COMP_MAX_BUILTINS 256
+
+// Where the run of names starting with prefix begins in a sorted table
+static size_t prefix_lower(char *const *table, size_t len, const char *prefix, size_t plen) {
+    size_t lo = 0, hi = len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(table[mid], prefix, plen) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+char **comp_command(struct completer *c, const char *prefix) {
+    struct matches m = {0};
+    size_t plen = strlen(prefix);
+
+    const char *builtins[COMP_MAX_BUILTINS];
+    size_t nbuiltins = builtin_names(builtins, COMP_MAX_BUILTINS);
+    if (nbuiltins > COMP_MAX_BUILTINS) nbuiltins = COMP_MAX_BUILTINS;
+    for (size_t i = 0; i < nbuiltins; i++) {
+        if (strncmp(builtins[i], prefix, plen) == 0) matches_add(&m, builtins[i], strlen(builtins[i]));
+    }
+    size_t from_builtins = m.len;
+
+    if (c) {
+        // The first Tab after startup may have to wait for the first scan
+        pthread_mutex_lock(&c->lock);
+        while (!c->ready) pthread_cond_wait(&c->done, &c->lock);
+
+        for (size_t i = prefix_lower(c->table, c->table_len, prefix, plen); i < c->table_len && strncmp(c->table[i], prefix, plen) == 0; i++) {
+            // A builtin shadows the program of the same name
+            bool dup = false;
+            for (size_t j = 1; j <= from_builtins && !dup; j++) {
+                dup = strcmp(m.list[j], c->table[i]) == 0;
+            }
+            if (!dup && matches_add(&m, c->table[i], strlen(c->table[i])) < 0) break;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    return matches_done(&m);
+}
+
+char **comp_jobs(struct completer *c, const char *prefix) {
+    struct matches m = {0};
+    if (!c || prefix[0] != '%') return NULL;
+    size_t plen = strlen(prefix);
+    for (size_t i = 0; i < c->njobs; i++) {
+        char id[16];
+        int n = snprintf(id, sizeof(id), "%%%d", c->jobs[i]);
+        if (strncmp(id, prefix, plen) == 0 && matches_add(&m, id, (size_t)n) < 0) break;
+    }
+    return matches_done(&m);
+}
+
+char **comp_history(struct completer *c, const char *prefix) {
+    if (!c) return NULL;
+    struct matches m = {0};
+    size_t plen = strlen(prefix);
+    pthread_mutex_lock(&c->lock);
+    for (size_t i = prefix_lower(c->words, c->nwords, prefix, plen);
+         i < c->nwords && strncmp(c->words[i], prefix, plen) == 0; i++) {
+        if (matches_add(&m, c->words[i], strlen(c->words[i])) < 0) break;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return matches_done(&m);
+}
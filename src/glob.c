@@ -0,0 +1,746 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "lab.h"
+
+// Filename expansion for *, ?, [...] and **. Directories are read with
+// getdents64 straight into a buffer, and the d_type it returns tells
+// directories from files so nothing is stat'ed unless the filesystem
+// leaves the type out or a symlink has to be followed.
+//
+// The walk is a queue of tasks, each one a directory and the pattern
+// component to match in it. Components without wildcards never read the
+// directory at all. Matches are collected unsorted and sorted once at the
+// end, the way bash prints them in the C locale.
+//
+// A walk that keeps finding directories is shared out to a few threads,
+// which all take tasks from the one queue and collect their own matches.
+// Sorting the matches of all of them at the end gives the same answer in
+// the same order as a walk on one thread.
+//
+// Listings can be kept in a cache. Each one remembers the mtime of its
+// directory, which changes whenever an entry is added, removed or renamed,
+// so a stat is enough to tell whether it can be used again.
+
+// Directories waiting before a walk starts more threads
+#define GLOB_SPAWN_TASKS 16
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct glob_ent {
+    uint32_t name;       // Offset of the name in the listing's arena
+    unsigned char type;  // d_type, DT_UNKNOWN if the filesystem did not say
+};
+
+struct glob_dir {
+    size_t refs;         // The cache and each walk using it
+    char *path;
+    struct timespec mtime;
+    dev_t dev;
+    ino_t ino;
+    struct glob_ent *ents;
+    size_t count;
+    char *names;
+};
+
+struct glob_cache {
+    pthread_mutex_t lock;
+    struct glob_dir **slots; // Open addressing by path hash
+    size_t cap;
+    size_t used;
+    size_t entries;      // Entries in all listings
+    size_t max_entries;  // Start over when there are more than this
+};
+
+struct glob_task {
+    char *dir;           // The directory with a trailing /, empty for .
+    size_t comp;         // The pattern component to match in it
+    bool descent;        // Reached by ** going down a level
+};
+
+struct glob_found {
+    char **paths;
+    size_t count;
+    size_t cap;
+    bool failed;
+};
+
+struct glob_walk {
+    char **comps;        // The pattern split at /
+    size_t ncomps;
+    bool dir_only;       // The pattern ended with /
+    struct glob_cache *cache;
+    pthread_mutex_t lock;
+    pthread_cond_t more; // Tasks were queued or the walk is over
+    struct glob_task *tasks;
+    size_t ntasks;
+    size_t tasks_cap;
+    size_t running;      // Threads taking tasks, the caller included
+    size_t idle;         // Of those, the ones waiting for a task
+    bool done;
+    bool failed;
+};
+
+struct glob_worker {
+    struct glob_walk *walk;
+    pthread_t thread;
+    struct glob_found found;
+};
+
+bool glob_has_magic(const char *s) {
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) {
+            s++;
+        } else if (*s == '*' || *s == '?' || *s == '[') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Match a bracket expression starting just after the [. Returns the
+// position after the ] or NULL if the bracket is not closed, in which
+// case the [ is an ordinary character.
+static const char *match_bracket(const char *p, char c, bool *matched) {
+    bool negate = *p == '!' || *p == '^';
+    if (negate) p++;
+    bool hit = false;
+    const char *start = p;
+    while (*p && (*p != ']' || p == start)) {
+        char lo = *p;
+        if (lo == '\\' && p[1]) lo = *++p;
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            char hi = p[2];
+            p += 2;
+            if (hi == '\\' && p[1]) hi = *++p;
+            if ((unsigned char)c >= (unsigned char)lo && (unsigned char)c <= (unsigned char)hi) hit = true;
+        } else if (c == lo) {
+            hit = true;
+        }
+        p++;
+    }
+    if (*p != ']') return NULL;
+    *matched = hit != negate;
+    return p + 1;
+}
+
+bool glob_match(const char *p, const char *s) {
+    // On a mismatch after a * we go back and let the * take one more
+    // character, only the last * ever needs to be retried
+    const char *star_p = NULL, *star_s = NULL;
+    while (*s) {
+        if (*p == '*') {
+            while (*p == '*') p++;
+            if (!*p) return true;
+            star_p = p;
+            star_s = s;
+            continue;
+        }
+        bool ok = false;
+        const char *next = p + 1;
+        if (*p == '?') {
+            ok = true;
+        } else if (*p == '[') {
+            const char *end = match_bracket(p + 1, *s, &ok);
+            if (end) {
+                next = end;
+            } else {
+                ok = *s == '[';
+            }
+        } else if (*p == '\\' && p[1]) {
+            ok = p[1] == *s;
+            next = p + 2;
+        } else {
+            ok = *p && *p == *s;
+        }
+        if (ok) {
+            p = next;
+            s++;
+        } else if (star_p) {
+            p = star_p;
+            s = ++star_s;
+        } else {
+            return false;
+        }
+    }
+    while (*p == '*') p++;
+    return !*p;
+}
+
+static void dir_free(struct glob_dir *d) {
+    if (!d) return;
+    free(d->path);
+    free(d->ents);
+    free(d->names);
+    free(d);
+}
+
+// Read a directory with getdents64. The caller has the stat for it.
+static struct glob_dir *dir_read(const char *path, const struct stat *st) {
+    int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct glob_dir *d = calloc(1, sizeof(struct glob_dir));
+    if (!d || !(d->path = strdup(path))) {
+        free(d);
+        close(fd);
+        return NULL;
+    }
+    d->refs = 1;
+    d->mtime = st->st_mtim;
+    d->dev = st->st_dev;
+    d->ino = st->st_ino;
+
+    size_t cap = 0, names_cap = 0, names_len = 0;
+    char buf[32768];
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *e = (struct linux_dirent64 *)(buf + off);
+            off += e->d_reclen;
+            const char *name = e->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+
+            size_t len = strlen(name) + 1;
+            if (names_len + len > names_cap) {
+                size_t ncap = names_cap ? names_cap * 2 : 4096;
+                while (names_len + len > ncap) ncap *= 2;
+                char *tmp = realloc(d->names, ncap);
+                if (!tmp) goto fail;
+                d->names = tmp;
+                names_cap = ncap;
+            }
+            if (d->count == cap) {
+                size_t ncap = cap ? cap * 2 : 64;
+                struct glob_ent *tmp = realloc(d->ents, ncap * sizeof(struct glob_ent));
+                if (!tmp) goto fail;
+                d->ents = tmp;
+                cap = ncap;
+            }
+            memcpy(d->names + names_len, name, len);
+            d->ents[d->count].name = (uint32_t)names_len;
+            d->ents[d->count].type = e->d_type;
+            d->count++;
+            names_len += len;
+        }
+    }
+    close(fd);
+    if (n < 0) {
+        dir_free(d);
+        return NULL;
+    }
+    return d;
+
+fail:
+    close(fd);
+    dir_free(d);
+    return NULL;
+}
+
+struct glob_cache *glob_cache_new(size_t max_entries) {
+    struct glob_cache *gc = calloc(1, sizeof(struct glob_cache));
+    if (!gc) return NULL;
+    pthread_mutex_init(&gc->lock, NULL);
+    gc->max_entries = max_entries;
+    return gc;
+}
+
+// Drop a reference to a listing, with the cache locked
+static void dir_unref(struct glob_dir *d) {
+    if (d && --d->refs == 0) dir_free(d);
+}
+
+static void cache_clear(struct glob_cache *gc) {
+    for (size_t i = 0; i < gc->cap; i++) {
+        dir_unref(gc->slots[i]);
+    }
+    free(gc->slots);
+    gc->slots = NULL;
+    gc->cap = gc->used = gc->entries = 0;
+}
+
+void glob_cache_free(struct glob_cache *gc) {
+    if (!gc) return;
+    cache_clear(gc);
+    pthread_mutex_destroy(&gc->lock);
+    free(gc);
+}
+
+static struct glob_dir **cache_slot(struct glob_cache *gc, const char *path, uint32_t hash) {
+    size_t mask = gc->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (!gc->slots[i] || strcmp(gc->slots[i]->path, path) == 0) return &gc->slots[i];
+    }
+}
+
+static int cache_grow(struct glob_cache *gc) {
+    size_t cap = gc->cap ? gc->cap * 2 : 256;
+    struct glob_dir **old = gc->slots;
+    size_t old_cap = gc->cap;
+    gc->slots = calloc(cap, sizeof(struct glob_dir *));
+    if (!gc->slots) {
+        gc->slots = old;
+        return -1;
+    }
+    gc->cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i]) *cache_slot(gc, old[i]->path, fnv1a_str(old[i]->path)) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static bool cache_used(const void *slot, uint32_t *hash) {
+    const struct glob_dir *d = *(struct glob_dir *const *)slot;
+    if (!d) return false;
+    *hash = fnv1a_str(d->path);
+    return true;
+}
+
+static void cache_remove(struct glob_cache *gc, struct glob_dir **slot) {
+    gc->entries -= (*slot)->count;
+    dir_unref(*slot);
+    *slot = NULL;
+    gc->used--;
+    hashtab_delete(gc->slots, sizeof(struct glob_dir *), gc->cap, (size_t)(slot - gc->slots),
+                   cache_used);
+}
+
+static bool dir_fresh(const struct glob_dir *d, const struct stat *st) {
+    return d->mtime.tv_sec == st->st_mtim.tv_sec && d->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           d->dev == st->st_dev && d->ino == st->st_ino;
+}
+
+// The listing of path, from the cache when the directory has not changed
+// since it was read. Give it back with dir_put.
+static struct glob_dir *dir_get(struct glob_cache *gc, const char *path) {
+    struct stat st;
+    if (stat(*path ? path : ".", &st) < 0 || !S_ISDIR(st.st_mode)) return NULL;
+    if (!gc) return dir_read(path, &st);
+
+    uint32_t hash = fnv1a_str(path);
+    pthread_mutex_lock(&gc->lock);
+    struct glob_dir **slot = gc->cap ? cache_slot(gc, path, hash) : NULL;
+    if (slot && *slot && dir_fresh(*slot, &st)) {
+        struct glob_dir *d = *slot;
+        d->refs++;
+        pthread_mutex_unlock(&gc->lock);
+        return d;
+    }
+    pthread_mutex_unlock(&gc->lock);
+
+    // Read it unlocked so the other threads of a walk keep going
+    struct glob_dir *d = dir_read(path, &st);
+    if (!d) return NULL;
+    pthread_mutex_lock(&gc->lock);
+    // Whatever is there now is stale or was read at the same time
+    slot = gc->cap ? cache_slot(gc, path, hash) : NULL;
+    if (slot && *slot) cache_remove(gc, slot);
+    if (gc->entries + d->count > gc->max_entries) cache_clear(gc);
+    // Without room to keep it the caller still has its reference
+    if ((gc->used + 1) * 2 <= gc->cap || cache_grow(gc) == 0) {
+        *cache_slot(gc, path, hash) = d;
+        d->refs++;
+        gc->used++;
+        gc->entries += d->count;
+    }
+    pthread_mutex_unlock(&gc->lock);
+    return d;
+}
+
+static void dir_put(struct glob_cache *gc, struct glob_dir *d) {
+    if (!gc) {
+        dir_free(d);
+        return;
+    }
+    pthread_mutex_lock(&gc->lock);
+    dir_unref(d);
+    pthread_mutex_unlock(&gc->lock);
+}
+
+// Queue a task, the walk takes over path
+static void walk_push(struct glob_walk *w, char *path, size_t comp, bool descent) {
+    pthread_mutex_lock(&w->lock);
+    if (path && w->ntasks == w->tasks_cap) {
+        size_t cap = w->tasks_cap ? w->tasks_cap * 2 : 64;
+        struct glob_task *tmp = realloc(w->tasks, cap * sizeof(struct glob_task));
+        if (tmp) {
+            w->tasks = tmp;
+            w->tasks_cap = cap;
+        } else {
+            free(path);
+            path = NULL;
+        }
+    }
+    if (path) {
+        w->tasks[w->ntasks].dir = path;
+        w->tasks[w->ntasks].comp = comp;
+        w->tasks[w->ntasks].descent = descent;
+        w->ntasks++;
+        if (w->idle) pthread_cond_signal(&w->more);
+    } else {
+        w->failed = true;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Queue the subdirectory name of dir
+static void walk_task(struct glob_walk *w, const char *dir, size_t dlen, const char *name,
+                      size_t comp, bool descent) {
+    size_t nlen = strlen(name);
+    char *path = malloc(dlen + nlen + 2);
+    if (path) {
+        memcpy(path, dir, dlen);
+        memcpy(path + dlen, name, nlen);
+        path[dlen + nlen] = '/';
+        path[dlen + nlen + 1] = '\0';
+    }
+    walk_push(w, path, comp, descent);
+}
+
+// Add a match, out takes over path
+static void walk_add(struct glob_found *out, char *path) {
+    if (!path) {
+        out->failed = true;
+        return;
+    }
+    if (out->count == out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 64;
+        char **tmp = realloc(out->paths, cap * sizeof(char *));
+        if (!tmp) {
+            free(path);
+            out->failed = true;
+            return;
+        }
+        out->paths = tmp;
+        out->cap = cap;
+    }
+    out->paths[out->count++] = path;
+}
+
+// Add the entry name of dir as a match
+static void walk_found(struct glob_walk *w, struct glob_found *out, const char *dir, size_t dlen,
+                       const char *name) {
+    size_t nlen = strlen(name);
+    char *path = malloc(dlen + nlen + 2);
+    if (path) {
+        memcpy(path, dir, dlen);
+        memcpy(path + dlen, name, nlen);
+        if (w->dir_only) path[dlen + nlen++] = '/';
+        path[dlen + nlen] = '\0';
+    }
+    walk_add(out, path);
+}
+
+// Whether an entry is a directory. d_type answers most of the time,
+// symlinks are followed unless nofollow is set, as ** does.
+static bool ent_is_dir(const char *dir, const char *name, unsigned char type, bool nofollow) {
+    if (type == DT_DIR) return true;
+    if (type != DT_UNKNOWN && (type != DT_LNK || nofollow)) return false;
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s%s", dir, name);
+    if ((nofollow ? lstat(path, &st) : stat(path, &st)) < 0) return false;
+    return S_ISDIR(st.st_mode);
+}
+
+// Copy a component without wildcards, dropping its backslashes
+static void unescape(char *out, const char *s) {
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) s++;
+        *out++ = *s;
+    }
+    *out = '\0';
+}
+
+static void walk_one(struct glob_walk *w, struct glob_found *out, const char *dir, size_t comp,
+                     bool descent) {
+    const char *pat = w->comps[comp];
+    size_t dlen = strlen(dir);
+    bool last = comp + 1 == w->ncomps;
+
+    if (!glob_has_magic(pat)) {
+        // Nothing to match, the name is used as is and only checked for
+        // at the end
+        char name[NAME_MAX + 1];
+        if (strlen(pat) > NAME_MAX) return;
+        unescape(name, pat);
+        if (!last) {
+            walk_task(w, dir, dlen, name, comp + 1, false);
+            return;
+        }
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s%s", dir, name);
+        if (lstat(path, &st) == 0 && (!w->dir_only || (stat(path, &st) == 0 && S_ISDIR(st.st_mode)))) {
+            walk_found(w, out, dir, dlen, name);
+        }
+        return;
+    }
+
+    bool globstar = strcmp(pat, "**") == 0;
+    if (globstar && !last) {
+        // ** matches no directory at all too
+        walk_push(w, strdup(dir), comp + 1, false);
+    }
+
+    struct glob_dir *d = dir_get(w->cache, dir);
+    if (!d) return;
+    if (globstar && last && *dir && !descent) {
+        // Which at the end of the pattern is the directory itself, as
+        // bash lists it with its slash
+        walk_add(out, strdup(dir));
+    }
+    bool dot = pat[0] == '.';
+    for (size_t i = 0; i < d->count && !out->failed; i++) {
+        const char *name = d->names + d->ents[i].name;
+        // Hidden entries only match a pattern that starts with a dot
+        if (name[0] == '.' && !dot) continue;
+        if (globstar) {
+            // Symlinks to directories match a trailing / but are not
+            // gone into
+            bool is_dir = ent_is_dir(dir, name, d->ents[i].type, true);
+            if (last && (!w->dir_only || is_dir || ent_is_dir(dir, name, d->ents[i].type, false))) {
+                walk_found(w, out, dir, dlen, name);
+            }
+            if (is_dir) walk_task(w, dir, dlen, name, comp, true);
+            continue;
+        }
+        if (!glob_match(pat, name)) continue;
+        if (last) {
+            if (!w->dir_only || ent_is_dir(dir, name, d->ents[i].type, false)) {
+                walk_found(w, out, dir, dlen, name);
+            }
+        } else if (ent_is_dir(dir, name, d->ents[i].type, false)) {
+            walk_task(w, dir, dlen, name, comp + 1, false);
+        }
+    }
+    dir_put(w->cache, d);
+}
+
+static void *walk_worker(void *arg);
+
+// Take tasks until there are none left and nobody is working on one that
+// could queue more. The caller of the walk brings in the pool once enough
+// directories are waiting, and returns how many threads it started.
+static size_t walk_run(struct glob_walk *w, struct glob_found *out, struct glob_worker *pool,
+                       size_t npool) {
+    size_t started = 0;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        if (out->failed) w->failed = true;
+        if (w->failed || w->done) break;
+        if (w->ntasks == 0) {
+            if (w->idle + 1 == w->running) break;
+            w->idle++;
+            pthread_cond_wait(&w->more, &w->lock);
+            w->idle--;
+            continue;
+        }
+        while (started < npool && w->ntasks > GLOB_SPAWN_TASKS) {
+            pool[started].walk = w;
+            if (pthread_create(&pool[started].thread, NULL, walk_worker, &pool[started]) != 0) {
+                npool = started;
+                break;
+            }
+            w->running++;
+            started++;
+        }
+        struct glob_task t = w->tasks[--w->ntasks];
+        pthread_mutex_unlock(&w->lock);
+        walk_one(w, out, t.dir, t.comp, t.descent);
+        free(t.dir);
+        pthread_mutex_lock(&w->lock);
+    }
+    w->done = true;
+    pthread_cond_broadcast(&w->more);
+    pthread_mutex_unlock(&w->lock);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(pool[i].thread, NULL);
+    }
+    return started;
+}
+
+static void *walk_worker(void *arg) {
+    struct glob_worker *worker = arg;
+    walk_run(worker->walk, &worker->found, NULL, 0);
+    return NULL;
+}
+
+static int found_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void found_free(struct glob_found *f) {
+    for (size_t i = 0; i < f->count; i++) free(f->paths[i]);
+    free(f->paths);
+}
+
+int glob_expand(const char *pattern, struct glob_cache *gc, size_t threads, char ***out,
+                size_t *n) {
+    struct glob_walk w = {0};
+    struct glob_found found = {0};
+    *out = NULL;
+    *n = 0;
+
+    // Split the pattern into components, a leading / starts at the root
+    char *copy = strdup(pattern);
+    if (!copy) return -1;
+    size_t cap = 1;
+    for (const char *p = pattern; *p; p++) {
+        if (*p == '/') cap++;
+    }
+    w.comps = malloc(cap * sizeof(char *));
+    struct glob_worker *pool = threads > 1 ? calloc(threads - 1, sizeof(struct glob_worker)) : NULL;
+    if (!w.comps || (threads > 1 && !pool)) {
+        free(w.comps);
+        free(copy);
+        return -1;
+    }
+    for (char *save = NULL, *tok = strtok_r(copy, "/", &save); tok; tok = strtok_r(NULL, "/", &save)) {
+        w.comps[w.ncomps++] = tok;
+    }
+    size_t plen = strlen(pattern);
+    w.dir_only = plen > 1 && pattern[plen - 1] == '/';
+    w.cache = gc;
+    w.running = 1;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.more, NULL);
+
+    // A relative pattern starts in ., which is the empty prefix
+    size_t started = 0;
+    if (w.ncomps > 0) {
+        walk_push(&w, strdup(pattern[0] == '/' ? "/" : ""), 0, false);
+        started = walk_run(&w, &found, pool, threads > 1 ? threads - 1 : 0);
+    }
+
+    // Everything the pool found goes in with the rest
+    for (size_t i = 0; i < started; i++) {
+        struct glob_found *f = &pool[i].found;
+        if (!f->failed && !found.failed && found.count + f->count > found.cap) {
+            char **tmp = realloc(found.paths, (found.count + f->count) * sizeof(char *));
+            if (tmp) {
+                found.paths = tmp;
+                found.cap = found.count + f->count;
+            } else {
+                found.failed = true;
+            }
+        }
+        if (f->failed || found.failed) {
+            found.failed = true;
+            found_free(f);
+            continue;
+        }
+        if (f->count) memcpy(found.paths + found.count, f->paths, f->count * sizeof(char *));
+        found.count += f->count;
+        free(f->paths);
+    }
+
+    for (size_t i = 0; i < w.ntasks; i++) free(w.tasks[i].dir);
+    free(w.tasks);
+    free(w.comps);
+    free(copy);
+    free(pool);
+    pthread_cond_destroy(&w.more);
+    pthread_mutex_destroy(&w.lock);
+
+    if (w.failed || found.failed) {
+        found_free(&found);
+        return -1;
+    }
+
+    // Sort once, consecutive ** can reach a path twice
+    qsort(found.paths, found.count, sizeof(char *), found_cmp);
+    size_t m = 0;
+    for (size_t i = 0; i < found.count; i++) {
+        if (m && strcmp(found.paths[m - 1], found.paths[i]) == 0) {
+            free(found.paths[i]);
+        } else {
+            found.paths[m++] = found.paths[i];
+        }
+    }
+    *out = found.paths;
+    *n = m;
+    return 0;
+}
+
+// One thread per CPU, up to GLOB_THREADS
+static size_t glob_threads(void) {
+    static size_t threads;
+    if (!threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > GLOB_THREADS ? GLOB_THREADS : (size_t)cpus;
+    }
+    return threads;
+}
+
+// Backslash is the only quoting there is, so it is removed from every word
+// the way bash removes quotes, whether or not the word was a pattern
+static char *glob_unescape(const char *s) {
+    char *out = malloc(strlen(s) + 1);
+    if (out) unescape(out, s);
+    return out;
+}
+
+char **glob_argv(struct shell *sh, char **argv) {
+    size_t argc = 0;
+    bool changed = false;
+    for (; argv[argc]; argc++) {
+        if (strchr(argv[argc], '\\') || glob_has_magic(argv[argc])) changed = true;
+    }
+    if (!changed) return argv;
+
+    size_t cap = argc + 1, n = 0;
+    char **out = malloc(cap * sizeof(char *));
+    if (!out) return NULL;
+    for (size_t i = 0; i < argc; i++) {
+        char **found = NULL;
+        size_t count = 0;
+        if (glob_has_magic(argv[i]) &&
+            glob_expand(argv[i], sh ? sh->glob_cache : NULL, glob_threads(), &found, &count) < 0) {
+            goto fail;
+        }
+        if (count == 0) {
+            free(found);
+            found = NULL;
+        }
+        if (n + (found ? count : 1) + 1 > cap) {
+            while (n + (found ? count : 1) + 1 > cap) cap *= 2;
+            char **tmp = realloc(out, cap * sizeof(char *));
+            if (!tmp) {
+                for (size_t j = 0; j < count; j++) free(found[j]);
+                free(found);
+                goto fail;
+            }
+            out = tmp;
+        }
+        if (found) {
+            memcpy(out + n, found, count * sizeof(char *));
+            n += count;
+            free(found);
+        } else if (!(out[n++] = glob_unescape(argv[i]))) {
+            n--;
+            goto fail;
+        }
+    }
+    out[n] = NULL;
+    return out;
+
+fail:
+    out[n] = NULL;
+    cmd_free(out);
+    return NULL;
+}
@@ -0,0 +1,19 @@
+#include <string.h>
+#include "lab.h"
+
+void hashtab_delete(void *slots, size_t size, size_t cap, size_t at, hashtab_hash_fn hash) {
+    char *base = slots;
+    size_t mask = cap - 1;
+    size_t hole = at;
+    uint32_t h;
+    for (size_t i = (at + 1) & mask; hash(base + i * size, &h); i = (i + 1) & mask) {
+        // An entry can fill the hole only if its probe passed through it,
+        // one whose home is between the hole and itself has to stay
+        size_t home = h & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            memcpy(base + hole * size, base + i * size, size);
+            hole = i;
+        }
+    }
+    memset(base + hole * size, 0, size);
+}
@@ -0,0 +1,867 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lab.h"
+
+// The history file starts with this magic and is followed by records. Each
+// record is a header, the line, a NUL and padding up to a multiple of 8.
+// Records are only ever appended and each one goes out in a single write on
+// an O_APPEND descriptor. A write cut short by a crash leaves the records
+// after it unaligned, so headers are always read with memcpy.
+//
+// A line that is already in the log is stored again as a reference record,
+// a header with HIST_REF as the length followed by the offset of the earlier
+// copy, so commands repeated for weeks cost 16 bytes each instead of a copy.
+//
+// Next to it lives <file>.idx, an array with the file offset of every
+// record. Every session derives the same offsets from the log, so the
+// index is just a cache that lets startup skip walking the records.
+#define HIST_MAGIC "LABHIST\001"
+#define HIST_MAGIC_LEN 8
+#define HIST_MIN_MAP (1 << 20)
+#define HIST_REF 0x80000000u
+#define HIST_REF_SIZE 16
+#define HIST_PREFIX_MAX 16
+
+struct hist_rec {
+    uint32_t len;        // Length of the line without the NUL
+    uint32_t hash;       // FNV-1a of the line
+};
+
+struct history {
+    int fd;              // The log, -1 when history is only kept in memory
+    int idx_fd;          // The index, -1 if it could not be opened
+    char *base;          // The mapped log or the in memory arena
+    size_t map_len;      // Bytes mapped or allocated at base
+    size_t size;         // End of the last record we have indexed
+    uint64_t *recs;      // Offset of each record from rec_base on
+    size_t rec_base;     // Record number of recs[0], older ones were dropped
+    size_t nrecs;
+    size_t cap;
+    size_t idx_count;    // Records known to be in the index file
+    uint32_t *view;      // Record numbers of the visible entries, ascending
+    size_t view_head;    // Entries before this fell off the front
+    size_t view_len;
+    size_t view_cap;
+    bool view_ready;     // Set once the view is built, new records go into it
+    size_t max;          // Most entries to keep, 0 for no limit
+    enum hist_dups dups;
+    uint32_t *dup_set;   // Newest record of each line plus one, by line hash
+    size_t dup_cap;
+    size_t dup_used;
+    struct tri_index tri; // Trigram index, built on the first search
+    size_t tri_seq;      // Records before this have been indexed
+    size_t tri_stale;    // Indexed records that are no longer visible
+    struct pre_slot *pre; // Prefix index for !prefix, built on first use
+    size_t pre_cap;
+    size_t pre_used;
+    size_t pre_seq;      // Records before this have been indexed
+};
+
+// The newest entry starting with some prefix of up to HIST_PREFIX_MAX bytes
+struct pre_slot {
+    uint32_t hash;       // FNV-1a of the prefix
+    uint32_t len;        // Length of the prefix
+    uint32_t seq;        // The record plus one, zero marks a free slot
+};
+
+static size_t rec_size(uint32_t len) {
+    if (len == HIST_REF) return HIST_REF_SIZE;
+    return (sizeof(struct hist_rec) + len + 1 + 7) & ~(size_t)7;
+}
+
+static struct hist_rec rec_at(const struct history *h, size_t off) {
+    struct hist_rec rec;
+    memcpy(&rec, h->base + off, sizeof(rec));
+    return rec;
+}
+
+static uint64_t ref_target(const struct history *h, size_t off) {
+    uint64_t target;
+    memcpy(&target, h->base + off + sizeof(struct hist_rec), sizeof(target));
+    return target;
+}
+
+// Check the record at off fits in the first end bytes and is intact
+static bool rec_valid(const struct history *h, size_t off, size_t end, bool check_hash) {
+    if (off + sizeof(struct hist_rec) > end) return false;
+    struct hist_rec rec = rec_at(h, off);
+    if (rec.len == HIST_REF) {
+        // A reference must point back at a line record with the same hash
+        if (off + HIST_REF_SIZE > end) return false;
+        uint64_t target = ref_target(h, off);
+        if (target >= off || (h->fd >= 0 && target < HIST_MAGIC_LEN)) return false;
+        if (rec_at(h, target).len == HIST_REF) return false;
+        return rec_valid(h, target, off, check_hash) && rec_at(h, target).hash == rec.hash;
+    }
+    if (rec.len > end - off - sizeof(struct hist_rec) - 1) return false;
+    if (off + rec_size(rec.len) > end) return false;
+    const char *line = h->base + off + sizeof(struct hist_rec);
+    if (line[rec.len] != '\0') return false;
+    return !check_hash || fnv1a(line, rec.len) == rec.hash;
+}
+
+static size_t rec_total(const struct history *h) {
+    return h->rec_base + h->nrecs;
+}
+
+// Offset of the line record holding the text of record seq
+static uint64_t rec_text(const struct history *h, size_t seq) {
+    uint64_t off = h->recs[seq - h->rec_base];
+    if (rec_at(h, off).len == HIST_REF) off = ref_target(h, off);
+    return off;
+}
+
+static const char *rec_line(const struct history *h, size_t seq) {
+    return h->base + rec_text(h, seq) + sizeof(struct hist_rec);
+}
+
+static uint32_t rec_hash(const struct history *h, size_t seq) {
+    return rec_at(h, h->recs[seq - h->rec_base]).hash;
+}
+
+static bool rec_same(const struct history *h, size_t a, size_t b) {
+    return rec_hash(h, a) == rec_hash(h, b) && rec_text(h, a) == rec_text(h, b);
+}
+
+// Find the slot for a line in the duplicate set, either the one holding
+// its newest record or the empty slot where that would go. Slots for
+// records that were dropped are skipped over.
+static uint32_t *dup_slot(struct history *h, uint32_t hash, const char *line) {
+    size_t mask = h->dup_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        uint32_t *slot = &h->dup_set[i];
+        if (*slot == 0) return slot;
+        size_t seq = *slot - 1;
+        if (seq >= h->rec_base && rec_hash(h, seq) == hash &&
+            strcmp(rec_line(h, seq), line) == 0) {
+            return slot;
+        }
+    }
+}
+
+// Make room for one more line, dropping entries for records that are gone
+static int dup_reserve(struct history *h) {
+    if ((h->dup_used + 1) * 2 <= h->dup_cap) return 0;
+
+    size_t live = 0;
+    for (size_t i = 0; i < h->dup_cap; i++) {
+        if (h->dup_set[i] && h->dup_set[i] - 1 >= h->rec_base) live++;
+    }
+    size_t cap = 1024;
+    while (cap < (live + 1) * 4) cap *= 2;
+    uint32_t *old = h->dup_set;
+    size_t old_cap = h->dup_cap;
+    h->dup_set = calloc(cap, sizeof(uint32_t));
+    if (!h->dup_set) {
+        h->dup_set = old;
+        return -1;
+    }
+    h->dup_cap = cap;
+    h->dup_used = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!old[i] || old[i] - 1 < h->rec_base) continue;
+        size_t seq = old[i] - 1;
+        *dup_slot(h, rec_hash(h, seq), rec_line(h, seq)) = old[i];
+        h->dup_used++;
+    }
+    free(old);
+    return 0;
+}
+
+// The position of record seq among the visible entries, or -1
+static long view_find(const struct history *h, size_t seq) {
+    size_t lo = h->view_head, hi = h->view_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (h->view[mid] < seq) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < h->view_len && h->view[lo] == seq) return (long)(lo - h->view_head);
+    return -1;
+}
+
+// The first visible entry with a record number of at least seq
+static size_t view_since(const struct history *h, size_t seq) {
+    size_t lo = h->view_head, hi = h->view_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (h->view[mid] < seq) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - h->view_head;
+}
+
+static void view_forget(struct history *h, size_t seq) {
+    if (seq < h->tri_seq) h->tri_stale++;
+}
+
+static void hist_save_index(struct history *h);
+
+// Drop the offsets of records older than the oldest visible entry, once
+// there are enough of them to be worth the copy
+static void recs_trim(struct history *h) {
+    if (h->view_head == h->view_len) return;
+    size_t drop = h->view[h->view_head] - h->rec_base;
+    if (drop < 1024 || drop * 2 < h->nrecs) return;
+
+    // The index file can only be extended from records we still have
+    hist_save_index(h);
+    memmove(h->recs, h->recs + drop, (h->nrecs - drop) * sizeof(uint64_t));
+    h->rec_base += drop;
+    h->nrecs -= drop;
+}
+
+// Decide whether a new record becomes a visible entry, applying the
+// duplicate policy and the size limit
+static void view_push(struct history *h, size_t seq) {
+    uint32_t hash = rec_hash(h, seq);
+    const char *line = rec_line(h, seq);
+
+    size_t count = h->view_len - h->view_head;
+    bool visible = !(h->dups == HIST_IGNORE_DUPS && count > 0 &&
+                     rec_same(h, h->view[h->view_len - 1], seq));
+
+    if (dup_reserve(h) == 0) {
+        uint32_t *slot = dup_slot(h, hash, line);
+        if (*slot == 0) {
+            h->dup_used++;
+        } else if (visible && h->dups == HIST_ERASE_DUPS) {
+            long i = view_find(h, *slot - 1);
+            if (i >= 0) {
+                size_t at = h->view_head + (size_t)i;
+                view_forget(h, h->view[at]);
+                memmove(h->view + at, h->view + at + 1,
+                        (h->view_len - at - 1) * sizeof(uint32_t));
+                h->view_len--;
+            }
+        }
+        *slot = (uint32_t)seq + 1;
+    }
+    if (!visible) return;
+
+    if (h->view_len == h->view_cap) {
+        if (h->view_head > 0) {
+            // Reuse the space of entries that fell off the front
+            memmove(h->view, h->view + h->view_head,
+                    (h->view_len - h->view_head) * sizeof(uint32_t));
+            h->view_len -= h->view_head;
+            h->view_head = 0;
+        }
+        if (h->view_cap == 0 || h->view_len * 2 > h->view_cap) {
+            size_t cap = h->view_cap ? h->view_cap * 2 : 1024;
+            uint32_t *tmp = realloc(h->view, cap * sizeof(uint32_t));
+            if (!tmp) return;
+            h->view = tmp;
+            h->view_cap = cap;
+        }
+    }
+    h->view[h->view_len++] = (uint32_t)seq;
+    if (h->max && h->view_len - h->view_head > h->max) {
+        view_forget(h, h->view[h->view_head]);
+        h->view_head++;
+    }
+    recs_trim(h);
+}
+
+static int push_rec(struct history *h, uint64_t off) {
+    if (h->nrecs == h->cap) {
+        size_t cap = h->cap ? h->cap * 2 : 1024;
+        uint64_t *tmp = realloc(h->recs, cap * sizeof(uint64_t));
+        if (!tmp) return -1;
+        h->recs = tmp;
+        h->cap = cap;
+    }
+    h->recs[h->nrecs++] = off;
+    if (h->view_ready) view_push(h, rec_total(h) - 1);
+    return 0;
+}
+
+static void tri_reset(struct history *h);
+static void pre_reset(struct history *h);
+
+// Rebuild the visible entries from the newest record back, which stops as
+// soon as the limit is reached instead of replaying the whole log
+static void view_rebuild(struct history *h) {
+    size_t total = rec_total(h);
+
+    tri_reset(h);
+    pre_reset(h);
+    free(h->dup_set);
+    h->dup_set = NULL;
+    h->dup_cap = h->dup_used = 0;
+    h->view_head = h->view_len = 0;
+
+    size_t want = h->max && h->max < h->nrecs ? h->max : h->nrecs;
+    if (want > h->view_cap) {
+        uint32_t *tmp = realloc(h->view, want * sizeof(uint32_t));
+        if (!tmp) return;
+        h->view = tmp;
+        h->view_cap = want;
+    }
+
+    for (size_t seq = total; seq-- > h->rec_base && h->view_len < want;) {
+        bool visible = true;
+        if (dup_reserve(h) == 0) {
+            uint32_t *slot = dup_slot(h, rec_hash(h, seq), rec_line(h, seq));
+            if (*slot == 0) {
+                *slot = (uint32_t)seq + 1;
+                h->dup_used++;
+            } else if (h->dups == HIST_ERASE_DUPS) {
+                visible = false;
+            }
+        }
+        // Of a run of the same line only the first one is kept
+        if (h->dups == HIST_IGNORE_DUPS && seq > h->rec_base && rec_same(h, seq - 1, seq)) {
+            visible = false;
+        }
+        if (visible) h->view[h->view_len++] = (uint32_t)seq;
+    }
+    h->view_ready = true;
+    for (size_t i = 0; i < h->view_len / 2; i++) {
+        uint32_t tmp = h->view[i];
+        h->view[i] = h->view[h->view_len - 1 - i];
+        h->view[h->view_len - 1 - i] = tmp;
+    }
+    recs_trim(h);
+}
+
+static int hist_map(struct history *h, size_t file_size) {
+    // Map well past the end of the file. Appends by us or anyone else show
+    // up in a shared mapping without remapping, as long as they fit.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = file_size * 2;
+    if (len < HIST_MIN_MAP) len = HIST_MIN_MAP;
+    len = (len + page - 1) & ~(page - 1);
+
+    void *base = mmap(NULL, len, PROT_READ, MAP_SHARED, h->fd, 0);
+    if (base == MAP_FAILED) return -1;
+    if (h->base) munmap(h->base, h->map_len);
+    h->base = base;
+    h->map_len = len;
+    return 0;
+}
+
+// Index whatever records were appended since we last looked. A write in
+// flight can leave a partial record at the end of the file, it simply
+// fails to validate until it is complete. Garbage with a valid record after
+// it can't be a write in flight, since O_APPEND writes are serialized, so
+// it must be left from a crash and we skip over it.
+static int hist_catch_up(struct history *h, size_t end) {
+    size_t off = h->size;
+    int added = 0;
+
+    while (off < end) {
+        if (!rec_valid(h, off, end, true)) {
+            size_t next = off + 1;
+            while (next < end && !rec_valid(h, next, end, true)) next++;
+            if (next >= end) break;
+            off = next;
+        }
+        if (push_rec(h, off) < 0) break;
+        off += rec_size(rec_at(h, off).len);
+        h->size = off;
+        added++;
+    }
+    return added;
+}
+
+int hist_sync(struct history *h) {
+    struct stat st;
+
+    if (!h || h->fd < 0) return 0;
+    if (fstat(h->fd, &st) < 0) return -1;
+    if ((size_t)st.st_size == h->size) return 0;
+    if ((size_t)st.st_size > h->map_len && hist_map(h, st.st_size) < 0) return -1;
+    return hist_catch_up(h, st.st_size);
+}
+
+static void hist_save_index(struct history *h) {
+    struct stat st;
+
+    size_t total = rec_total(h);
+    if (h->idx_fd < 0 || h->idx_count >= total) return;
+    if (flock(h->idx_fd, LOCK_EX) < 0) return;
+    if (fstat(h->idx_fd, &st) == 0) {
+        // Another session may have written some of this already, the
+        // offsets are the same either way so only add what is missing
+        size_t have = (size_t)st.st_size / sizeof(uint64_t);
+        if (have < total && have >= h->rec_base) {
+            size_t n = (total - have) * sizeof(uint64_t);
+            if (pwrite(h->idx_fd, h->recs + (have - h->rec_base), n,
+                       have * sizeof(uint64_t)) == (ssize_t)n) {
+                have = total;
+            }
+        }
+        h->idx_count = have;
+    }
+    flock(h->idx_fd, LOCK_UN);
+}
+
+static void hist_load_index(struct history *h, size_t file_size) {
+    struct stat st;
+
+    if (h->idx_fd < 0 || fstat(h->idx_fd, &st) < 0) return;
+    size_t n = (size_t)st.st_size / sizeof(uint64_t);
+    if (n == 0) return;
+
+    h->recs = malloc(n * 2 * sizeof(uint64_t));
+    if (!h->recs) return;
+    h->cap = n * 2;
+    if (pread(h->idx_fd, h->recs, n * sizeof(uint64_t), 0) != (ssize_t)(n * sizeof(uint64_t))) {
+        return;
+    }
+
+    // Only the last entry is checked, if the log was replaced or truncated
+    // under us it will not point at a record and we rebuild from scratch
+    uint64_t last = h->recs[n - 1];
+    if (last < HIST_MAGIC_LEN || last >= file_size ||
+        !rec_valid(h, last, file_size, false)) {
+        if (flock(h->idx_fd, LOCK_EX) == 0) {
+            if (ftruncate(h->idx_fd, 0) < 0) perror("history");
+            flock(h->idx_fd, LOCK_UN);
+        }
+        return;
+    }
+    h->nrecs = n;
+    h->idx_count = n;
+    h->size = last + rec_size(rec_at(h, last).len);
+}
+
+static int hist_open_file(struct history *h, const char *path) {
+    struct stat st;
+
+    h->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (h->fd < 0) return -1;
+
+    // Two shells starting at once must not both write the magic
+    flock(h->fd, LOCK_EX);
+    if (fstat(h->fd, &st) == 0 && st.st_size == 0) {
+        if (write(h->fd, HIST_MAGIC, HIST_MAGIC_LEN) != HIST_MAGIC_LEN) {
+            st.st_size = -1;
+        } else {
+            st.st_size = HIST_MAGIC_LEN;
+        }
+    }
+    flock(h->fd, LOCK_UN);
+    if (st.st_size < HIST_MAGIC_LEN) goto fail;
+
+    char magic[HIST_MAGIC_LEN];
+    if (pread(h->fd, magic, HIST_MAGIC_LEN, 0) != HIST_MAGIC_LEN ||
+        memcmp(magic, HIST_MAGIC, HIST_MAGIC_LEN) != 0) {
+        fprintf(stderr, "history: %s is not a history file\n", path);
+        goto fail;
+    }
+    if (hist_map(h, st.st_size) < 0) goto fail;
+    h->size = HIST_MAGIC_LEN;
+
+    size_t ilen = strlen(path) + sizeof(".idx");
+    char *idx = malloc(ilen);
+    if (idx) {
+        snprintf(idx, ilen, "%s.idx", path);
+        h->idx_fd = open(idx, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        free(idx);
+    }
+    hist_load_index(h, st.st_size);
+    hist_catch_up(h, st.st_size);
+    hist_save_index(h);
+    view_rebuild(h);
+    return 0;
+
+fail:
+    close(h->fd);
+    h->fd = -1;
+    return -1;
+}
+
+struct history *hist_open(const char *path) {
+    struct history *h = calloc(1, sizeof(struct history));
+    if (!h) return NULL;
+    h->fd = -1;
+    h->idx_fd = -1;
+
+    if (path && *path && hist_open_file(h, path) == 0) return h;
+
+    // No file, or one we can't use, keep history in memory for this session
+    if (h->idx_fd >= 0) close(h->idx_fd);
+    h->idx_fd = -1;
+    free(h->recs);
+    h->recs = NULL;
+    h->nrecs = h->cap = h->idx_count = 0;
+    h->view_head = h->view_len = 0;
+    h->base = NULL;
+    h->map_len = 0;
+    h->size = 0;
+    view_rebuild(h);
+    return h;
+}
+
+void hist_close(struct history *h) {
+    if (!h) return;
+    if (h->fd >= 0) {
+        hist_sync(h);
+        hist_save_index(h);
+        munmap(h->base, h->map_len);
+        close(h->fd);
+    } else {
+        free(h->base);
+    }
+    if (h->idx_fd >= 0) close(h->idx_fd);
+    tri_reset(h);
+    pre_reset(h);
+    free(h->dup_set);
+    free(h->view);
+    free(h->recs);
+    free(h);
+}
+
+void hist_limit(struct history *h, size_t max, enum hist_dups dups) {
+    if (!h) return;
+    h->max = max;
+    h->dups = dups;
+    view_rebuild(h);
+}
+
+int hist_add(struct history *h, const char *line) {
+    if (!h) return -1;
+    size_t len = strlen(line);
+    if (len > UINT32_MAX - 16) return -1;
+
+    // Other shells may have added this line since we last looked
+    hist_sync(h);
+
+    struct hist_rec rec = {(uint32_t)len, fnv1a(line, len)};
+    uint32_t *dup = NULL;
+    if (dup_reserve(h) == 0) dup = dup_slot(h, rec.hash, line);
+
+    size_t total = dup && *dup ? HIST_REF_SIZE : rec_size((uint32_t)len);
+    char stack[512];
+    char *buf = total <= sizeof(stack) ? stack : malloc(total);
+    if (!buf) return -1;
+
+    memset(buf + total - 8, 0, 8);
+    if (dup && *dup) {
+        // Seen it before, point at the earlier copy instead of storing it
+        uint64_t target = rec_text(h, *dup - 1);
+        rec.len = HIST_REF;
+        memcpy(buf + sizeof(rec), &target, sizeof(target));
+    } else {
+        memcpy(buf + sizeof(rec), line, len + 1);
+    }
+    memcpy(buf, &rec, sizeof(rec));
+
+    int rval = 0;
+    if (h->fd >= 0) {
+        // One write on an O_APPEND descriptor, so records from other shells
+        // sharing the file can never end up interleaved with ours. Our own
+        // record gets indexed along with any of theirs by hist_sync.
+        if (write(h->fd, buf, total) != (ssize_t)total || hist_sync(h) < 0) {
+            rval = -1;
+        }
+    } else {
+        if (h->size + total > h->map_len) {
+            size_t cap = h->map_len ? h->map_len * 2 : 4096;
+            while (cap < h->size + total) cap *= 2;
+            char *tmp = realloc(h->base, cap);
+            if (!tmp) {
+                rval = -1;
+                goto out;
+            }
+            h->base = tmp;
+            h->map_len = cap;
+        }
+        memcpy(h->base + h->size, buf, total);
+        if (push_rec(h, h->size) < 0) {
+            rval = -1;
+        } else {
+            h->size += total;
+        }
+    }
+out:
+    if (buf != stack) free(buf);
+    return rval;
+}
+
+size_t hist_count(const struct history *h) {
+    return h ? h->view_len - h->view_head : 0;
+}
+
+const char *hist_get(const struct history *h, size_t i) {
+    if (!h || i >= hist_count(h)) return NULL;
+    return rec_line(h, h->view[h->view_head + i]);
+}
+
+size_t hist_records(const struct history *h) {
+    return h ? rec_total(h) : 0;
+}
+
+size_t hist_since(const struct history *h, size_t seq) {
+    return h ? view_since(h, seq) : 0;
+}
+
+void hist_stats(const struct history *h, struct hist_stats *st) {
+    memset(st, 0, sizeof(*st));
+    if (!h) return;
+    st->entries = hist_count(h);
+    st->records = rec_total(h);
+    st->log_bytes = h->size;
+    st->index_bytes = h->cap * sizeof(uint64_t) + h->view_cap * sizeof(uint32_t) +
+                      h->dup_cap * sizeof(uint32_t);
+    st->search_bytes = tri_index_bytes(&h->tri) + h->pre_cap * sizeof(struct pre_slot);
+}
+
+static void tri_reset(struct history *h) {
+    tri_index_free(&h->tri);
+    h->tri_seq = h->tri_stale = 0;
+}
+
+// Bring the trigram index up to date, only entries added since the last
+// search are looked at. Entries that were erased or fell off the front
+// stay listed until they outnumber the live ones, then we start over.
+static void tri_update(struct history *h) {
+    size_t count = hist_count(h);
+    if (h->tri_stale > 1024 && h->tri_stale > count) tri_reset(h);
+
+    for (size_t i = view_since(h, h->tri_seq); i < count; i++) {
+        uint32_t seq = h->view[h->view_head + i];
+        uint64_t off = rec_text(h, seq);
+        const char *line = h->base + off + sizeof(struct hist_rec);
+        if (tri_index_add(&h->tri, line, rec_at(h, off).len, seq) < 0) return;
+    }
+    h->tri_seq = rec_total(h);
+}
+
+#define TRI_MAX_LISTS 32
+
+long hist_search(struct history *h, const char *pattern, size_t before) {
+    size_t plen = strlen(pattern);
+    if (!h) return -1;
+    size_t count = hist_count(h);
+    if (before > count) before = count;
+
+    if (plen < 3) {
+        // Too short to have a trigram, fall back to a scan from the end
+        for (size_t i = before; i-- > 0;) {
+            if (strstr(hist_get(h, i), pattern)) return (long)i;
+        }
+        return -1;
+    }
+
+    tri_update(h);
+
+    // Every trigram of the pattern must be in a matching line, so we walk
+    // the shortest list and check the others with a binary search
+    const struct tri_list *lists[TRI_MAX_LISTS];
+    size_t nlists = 0;
+    if (tri_index_plan(&h->tri, pattern, plen, lists, &nlists, TRI_MAX_LISTS) < 0) return -1;
+
+    // The lists hold record numbers, the caller counts visible entries
+    size_t bound = before < count ? h->view[h->view_head + before] : rec_total(h);
+    const struct tri_list *drive = lists[0];
+    for (size_t k = tri_list_lower(drive, (uint32_t)bound); k-- > 0;) {
+        uint32_t id = drive->ids[k];
+        bool all = true;
+        for (size_t j = 1; j < nlists && all; j++) {
+            all = tri_list_has(lists[j], id);
+        }
+        if (!all) continue;
+        long i = view_find(h, id);
+        // The trigrams can all be there without being in the right order
+        if (i >= 0 && strstr(rec_line(h, id), pattern)) return i;
+    }
+    return -1;
+}
+
+static void pre_reset(struct history *h) {
+    free(h->pre);
+    h->pre = NULL;
+    h->pre_cap = h->pre_used = 0;
+    h->pre_seq = 0;
+}
+
+static struct pre_slot *pre_slot(struct history *h, const char *prefix, size_t len,
+                                 uint32_t hash) {
+    size_t mask = h->pre_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct pre_slot *slot = &h->pre[i];
+        if (slot->seq == 0) return slot;
+        if (slot->hash == hash && slot->len == len && slot->seq - 1 >= h->rec_base &&
+            strncmp(rec_line(h, slot->seq - 1), prefix, len) == 0) {
+            return slot;
+        }
+    }
+}
+
+static int pre_grow(struct history *h) {
+    size_t cap = h->pre_cap ? h->pre_cap * 2 : 4096;
+    struct pre_slot *old = h->pre;
+    size_t old_cap = h->pre_cap;
+    h->pre = calloc(cap, sizeof(struct pre_slot));
+    if (!h->pre) {
+        h->pre = old;
+        return -1;
+    }
+    h->pre_cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!old[i].seq || old[i].seq - 1 < h->rec_base) continue;
+        *pre_slot(h, rec_line(h, old[i].seq - 1), old[i].len, old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// Bring the prefix index up to date. Each entry sets itself as the newest
+// for every prefix of its first HIST_PREFIX_MAX bytes, so it holds at most
+// that many slots per distinct line and is started over once it has more
+// slots than that, which means it is mostly entries that are gone.
+static void pre_update(struct history *h) {
+    size_t count = hist_count(h);
+    if (h->pre_used > 1024 && h->pre_used > count * HIST_PREFIX_MAX) pre_reset(h);
+
+    for (size_t i = view_since(h, h->pre_seq); i < count; i++) {
+        uint32_t seq = h->view[h->view_head + i];
+        const char *line = rec_line(h, seq);
+        uint32_t hash = FNV1A_INIT;
+        for (size_t len = 1; len <= HIST_PREFIX_MAX && line[len - 1]; len++) {
+            hash = fnv1a_step(hash, (unsigned char)line[len - 1]);
+            if ((h->pre_used + 1) * 2 > h->pre_cap && pre_grow(h) < 0) return;
+            struct pre_slot *slot = pre_slot(h, line, len, hash);
+            if (slot->seq == 0) {
+                slot->hash = hash;
+                slot->len = (uint32_t)len;
+                h->pre_used++;
+            }
+            slot->seq = seq + 1;
+        }
+    }
+    h->pre_seq = rec_total(h);
+}
+
+long hist_prefix(struct history *h, const char *prefix, size_t len) {
+    if (!h || len == 0) return -1;
+    pre_update(h);
+    if (!h->pre) return -1;
+
+    size_t key = len < HIST_PREFIX_MAX ? len : HIST_PREFIX_MAX;
+    struct pre_slot *slot = pre_slot(h, prefix, key, fnv1a(prefix, key));
+    if (slot->seq == 0) return -1;
+    long i = view_find(h, slot->seq - 1);
+    if (i < 0) return -1;
+
+    // Past the indexed length the newest match is no newer than this one
+    for (; i >= 0; i--) {
+        if (strncmp(hist_get(h, (size_t)i), prefix, len) == 0) return i;
+    }
+    return -1;
+}
+
+// Characters that end the event in !prefix
+static bool bang_stop(char c) {
+    return c == '\0' || isspace((unsigned char)c) || strchr(";&|<>()'\"`:", c);
+}
+
+int hist_expand(struct history *h, const char *line, char **out) {
+    *out = NULL;
+    if (!strchr(line, '!')) return 0;
+
+    size_t count = hist_count(h);
+    size_t cap = strlen(line) + 1, used = 0;
+    char *buf = malloc(cap);
+    bool quoted = false;
+    bool expanded = false;
+    if (!buf) return -1;
+
+    for (const char *s = line; *s;) {
+        const char *from = s;
+        size_t n = 1;
+
+        if (*s == '\'') {
+            quoted = !quoted;
+            s++;
+        } else if (quoted || (*s != '!' && !(*s == '\\' && s[1] == '!'))) {
+            s++;
+        } else if (*s == '\\') {
+            // \! keeps the ! and drops the backslash
+            from = s + 1;
+            s += 2;
+            expanded = true;
+        } else if (s[1] == '\0' || isspace((unsigned char)s[1]) || s[1] == '=' || s[1] == '(') {
+            // A lone ! is not an event
+            s++;
+        } else {
+            const char *event = s + 1;
+            char *end = (char *)event;
+            long i;
+            if (*event == '!') {
+                end++;
+                i = (long)count - 1;
+            } else if (isdigit((unsigned char)*event) ||
+                       (*event == '-' && isdigit((unsigned char)event[1]))) {
+                // Numbers are the ones history prints, counting from 1
+                unsigned long num = strtoul(*event == '-' ? event + 1 : event, &end, 10);
+                if (num == 0 || num > count) {
+                    i = -1;
+                } else {
+                    i = *event == '-' ? (long)(count - num) : (long)num - 1;
+                }
+            } else {
+                while (!bang_stop(*end)) end++;
+                i = hist_prefix(h, event, (size_t)(end - event));
+            }
+            if (i < 0) {
+                fprintf(stderr, "!%.*s: event not found\n", (int)(end - event), event);
+                free(buf);
+                return -1;
+            }
+            from = hist_get(h, (size_t)i);
+            n = strlen(from);
+            s = end;
+            expanded = true;
+        }
+
+        if (used + n + 1 > cap) {
+            while (used + n + 1 > cap) cap *= 2;
+            char *tmp = realloc(buf, cap);
+            if (!tmp) {
+                free(buf);
+                return -1;
+            }
+            buf = tmp;
+        }
+        memcpy(buf + used, from, n);
+        used += n;
+    }
+
+    if (!expanded) {
+        free(buf);
+        return 0;
+    }
+    buf[used] = '\0';
+    *out = buf;
+    return 1;
+}
+
+const char *hist_default_path(void) {
+    static char path[4096];
+    const char *env = getenv("MY_HISTFILE");
+    if (env) return env;
+
+    const char *home = getenv("HOME");
+    if (!home) return NULL;
+    snprintf(path, sizeof(path), "%s/.lab_history", home);
+    return path;
+}
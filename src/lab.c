@@ -1,5 +1,6 @@
 /**Update this file with the starter code**/
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,13 +10,17 @@
 #include <pwd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <signal.h>
 #include <linux/limits.h>
+#include <poll.h>
 #include "lab.h"
 
+extern char **environ;
+
 char *get_prompt(const char *env) {
     const char *prompt_env = getenv(env);
     const char *default_prompt = "shell>";
@@ -27,24 +32,70 @@ char *get_prompt(const char *env) {
     return result;
 }
 
-int change_dir(char **dir) {
-    char *path;
-
-    if (dir[1] == NULL) {
-        // No directory specified, use HOME
-        path = getenv("HOME");
-        if (path == NULL) {
-            // HOME not set, use getpwuid
-            struct passwd *pw = getpwuid(getuid());
-            if (pw == NULL) {
-                return -1; // Error, could not determine home directory
-            }
-            path = pw->pw_dir;
-        }
+const char *home_dir(void) {
+    // getpwuid goes through NSS, which can mean loading modules or asking
+    // a directory server, so it is only ever done once
+    static char *cached;
+    const char *home = getenv("HOME");
+    if (home && *home) return home;
+    if (!cached) {
+        struct passwd *pw = getpwuid(getuid());
+        if (pw) cached = strdup(pw->pw_dir);
+    }
+    return cached;
+}
+
+const char *sh_cwd(struct shell *sh) {
+    if (sh->cwd) return sh->cwd;
+
+    // An inherited PWD is kept when it names the directory we are in, it
+    // has the symlinks the user went through where getcwd would not
+    const char *pwd = getenv("PWD");
+    struct stat a, b;
+    if (pwd && pwd[0] == '/' && stat(pwd, &a) == 0 && stat(".", &b) == 0 &&
+        a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+        sh->cwd = strdup(pwd);
     } else {
-        path = dir[1];
+        sh->cwd = getcwd(NULL, 0);
     }
+    return sh->cwd;
+}
 
+const char *sh_getvar(struct shell *sh, const char *name) {
+    if (!sh || !sh->vars) return getenv(name);
+    return vars_get(sh->vars, name);
+}
+
+int sh_setvar(struct shell *sh, const char *name, const char *value, bool export) {
+    if (!sh || !sh->vars) return value ? setenv(name, value, 1) : 0;
+    if (value && vars_set(sh->vars, name, value) < 0) return -1;
+    if (export && vars_export(sh->vars, name) < 0) return -1;
+    return 0;
+}
+
+void sh_unsetvar(struct shell *sh, const char *name) {
+    if (!sh || !sh->vars) {
+        unsetenv(name);
+        return;
+    }
+    vars_unset(sh->vars, name);
+}
+
+void sh_syncenv(struct shell *sh) {
+    if (!sh || !sh->vars) return;
+    // vars_envp frees the array environ points at when it builds a new
+    // one, so environ has to follow straight away. The new array is made
+    // before the old one is freed, a different pointer means a rebuild.
+    char **old = environ;
+    environ = vars_envp(sh->vars);
+    if (environ != old) vcs_setenv(sh->vcs, environ);
+}
+
+int change_dir(char **dir) {
+    const char *path = dir[1] ? dir[1] : home_dir();
+    if (path == NULL) {
+        return -1; // Error, could not determine home directory
+    }
     return chdir(path);
 }
 
@@ -52,7 +103,16 @@ int change_dir(char **dir) {
 char **cmd_parse(const char *line) {
 
     size_t arg_max = sysconf(_SC_ARG_MAX);
-    char **args = malloc(arg_max * sizeof(char *));
+
+    // Size the array for the tokens we actually have instead of ARG_MAX
+    // pointers, that is megabytes of allocation for every command
+    size_t count = 1;
+    for (const char *p = line; *p; p++) {
+        if (*p != ' ' && (p == line || p[-1] == ' ')) count++;
+    }
+    if (count > arg_max) count = arg_max;
+
+    char **args = malloc(count * sizeof(char *));
     if (!args) return NULL;
 
     char *token;
@@ -63,8 +123,10 @@ char **cmd_parse(const char *line) {
     }
     size_t index = 0;
 
-    token = strtok(line_copy, " ");
-    while (token != NULL && index < arg_max - 1) {
+    // strtok_r, the parallel builtin's workers parse lines at the same time
+    char *save = NULL;
+    token = strtok_r(line_copy, " ", &save);
+    while (token != NULL && index < count - 1) {
         args[index] = strdup(token);
         if (!args[index]) {
             // Free previously allocated memory in case of failure
@@ -76,7 +138,7 @@ char **cmd_parse(const char *line) {
             return NULL;
         }
         index++;
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
     }
     args[index] = NULL;
 
@@ -112,40 +174,144 @@ char *trim_white(char *line) {
     return start;
 }
 
+// A command made only of NAME=value words sets those variables
+static bool do_assign(struct shell *sh, char **argv) {
+    for (size_t i = 0; argv[i]; i++) {
+        const char *eq = strchr(argv[i], '=');
+        if (!eq || !vars_valid_name(argv[i], eq - argv[i])) return false;
+    }
+    sh->last_status = 0;
+    for (size_t i = 0; argv[i]; i++) {
+        char *eq = strchr(argv[i], '=');
+        *eq = '\0';
+        if (sh_setvar(sh, argv[i], eq + 1, false) < 0) sh->last_status = 1;
+        *eq = '=';
+    }
+    return true;
+}
+
 bool do_builtin(struct shell *sh, char **argv) {
-    if (strcmp(argv[0], "exit") == 0) {
-        sh_destroy(sh);
-        exit(0);
-    } else if (strcmp(argv[0], "cd") == 0) {
-        const char *path = NULL;
-        if (argv[1] == NULL) {
-            path = getenv("HOME");
-            if (path == NULL) {
-                struct passwd *pw = getpwuid(getuid());
-                if (pw != NULL) {
-                    path = pw->pw_dir;
-                }
-            }
+    if (strchr(argv[0], '=') && do_assign(sh, argv)) return true;
+    builtin_fn fn = builtin_lookup(argv[0]);
+    if (!fn) return false;
+    sh->last_status = fn(sh, argv);
+    return true;
+}
+
+
+// The shell readline callbacks work on, readline gives them no context
+static struct shell *rl_shell;
+
+// What environ was before the shell pointed it at its variables
+static char **startup_environ;
+
+// Bound to C-r. An incremental search like readline's own: every key
+// typed into the minibuffer searches the history again, C-r moves on to
+// older matches, Backspace shortens the pattern, C-g puts the line back
+// and any other key keeps the match and is then handled as usual.
+static int rl_history_search(int count, int key) {
+    UNUSED(count);
+    UNUSED(key);
+
+    if (!rl_shell) return 0;
+    struct history *h = rl_shell->history;
+    char *saved = strdup(rl_line_buffer);
+    if (!saved) return 0;
+
+    char pattern[256];
+    size_t len = 0;
+    long match = -1;
+    bool failed = false;
+    pattern[0] = '\0';
+
+    for (;;) {
+        rl_message("(%sreverse-i-search)`%s': ", failed ? "failed " : "", pattern);
+        int c = rl_read_key();
+        long found = match;
+        if (c <= 0) {
+            break;
+        } else if (c == CTRL('R')) {
+            // Nothing typed yet, search again for the last pattern
+            if (len == 0) continue;
+            found = hist_search(h, pattern, match < 0 ? hist_count(h) : (size_t)match);
+        } else if (c == RUBOUT || c == CTRL('H')) {
+            if (len == 0) continue;
+            pattern[--len] = '\0';
+            found = len ? hist_search(h, pattern, hist_count(h)) : -1;
+        } else if (c == CTRL('G')) {
+            rl_replace_line(saved, 0);
+            rl_point = rl_end;
+            break;
+        } else if (c >= ' ' && c != RUBOUT && len + 1 < sizeof(pattern)) {
+            pattern[len++] = (char)c;
+            pattern[len] = '\0';
+            // A longer pattern can still match the entry we are on
+            found = hist_search(h, pattern, match < 0 ? hist_count(h) : (size_t)match + 1);
         } else {
-            path = argv[1];
+            // Enter, arrows, C-a and so on leave the search with the match
+            rl_execute_next(c);
+            break;
+        }
+
+        failed = found < 0 && len > 0;
+        if (failed) {
+            rl_ding();
+            continue;
         }
+        match = found;
+        rl_replace_line(match < 0 ? saved : hist_get(h, (size_t)match), 0);
+        rl_point = rl_end;
+    }
+
+    rl_clear_message();
+    free(saved);
+    return 0;
+}
 
-        if (path == NULL || chdir(path) != 0) {
-            perror("cd");
+// Reads a key for readline while also watching the git status worker, so
+// a fresh status is drawn while the user is still typing
+static int rl_getc_vcs(FILE *in) {
+    for (;;) {
+        struct pollfd fds[2] = {
+            {fileno(in), POLLIN, 0},
+            {rl_shell ? vcs_fd(rl_shell->vcs) : -1, POLLIN, 0},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return EOF;
         }
-        return true;
-    } else if (strcmp(argv[0], "history") == 0) {
-        HIST_ENTRY **history_list_vm = history_list();
-        if (history_list_vm) {
-            for (int i = 0; history_list_vm[i]; i++) {
-                printf("%d: %s\n", i + history_base, history_list_vm[i]->line);
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(fds[1].fd, buf, sizeof(buf)) > 0)
+                ;
+            const char *prompt = prompt_render(rl_shell->prompt_cache, rl_shell);
+            if (!rl_prompt || strcmp(prompt, rl_prompt) != 0) {
+                rl_set_prompt(prompt);
+                rl_redisplay();
             }
         }
-        return true;
+        if (fds[0].revents) return rl_getc(in);
     }
-    return false;
 }
 
+// Completion for readline. The first word of a command completes to a
+// builtin or program, %n to a job, and anything else to a file name or,
+// if no file matches, a word from the history.
+static char **rl_complete_word(const char *text, int start, int end) {
+    UNUSED(end);
+    if (!rl_shell) return NULL;
+    struct completer *c = rl_shell->completer;
+
+    int i = start;
+    while (i > 0 && isspace((unsigned char)rl_line_buffer[i - 1])) i--;
+    bool command = i == 0 || strchr("|;&", rl_line_buffer[i - 1]);
+
+    rl_attempted_completion_over = 1;
+    if (text[0] == '%') return comp_jobs(c, text);
+    if (command && !strchr(text, '/')) return comp_command(c, text);
+    char **matches = rl_completion_matches(text, rl_filename_completion_function);
+    return matches ? matches : comp_history(c, text);
+}
 
 void sh_init(struct shell *sh) {
     sh->shell_terminal = STDIN_FILENO;
@@ -156,8 +322,10 @@ void sh_init(struct shell *sh) {
             kill(-sh->shell_pgid, SIGTTIN);
         }
 
+        // Started by a terminal emulator we lead our own session, and with
+        // it our group, and setpgid would fail with EPERM
         sh->shell_pgid = getpid();
-        if (setpgid(sh->shell_pgid, sh->shell_pgid) < 0) {
+        if (getpgrp() != sh->shell_pgid && setpgid(sh->shell_pgid, sh->shell_pgid) < 0) {
             perror("Couldn't put the shell in its own process group");
             exit(1);
         }
@@ -167,10 +335,129 @@ void sh_init(struct shell *sh) {
     }
 
     sh->prompt = get_prompt("MY_PROMPT");
+    sh->prompt_cache = sh->prompt ? prompt_compile(sh->prompt) : NULL;
+    sh->cwd_gen = 0;
+    sh->job_count = 0;
+    sh->last_elapsed_ns = 0;
+    sh->last_status = 0;
+    sh->should_exit = false;
+
+    // MY_HISTSIZE and MY_HISTCONTROL work like their bash namesakes
+    size_t max = HIST_DEFAULT_SIZE;
+    const char *size = getenv("MY_HISTSIZE");
+    if (size && *size) max = strtoul(size, NULL, 10);
+    const char *control = getenv("MY_HISTCONTROL");
+    sh->history_dups = HIST_KEEP_DUPS;
+    if (control && strstr(control, "erasedups")) {
+        sh->history_dups = HIST_ERASE_DUPS;
+    } else if (control && (strstr(control, "ignoredups") || strstr(control, "ignoreboth"))) {
+        sh->history_dups = HIST_IGNORE_DUPS;
+    }
+
+    sh->history = hist_open(hist_default_path());
+    hist_limit(sh->history, max, sh->history_dups);
+    if (max > 0) stifle_history(max < INT_MAX ? (int)max : INT_MAX);
+
+    // Give readline the tail of the saved history for the arrow keys, the
+    // history builtin reads the rest straight from the mapped log
+    size_t count = hist_count(sh->history);
+    for (size_t i = count > HIST_READLINE_SEED ? count - HIST_READLINE_SEED : 0; i < count; i++) {
+        add_history(hist_get(sh->history, i));
+    }
+    sh->history_seen = hist_records(sh->history);
+
+    // From here on environ is the envp of the exported variables
+    startup_environ = environ;
+    sh->vars = vars_new(environ);
+    sh->last_bg = 0;
+    sh->aliases = alias_new();
+
+    const char *home = home_dir();
+    sh->home = home ? strdup(home) : NULL;
+    sh->cwd = NULL;
+    const char *cwd = sh_cwd(sh);
+    if (cwd) sh_setvar(sh, "PWD", cwd, true);
+    sh->vcs = NULL;
+    sh_syncenv(sh);
+    sh->zdb = zdb_open(zdb_default_path());
+    sh->dir_stack = NULL;
+    sh->dir_depth = sh->dir_cap = 0;
+    sh->glob_cache = glob_cache_new(GLOB_CACHE_ENTRIES);
+
+    rl_shell = sh;
+    rl_bind_keyseq("\\C-r", rl_history_search);
+
+    // The executables are read in the background, only an interactive
+    // shell ever completes anything
+    sh->completer = NULL;
+    if (sh->shell_is_interactive) {
+        sh->completer = comp_start(getenv("PATH"));
+        rl_attempted_completion_function = rl_complete_word;
+    }
+
+    // Only pay for the git worker when the prompt shows it
+    if (prompt_uses_vcs(sh->prompt_cache)) {
+        sh->vcs = vcs_start();
+        if (sh->vcs && sh->shell_is_interactive) rl_getc_function = rl_getc_vcs;
+    }
+}
+
+// Remove an older copy of line from readline's list, it is never longer
+// than the history limit
+static void rl_erase_dup(const char *line) {
+    HIST_ENTRY **list = history_list();
+    if (!list) return;
+    for (int i = history_length - 1; i >= 0; i--) {
+        if (strcmp(list[i]->line, line) == 0) {
+            HIST_ENTRY *old = remove_history(i);
+            if (old) free_history_entry(old);
+            return;
+        }
+    }
+}
+
+void sh_history_sync(struct shell *sh) {
+    hist_sync(sh->history);
+    size_t count = hist_count(sh->history);
+    for (size_t i = hist_since(sh->history, sh->history_seen); i < count; i++) {
+        const char *line = hist_get(sh->history, i);
+        if (sh->history_dups == HIST_ERASE_DUPS) rl_erase_dup(line);
+        add_history(line);
+    }
+    sh->history_seen = hist_records(sh->history);
 }
 
 void sh_destroy(struct shell *sh) {
+    if (rl_shell == sh) rl_shell = NULL;
+    if (rl_getc_function == rl_getc_vcs) rl_getc_function = rl_getc;
+    vcs_stop(sh->vcs);
+    sh->vcs = NULL;
+    if (rl_attempted_completion_function == rl_complete_word) rl_attempted_completion_function = NULL;
+    comp_stop(sh->completer);
+    sh->completer = NULL;
+    prompt_free(sh->prompt_cache);
+    sh->prompt_cache = NULL;
     free(sh->prompt);
+    hist_close(sh->history);
+    sh->history = NULL;
+    zdb_close(sh->zdb);
+    sh->zdb = NULL;
+    glob_cache_free(sh->glob_cache);
+    sh->glob_cache = NULL;
+    free(sh->home);
+    free(sh->cwd);
+    sh->home = sh->cwd = NULL;
+    for (size_t i = 0; i < sh->dir_depth; i++) {
+        free(sh->dir_stack[i]);
+    }
+    free(sh->dir_stack);
+    sh->dir_stack = NULL;
+    sh->dir_depth = sh->dir_cap = 0;
+    if (sh->vars) environ = startup_environ;
+    vars_free(sh->vars);
+    sh->vars = NULL;
+    alias_free(sh->aliases);
+    sh->aliases = NULL;
 }
 
 void parse_args(int argc, char **argv) {
@@ -181,11 +468,13 @@ void parse_args(int argc, char **argv) {
     }
 }
 
-void print_working_directory() {
+int print_working_directory(void) {
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) != NULL) {
         printf("%s\n", cwd);
+        return 0;
     } else {
         perror("getcwd");
+        return -1;
     }
 }
\ No newline at end of file
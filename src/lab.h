@@ -2,7 +2,9 @@
 #define LAB_H
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -10,11 +12,137 @@
 #define lab_VERSION_MINOR 0
 #define UNUSED(x) (void)x;
 
+#define LAB_PLUGIN_ABI 2
+#define LAB_PLUGIN_SYMBOL "lab_plugin"
+
+#define HIST_READLINE_SEED 1000
+#define HIST_DEFAULT_SIZE 10000
+
+#define VCS_MAX 256
+
+#define OUTBUF_SIZE 65536
+#define OUTBUF_IOV 64
+
+#define COMP_HISTORY_LINES 1000
+
+#define GLOB_CACHE_ENTRIES (1 << 20)
+#define GLOB_THREADS 8
+
+#define ALIAS_MAX_DEPTH 16
+
+#define TRACE_EVENTS 65536
+
+// Histograms keep 2^(STAT_SUB_BITS-1) buckets per power of two, so a
+// value is off by at most 1/8th
+#define STAT_SUB_BITS 4
+#define STAT_BUCKETS ((66 - STAT_SUB_BITS) << (STAT_SUB_BITS - 1))
+
+// End the span started by the previous TRACE on this thread and give it a
+// name, the only cost when tracing is off is the branch
+#define TRACE(name)                                      \
+    do {                                                 \
+        if (__builtin_expect(trace_enabled, 0)) {        \
+            trace_record(name);                          \
+        }                                                \
+    } while (0)
+
+// FNV-1a, the hash every table in the shell uses for strings. The step is
+// for callers that hash a string one prefix at a time.
+#define FNV1A_INIT 2166136261u
+
+static inline uint32_t fnv1a_step(uint32_t h, unsigned char c) {
+    return (h ^ c) * 16777619u;
+}
+
+static inline uint32_t fnv1a(const char *s, size_t len) {
+    uint32_t h = FNV1A_INIT;
+    for (size_t i = 0; i < len; i++) h = fnv1a_step(h, (unsigned char)s[i]);
+    return h;
+}
+
+static inline uint32_t fnv1a_str(const char *s) {
+    uint32_t h = FNV1A_INIT;
+    for (; *s; s++) h = fnv1a_step(h, (unsigned char)*s);
+    return h;
+}
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+  struct history;
+  struct prompt_cache;
+  struct vcs;
+  struct zdb;
+  struct completer;
+  struct glob_cache;
+  struct vars;
+  struct aliases;
+
+  /**
+   * @brief What to do with a command that is already in the history.
+   */
+  enum hist_dups {
+    HIST_KEEP_DUPS,      // Keep every copy
+    HIST_IGNORE_DUPS,    // Drop a command that repeats the one before it
+    HIST_ERASE_DUPS      // Drop older copies so each command is listed once
+  };
+
+  /**
+   * @brief The counters the stats builtin reports.
+   */
+  enum stat_counter {
+    STAT_COMMANDS,       // Commands run, builtins and external
+    STAT_BUILTINS,
+    STAT_EXTERNAL,
+    STAT_BACKGROUND,     // External commands started with &
+    STAT_FORK_FAILED,
+    STAT_REAPED,         // Background jobs seen to finish
+    STAT_PERF_JOBS,      // Jobs run with hardware counters, totals below
+    STAT_CYCLES,
+    STAT_INSTRUCTIONS,
+    STAT_CACHE_MISSES,
+    STAT_CONTEXT_SWITCHES,
+    STAT_COUNTERS
+  };
+
+  /**
+   * @brief The histograms the stats builtin reports, all in nanoseconds
+   * except STAT_ALLOCS.
+   */
+  enum stat_hist {
+    STAT_FORK,           // fork() as seen by the shell
+    STAT_RUN,            // From fork to the child exiting
+    STAT_REAP_LAG,       // From a background job exiting to the shell noticing
+    STAT_PARSE,          // Alias expansion and splitting the line
+    STAT_ALLOCS,         // Allocations the shell made for one command
+    STAT_HISTS
+  };
+
+  /**
+   * @brief The performance counters kept for a job.
+   */
+  enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_COUNTERS
+  };
+
+  /**
+   * Counters following a job and everything it forks, from perf_open.
+   */
+  struct perf_job
+  {
+    int fds[PERF_COUNTERS];        // -1 once closed or if it never opened
+    uint64_t values[PERF_COUNTERS]; // As of the last perf_read
+    unsigned have;                 // Bit i is set if counter i opened
+    bool user_only;                // Kernel events were not allowed
+    int error;                     // Why the first missing counter is missing
+  };
+
   struct shell
   {
     int shell_is_interactive;
@@ -22,6 +150,67 @@ extern "C"
     struct termios shell_tmodes;
     int shell_terminal;
     char *prompt;
+    struct prompt_cache *prompt_cache;
+    struct vcs *vcs;             // Git status for \g, NULL when not used
+    unsigned cwd_gen;            // Bumped whenever the shell changes directory
+    int job_count;               // Background jobs the shell is tracking
+    long long last_elapsed_ns;   // How long the last command took
+    int last_status;
+    bool should_exit;
+    struct history *history;
+    size_t history_seen;
+    enum hist_dups history_dups;
+    struct zdb *zdb;             // Directories visited, for z, NULL if none
+    char **dir_stack;            // pushd stack, the top is the last one
+    size_t dir_depth;
+    size_t dir_cap;
+    char *home;                  // Resolved once, NULL if there is none
+    char *cwd;                   // Logical working directory, see sh_cwd
+    struct completer *completer; // Tab completion, NULL when not interactive
+    struct glob_cache *glob_cache; // Directory listings kept for globbing
+    struct vars *vars;           // Shell variables, environ is their envp
+    pid_t last_bg;               // The last background job, for $!
+    struct aliases *aliases;     // Set with alias, NULL if there is no table
+  };
+
+  /**
+   * A builtin command. The handler gets the shell and the full argument
+   * list, including the command name in argv[0], and returns the exit
+   * status of the command.
+   */
+  typedef int (*builtin_fn)(struct shell *sh, char **argv);
+
+  struct builtin
+  {
+    const char *name;
+    builtin_fn fn;
+  };
+
+  /**
+   * What a plugin exports under the name LAB_PLUGIN_SYMBOL. abi_version
+   * must be LAB_PLUGIN_ABI, it is bumped whenever struct shell, struct
+   * builtin or this struct change. builtins ends with a NULL name.
+   */
+  struct lab_plugin
+  {
+    unsigned abi_version;
+    const char *name;
+    const struct builtin *builtins;
+  };
+
+  /**
+   * Output buffer used by the builtins. Small pieces are copied into buf,
+   * larger ones can be referenced in place with ob_ref. Everything is
+   * written with a single writev when the buffer fills up or on ob_flush.
+   */
+  struct outbuf
+  {
+    int fd;
+    int iovcnt;
+    size_t used;
+    int error;
+    struct iovec iov[OUTBUF_IOV];
+    char buf[OUTBUF_SIZE];
   };
 
 
@@ -37,6 +226,174 @@ extern "C"
    */
   char *get_prompt(const char *env);
 
+  /**
+   * @brief Split a prompt template into segments. Besides plain text it
+   * understands \\w and \\W for the working directory, \\u, \\h and \\H
+   * for the user and host, \\t and \\A for the time, \\? for the last
+   * exit status, \\j for the number of jobs, \\E for how long the last
+   * command took, \\g for the git branch with a * when the work tree is
+   * dirty, and \\$, \\n, \\e, \\[, \\] and \\\\ as in bash. User and
+   * host are looked up here, once.
+   *
+   * @param template The prompt template
+   * @return The compiled prompt or NULL if out of memory
+   */
+  struct prompt_cache *prompt_compile(const char *template);
+
+  /**
+   * @brief Render the prompt. Each segment is only redone when its input
+   * changed since the last call, and when none did the previous string is
+   * returned without a syscall.
+   *
+   * @param pc The compiled prompt, if NULL sh->prompt is returned as is
+   * @param sh The shell the inputs come from
+   * @return The prompt, valid until the next call
+   */
+  const char *prompt_render(struct prompt_cache *pc, const struct shell *sh);
+
+  /**
+   * @brief Check whether the prompt shows the git status, so the shell
+   * only starts the worker for it when needed.
+   *
+   * @param pc The compiled prompt
+   * @return true if the template has \\g
+   */
+  bool prompt_uses_vcs(const struct prompt_cache *pc);
+
+  /**
+   * @brief Start a thread that keeps the git status of the working
+   * directory up to date. It reads the branch from .git/HEAD and runs git
+   * to find out if the work tree is dirty, neither ever blocks the caller.
+   * git gets a copy of environ as it is now, see vcs_setenv.
+   *
+   * @return The worker or NULL if it could not be started
+   */
+  struct vcs *vcs_start(void);
+
+  /**
+   * @brief Stop the worker and free it. This waits for a git command that
+   * is still running.
+   *
+   * @param v The worker
+   */
+  void vcs_stop(struct vcs *v);
+
+  /**
+   * @brief Ask the worker to look again, after a command that may have
+   * changed the directory or the files in it. Requests made while it is
+   * busy are folded into one.
+   *
+   * @param v The worker
+   */
+  void vcs_refresh(struct vcs *v);
+
+  /**
+   * @brief Give the worker a new environment for git. It is copied, envp
+   * can be freed as soon as this returns, and used from the next refresh.
+   *
+   * @param v The worker, NULL does nothing
+   * @param envp The environment
+   */
+  void vcs_setenv(struct vcs *v, char *const *envp);
+
+  /**
+   * @brief A descriptor that becomes readable each time the status
+   * changes, for redrawing the prompt. The caller drains it.
+   *
+   * @param v The worker
+   * @return The descriptor or -1 if v is NULL
+   */
+  int vcs_fd(const struct vcs *v);
+
+  /**
+   * @brief Copy the last known status, the branch name followed by * if
+   * dirty, or an empty string outside a repository.
+   *
+   * @param v The worker
+   * @param buf Where to copy it
+   * @param len The size of buf
+   * @return The generation of the status, see vcs_gen
+   */
+  unsigned vcs_get(struct vcs *v, char *buf, size_t len);
+
+  /**
+   * @brief A counter that changes whenever the status does.
+   *
+   * @param v The worker
+   * @return The generation
+   */
+  unsigned vcs_gen(struct vcs *v);
+
+  /**
+   * @brief Free a compiled prompt.
+   *
+   * @param pc The compiled prompt
+   */
+  void prompt_free(struct prompt_cache *pc);
+
+  /**
+   * @brief The home directory, HOME when it is set and otherwise the one
+   * in the password database. That lookup goes through NSS so it is done
+   * at most once.
+   *
+   * @return The home directory or NULL if there is none
+   */
+  const char *home_dir(void);
+
+  /**
+   * @brief The working directory as the shell last set it, with the
+   * symlinks that were followed to get there. It is worked out the first
+   * time it is needed, from PWD if that names the directory we are in and
+   * from getcwd otherwise, and after that only changes on cd.
+   *
+   * @param sh The shell
+   * @return The working directory or NULL if it can't be determined
+   */
+  const char *sh_cwd(struct shell *sh);
+
+  /**
+   * @brief The value of a shell variable. A shell without a variable
+   * table, as in the tests, reads the environment instead.
+   *
+   * @param sh The shell
+   * @param name The variable
+   * @return The value, valid until the next change to a variable, or NULL
+   * if it is not set
+   */
+  const char *sh_getvar(struct shell *sh, const char *name);
+
+  /**
+   * @brief Set a shell variable. An exported one reaches environ, and so
+   * programs and getenv, at the next sh_syncenv.
+   *
+   * @param sh The shell
+   * @param name The variable
+   * @param value The value, NULL to leave it as it is and only export it
+   * @param export Export it as well, false leaves that as it was
+   * @return 0 on success, -1 for a bad name or out of memory
+   */
+  int sh_setvar(struct shell *sh, const char *name, const char *value, bool export);
+
+  /**
+   * @brief Remove a shell variable, and from the environment if it was
+   * exported.
+   *
+   * @param sh The shell
+   * @param name The variable
+   */
+  void sh_unsetvar(struct shell *sh, const char *name);
+
+  /**
+   * @brief Point environ at the exported variables, building the envp
+   * again only if one changed, and hand the git worker its own copy when
+   * it did. The main loop calls this once before each command so environ
+   * is never rebuilt while something is using it, and only the main
+   * thread reads environ.
+   *
+   * @param sh The shell
+   */
+  void sh_syncenv(struct shell *sh);
+
   /**
    * Changes the current working directory of the shell. Uses the linux system
    * call chdir. With no arguments the users home directory is used as the
@@ -82,9 +439,10 @@ extern "C"
   /**
    * @brief Takes an argument list and checks if the first argument is a
    * built in command such as exit, cd, jobs, etc. If the command is a
-   * built in command this function will handle the command and then return
-   * true. If the first argument is NOT a built in command this function will
-   * return false.
+   * built in command this function will handle the command, store its exit
+   * status in sh->last_status and then return true. If the first argument
+   * is NOT a built in command this function will return false. The exit
+   * builtin sets sh->should_exit rather than exiting itself.
    *
    * @param sh The shell
    * @param argv The command to check
@@ -93,32 +451,1123 @@ extern "C"
   bool do_builtin(struct shell *sh, char **argv);
 
   /**
-   * @brief Initialize the shell for use. Allocate all data structures
-   * Grab control of the terminal and put the shell in its own
-   * process group. NOTE: This function will block until the shell is
-   * in its own program group. Attaching a debugger will always cause
-   * this function to fail because the debugger maintains control of
-   * the subprocess it is debugging.
+   * @brief Add a builtin command to the dispatch table, replacing any
+   * builtin already registered with the same name. The name is copied.
    *
-   * @param sh
+   * @param name The command name
+   * @param fn The handler
+   * @return 0 on success, -1 with errno set on error
    */
-  void sh_init(struct shell *sh);
+  int builtin_register(const char *name, builtin_fn fn);
 
   /**
-   * @brief Destroy shell. Free any allocated memory and resources and exit
-   * normally.
+   * @brief Find the handler for a builtin command.
    *
-   * @param sh
+   * @param name The command name
+   * @return The handler or NULL if name is not a builtin
    */
-  void sh_destroy(struct shell *sh);
+  builtin_fn builtin_lookup(const char *name);
 
   /**
-   * @brief Parse command line args from the user when the shell was launched
+   * @brief List the names of the registered builtins, in no particular
+   * order.
    *
-   * @param argc Number of args
-   * @param argv The arg array
+   * @param names Filled with up to max names
+   * @param max The size of names
+   * @return The number of builtins, which may be more than max
    */
-  void parse_args(int argc, char **argv);
+  size_t builtin_names(const char **names, size_t max);
+
+  /**
+   * @brief Start the completion engine. A thread reads the executables in
+   * every directory on path into a sorted table, the caller does not wait
+   * for it.
+   *
+   * @param path A PATH style list of directories
+   * @return The engine or NULL if it could not be started
+   */
+  struct completer *comp_start(const char *path);
+
+  /**
+   * @brief Stop the engine's thread and free it.
+   *
+   * @param c The engine
+   */
+  void comp_stop(struct completer *c);
+
+  /**
+   * @brief Ask the thread to look at PATH again. Only directories that
+   * are new or whose mtime changed are read, and the table is only
+   * rebuilt when one was.
+   *
+   * @param c The engine
+   * @param path The current PATH, NULL to keep the last one
+   */
+  void comp_refresh(struct completer *c, const char *path);
+
+  /**
+   * @brief Wait until the thread has handled every refresh asked for.
+   *
+   * @param c The engine
+   */
+  void comp_wait(struct completer *c);
+
+  /**
+   * @brief The number of directories read so far.
+   *
+   * @param c The engine
+   * @return The count
+   */
+  unsigned comp_scans(struct completer *c);
+
+  /**
+   * @brief Tell the engine which job numbers exist, for completing %n.
+   *
+   * @param c The engine
+   * @param ids The job numbers
+   * @param n How many there are
+   */
+  void comp_set_jobs(struct completer *c, const int *ids, size_t n);
+
+  /**
+   * @brief Complete a command name from the builtins and the executables
+   * on PATH. A lookup is a binary search for the first name with the
+   * prefix, so its cost depends on the matches and not on the table. The
+   * first call waits for the initial scan if it is still running.
+   *
+   * @param c The engine, NULL for builtins only
+   * @param prefix What has been typed so far
+   * @return The matches in the form readline wants them, the common
+   * prefix first, or NULL if there are none
+   */
+  char **comp_command(struct completer *c, const char *prefix);
+
+  /**
+   * @brief Complete a job reference such as %1.
+   *
+   * @param c The engine
+   * @param prefix What has been typed so far, starting with %
+   * @return The matches as for comp_command
+   */
+  char **comp_jobs(struct completer *c, const char *prefix);
+
+  /**
+   * @brief Hand the newest COMP_HISTORY_LINES history entries to the
+   * thread, which splits them into a sorted table of words. Does nothing
+   * if no entry was added since the last call.
+   *
+   * @param c The engine
+   * @param h The history
+   */
+  void comp_set_history(struct completer *c, struct history *h);
+
+  /**
+   * @brief Complete a word used in the history entries last handed over
+   * with comp_set_history. The table is not waited for, until the thread
+   * has built it there are no matches.
+   *
+   * @param c The engine
+   * @param prefix What has been typed so far
+   * @return The matches as for comp_command
+   */
+  char **comp_history(struct completer *c, const char *prefix);
+
+  /**
+   * @brief Whether a word has a *, ? or [ that is not escaped with a
+   * backslash and so needs to be expanded.
+   *
+   * @param s The word
+   * @return true if it is a pattern
+   */
+  bool glob_has_magic(const char *s);
+
+  /**
+   * @brief Match one path component against a pattern. * matches any
+   * run of characters, ? any one character and [...] one character from
+   * the set, which can hold ranges and is negated by a leading ! or ^.
+   * A backslash makes the next character literal.
+   *
+   * @param pattern The pattern
+   * @param name The name to match
+   * @return true if it matches
+   */
+  bool glob_match(const char *pattern, const char *name);
+
+  /**
+   * @brief Make a cache of directory listings for glob_expand. A listing
+   * is used again as long as the mtime of its directory has not changed.
+   * Walks on several threads can share it.
+   *
+   * @param max_entries Drop everything when the listings hold more
+   * entries than this
+   * @return The cache, NULL if out of memory
+   */
+  struct glob_cache *glob_cache_new(size_t max_entries);
+
+  /**
+   * @brief Free a cache of directory listings, NULL is fine.
+   *
+   * @param gc The cache
+   */
+  void glob_cache_free(struct glob_cache *gc);
+
+  /**
+   * @brief Find the paths matching a pattern. Each component between
+   * slashes is matched with glob_match, a component that is just **
+   * matches any number of directories without following symlinks, and a
+   * trailing / only matches directories. Names starting with a dot only
+   * match a component that does too, . and .. never do. Directories are
+   * read with getdents64 and their entries are only stat'ed when the
+   * filesystem does not report a type. Once enough directories are
+   * waiting to be read they are shared out to a pool of threads, the
+   * matches are the same as with one thread.
+   *
+   * @param pattern The pattern
+   * @param gc A cache of listings, or NULL to read every directory
+   * @param threads The most threads to walk with, the caller included
+   * @param out Set to the matches sorted with strcmp, free each of them
+   * and the array
+   * @param n Set to the number of matches
+   * @return 0 on success, -1 if out of memory
+   */
+  int glob_expand(const char *pattern, struct glob_cache *gc, size_t threads, char ***out,
+                  size_t *n);
+
+  /**
+   * @brief Expand the patterns in a parsed command, with up to one thread
+   * per CPU. A pattern that matches nothing is passed on, like bash
+   * does. The backslashes escaping characters are removed from every word
+   * that is not replaced by matches.
+   *
+   * @param sh The shell, for its listing cache
+   * @param argv The command, NULL terminated
+   * @return argv itself when there is nothing to expand, otherwise a new
+   * command to free with cmd_free. NULL if out of memory
+   */
+  char **glob_argv(struct shell *sh, char **argv);
+
+  /**
+   * @brief Make a variable table holding the NAME=value strings of env,
+   * all of them exported.
+   *
+   * @param env The environment to start from, NULL for none
+   * @return The table, NULL if out of memory
+   */
+  struct vars *vars_new(char **env);
+
+  /**
+   * @brief Free a variable table, NULL is fine.
+   *
+   * @param v The table
+   */
+  void vars_free(struct vars *v);
+
+  /**
+   * @brief Whether a name can be a variable: letters, digits and _, not
+   * starting with a digit.
+   *
+   * @param name The name
+   * @param len Its length
+   * @return true if it is valid
+   */
+  bool vars_valid_name(const char *name, size_t len);
+
+  /**
+   * @brief Look up a variable.
+   *
+   * @param v The table
+   * @param name The variable
+   * @return The value, valid until the next change to the table, or NULL
+   * if it is not set
+   */
+  const char *vars_get(const struct vars *v, const char *name);
+
+  /**
+   * @brief Set a variable, keeping whether it is exported.
+   *
+   * @param v The table
+   * @param name The variable
+   * @param value The value
+   * @return 0 on success, -1 for a bad name or out of memory
+   */
+  int vars_set(struct vars *v, const char *name, const char *value);
+
+  /**
+   * @brief Mark a variable exported. One that is not set yet is exported
+   * once it is.
+   *
+   * @param v The table
+   * @param name The variable
+   * @return 0 on success, -1 for a bad name or out of memory
+   */
+  int vars_export(struct vars *v, const char *name);
+
+  /**
+   * @brief Remove a variable.
+   *
+   * @param v The table
+   * @param name The variable
+   * @return 0 on success, -1 if it was not set
+   */
+  int vars_unset(struct vars *v, const char *name);
+
+  /**
+   * @brief The exported variables as an environment for exec. The array
+   * points into the table and is only built again after an exported
+   * variable changed, so asking for it before every command is cheap. A
+   * rebuild frees the previous array, see sh_syncenv.
+   *
+   * @param v The table
+   * @return The NULL terminated NAME=value strings
+   */
+  char **vars_envp(struct vars *v);
+
+  /**
+   * @brief Expand $NAME, ${NAME}, $?, $$ and $! in a word. A variable that
+   * is not set is empty and a $ that starts none of these is kept. \\$ is
+   * a plain $, other backslashes are left in place.
+   *
+   * @param sh The shell
+   * @param word The word
+   * @return The expanded word to free, NULL if out of memory
+   */
+  char *vars_expand(struct shell *sh, const char *word);
+
+  /**
+   * @brief Expand the variables in a parsed command. The value of a
+   * variable is not split into more words, and a word that expands to
+   * nothing is dropped like an unquoted one in bash.
+   *
+   * @param sh The shell
+   * @param argv The command, NULL terminated
+   * @return argv itself when no word has a $, otherwise a new command to
+   * free with cmd_free. NULL if out of memory
+   */
+  char **vars_argv(struct shell *sh, char **argv);
+
+  /**
+   * @brief Make an empty alias table.
+   *
+   * @return The table, NULL if out of memory
+   */
+  struct aliases *alias_new(void);
+
+  /**
+   * @brief Free an alias table, NULL is fine.
+   *
+   * @param al The table
+   */
+  void alias_free(struct aliases *al);
+
+  /**
+   * @brief Whether a name can be an alias, it has to be a word that could
+   * start a command and can't hold =, / or $.
+   *
+   * @param name The name
+   * @return true if it is valid
+   */
+  bool alias_valid_name(const char *name);
+
+  /**
+   * @brief Define or redefine an alias.
+   *
+   * @param al The table
+   * @param name The alias
+   * @param value What it expands to
+   * @return 0 on success, -1 for a bad name or out of memory
+   */
+  int alias_set(struct aliases *al, const char *name, const char *value);
+
+  /**
+   * @brief Look up an alias.
+   *
+   * @param al The table
+   * @param name The alias
+   * @return Its value or NULL if there is no such alias
+   */
+  const char *alias_get(const struct aliases *al, const char *name);
+
+  /**
+   * @brief Remove an alias.
+   *
+   * @param al The table
+   * @param name The alias
+   * @return 0 on success, -1 if there was no such alias
+   */
+  int alias_remove(struct aliases *al, const char *name);
+
+  /**
+   * @brief Remove every alias.
+   *
+   * @param al The table
+   */
+  void alias_clear(struct aliases *al);
+
+  /**
+   * @brief The names of all aliases, in no particular order.
+   *
+   * @param al The table
+   * @param names Filled with up to max names
+   * @param max The room in names
+   * @return The number of aliases, which can be more than max
+   */
+  size_t alias_list(const struct aliases *al, const char **names, size_t max);
+
+  /**
+   * @brief Expand aliases at the start of a command line. The first word
+   * is replaced by its value and the first word of that is looked up in
+   * turn, up to ALIAS_MAX_DEPTH times and never the same alias twice. A
+   * value ending in a blank has the word after it expanded as well. Only
+   * the front of the line is looked at, the rest is copied as it is.
+   *
+   * @param al The table, NULL for none
+   * @param line The command line
+   * @return The new line to free, or NULL when no alias applies or out of
+   * memory, the line is then used as it is
+   */
+  char *alias_expand(const struct aliases *al, const char *line);
+
+  /**
+   * True while a trace is being recorded, TRACE checks this and nothing
+   * else.
+   */
+  extern bool trace_enabled;
+
+  /**
+   * @brief Start recording a trace in the Chrome trace format, which
+   * chrome://tracing and Perfetto load. Events are kept in memory shared
+   * with forked children, so their marks before exec show up too.
+   *
+   * @param path The JSON file to write
+   * @return 0 on success, -1 if the file or the buffer can't be made
+   */
+  int trace_start(const char *path);
+
+  /**
+   * @brief Record the span from the previous mark on this thread to now,
+   * use TRACE instead so nothing is called when tracing is off.
+   *
+   * @param name The name of the span, a string that outlives the trace
+   */
+  void trace_record(const char *name);
+
+  /**
+   * @brief Append the events recorded since the last flush to the file.
+   * The shell does this between commands.
+   */
+  void trace_flush(void);
+
+  /**
+   * @brief The events that were overwritten before they could be flushed.
+   *
+   * @return The count
+   */
+  size_t trace_dropped(void);
+
+  /**
+   * @brief Flush what is left, finish the JSON and stop tracing.
+   */
+  void trace_stop(void);
+
+  /**
+   * @brief The monotonic clock in nanoseconds, what the stats histograms
+   * are recorded in.
+   *
+   * @return The time
+   */
+  uint64_t stats_now(void);
+
+  /**
+   * @brief Add to one of the shell's counters.
+   *
+   * @param c The counter
+   * @param n How much to add
+   */
+  void stats_add(enum stat_counter c, uint64_t n);
+
+  /**
+   * @brief Read one of the shell's counters.
+   *
+   * @param c The counter
+   * @return Its value since the last reset
+   */
+  uint64_t stats_counter(enum stat_counter c);
+
+  /**
+   * @brief Record a value in one of the histograms.
+   *
+   * @param h The histogram
+   * @param value The value, nanoseconds for the timing histograms
+   */
+  void stats_record(enum stat_hist h, uint64_t value);
+
+  /**
+   * @brief The number of values recorded in a histogram.
+   *
+   * @param h The histogram
+   * @return The count since the last reset
+   */
+  uint64_t stats_count(enum stat_hist h);
+
+  /**
+   * @brief A percentile of a histogram, as the top of the bucket it falls
+   * in but never past the largest value recorded.
+   *
+   * @param h The histogram
+   * @param p The percentile, 0 to 100
+   * @return The value, 0 if nothing has been recorded
+   */
+  uint64_t stats_percentile(enum stat_hist h, double p);
+
+  /**
+   * @brief Allocations made by the shell's own code, counted by wrapping
+   * malloc, calloc, realloc and strdup at link time. Libraries such as
+   * readline allocate on their own and are not included.
+   *
+   * @return The count since the last reset
+   */
+  uint64_t stats_allocs(void);
+
+  /**
+   * @brief The bytes asked for by the allocations stats_allocs counts,
+   * what realloc grows a block to counts in full.
+   *
+   * @return The count since the last reset
+   */
+  uint64_t stats_alloc_bytes(void);
+
+  /**
+   * @brief Note that a child exited, for the SIGCHLD handler. Only stores
+   * the time so it is async signal safe.
+   */
+  void stats_child_exited(void);
+
+  /**
+   * @brief When a child last exited, per stats_child_exited.
+   *
+   * @return The time from stats_now, 0 if no child has exited
+   */
+  uint64_t stats_last_exit(void);
+
+  /**
+   * @brief Clear every counter and histogram.
+   */
+  void stats_reset(void);
+
+  /**
+   * @brief The stats builtin. Prints the counters and the histograms
+   * with their percentiles, --json prints them and the non-empty buckets
+   * as JSON and --reset clears them.
+   *
+   * @param sh The shell
+   * @param argv The arguments including "stats" in argv[0]
+   * @return 0 on success, 1 if the output could not be written, 2 on a
+   * bad option
+   */
+  int builtin_stats(struct shell *sh, char **argv);
+
+  /**
+   * @brief Open cycle, instruction, cache miss and context switch
+   * counters on a process and the children it goes on to create. Whatever
+   * the kernel refuses is left out, and when kernel events are not allowed
+   * (perf_event_paranoid) only user space is counted.
+   *
+   * @param pj The counters, have is 0 afterwards if none opened
+   * @param pid The process, 0 for the shell itself
+   * @param on_exec Only start counting when the process calls exec, for a
+   * child that is waiting to exec
+   * @return The number of counters opened
+   */
+  int perf_open(struct perf_job *pj, pid_t pid, bool on_exec);
+
+  /**
+   * @brief Update the values from the counters still open, scaled up if
+   * the kernel had to share the hardware between events.
+   *
+   * @param pj The counters
+   */
+  void perf_read(struct perf_job *pj);
+
+  /**
+   * @brief Read the counters one last time and close them, the values
+   * stay.
+   *
+   * @param pj The counters
+   */
+  void perf_close(struct perf_job *pj);
+
+  /**
+   * @brief Write the values as name=value pairs, - for a counter that
+   * could not be opened.
+   *
+   * @param ob Where to write them
+   * @param pj The counters
+   */
+  void perf_print(struct outbuf *ob, const struct perf_job *pj);
+
+  /**
+   * @brief Say on stderr which counters are missing and why, nothing if
+   * all of them opened.
+   *
+   * @param who What to start the message with
+   * @param pj The counters
+   */
+  void perf_explain(const char *who, const struct perf_job *pj);
+
+  /**
+   * @brief Add a finished job's counters to the totals stats reports.
+   *
+   * @param pj The counters
+   */
+  void perf_account(const struct perf_job *pj);
+
+  /**
+   * @brief Load a shared object with dlopen and register the builtins it
+   * exports through struct lab_plugin.
+   *
+   * @param path The path to the shared object
+   * @return The number of builtins registered, or -1 on error
+   */
+  int plugin_load(const char *path);
+
+  /**
+   * @brief The load builtin, calls plugin_load for each argument.
+   *
+   * @param sh The shell
+   * @param argv The arguments including "load" in argv[0]
+   * @return The exit status
+   */
+  int builtin_load(struct shell *sh, char **argv);
+
+  /**
+   * @brief Open the history log at path, creating it if needed. The file
+   * is memory mapped and the offsets of its records are loaded from an
+   * index kept next to it in <path>.idx, so opening does not depend on the
+   * number of entries. If path is NULL or empty, or the file can't be used,
+   * history is kept in memory for this session only.
+   *
+   * @param path The history file or NULL
+   * @return The history or NULL if out of memory
+   */
+  struct history *hist_open(const char *path);
+
+  /**
+   * @brief Update the index and release the history.
+   *
+   * @param h The history
+   */
+  void hist_close(struct history *h);
+
+  /**
+   * @brief Append a line to the history. The record is written to the log
+   * with a single write so it is safe to share the file between shells.
+   *
+   * @param h The history
+   * @param line The line to add
+   * @return 0 on success, -1 on error
+   */
+  int hist_add(struct history *h, const char *line);
+
+  /**
+   * @brief Pick up any records appended to the log since the last call,
+   * including ones written by other shells.
+   *
+   * @param h The history
+   * @return The number of new entries, or -1 on error
+   */
+  int hist_sync(struct history *h);
+
+  /**
+   * @brief Limit the history to the newest max entries and apply a
+   * duplicate policy. The visible entries are rebuilt from the newest
+   * record back, the log itself keeps every record so shells sharing it
+   * can each use their own settings.
+   *
+   * @param h The history
+   * @param max The most entries to keep, 0 for no limit
+   * @param dups What to do with duplicate commands
+   */
+  void hist_limit(struct history *h, size_t max, enum hist_dups dups);
+
+  /**
+   * @brief The number of entries in the history.
+   *
+   * @param h The history
+   * @return The number of entries
+   */
+  size_t hist_count(const struct history *h);
+
+  /**
+   * @brief Get an entry, 0 is the oldest. The string points into the
+   * mapped log and is only valid until the next call to hist_add or
+   * hist_sync.
+   *
+   * @param h The history
+   * @param i The entry to get
+   * @return The entry or NULL if i is out of range
+   */
+  const char *hist_get(const struct history *h, size_t i);
+
+  /**
+   * @brief The number of records in the log, including the ones hidden by
+   * the limit or the duplicate policy. Use it with hist_since to find
+   * entries that were added after some point.
+   *
+   * @param h The history
+   * @return The number of records
+   */
+  size_t hist_records(const struct history *h);
+
+  /**
+   * @brief The first entry that came from record number seq or later.
+   *
+   * @param h The history
+   * @param seq A value returned by hist_records
+   * @return The entry, hist_count(h) if there is none
+   */
+  size_t hist_since(const struct history *h, size_t seq);
+
+  struct hist_stats {
+    size_t entries;      // Visible entries
+    size_t records;      // Records in the log
+    size_t log_bytes;    // Size of the log or the in memory arena
+    size_t index_bytes;  // Record offsets, entry list and duplicate set
+    size_t search_bytes; // Trigram index
+  };
+
+  /**
+   * @brief Report how much memory the history is using.
+   *
+   * @param h The history
+   * @param st Filled in with the numbers
+   */
+  void hist_stats(const struct history *h, struct hist_stats *st);
+
+  /**
+   * @brief Find the newest entry before entry number before that contains
+   * pattern. Patterns of three or more characters are answered from a
+   * trigram index that is brought up to date on each call, so only new
+   * entries are ever indexed.
+   *
+   * @param h The history
+   * @param pattern The substring to look for
+   * @param before Only entries older than this are considered, pass
+   * hist_count(h) to search everything
+   * @return The matching entry or -1 if there is none
+   */
+  long hist_search(struct history *h, const char *pattern, size_t before);
+
+  /**
+   * @brief Find the newest entry that starts with the first len bytes of
+   * prefix. Prefixes of up to 16 bytes are answered from an index that
+   * maps each prefix to its newest entry, longer ones scan back from the
+   * entry their first 16 bytes give.
+   *
+   * @param h The history
+   * @param prefix The prefix, it does not need to be NUL terminated
+   * @param len The length of the prefix
+   * @return The matching entry or -1 if there is none
+   */
+  long hist_prefix(struct history *h, const char *prefix, size_t len);
+
+  /**
+   * @brief Expand history references in line the way bash does: !! is the
+   * last entry, !n entry n as history numbers them, !-n the nth entry
+   * back and !prefix the newest entry starting with prefix. Nothing is
+   * expanded inside single quotes and \! is a literal !. An event that
+   * does not exist is reported on stderr.
+   *
+   * @param h The history
+   * @param line The line to expand
+   * @param out Set to the expanded line, which the caller must free
+   * @return 1 if line was expanded, 0 if it had nothing to expand and -1
+   * on error
+   */
+  int hist_expand(struct history *h, const char *line, char **out);
+
+  /**
+   * @brief The history file to use. This is MY_HISTFILE when set, an
+   * empty MY_HISTFILE turns persistence off. Otherwise ~/.lab_history.
+   *
+   * @return The path, or NULL if there is no home directory
+   */
+  const char *hist_default_path(void);
+
+  /**
+   * @brief The ids of the strings containing one trigram, ascending.
+   */
+  struct tri_list
+  {
+    uint32_t key;        // The three bytes plus one, zero marks a free slot
+    uint32_t len;
+    uint32_t cap;
+    uint32_t *ids;
+  };
+
+  /**
+   * @brief A trigram index for substring search, used by the history and
+   * the directory database. Zero it before first use.
+   */
+  struct tri_index
+  {
+    struct tri_list *tab;
+    size_t cap;
+    size_t used;
+  };
+
+  /**
+   * @brief Add every trigram of a string to the index. Ids must be added
+   * in ascending order.
+   *
+   * @param t The index
+   * @param s The string, it does not need to be NUL terminated
+   * @param len The length of s
+   * @param id The id of the string
+   * @return 0 on success, -1 if out of memory
+   */
+  int tri_index_add(struct tri_index *t, const char *s, size_t len, uint32_t id);
+
+  /**
+   * @brief Look up the lists for every trigram of pattern and add the ones
+   * not already in lists, keeping the shortest in lists[0]. A match must
+   * be in all of them.
+   *
+   * @param t The index
+   * @param pattern The pattern
+   * @param len The length of pattern
+   * @param lists The lists found so far
+   * @param n The number of lists, updated
+   * @param max The size of lists, trigrams past it are left out
+   * @return 0 on success, -1 if some trigram is in no string at all
+   */
+  int tri_index_plan(const struct tri_index *t, const char *pattern, size_t len,
+                     const struct tri_list **lists, size_t *n, size_t max);
+
+  /**
+   * @brief The position of the first id in list that is not below id.
+   *
+   * @param list The list
+   * @param id The id
+   * @return The position, list->len if there is none
+   */
+  size_t tri_list_lower(const struct tri_list *list, uint32_t id);
+
+  /**
+   * @brief Check whether id is in list, with a binary search.
+   *
+   * @param list The list
+   * @param id The id
+   * @return true if it is
+   */
+  bool tri_list_has(const struct tri_list *list, uint32_t id);
+
+  /**
+   * @brief The memory used by the index.
+   *
+   * @param t The index
+   * @return The number of bytes
+   */
+  size_t tri_index_bytes(const struct tri_index *t);
+
+  /**
+   * @brief Free the index, it can be used again afterwards.
+   *
+   * @param t The index
+   */
+  void tri_index_free(struct tri_index *t);
+
+  /**
+   * @brief Tells hashtab_delete whether a slot is in use and what its
+   * hash is.
+   */
+  typedef bool (*hashtab_hash_fn)(const void *slot, uint32_t *hash);
+
+  /**
+   * @brief Remove an entry from an open addressing table with linear
+   * probing. The entries after it are shifted back so every entry can
+   * still be reached from its home slot without leaving tombstones, and
+   * the slot that ends up free is zeroed, which must mark it unused.
+   *
+   * @param slots The table
+   * @param size The size of a slot
+   * @param cap The number of slots, a power of two
+   * @param at The slot to remove, its contents are already released
+   * @param hash Returns false for a free slot, otherwise sets the hash
+   * the slot was placed by
+   */
+  void hashtab_delete(void *slots, size_t size, size_t cap, size_t at, hashtab_hash_fn hash);
+
+  struct zdb_match {
+    const char *path;
+    double score;        // The rank weighted by how recent the last visit is
+  };
+
+  /**
+   * @brief Open the directory database used by z, creating it if needed.
+   * The file is memory mapped and can be shared by several shells.
+   *
+   * @param path The file, if NULL or empty there is no database
+   * @return The database, or NULL if there is none or it can't be used
+   */
+  struct zdb *zdb_open(const char *path);
+
+  /**
+   * @brief Close the database.
+   *
+   * @param z The database
+   */
+  void zdb_close(struct zdb *z);
+
+  /**
+   * @brief Record a visit to a directory. Its rank goes up by one, and
+   * once all ranks add up to more than 100000 they are aged so directories
+   * that are no longer used drop out.
+   *
+   * @param z The database
+   * @param dir The absolute path of the directory
+   * @param now The time of the visit
+   * @return 0 on success, -1 on error
+   */
+  int zdb_visit(struct zdb *z, const char *dir, time_t now);
+
+  /**
+   * @brief Drop a directory from the database.
+   *
+   * @param z The database
+   * @param dir The absolute path of the directory
+   * @return 0 on success, -1 if it was not there
+   */
+  int zdb_remove(struct zdb *z, const char *dir);
+
+  /**
+   * @brief Find the directories whose path contains each of words, in that
+   * order and ignoring case, and rank them by frecency: the rank times 4
+   * if the last visit was within the hour, 2 within the day, 1/2 within
+   * the week and 1/4 after that. Candidates come from a trigram index so
+   * only directories that can match are looked at.
+   *
+   * @param z The database
+   * @param words The words, NULL terminated, none matches everything
+   * @param now The current time
+   * @param out Set to the matches, best first, valid until the next call
+   * @return The number of matches
+   */
+  size_t zdb_query(struct zdb *z, char **words, time_t now, const struct zdb_match **out);
+
+  /**
+   * @brief The directory database to use. This is MY_ZFILE when set, an
+   * empty MY_ZFILE turns z off. Otherwise ~/.lab_z.
+   *
+   * @return The path, or NULL if there is no home directory
+   */
+  const char *zdb_default_path(void);
+
+  /**
+   * @brief Pick up history written since the last call, by this shell or
+   * any other shell sharing the history file, and hand it to readline so
+   * the arrow keys see it. This costs one fstat when nothing changed and
+   * is meant to be called before every prompt.
+   *
+   * @param sh The shell
+   */
+  void sh_history_sync(struct shell *sh);
+
+  /**
+   * @brief Initialize the shell for use. Allocate all data structures
+   * Grab control of the terminal and put the shell in its own
+   * process group. NOTE: This function will block until the shell is
+   * in its own program group. Attaching a debugger will always cause
+   * this function to fail because the debugger maintains control of
+   * the subprocess it is debugging.
+   *
+   * @param sh
+   */
+  void sh_init(struct shell *sh);
+
+  /**
+   * @brief Destroy shell. Free any allocated memory and resources and exit
+   * normally.
+   *
+   * @param sh
+   */
+  void sh_destroy(struct shell *sh);
+
+  /**
+   * @brief Parse command line args from the user when the shell was launched
+   *
+   * @param argc Number of args
+   * @param argv The arg array
+   */
+  void parse_args(int argc, char **argv);
+
+  /**
+   * @brief Print the current working directory to stdout.
+   *
+   * @return On success, zero is returned. On error, -1 is returned.
+   */
+  int print_working_directory(void);
+
+  /**
+   * @brief Prepare an output buffer that writes to fd. If fd is stdout or
+   * stderr the matching stdio stream is flushed first so output stays in
+   * order.
+   *
+   * @param ob The buffer
+   * @param fd The file descriptor to write to
+   */
+  void ob_init(struct outbuf *ob, int fd);
+
+  /**
+   * @brief Copy n bytes into the buffer, flushing as needed.
+   *
+   * @param ob The buffer
+   * @param s The bytes to add
+   * @param n The number of bytes
+   */
+  void ob_write(struct outbuf *ob, const char *s, size_t n);
+
+  /**
+   * @brief Add n bytes without copying them. The caller must keep s valid
+   * until the next ob_flush.
+   *
+   * @param ob The buffer
+   * @param s The bytes to add
+   * @param n The number of bytes
+   */
+  void ob_ref(struct outbuf *ob, const char *s, size_t n);
+
+  /**
+   * @brief Copy a NUL terminated string into the buffer.
+   *
+   * @param ob The buffer
+   * @param s The string
+   */
+  void ob_puts(struct outbuf *ob, const char *s);
+
+  /**
+   * @brief Write an unsigned number in decimal, without going through
+   * printf.
+   *
+   * @param ob The buffer
+   * @param n The number
+   */
+  void ob_putu(struct outbuf *ob, unsigned long long n);
+
+  /**
+   * @brief printf into the buffer.
+   *
+   * @param ob The buffer
+   * @param fmt The format
+   */
+  void ob_printf(struct outbuf *ob, const char *fmt, ...)
+      __attribute__((format(printf, 2, 3)));
+
+  /**
+   * @brief Write everything in the buffer. Once a write fails (EPIPE for
+   * example) the error is kept in ob->error and later output is dropped.
+   *
+   * @param ob The buffer
+   * @return 0 on success, -1 if any write has failed
+   */
+  int ob_flush(struct outbuf *ob);
+
+  /**
+   * @brief The echo builtin, supports -n, -e and -E like coreutils.
+   *
+   * @param sh The shell
+   * @param argv The arguments including "echo" in argv[0]
+   * @return The exit status
+   */
+  int builtin_echo(struct shell *sh, char **argv);
+
+  /**
+   * @brief The printf builtin. Supports the d, i, u, o, x, X, c, s and b
+   * conversions with flags, width and precision. The format is reused
+   * until all arguments are consumed.
+   *
+   * @param sh The shell
+   * @param argv The arguments including "printf" in argv[0]
+   * @return The exit status
+   */
+  int builtin_printf(struct shell *sh, char **argv);
+
+  /**
+   * @brief The test builtin, also used for "[" in which case the last
+   * argument must be "]".
+   *
+   * @param sh The shell
+   * @param argv The arguments including "test" or "[" in argv[0]
+   * @return 0 if the expression is true, 1 if false and 2 on error
+   */
+  int builtin_test(struct shell *sh, char **argv);
+
+  /**
+   * @brief The pwd builtin.
+   *
+   * @param sh The shell
+   * @param argv The arguments including "pwd" in argv[0]
+   * @return The exit status
+   */
+  int builtin_pwd(struct shell *sh, char **argv);
+
+  /**
+   * @brief Start a new process running argv[0] with the given arguments.
+   * The job control signals the shell ignores are reset to their defaults
+   * in the child. If pidfd is not NULL it receives a pidfd for the child
+   * that can be used with poll, or -1 if the kernel does not support them.
+   *
+   * @param argv The command to run, NULL terminated
+   * @param pidfd Optional location for the pidfd of the child
+   * @return The pid of the child, or -1 with errno set on error
+   */
+  pid_t spawn_process(char **argv, int *pidfd);
+
+  /**
+   * @brief Wait for a process started with spawn_process to exit and close
+   * its pidfd.
+   *
+   * @param pid The process to wait for
+   * @param pidfd The pidfd returned by spawn_process or -1
+   * @return The exit status, 128 + the signal number if the child was
+   * killed, or -1 on error
+   */
+  int reap_process(pid_t pid, int pidfd);
+
+  /**
+   * @brief Number of bytes available for arguments when exec'ing a new
+   * program. This is ARG_MAX less the space taken by the current
+   * environment and the headroom POSIX reserves for the new program.
+   *
+   * @return The number of bytes available
+   */
+  size_t xargs_arg_limit(void);
+
+  /**
+   * @brief The xargs builtin. Reads items separated by newlines (or NUL
+   * with -0) from stdin or the file given with -a and runs the command
+   * with as many items as fit under xargs_arg_limit. Supported options are
+   * -0, -a file, -n max-args, -P max-procs and -s max-chars.
+   *
+   * @param sh The shell
+   * @param argv The arguments including "xargs" in argv[0]
+   * @return 0 on success, 123 if any invocation failed, 127 if the command
+   * could not be found
+   */
+  int builtin_xargs(struct shell *sh, char **argv);
+
+  /**
+   * @brief The parallel builtin. Reads one command per line from the file
+   * named in argv or stdin and runs them on a pool of worker threads, -j
+   * sets the number of workers (default one per CPU). Each worker owns a
+   * deque of commands and steals from its siblings when it runs dry. The
+   * per worker utilization and the overall makespan are reported on stderr
+   * when everything has finished.
+   *
+   * @param sh The shell
+   * @param argv The arguments including "parallel" in argv[0]
+   * @return The number of commands that failed, capped at 101
+   */
+  int builtin_parallel(struct shell *sh, char **argv);
 
 
 
@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lab.h"
+
+void ob_init(struct outbuf *ob, int fd) {
+    ob->fd = fd;
+    ob->iovcnt = 0;
+    ob->used = 0;
+    ob->error = 0;
+
+    // Anything still sitting in stdio has to go out before our bytes do
+    if (fd == STDOUT_FILENO) fflush(stdout);
+    if (fd == STDERR_FILENO) fflush(stderr);
+}
+
+int ob_flush(struct outbuf *ob) {
+    struct iovec *iov = ob->iov;
+    int iovcnt = ob->iovcnt;
+
+    while (iovcnt > 0 && !ob->error) {
+        ssize_t n = writev(ob->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ob->error = errno;
+            break;
+        }
+        // Skip past whatever made it out, a short write can stop anywhere
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    ob->iovcnt = 0;
+    ob->used = 0;
+    return ob->error ? -1 : 0;
+}
+
+void ob_ref(struct outbuf *ob, const char *s, size_t n) {
+    if (n == 0 || ob->error) return;
+    if (ob->iovcnt == OUTBUF_IOV) ob_flush(ob);
+    ob->iov[ob->iovcnt].iov_base = (void *)s;
+    ob->iov[ob->iovcnt].iov_len = n;
+    ob->iovcnt++;
+}
+
+void ob_write(struct outbuf *ob, const char *s, size_t n) {
+    while (n > 0 && !ob->error) {
+        // Flush before copying, a flush from ob_ref would empty buf with
+        // the bytes we are about to put there not yet written
+        if (ob->used == OUTBUF_SIZE || ob->iovcnt == OUTBUF_IOV) ob_flush(ob);
+        size_t chunk = OUTBUF_SIZE - ob->used;
+        if (chunk > n) chunk = n;
+
+        char *dst = ob->buf + ob->used;
+        memcpy(dst, s, chunk);
+        ob->used += chunk;
+        s += chunk;
+        n -= chunk;
+
+        // Grow the last iovec when it already ends where we just wrote
+        struct iovec *last = ob->iovcnt ? &ob->iov[ob->iovcnt - 1] : NULL;
+        if (last && (char *)last->iov_base + last->iov_len == dst) {
+            last->iov_len += chunk;
+        } else {
+            ob_ref(ob, dst, chunk);
+        }
+    }
+}
+
+void ob_puts(struct outbuf *ob, const char *s) {
+    ob_write(ob, s, strlen(s));
+}
+
+void ob_putu(struct outbuf *ob, unsigned long long n) {
+    char digits[20];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+    ob_write(ob, digits + i, sizeof(digits) - i);
+}
+
+void ob_printf(struct outbuf *ob, const char *fmt, ...) {
+    va_list ap;
+
+    if (ob->error) return;
+    if (OUTBUF_SIZE - ob->used < 256 || ob->iovcnt == OUTBUF_IOV) ob_flush(ob);
+
+    va_start(ap, fmt);
+    int n = vsnprintf(ob->buf + ob->used, OUTBUF_SIZE - ob->used, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+
+    if ((size_t)n < OUTBUF_SIZE - ob->used) {
+        // Formatted in place, just account for it
+        char *dst = ob->buf + ob->used;
+        ob->used += n;
+        struct iovec *last = ob->iovcnt ? &ob->iov[ob->iovcnt - 1] : NULL;
+        if (last && (char *)last->iov_base + last->iov_len == dst) {
+            last->iov_len += n;
+        } else {
+            ob_ref(ob, dst, n);
+        }
+        return;
+    }
+
+    // Too big for what is left of the buffer, format it on the heap
+    char *tmp = malloc((size_t)n + 1);
+    if (!tmp) return;
+    va_start(ap, fmt);
+    vsnprintf(tmp, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    ob_write(ob, tmp, n);
+    free(tmp);
+}
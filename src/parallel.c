@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lab.h"
+
+// A worker's queue of commands. The owner takes from the head so commands
+// start in the order they were given, thieves take from the tail so they
+// collide with the owner as little as possible.
+struct par_deque {
+    pthread_mutex_t lock;
+    size_t *items;       // Indexes into the command list
+    size_t head;
+    size_t tail;
+};
+
+struct par_worker {
+    pthread_t thread;
+    size_t id;
+    struct par_pool *pool;
+    struct par_deque deque;
+    size_t ran;          // Commands this worker ran
+    size_t stolen;       // Commands this worker took from a sibling
+    size_t failed;       // Commands that exited with a non zero status
+    long long busy_ns;   // Time spent with a child running
+};
+
+struct par_pool {
+    char **lines;
+    size_t nlines;
+    struct par_worker *workers;
+    size_t nworkers;
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool deque_pop(struct par_deque *dq, size_t *item) {
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+        *item = dq->items[dq->head++];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static bool deque_steal(struct par_deque *dq, size_t *item) {
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+        *item = dq->items[--dq->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// Find work in a sibling's deque. Commands are never added once the pool is
+// running, so a full pass that finds nothing means we are done.
+static bool par_steal(struct par_worker *w, size_t *item) {
+    struct par_pool *pool = w->pool;
+    for (size_t i = 1; i < pool->nworkers; i++) {
+        struct par_deque *dq = &pool->workers[(w->id + i) % pool->nworkers].deque;
+        if (deque_steal(dq, item)) return true;
+    }
+    return false;
+}
+
+static void par_run_one(struct par_worker *w, const char *line) {
+    char **argv = cmd_parse(line);
+    if (!argv || !argv[0]) {
+        cmd_free(argv);
+        return;
+    }
+
+    long long start = now_ns();
+    int pidfd;
+    pid_t pid = spawn_process(argv, &pidfd);
+    int rval;
+    if (pid < 0) {
+        fprintf(stderr, "parallel: %s: %s\n", argv[0], strerror(errno));
+        rval = 127;
+    } else {
+        rval = reap_process(pid, pidfd);
+    }
+    w->busy_ns += now_ns() - start;
+    w->ran++;
+    if (rval != 0) w->failed++;
+    cmd_free(argv);
+}
+
+static void *par_worker_main(void *arg) {
+    struct par_worker *w = arg;
+    size_t item;
+
+    for (;;) {
+        if (deque_pop(&w->deque, &item)) {
+            par_run_one(w, w->pool->lines[item]);
+        } else if (par_steal(w, &item)) {
+            w->stolen++;
+            par_run_one(w, w->pool->lines[item]);
+        } else {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int read_lines(FILE *in, struct par_pool *pool) {
+    size_t cap = 64;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+
+    pool->lines = malloc(cap * sizeof(char *));
+    if (!pool->lines) return -1;
+    while ((n = getline(&line, &line_cap, in)) != -1) {
+        char *cmd = trim_white(line);
+        if (*cmd == '\0' || *cmd == '#') continue;
+        if (pool->nlines == cap) {
+            cap *= 2;
+            char **tmp = realloc(pool->lines, cap * sizeof(char *));
+            if (!tmp) goto fail;
+            pool->lines = tmp;
+        }
+        pool->lines[pool->nlines] = strdup(cmd);
+        if (!pool->lines[pool->nlines]) goto fail;
+        pool->nlines++;
+    }
+    free(line);
+    return 0;
+
+fail:
+    // Running only part of the list would look like success
+    for (size_t i = 0; i < pool->nlines; i++) free(pool->lines[i]);
+    free(pool->lines);
+    pool->lines = NULL;
+    pool->nlines = 0;
+    free(line);
+    return -1;
+}
+
+int builtin_parallel(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    struct par_pool pool = {0};
+    long jobs = 0;
+    int opt;
+
+    int argc = 0;
+    while (argv[argc]) argc++;
+
+    optind = 0;
+    while ((opt = getopt(argc, argv, "+j:")) != -1) {
+        switch (opt) {
+            case 'j':
+                jobs = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: parallel [-j jobs] [file]\n");
+                return 1;
+        }
+    }
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? cpus : 1;
+    }
+
+    FILE *in = stdin;
+    if (optind < argc) {
+        in = fopen(argv[optind], "r");
+        if (!in) {
+            fprintf(stderr, "parallel: %s: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+    }
+    int rval = read_lines(in, &pool);
+    if (in == stdin) {
+        clearerr(stdin);
+    } else {
+        fclose(in);
+    }
+    if (rval < 0) {
+        perror("parallel");
+        return 1;
+    }
+
+    pool.nworkers = (size_t)jobs;
+    if (pool.nworkers > pool.nlines) pool.nworkers = pool.nlines ? pool.nlines : 1;
+    size_t per_worker = pool.nlines / pool.nworkers + 1;
+    pool.workers = calloc(pool.nworkers, sizeof(struct par_worker));
+    size_t *items = malloc(pool.nworkers * per_worker * sizeof(size_t));
+    if (!pool.workers || !items) {
+        perror("parallel");
+        for (size_t i = 0; i < pool.nlines; i++) free(pool.lines[i]);
+        free(pool.lines);
+        free(pool.workers);
+        free(items);
+        return 1;
+    }
+
+    // Deal the commands out round robin, stealing evens out whatever
+    // imbalance the long running ones cause
+    for (size_t i = 0; i < pool.nworkers; i++) {
+        struct par_worker *w = &pool.workers[i];
+        w->id = i;
+        w->pool = &pool;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        w->deque.items = items + i * per_worker;
+    }
+    for (size_t i = 0; i < pool.nlines; i++) {
+        struct par_deque *dq = &pool.workers[i % pool.nworkers].deque;
+        dq->items[dq->tail++] = i;
+    }
+
+    long long start = now_ns();
+    size_t started = 0;
+    for (; started < pool.nworkers; started++) {
+        if (pthread_create(&pool.workers[started].thread, NULL, par_worker_main,
+                           &pool.workers[started]) != 0) {
+            perror("parallel");
+            break;
+        }
+    }
+    // If we could not start every thread the ones that did start will steal
+    // the orphaned work, with none started we run it ourselves
+    if (started == 0) {
+        par_worker_main(&pool.workers[0]);
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    long long makespan = now_ns() - start;
+
+    size_t failed = 0;
+    for (size_t i = 0; i < pool.nworkers; i++) {
+        struct par_worker *w = &pool.workers[i];
+        double util = makespan > 0 ? 100.0 * w->busy_ns / makespan : 0.0;
+        fprintf(stderr, "worker %zu: %zu ran, %zu stolen, %.1f%% busy\n",
+                i, w->ran, w->stolen, util);
+        failed += w->failed;
+        pthread_mutex_destroy(&w->deque.lock);
+    }
+    fprintf(stderr, "makespan: %.3fs\n", makespan / 1e9);
+
+    for (size_t i = 0; i < pool.nlines; i++) free(pool.lines[i]);
+    free(pool.lines);
+    free(pool.workers);
+    free(items);
+
+    // Same convention as GNU parallel, the number of failed jobs up to 100
+    // and 101 for more than that
+    return failed > 100 ? 101 : (int)failed;
+}
@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include "lab.h"
+
+// Hardware counters for jobs, through perf_event_open.
+//
+// Counters are opened with inherit so children of the job are counted
+// too, and for a job that has not started yet with enable_on_exec, so
+// what is counted is the program and not the shell's fork path. There is
+// no group read with inherit, each counter is read on its own.
+//
+// Plenty of machines don't give us everything. Virtual machines often
+// have no hardware events at all, and perf_event_paranoid set to 2 or
+// more keeps kernel events from unprivileged users. Counters the kernel
+// does not have are remembered and not asked for again, a refusal to
+// count the kernel is retried for user space only.
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+// The errno of counters this kernel or machine does not have at all
+static int perf_missing[PERF_COUNTERS];
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid) {
+    return (int)syscall(SYS_perf_event_open, attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+int perf_open(struct perf_job *pj, pid_t pid, bool on_exec) {
+    int opened = 0;
+    memset(pj, 0, sizeof(*pj));
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        pj->fds[i] = -1;
+        if (perf_missing[i]) {
+            if (!pj->error) pj->error = perf_missing[i];
+            continue;
+        }
+
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1;
+        attr.exclude_hv = 1;
+        attr.exclude_kernel = pj->user_only;
+        attr.disabled = on_exec;
+        attr.enable_on_exec = on_exec;
+
+        int fd = perf_event_open(&attr, pid);
+        if (fd < 0 && (errno == EACCES || errno == EPERM) && !pj->user_only) {
+            attr.exclude_kernel = 1;
+            if ((fd = perf_event_open(&attr, pid)) >= 0) pj->user_only = true;
+        }
+        if (fd < 0) {
+            if (errno == ENOENT || errno == ENODEV || errno == EOPNOTSUPP || errno == ENOSYS) {
+                perf_missing[i] = errno;
+            }
+            if (!pj->error) pj->error = errno;
+            continue;
+        }
+        pj->fds[i] = fd;
+        pj->have |= 1u << i;
+        opened++;
+    }
+    return opened;
+}
+
+void perf_read(struct perf_job *pj) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        uint64_t v[3];
+        if (pj->fds[i] < 0 || read(pj->fds[i], v, sizeof(v)) != sizeof(v)) continue;
+        // v[1] is the time enabled and v[2] the time actually counting
+        if (v[2] && v[2] < v[1]) {
+            v[0] = (uint64_t)((double)v[0] * (double)v[1] / (double)v[2]);
+        }
+        pj->values[i] = v[0];
+    }
+}
+
+void perf_close(struct perf_job *pj) {
+    perf_read(pj);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (pj->fds[i] < 0) continue;
+        close(pj->fds[i]);
+        pj->fds[i] = -1;
+    }
+}
+
+void perf_print(struct outbuf *ob, const struct perf_job *pj) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (i) ob_write(ob, " ", 1);
+        ob_puts(ob, perf_events[i].name);
+        if (!(pj->have & (1u << i))) {
+            ob_write(ob, "=-", 2);
+        } else {
+            ob_printf(ob, "=%llu", (unsigned long long)pj->values[i]);
+        }
+        if (i == PERF_INSTRUCTIONS && (pj->have & (1u << PERF_CYCLES)) &&
+            (pj->have & (1u << i)) && pj->values[PERF_CYCLES]) {
+            ob_printf(ob, " ipc=%.2f", (double)pj->values[i] / (double)pj->values[PERF_CYCLES]);
+        }
+    }
+    if (pj->user_only) ob_puts(ob, " (user)");
+}
+
+static int perf_paranoid(void) {
+    int level = -9;
+    FILE *fp = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+    if (fp) {
+        if (fscanf(fp, "%d", &level) != 1) level = -9;
+        fclose(fp);
+    }
+    return level;
+}
+
+void perf_explain(const char *who, const struct perf_job *pj) {
+    char missing[128] = "";
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (pj->have & (1u << i)) continue;
+        if (*missing) strncat(missing, ", ", sizeof(missing) - strlen(missing) - 1);
+        strncat(missing, perf_events[i].name, sizeof(missing) - strlen(missing) - 1);
+    }
+    int level = perf_paranoid();
+    if (*missing) {
+        fprintf(stderr, "%s: %s not counted: %s", who, missing, strerror(pj->error));
+        if ((pj->error == EACCES || pj->error == EPERM) && level != -9) {
+            fprintf(stderr, " (kernel.perf_event_paranoid is %d)", level);
+        }
+        fprintf(stderr, "\n");
+    }
+    if (pj->user_only) {
+        fprintf(stderr, "%s: counting user space only", who);
+        if (level != -9) fprintf(stderr, " (kernel.perf_event_paranoid is %d)", level);
+        fprintf(stderr, "\n");
+    }
+}
+
+void perf_account(const struct perf_job *pj) {
+    stats_add(STAT_PERF_JOBS, 1);
+    stats_add(STAT_CYCLES, pj->values[PERF_CYCLES]);
+    stats_add(STAT_INSTRUCTIONS, pj->values[PERF_INSTRUCTIONS]);
+    stats_add(STAT_CACHE_MISSES, pj->values[PERF_CACHE_MISSES]);
+    stats_add(STAT_CONTEXT_SWITCHES, pj->values[PERF_CONTEXT_SWITCHES]);
+}
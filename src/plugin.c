@@ -0,0 +1,60 @@
+#include <dlfcn.h>
+#include <stdio.h>
+#include "lab.h"
+
+// Plugins are handed struct shell as is, so its layout is part of the ABI.
+// When this fails the struct changed: bump LAB_PLUGIN_ABI and update both
+// numbers here.
+#if __SIZEOF_POINTER__ == 8
+_Static_assert(LAB_PLUGIN_ABI == 2 && sizeof(struct shell) == 232,
+               "struct shell changed, bump LAB_PLUGIN_ABI");
+#endif
+
+int plugin_load(const char *path) {
+    // RTLD_NOW so a plugin with missing symbols fails here and not halfway
+    // through a command
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "load: %s\n", dlerror());
+        return -1;
+    }
+
+    const struct lab_plugin *plugin = dlsym(handle, LAB_PLUGIN_SYMBOL);
+    if (!plugin) {
+        fprintf(stderr, "load: %s: not a shell plugin\n", path);
+        dlclose(handle);
+        return -1;
+    }
+    if (plugin->abi_version != LAB_PLUGIN_ABI) {
+        fprintf(stderr, "load: %s: plugin ABI %u, shell ABI %u\n", path,
+                plugin->abi_version, LAB_PLUGIN_ABI);
+        dlclose(handle);
+        return -1;
+    }
+
+    // The handle stays open for the life of the shell, the table points
+    // straight at the plugin's functions
+    int count = 0;
+    for (const struct builtin *b = plugin->builtins; b && b->name; b++) {
+        if (builtin_register(b->name, b->fn) < 0) {
+            perror("load");
+            return -1;
+        }
+        count++;
+    }
+    return count;
+}
+
+int builtin_load(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    int status = 0;
+
+    if (!argv[1]) {
+        fprintf(stderr, "Usage: load plugin.so...\n");
+        return 2;
+    }
+    for (int i = 1; argv[i]; i++) {
+        if (plugin_load(argv[i]) < 0) status = 1;
+    }
+    return status;
+}
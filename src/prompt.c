@@ -0,0 +1,273 @@
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lab.h"
+
+// The prompt template is split once into segments. Text and anything that
+// can't change while the shell runs (user, host, $) is resolved right away,
+// the rest keeps the input it was last rendered from and is only redone
+// when that input changes. The cheapest input that tells us so is picked
+// for each one, a counter bumped by cd for the directory, a vDSO clock for
+// the time and plain shell fields for everything else.
+enum seg_kind {
+    SEG_TEXT,
+    SEG_CWD,         // \w
+    SEG_CWD_BASE,    // \W
+    SEG_TIME,        // \t
+    SEG_TIME_HM,     // \A
+    SEG_STATUS,      // \?
+    SEG_JOBS,        // \j
+    SEG_ELAPSED,     // \E
+    SEG_VCS,         // \g
+};
+
+struct prompt_seg {
+    enum seg_kind kind;
+    char *text;
+    size_t len;
+    long long key;       // The input text was rendered from
+    bool valid;
+};
+
+struct prompt_cache {
+    struct prompt_seg *segs;
+    size_t nsegs;
+    char *out;           // The rendered prompt
+    size_t out_cap;
+    bool dirty;          // A segment changed since out was built
+};
+
+static int seg_set(struct prompt_seg *seg, const char *s, size_t len) {
+    char *text = realloc(seg->text, len + 1);
+    if (!text) return -1;
+    memcpy(text, s, len);
+    text[len] = '\0';
+    seg->text = text;
+    seg->len = len;
+    return 0;
+}
+
+// Add text to the template, merging it into the segment before if that is
+// text too
+static int seg_text(struct prompt_cache *pc, const char *s, size_t len) {
+    struct prompt_seg *last = pc->nsegs ? &pc->segs[pc->nsegs - 1] : NULL;
+    if (last && last->kind == SEG_TEXT) {
+        char *text = realloc(last->text, last->len + len + 1);
+        if (!text) return -1;
+        memcpy(text + last->len, s, len);
+        last->len += len;
+        text[last->len] = '\0';
+        last->text = text;
+        return 0;
+    }
+    struct prompt_seg *seg = &pc->segs[pc->nsegs++];
+    seg->kind = SEG_TEXT;
+    seg->valid = true;
+    return seg_set(seg, s, len);
+}
+
+static void seg_dynamic(struct prompt_cache *pc, enum seg_kind kind) {
+    struct prompt_seg *seg = &pc->segs[pc->nsegs++];
+    seg->kind = kind;
+}
+
+struct prompt_cache *prompt_compile(const char *template) {
+    struct prompt_cache *pc = calloc(1, sizeof(struct prompt_cache));
+    if (!pc) return NULL;
+
+    // Every character makes at most one segment
+    pc->segs = calloc(strlen(template) + 1, sizeof(struct prompt_seg));
+    if (!pc->segs) {
+        free(pc);
+        return NULL;
+    }
+
+    char host[HOST_NAME_MAX + 1] = "";
+    const char *user = NULL;
+    int rval = 0;
+
+    for (const char *s = template; *s && rval == 0; s++) {
+        if (*s != '\\' || !s[1]) {
+            rval = seg_text(pc, s, 1);
+            continue;
+        }
+        s++;
+        switch (*s) {
+            case 'w': seg_dynamic(pc, SEG_CWD); break;
+            case 'W': seg_dynamic(pc, SEG_CWD_BASE); break;
+            case 't': seg_dynamic(pc, SEG_TIME); break;
+            case 'A': seg_dynamic(pc, SEG_TIME_HM); break;
+            case '?': seg_dynamic(pc, SEG_STATUS); break;
+            case 'j': seg_dynamic(pc, SEG_JOBS); break;
+            case 'E': seg_dynamic(pc, SEG_ELAPSED); break;
+            case 'g': seg_dynamic(pc, SEG_VCS); break;
+            case 'u':
+                if (!user) {
+                    struct passwd *pw = getpwuid(getuid());
+                    user = pw ? pw->pw_name : getenv("USER");
+                    if (!user) user = "";
+                }
+                rval = seg_text(pc, user, strlen(user));
+                break;
+            case 'h':
+            case 'H':
+                if (!*host) gethostname(host, sizeof(host) - 1);
+                rval = seg_text(pc, host, *s == 'h' ? strcspn(host, ".") : strlen(host));
+                break;
+            case '$': rval = seg_text(pc, geteuid() == 0 ? "#" : "$", 1); break;
+            case 'n': rval = seg_text(pc, "\n", 1); break;
+            case 'e': rval = seg_text(pc, "\033", 1); break;
+            // Readline's markers for characters that take no space
+            case '[': rval = seg_text(pc, "\001", 1); break;
+            case ']': rval = seg_text(pc, "\002", 1); break;
+            case '\\': rval = seg_text(pc, "\\", 1); break;
+            default: rval = seg_text(pc, s - 1, 2); break;
+        }
+    }
+    if (rval < 0) {
+        prompt_free(pc);
+        return NULL;
+    }
+    pc->dirty = true;
+    return pc;
+}
+
+bool prompt_uses_vcs(const struct prompt_cache *pc) {
+    for (size_t i = 0; pc && i < pc->nsegs; i++) {
+        if (pc->segs[i].kind == SEG_VCS) return true;
+    }
+    return false;
+}
+
+void prompt_free(struct prompt_cache *pc) {
+    if (!pc) return;
+    for (size_t i = 0; i < pc->nsegs; i++) {
+        free(pc->segs[i].text);
+    }
+    free(pc->segs);
+    free(pc->out);
+    free(pc);
+}
+
+static void render_cwd(struct prompt_seg *seg, const struct shell *sh, bool base) {
+    // The shell keeps track of where it is, getcwd is only for a shell
+    // that has not been asked yet
+    char buf[PATH_MAX];
+    const char *cwd = sh->cwd ? sh->cwd : getcwd(buf, sizeof(buf));
+    if (!cwd) {
+        seg_set(seg, "?", 1);
+        return;
+    }
+
+    const char *home = sh->home ? sh->home : getenv("HOME");
+    size_t hlen = home ? strlen(home) : 0;
+    bool in_home = hlen > 1 && strncmp(cwd, home, hlen) == 0 &&
+                   (cwd[hlen] == '/' || cwd[hlen] == '\0');
+    if (base) {
+        const char *slash = strrchr(cwd, '/');
+        const char *name = in_home && cwd[hlen] == '\0' ? "~" :
+                           slash && slash[1] ? slash + 1 : cwd;
+        seg_set(seg, name, strlen(name));
+    } else if (in_home) {
+        char tilde[PATH_MAX];
+        int n = snprintf(tilde, sizeof(tilde), "~%s", cwd + hlen);
+        seg_set(seg, tilde, (size_t)n);
+    } else {
+        seg_set(seg, cwd, strlen(cwd));
+    }
+}
+
+static void render_elapsed(struct prompt_seg *seg, long long ns) {
+    char buf[32];
+    int n;
+    if (ns < 1000000000LL) {
+        n = snprintf(buf, sizeof(buf), "%lldms", ns / 1000000);
+    } else if (ns < 60000000000LL) {
+        n = snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+    } else {
+        long long secs = ns / 1000000000LL;
+        n = snprintf(buf, sizeof(buf), "%lldm%02llds", secs / 60, secs % 60);
+    }
+    seg_set(seg, buf, (size_t)n);
+}
+
+const char *prompt_render(struct prompt_cache *pc, const struct shell *sh) {
+    struct timespec now = {0, 0};
+    bool have_now = false;
+
+    if (!pc) return sh->prompt;
+
+    for (size_t i = 0; i < pc->nsegs; i++) {
+        struct prompt_seg *seg = &pc->segs[i];
+        long long key;
+        switch (seg->kind) {
+            case SEG_CWD:
+            case SEG_CWD_BASE: key = sh->cwd_gen; break;
+            case SEG_TIME:
+            case SEG_TIME_HM:
+                // The coarse clock is read from the vDSO without a syscall
+                if (!have_now) clock_gettime(CLOCK_REALTIME_COARSE, &now);
+                have_now = true;
+                key = seg->kind == SEG_TIME ? now.tv_sec : now.tv_sec / 60;
+                break;
+            case SEG_STATUS: key = sh->last_status; break;
+            case SEG_JOBS: key = sh->job_count; break;
+            case SEG_ELAPSED: key = sh->last_elapsed_ns; break;
+            // Whatever the worker last published, it never makes us wait
+            case SEG_VCS: key = vcs_gen(sh->vcs); break;
+            default: continue;
+        }
+        if (seg->valid && seg->key == key) continue;
+
+        char buf[32];
+        struct tm tm;
+        switch (seg->kind) {
+            case SEG_CWD: render_cwd(seg, sh, false); break;
+            case SEG_CWD_BASE: render_cwd(seg, sh, true); break;
+            case SEG_TIME:
+            case SEG_TIME_HM:
+                localtime_r(&now.tv_sec, &tm);
+                strftime(buf, sizeof(buf), seg->kind == SEG_TIME ? "%H:%M:%S" : "%H:%M", &tm);
+                seg_set(seg, buf, strlen(buf));
+                break;
+            case SEG_STATUS:
+            case SEG_JOBS:
+                snprintf(buf, sizeof(buf), "%lld", key);
+                seg_set(seg, buf, strlen(buf));
+                break;
+            case SEG_ELAPSED: render_elapsed(seg, key); break;
+            case SEG_VCS: {
+                char status[VCS_MAX];
+                key = vcs_get(sh->vcs, status, sizeof(status));
+                seg_set(seg, status, strlen(status));
+                break;
+            }
+            default: break;
+        }
+        seg->key = key;
+        seg->valid = true;
+        pc->dirty = true;
+    }
+    if (!pc->dirty) return pc->out;
+
+    size_t len = 0;
+    for (size_t i = 0; i < pc->nsegs; i++) len += pc->segs[i].len;
+    if (len + 1 > pc->out_cap) {
+        char *out = realloc(pc->out, len + 1);
+        if (!out) return pc->out ? pc->out : "";
+        pc->out = out;
+        pc->out_cap = len + 1;
+    }
+    char *p = pc->out;
+    for (size_t i = 0; i < pc->nsegs; i++) {
+        if (pc->segs[i].text) memcpy(p, pc->segs[i].text, pc->segs[i].len);
+        p += pc->segs[i].len;
+    }
+    *p = '\0';
+    pc->dirty = false;
+    return pc->out;
+}
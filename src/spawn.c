@@ -0,0 +1,76 @@
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "lab.h"
+
+extern char **environ;
+
+// waitid(2) id type for pidfds, not yet exported by every libc
+#define LAB_P_PIDFD 3
+
+pid_t spawn_process(char **argv, int *pidfd) {
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    pid_t pid;
+
+    if (pidfd) *pidfd = -1;
+
+    // The shell ignores the job control signals, and ignored signals are
+    // inherited across exec, so put them back to default in the child
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGPIPE);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    int rval = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (rval != 0) {
+        errno = rval;
+        return -1;
+    }
+
+#ifdef SYS_pidfd_open
+    if (pidfd) {
+        // Older kernels return ENOSYS, callers fall back to waitpid
+        *pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    }
+#endif
+    return pid;
+}
+
+int reap_process(pid_t pid, int pidfd) {
+    int status;
+
+    if (pidfd >= 0) {
+        siginfo_t info;
+        int rval;
+        while ((rval = waitid((idtype_t)LAB_P_PIDFD, pidfd, &info, WEXITED)) < 0 &&
+               errno == EINTR)
+            ;
+        close(pidfd);
+        if (rval == 0) {
+            if (info.si_code == CLD_EXITED) return info.si_status;
+            return 128 + info.si_status;
+        }
+        // Kernels with pidfd_open but without P_PIDFD land here
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return -1;
+}
@@ -0,0 +1,268 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "lab.h"
+
+// Counters and latency histograms for the stats builtin.
+//
+// The histograms are log bucketed the way HdrHistogram does it, values
+// below 2^STAT_SUB_BITS get a bucket each and above that every power of
+// two is split into 2^(STAT_SUB_BITS-1) equal buckets. Recording is a
+// count leading zeros and a shift, and the whole 64 bit range fits in a
+// few hundred buckets so nothing has to be configured per histogram.
+//
+// Everything is recorded from the main loop except the allocation count,
+// which any thread can bump, and the exit time, which the SIGCHLD handler
+// writes.
+
+struct stat_hist_data {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[STAT_BUCKETS];
+};
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "commands", "builtins", "external", "background", "fork_failed", "reaped",
+    "perf_jobs", "cycles", "instructions", "cache_misses", "context_switches",
+};
+
+static const char *hist_names[STAT_HISTS] = {
+    "fork", "run", "reap_lag", "parse", "allocs",
+};
+
+static uint64_t counters[STAT_COUNTERS];
+static struct stat_hist_data hists[STAT_HISTS];
+static _Atomic uint64_t allocs;
+static _Atomic uint64_t alloc_bytes;
+static _Atomic uint64_t last_exit;
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t stat_bucket(uint64_t v) {
+    if (v < (1u << STAT_SUB_BITS)) return (size_t)v;
+    unsigned e = 63 - (unsigned)__builtin_clzll(v);
+    unsigned shift = e - STAT_SUB_BITS + 1;
+    return ((size_t)shift << (STAT_SUB_BITS - 1)) + (size_t)(v >> shift);
+}
+
+// The smallest value that lands in bucket i
+static uint64_t stat_bucket_low(size_t i) {
+    const size_t half = 1u << (STAT_SUB_BITS - 1);
+    if (i < 2 * half) return i;
+    size_t shift = i / half - 1;
+    return (uint64_t)(i - shift * half) << shift;
+}
+
+static uint64_t stat_bucket_high(size_t i) {
+    return i + 1 < STAT_BUCKETS ? stat_bucket_low(i + 1) - 1 : UINT64_MAX;
+}
+
+void stats_add(enum stat_counter c, uint64_t n) {
+    counters[c] += n;
+}
+
+uint64_t stats_counter(enum stat_counter c) {
+    return counters[c];
+}
+
+void stats_record(enum stat_hist h, uint64_t value) {
+    struct stat_hist_data *d = &hists[h];
+    if (!d->count || value < d->min) d->min = value;
+    if (value > d->max) d->max = value;
+    d->count++;
+    d->sum += value;
+    d->buckets[stat_bucket(value)]++;
+}
+
+uint64_t stats_count(enum stat_hist h) {
+    return hists[h].count;
+}
+
+uint64_t stats_percentile(enum stat_hist h, double p) {
+    const struct stat_hist_data *d = &hists[h];
+    if (!d->count) return 0;
+    if (p <= 0) return d->min;
+    uint64_t want = (uint64_t)(p / 100.0 * (double)d->count + 0.5);
+    if (want < 1) want = 1;
+    if (want > d->count) want = d->count;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STAT_BUCKETS; i++) {
+        seen += d->buckets[i];
+        if (seen >= want) {
+            uint64_t v = stat_bucket_high(i);
+            if (v > d->max) v = d->max;
+            return v < d->min ? d->min : v;
+        }
+    }
+    return d->max;
+}
+
+uint64_t stats_allocs(void) {
+    return atomic_load_explicit(&allocs, memory_order_relaxed);
+}
+
+uint64_t stats_alloc_bytes(void) {
+    return atomic_load_explicit(&alloc_bytes, memory_order_relaxed);
+}
+
+static void stat_alloc(size_t size) {
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+}
+
+void stats_child_exited(void) {
+    atomic_store_explicit(&last_exit, stats_now(), memory_order_relaxed);
+}
+
+uint64_t stats_last_exit(void) {
+    return atomic_load_explicit(&last_exit, memory_order_relaxed);
+}
+
+void stats_reset(void) {
+    memset(counters, 0, sizeof(counters));
+    memset(hists, 0, sizeof(hists));
+    atomic_store_explicit(&allocs, 0, memory_order_relaxed);
+    atomic_store_explicit(&alloc_bytes, 0, memory_order_relaxed);
+}
+
+// The linker sends the shell's calls here with --wrap, see the Makefile
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size) {
+    stat_alloc(size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    stat_alloc(n * size);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    stat_alloc(size);
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+    stat_alloc(strlen(s) + 1);
+    return __real_strdup(s);
+}
+
+// Nanoseconds in the unit that keeps three or so significant digits
+static void stat_time(char *buf, size_t len, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(buf, len, "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, len, "%.2fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, len, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buf, len, "%.2fs", ns / 1e9);
+    }
+}
+
+static const double percentiles[] = {50, 90, 99, 99.9};
+
+static void stats_text(struct outbuf *ob) {
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        ob_printf(ob, "%-16s %llu\n", counter_names[c], (unsigned long long)counters[c]);
+    }
+    ob_printf(ob, "%-16s %llu\n", "allocations", (unsigned long long)stats_allocs());
+    ob_printf(ob, "%-16s %llu\n", "allocated_bytes", (unsigned long long)stats_alloc_bytes());
+    ob_printf(ob, "\n%-9s %8s %9s %9s %9s %9s %9s %9s %9s\n", "", "count", "min", "mean",
+              "p50", "p90", "p99", "p99.9", "max");
+    for (int h = 0; h < STAT_HISTS; h++) {
+        const struct stat_hist_data *d = &hists[h];
+        uint64_t values[7];
+        values[0] = d->min;
+        values[1] = d->count ? d->sum / d->count : 0;
+        for (size_t i = 0; i < 4; i++) values[2 + i] = stats_percentile(h, percentiles[i]);
+        values[6] = d->max;
+        ob_printf(ob, "%-9s %8llu", hist_names[h], (unsigned long long)d->count);
+        for (size_t i = 0; i < 7; i++) {
+            char buf[32];
+            if (h == STAT_ALLOCS) {
+                snprintf(buf, sizeof(buf), "%llu", (unsigned long long)values[i]);
+            } else {
+                stat_time(buf, sizeof(buf), values[i]);
+            }
+            ob_printf(ob, " %9s", buf);
+        }
+        ob_write(ob, "\n", 1);
+    }
+}
+
+// Buckets are given as [low, high, count] so hosts with different builds
+// can still be compared
+static void stats_json(struct outbuf *ob) {
+    ob_puts(ob, "{\"counters\":{");
+    for (int c = 0; c < STAT_COUNTERS; c++) {
+        ob_printf(ob, "\"%s\":%llu,", counter_names[c], (unsigned long long)counters[c]);
+    }
+    ob_printf(ob, "\"allocations\":%llu,\"allocated_bytes\":%llu},\"histograms\":{",
+              (unsigned long long)stats_allocs(), (unsigned long long)stats_alloc_bytes());
+    for (int h = 0; h < STAT_HISTS; h++) {
+        const struct stat_hist_data *d = &hists[h];
+        ob_printf(ob, "%s\"%s\":{\"unit\":\"%s\",\"count\":%llu,\"min\":%llu,\"max\":%llu,"
+                  "\"sum\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"buckets\":[",
+                  h ? "," : "", hist_names[h], h == STAT_ALLOCS ? "count" : "ns",
+                  (unsigned long long)d->count, (unsigned long long)d->min,
+                  (unsigned long long)d->max, (unsigned long long)d->sum,
+                  (unsigned long long)stats_percentile(h, 50),
+                  (unsigned long long)stats_percentile(h, 90),
+                  (unsigned long long)stats_percentile(h, 99),
+                  (unsigned long long)stats_percentile(h, 99.9));
+        bool first = true;
+        for (size_t i = 0; i < STAT_BUCKETS; i++) {
+            if (!d->buckets[i]) continue;
+            ob_printf(ob, "%s[%llu,%llu,%llu]", first ? "" : ",",
+                      (unsigned long long)stat_bucket_low(i),
+                      (unsigned long long)stat_bucket_high(i),
+                      (unsigned long long)d->buckets[i]);
+            first = false;
+        }
+        ob_puts(ob, "]}");
+    }
+    ob_puts(ob, "}}\n");
+}
+
+int builtin_stats(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    bool json = false, reset = false;
+    for (size_t i = 1; argv[i]; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "--reset") == 0) {
+            reset = true;
+        } else {
+            fprintf(stderr, "Usage: stats [--json] [--reset]\n");
+            return 2;
+        }
+    }
+    if (reset && !json) {
+        stats_reset();
+        return 0;
+    }
+
+    struct outbuf ob;
+    ob_init(&ob, STDOUT_FILENO);
+    if (json) {
+        stats_json(&ob);
+    } else {
+        stats_text(&ob);
+    }
+    int rval = ob_flush(&ob) < 0 ? 1 : 0;
+    // With both, what was printed is what got cleared
+    if (reset) stats_reset();
+    return rval;
+}
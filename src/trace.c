@@ -0,0 +1,173 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "lab.h"
+
+// Event tracing in the Chrome trace format, which Perfetto and
+// chrome://tracing both load.
+//
+// A trace point marks the end of a span that started at the previous
+// mark on the same thread, so the code being traced has one TRACE per
+// span and pays a single branch on trace_enabled when tracing is off.
+//
+// Events go into a ring in shared memory that is claimed with one atomic
+// add, and each slot is published with a sequence number the flush checks
+// before reading it. Being shared, the ring also gets the marks of forked
+// children before they exec, whose previous mark is the parent's last one
+// before the fork. The flush runs in the shell between commands and
+// appends to the file, a slot still being written is left for the next
+// flush.
+
+struct trace_event {
+    _Atomic uint64_t seq;    // Index + 1 once the event is written
+    const char *name;
+    uint64_t start;          // ns on the monotonic clock
+    uint64_t dur;
+    int32_t pid;
+    int32_t tid;
+};
+
+struct trace_ring {
+    _Atomic uint64_t next;
+    struct trace_event events[TRACE_EVENTS];
+};
+
+bool trace_enabled;
+
+static struct trace_ring *ring;
+static int trace_fd = -1;
+static uint64_t flushed;
+static uint64_t dropped;
+
+// The last mark on this thread and who we are. A forked child keeps the
+// mark but has to look itself up again.
+static __thread uint64_t trace_last;
+static __thread int32_t trace_pid;
+static __thread int32_t trace_tid;
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void trace_forked(void) {
+    trace_pid = trace_tid = 0;
+}
+
+int trace_start(const char *path) {
+    static bool atfork;
+    if (trace_enabled) return 0;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    void *mem = mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (!atfork) {
+        pthread_atfork(NULL, NULL, trace_forked);
+        atfork = true;
+    }
+    ring = mem;
+    trace_fd = fd;
+    flushed = dropped = 0;
+    trace_last = trace_now();
+    if (write(fd, "[\n", 2) != 2) {
+        munmap(mem, sizeof(struct trace_ring));
+        close(fd);
+        ring = NULL;
+        trace_fd = -1;
+        return -1;
+    }
+    trace_enabled = true;
+    return 0;
+}
+
+void trace_record(const char *name) {
+    if (!ring) return;
+    uint64_t now = trace_now();
+    uint64_t start = trace_last ? trace_last : now;
+    trace_last = now;
+    if (!trace_pid) {
+        trace_pid = getpid();
+        trace_tid = (int32_t)syscall(SYS_gettid);
+    }
+
+    uint64_t idx = atomic_fetch_add_explicit(&ring->next, 1, memory_order_relaxed);
+    struct trace_event *e = &ring->events[idx % TRACE_EVENTS];
+    atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+    e->name = name;
+    e->start = start;
+    e->dur = now - start;
+    e->pid = trace_pid;
+    e->tid = trace_tid;
+    atomic_store_explicit(&e->seq, idx + 1, memory_order_release);
+}
+
+void trace_flush(void) {
+    if (!ring || trace_fd < 0) return;
+    struct outbuf ob;
+    ob_init(&ob, trace_fd);
+    uint64_t end = atomic_load_explicit(&ring->next, memory_order_acquire);
+    uint64_t i = flushed;
+    for (; i < end; i++) {
+        struct trace_event *e = &ring->events[i % TRACE_EVENTS];
+        uint64_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (seq != i + 1) {
+            // Overwritten before we got here, or still being written. A
+            // writer that never finishes is given up on eventually.
+            if (seq > i + 1 || end - i > TRACE_EVENTS / 2) {
+                dropped++;
+                continue;
+            }
+            break;
+        }
+        // Copy it out and check it was not reused for a newer event meanwhile
+        struct trace_event copy;
+        copy.name = e->name;
+        copy.start = e->start;
+        copy.dur = e->dur;
+        copy.pid = e->pid;
+        copy.tid = e->tid;
+        if (atomic_load_explicit(&e->seq, memory_order_acquire) != seq) {
+            dropped++;
+            continue;
+        }
+        ob_printf(&ob, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+                  "\"pid\":%d,\"tid\":%d},\n", copy.name,
+                  (unsigned long long)(copy.start / 1000), (unsigned long long)(copy.start % 1000),
+                  (unsigned long long)(copy.dur / 1000), (unsigned long long)(copy.dur % 1000),
+                  copy.pid, copy.tid);
+    }
+    flushed = i;
+    ob_flush(&ob);
+}
+
+size_t trace_dropped(void) {
+    return dropped;
+}
+
+void trace_stop(void) {
+    if (!trace_enabled) return;
+    trace_flush();
+    trace_enabled = false;
+    struct outbuf ob;
+    ob_init(&ob, trace_fd);
+    ob_printf(&ob, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+              "\"args\":{\"name\":\"lab shell\",\"dropped\":%llu}}\n]\n",
+              (int)getpid(), (unsigned long long)dropped);
+    ob_flush(&ob);
+    close(trace_fd);
+    trace_fd = -1;
+    munmap(ring, sizeof(struct trace_ring));
+    ring = NULL;
+}
@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lab.h"
+
+static uint32_t tri_key(const char *s) {
+    return (((uint32_t)(unsigned char)s[0] << 16) |
+            ((uint32_t)(unsigned char)s[1] << 8) |
+            (uint32_t)(unsigned char)s[2]) + 1;
+}
+
+static struct tri_list *tri_slot(struct tri_list *tab, size_t cap, uint32_t key) {
+    // Multiplicative hash, trigram keys are far from uniform
+    size_t mask = cap - 1;
+    for (size_t i = (key * 2654435761u) & mask;; i = (i + 1) & mask) {
+        if (tab[i].key == key || tab[i].key == 0) return &tab[i];
+    }
+}
+
+static int tri_grow(struct tri_index *t) {
+    size_t cap = t->cap ? t->cap * 2 : 4096;
+    struct tri_list *tab = calloc(cap, sizeof(struct tri_list));
+    if (!tab) return -1;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->tab[i].key) *tri_slot(tab, cap, t->tab[i].key) = t->tab[i];
+    }
+    free(t->tab);
+    t->tab = tab;
+    t->cap = cap;
+    return 0;
+}
+
+static int tri_add(struct tri_index *t, uint32_t key, uint32_t id) {
+    if ((t->used + 1) * 2 > t->cap && tri_grow(t) < 0) return -1;
+    struct tri_list *list = tri_slot(t->tab, t->cap, key);
+    if (list->key == 0) {
+        list->key = key;
+        t->used++;
+    }
+    // A string with the same trigram twice is only listed once
+    if (list->len && list->ids[list->len - 1] == id) return 0;
+    if (list->len == list->cap) {
+        uint32_t cap = list->cap ? list->cap * 2 : 4;
+        uint32_t *ids = realloc(list->ids, cap * sizeof(uint32_t));
+        if (!ids) return -1;
+        list->ids = ids;
+        list->cap = cap;
+    }
+    list->ids[list->len++] = id;
+    return 0;
+}
+
+int tri_index_add(struct tri_index *t, const char *s, size_t len, uint32_t id) {
+    for (size_t i = 0; i + 3 <= len; i++) {
+        if (tri_add(t, tri_key(s + i), id) < 0) return -1;
+    }
+    return 0;
+}
+
+int tri_index_plan(const struct tri_index *t, const char *pattern, size_t len,
+                   const struct tri_list **lists, size_t *n, size_t max) {
+    for (size_t i = 0; i + 3 <= len && *n < max; i++) {
+        if (!t->tab) return -1;
+        const struct tri_list *list = tri_slot(t->tab, t->cap, tri_key(pattern + i));
+        if (!list->key) return -1;
+        bool dup = false;
+        for (size_t j = 0; j < *n; j++) {
+            if (lists[j] == list) dup = true;
+        }
+        if (dup) continue;
+        if (*n && list->len < lists[0]->len) {
+            lists[(*n)++] = lists[0];
+            lists[0] = list;
+        } else {
+            lists[(*n)++] = list;
+        }
+    }
+    return 0;
+}
+
+size_t tri_list_lower(const struct tri_list *list, uint32_t id) {
+    size_t lo = 0, hi = list->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list->ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool tri_list_has(const struct tri_list *list, uint32_t id) {
+    size_t i = tri_list_lower(list, id);
+    return i < list->len && list->ids[i] == id;
+}
+
+size_t tri_index_bytes(const struct tri_index *t) {
+    size_t bytes = t->cap * sizeof(struct tri_list);
+    for (size_t i = 0; i < t->cap; i++) {
+        bytes += t->tab[i].cap * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+void tri_index_free(struct tri_index *t) {
+    for (size_t i = 0; i < t->cap; i++) {
+        free(t->tab[i].ids);
+    }
+    free(t->tab);
+    t->tab = NULL;
+    t->cap = t->used = 0;
+}
@@ -0,0 +1,413 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lab.h"
+
+// Shell variables. Each one is kept as NAME=value in an arena, which is
+// the form the environment wants, so the envp array for exported
+// variables is just pointers into the arena. It is built when it is
+// first asked for after an exported variable changed and handed out
+// unchanged every other time.
+//
+// The table is open addressing keyed by FNV-1a like the builtin table,
+// with the hash kept in each slot. A variable that is replaced leaves its
+// old text behind in the arena, which is compacted once more of it is
+// dead than alive.
+//
+// The shell points environ at the envp array once per command, see
+// sh_syncenv, and only the main thread reads environ. An arena replaced by
+// compaction is kept until envp is next built, since the array still
+// points into it, and the old array is freed as the new one is handed out.
+
+#define VARS_BLOCK 4096
+
+struct vars_block {
+    struct vars_block *next;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
+struct var {
+    uint32_t hash;
+    bool exported;
+    size_t name_len;
+    char *entry;         // NAME=value in the arena, just NAME when unset
+};
+
+struct vars {
+    struct var *slots;
+    size_t cap;
+    size_t used;
+    struct vars_block *arena;
+    struct vars_block *retired;  // Arenas envp may still point into
+    size_t live;         // Arena bytes in use by a variable
+    size_t dead;         // Arena bytes left behind by a change
+    char **envp;
+    bool envp_stale;
+};
+
+static bool name_char(char c) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+bool vars_valid_name(const char *name, size_t len) {
+    if (len == 0 || (name[0] >= '0' && name[0] <= '9')) return false;
+    for (size_t i = 0; i < len; i++) {
+        if (!name_char(name[i])) return false;
+    }
+    return true;
+}
+
+static void blocks_free(struct vars_block *b) {
+    while (b) {
+        struct vars_block *next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+static char *arena_alloc(struct vars_block **arena, size_t len) {
+    struct vars_block *b = *arena;
+    if (!b || b->cap - b->used < len) {
+        size_t cap = len > VARS_BLOCK ? len : VARS_BLOCK;
+        b = malloc(sizeof(struct vars_block) + cap);
+        if (!b) return NULL;
+        b->next = *arena;
+        b->used = 0;
+        b->cap = cap;
+        *arena = b;
+    }
+    char *p = b->data + b->used;
+    b->used += len;
+    return p;
+}
+
+static bool var_used(const void *slot, uint32_t *hash) {
+    const struct var *var = slot;
+    *hash = var->hash;
+    return var->entry != NULL;
+}
+
+static struct var *var_slot(struct var *slots, size_t cap, const char *name, size_t len,
+                            uint32_t hash) {
+    size_t mask = cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct var *v = &slots[i];
+        if (!v->entry) return v;
+        if (v->hash == hash && v->name_len == len && memcmp(v->entry, name, len) == 0) return v;
+    }
+}
+
+static int vars_grow(struct vars *v) {
+    size_t cap = v->cap ? v->cap * 2 : 64;
+    struct var *slots = calloc(cap, sizeof(struct var));
+    if (!slots) return -1;
+    for (size_t i = 0; i < v->cap; i++) {
+        struct var *old = &v->slots[i];
+        if (old->entry) *var_slot(slots, cap, old->entry, old->name_len, old->hash) = *old;
+    }
+    free(v->slots);
+    v->slots = slots;
+    v->cap = cap;
+    return 0;
+}
+
+static size_t entry_size(const struct var *var) {
+    return strlen(var->entry) + 1;
+}
+
+// Copy every variable into a fresh arena. The old one is kept until envp
+// is built again, envp still points into it.
+static void vars_compact(struct vars *v) {
+    struct vars_block *arena = NULL;
+    for (size_t i = 0; i < v->cap; i++) {
+        struct var *var = &v->slots[i];
+        if (!var->entry) continue;
+        size_t len = entry_size(var);
+        char *copy = arena_alloc(&arena, len);
+        if (!copy) {
+            // Keep the old arena, the live pointers into it are fine
+            blocks_free(arena);
+            return;
+        }
+        memcpy(copy, var->entry, len);
+        var->entry = copy;
+    }
+    struct vars_block **tail = &v->arena;
+    while (*tail) tail = &(*tail)->next;
+    *tail = v->retired;
+    v->retired = v->arena;
+    v->arena = arena;
+    v->dead = 0;
+    v->envp_stale = true;
+}
+
+struct vars *vars_new(char **env) {
+    struct vars *v = calloc(1, sizeof(struct vars));
+    if (!v) return NULL;
+    v->envp_stale = true;
+    for (char **e = env; e && *e; e++) {
+        char *eq = strchr(*e, '=');
+        if (!eq || !vars_valid_name(*e, eq - *e)) continue;
+        char name[256];
+        size_t len = eq - *e;
+        if (len >= sizeof(name)) continue;
+        memcpy(name, *e, len);
+        name[len] = '\0';
+        if (vars_set(v, name, eq + 1) < 0 || vars_export(v, name) < 0) {
+            vars_free(v);
+            return NULL;
+        }
+    }
+    return v;
+}
+
+void vars_free(struct vars *v) {
+    if (!v) return;
+    free(v->slots);
+    blocks_free(v->arena);
+    blocks_free(v->retired);
+    free(v->envp);
+    free(v);
+}
+
+static struct var *vars_find(const struct vars *v, const char *name) {
+    if (!v || !v->cap) return NULL;
+    size_t len = strlen(name);
+    struct var *var = var_slot(v->slots, v->cap, name, len, fnv1a(name, len));
+    return var->entry ? var : NULL;
+}
+
+const char *vars_get(const struct vars *v, const char *name) {
+    struct var *var = vars_find(v, name);
+    if (!var || var->entry[var->name_len] != '=') return NULL;
+    return var->entry + var->name_len + 1;
+}
+
+// Point var at NAME=value, or NAME alone when value is NULL
+static int var_store(struct vars *v, struct var *var, const char *name, size_t len,
+                     const char *value) {
+    size_t vlen = value ? strlen(value) + 1 : 0;
+    char *entry = arena_alloc(&v->arena, len + vlen + 1);
+    if (!entry) return -1;
+    memcpy(entry, name, len);
+    if (value) {
+        entry[len] = '=';
+        memcpy(entry + len + 1, value, vlen);
+    } else {
+        entry[len] = '\0';
+    }
+    if (var->entry) {
+        size_t old = entry_size(var);
+        v->live -= old;
+        v->dead += old;
+    }
+    v->live += len + vlen + 1;
+    var->entry = entry;
+    if (var->exported) v->envp_stale = true;
+    if (v->dead > v->live && v->dead > VARS_BLOCK) vars_compact(v);
+    return 0;
+}
+
+static struct var *vars_add(struct vars *v, const char *name) {
+    size_t len = strlen(name);
+    if (!vars_valid_name(name, len)) return NULL;
+    if ((v->used + 1) * 2 > v->cap && vars_grow(v) < 0) return NULL;
+    uint32_t hash = fnv1a(name, len);
+    struct var *var = var_slot(v->slots, v->cap, name, len, hash);
+    if (!var->entry) {
+        var->hash = hash;
+        var->name_len = len;
+        var->exported = false;
+    }
+    return var;
+}
+
+int vars_set(struct vars *v, const char *name, const char *value) {
+    struct var *var = vars_add(v, name);
+    if (!var) return -1;
+    bool fresh = !var->entry;
+    if (var_store(v, var, name, var->name_len, value) < 0) return -1;
+    if (fresh) v->used++;
+    return 0;
+}
+
+int vars_export(struct vars *v, const char *name) {
+    struct var *var = vars_add(v, name);
+    if (!var) return -1;
+    if (!var->entry) {
+        // Exported before it has a value, it shows up in envp once set
+        if (var_store(v, var, name, var->name_len, NULL) < 0) return -1;
+        v->used++;
+    }
+    if (!var->exported) {
+        var->exported = true;
+        v->envp_stale = true;
+    }
+    return 0;
+}
+
+int vars_unset(struct vars *v, const char *name) {
+    struct var *var = vars_find(v, name);
+    if (!var) return -1;
+    size_t size = entry_size(var);
+    v->live -= size;
+    v->dead += size;
+    if (var->exported) v->envp_stale = true;
+    v->used--;
+    hashtab_delete(v->slots, sizeof(struct var), v->cap, (size_t)(var - v->slots), var_used);
+    return 0;
+}
+
+char **vars_envp(struct vars *v) {
+    if (!v->envp_stale) return v->envp;
+    size_t n = 0;
+    for (size_t i = 0; i < v->cap; i++) {
+        struct var *var = &v->slots[i];
+        if (var->entry && var->exported && var->entry[var->name_len] == '=') n++;
+    }
+    char **envp = malloc((n + 1) * sizeof(char *));
+    if (!envp) return v->envp;
+    n = 0;
+    for (size_t i = 0; i < v->cap; i++) {
+        struct var *var = &v->slots[i];
+        if (var->entry && var->exported && var->entry[var->name_len] == '=') envp[n++] = var->entry;
+    }
+    envp[n] = NULL;
+    free(v->envp);
+    v->envp = envp;
+    v->envp_stale = false;
+
+    // Nothing points into the compacted away arenas any more
+    blocks_free(v->retired);
+    v->retired = NULL;
+    return envp;
+}
+
+// Append s to the growing word
+static int word_add(char **buf, size_t *len, size_t *cap, const char *s, size_t n) {
+    if (*len + n + 1 > *cap) {
+        size_t ncap = *cap ? *cap * 2 : 64;
+        while (*len + n + 1 > ncap) ncap *= 2;
+        char *tmp = realloc(*buf, ncap);
+        if (!tmp) return -1;
+        *buf = tmp;
+        *cap = ncap;
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+char *vars_expand(struct shell *sh, const char *word) {
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    char num[24];
+    const char *p = word;
+    if (word_add(&buf, &len, &cap, "", 0) < 0) return NULL;
+    while (*p) {
+        // Copy up to the next $ that is not escaped. A backslash escapes
+        // the character after it, backslashes included, and the ones in
+        // front of other characters are left for glob_argv to remove.
+        const char *start = p;
+        while (*p && *p != '$' && !(*p == '\\' && p[1] == '$')) {
+            if (*p == '\\' && p[1]) p++;
+            p++;
+        }
+        if (word_add(&buf, &len, &cap, start, p - start) < 0) goto fail;
+        if (!*p) break;
+
+        // An escaped $ is a plain $ and the backslash goes
+        if (*p == '\\') {
+            if (word_add(&buf, &len, &cap, "$", 1) < 0) goto fail;
+            p += 2;
+            continue;
+        }
+
+        const char *value = NULL;
+        const char *name = p + 1;
+        size_t name_len = 0;
+        const char *next = name;
+        if (*name == '?' || *name == '$' || *name == '!') {
+            if (*name == '?') {
+                snprintf(num, sizeof(num), "%d", sh->last_status);
+            } else if (*name == '$') {
+                snprintf(num, sizeof(num), "%ld", (long)getpid());
+            } else if (sh->last_bg > 0) {
+                snprintf(num, sizeof(num), "%ld", (long)sh->last_bg);
+            } else {
+                num[0] = '\0';
+            }
+            value = num;
+            next = name + 1;
+        } else if (*name == '{') {
+            const char *close = strchr(name, '}');
+            if (close && vars_valid_name(name + 1, close - name - 1)) {
+                name++;
+                name_len = close - name;
+                next = close + 1;
+            }
+        } else {
+            if (!(*name >= '0' && *name <= '9')) {
+                while (name_char(name[name_len])) name_len++;
+            }
+            next = name + name_len;
+        }
+
+        if (name_len > 0) {
+            char key[256];
+            if (name_len < sizeof(key)) {
+                memcpy(key, name, name_len);
+                key[name_len] = '\0';
+                value = sh_getvar(sh, key);
+            }
+            if (!value) value = "";
+        }
+        if (!value) {
+            // Not something that expands, the $ is just a character
+            if (word_add(&buf, &len, &cap, "$", 1) < 0) goto fail;
+            p++;
+            continue;
+        }
+        if (word_add(&buf, &len, &cap, value, strlen(value)) < 0) goto fail;
+        p = next;
+    }
+    return buf;
+
+fail:
+    free(buf);
+    return NULL;
+}
+
+char **vars_argv(struct shell *sh, char **argv) {
+    size_t argc = 0;
+    bool dollar = false;
+    for (; argv[argc]; argc++) {
+        if (strchr(argv[argc], '$')) dollar = true;
+    }
+    if (!dollar) return argv;
+
+    char **out = malloc((argc + 1) * sizeof(char *));
+    if (!out) return NULL;
+    size_t n = 0;
+    for (size_t i = 0; i < argc; i++) {
+        char *word = strchr(argv[i], '$') ? vars_expand(sh, argv[i]) : strdup(argv[i]);
+        if (!word) {
+            out[n] = NULL;
+            cmd_free(out);
+            return NULL;
+        }
+        // A word that expanded to nothing is gone, as without quotes in bash
+        if (!*word && *argv[i]) {
+            free(word);
+            continue;
+        }
+        out[n++] = word;
+    }
+    out[n] = NULL;
+    return out;
+}
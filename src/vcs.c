@@ -0,0 +1,335 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "lab.h"
+
+extern char **environ;
+
+// Git status for the prompt, worked out by a thread so the prompt never
+// waits on it. The branch comes straight from .git/HEAD and is published
+// as soon as it is known, the dirty flag needs git itself and follows
+// whenever it is done. Each time the value changes a byte is written to a
+// pipe, readline watches it and redraws the prompt.
+//
+// git is run with a copy of the environment the shell hands over with
+// vcs_setenv, never environ, which the main thread rebuilds between
+// commands. The worker takes a new copy over at the start of a refresh,
+// and the one it had is only freed then, by the worker.
+struct vcs {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool requested;      // A refresh was asked for since the last one started
+    bool stop;
+    int notify[2];       // Written by the worker when the status changed
+    char status[VCS_MAX]; // What the prompt shows, empty outside a repo
+    unsigned gen;        // Bumped whenever status changes
+    char **env_next;     // A newer environment for the worker, or NULL
+    char **env;          // The worker's own from here on
+    char *git;           // git found on the PATH in env, NULL if not there
+};
+
+// One allocation holding the array and the strings
+static char **env_copy(char *const *envp) {
+    size_t n = 0, len = 0;
+    for (; envp && envp[n]; n++) len += strlen(envp[n]) + 1;
+    char **copy = malloc((n + 1) * sizeof(char *) + len);
+    if (!copy) return NULL;
+    char *p = (char *)(copy + n + 1);
+    for (size_t i = 0; i < n; i++) {
+        size_t size = strlen(envp[i]) + 1;
+        memcpy(p, envp[i], size);
+        copy[i] = p;
+        p += size;
+    }
+    copy[n] = NULL;
+    return copy;
+}
+
+// Look git up on the PATH in env ourselves, posix_spawnp would read the
+// shell's environ for it
+static char *vcs_git(char **env) {
+    const char *path = "/bin:/usr/bin";
+    for (char **e = env; e && *e; e++) {
+        if (strncmp(*e, "PATH=", 5) == 0) path = *e + 5;
+    }
+    char file[PATH_MAX];
+    for (const char *p = path;; p++) {
+        const char *end = strchr(p, ':');
+        if (!end) end = p + strlen(p);
+        int len = end == p ? snprintf(file, sizeof(file), "git")
+                           : snprintf(file, sizeof(file), "%.*s/git", (int)(end - p), p);
+        if (len > 0 && (size_t)len < sizeof(file) && access(file, X_OK) == 0) return strdup(file);
+        if (!*end) return NULL;
+        p = end;
+    }
+}
+
+// Find the git directory for cwd. A .git file instead of a directory is
+// a worktree or submodule and holds the real location. A path too long
+// for gitdir is taken as no repository.
+static bool vcs_find(char *gitdir, size_t len) {
+    char dir[PATH_MAX];
+    struct stat st;
+
+    if (!getcwd(dir, sizeof(dir))) return false;
+    for (;;) {
+        bool root = strcmp(dir, "/") == 0;
+        if (snprintf(gitdir, len, "%s/.git", root ? "" : dir) >= (int)len) return false;
+        if (stat(gitdir, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) return true;
+            FILE *f = fopen(gitdir, "r");
+            char line[PATH_MAX + 16];
+            bool found = false;
+            if (f && fgets(line, sizeof(line), f) && strncmp(line, "gitdir: ", 8) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                int n;
+                if (line[8] == '/') {
+                    n = snprintf(gitdir, len, "%s", line + 8);
+                } else {
+                    n = snprintf(gitdir, len, "%s/%s", dir, line + 8);
+                }
+                found = n >= 0 && (size_t)n < len;
+            }
+            if (f) fclose(f);
+            return found;
+        }
+        if (root) return false;
+        char *slash = strrchr(dir, '/');
+        if (slash == dir) {
+            dir[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+}
+
+// The branch HEAD points at, or the start of the commit when detached
+static bool vcs_branch(const char *gitdir, char *branch, size_t len) {
+    char path[PATH_MAX + 8];
+    char head[256];
+
+    snprintf(path, sizeof(path), "%s/HEAD", gitdir);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t n = read(fd, head, sizeof(head) - 1);
+    close(fd);
+    if (n <= 0) return false;
+    head[n] = '\0';
+    head[strcspn(head, "\n")] = '\0';
+
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+        snprintf(branch, len, "%s", head + 16);
+    } else if (strncmp(head, "ref: ", 5) == 0) {
+        snprintf(branch, len, "%s", head + 5);
+    } else {
+        snprintf(branch, len, "%.7s", head);
+    }
+    return true;
+}
+
+// Ask git whether the work tree differs from HEAD. This is the slow part,
+// it has to look at every tracked file.
+static bool vcs_dirty(const char *git, char **env) {
+    char *argv[] = {"git", "--no-optional-locks", "diff", "--quiet", "HEAD", "--", NULL};
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    pid_t pid;
+    int status;
+
+    if (!git) return false;
+
+    // Not the signals the shell ignores, as in spawn_process, and a process
+    // group of its own so keys typed at the prompt never reach it
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    int rval = posix_spawn(&pid, git, &actions, &attr, argv, env);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (rval != 0) return false;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+    // 1 means there are differences, anything else is clean or an error
+    return WIFEXITED(status) && WEXITSTATUS(status) == 1;
+}
+
+static void vcs_publish(struct vcs *v, const char *status) {
+    bool changed = false;
+    pthread_mutex_lock(&v->lock);
+    if (strcmp(v->status, status) != 0) {
+        snprintf(v->status, sizeof(v->status), "%s", status);
+        v->gen++;
+        changed = true;
+    }
+    pthread_mutex_unlock(&v->lock);
+
+    if (changed) {
+        // A full pipe means a redraw is already on its way
+        ssize_t n = write(v->notify[1], "", 1);
+        UNUSED(n);
+    }
+}
+
+static void *vcs_worker(void *arg) {
+    struct vcs *v = arg;
+    char gitdir[PATH_MAX];
+    char branch[VCS_MAX - 1];    // Leaves room for the * in status
+    char status[VCS_MAX];
+    bool dirty = false;
+
+    for (;;) {
+        pthread_mutex_lock(&v->lock);
+        while (!v->requested && !v->stop) {
+            pthread_cond_wait(&v->wake, &v->lock);
+        }
+        if (v->stop) {
+            pthread_mutex_unlock(&v->lock);
+            break;
+        }
+        v->requested = false;
+        char **env = v->env_next;
+        v->env_next = NULL;
+        pthread_mutex_unlock(&v->lock);
+
+        if (env) {
+            free(v->env);
+            free(v->git);
+            v->env = env;
+            v->git = vcs_git(env);
+        }
+
+        if (!vcs_find(gitdir, sizeof(gitdir)) || !vcs_branch(gitdir, branch, sizeof(branch))) {
+            vcs_publish(v, "");
+            continue;
+        }
+
+        // The branch is cheap, show it with the dirty flag we had before
+        // and correct the flag once git is done
+        snprintf(status, sizeof(status), "%s%s", branch, dirty ? "*" : "");
+        vcs_publish(v, status);
+        dirty = vcs_dirty(v->git, v->env);
+        snprintf(status, sizeof(status), "%s%s", branch, dirty ? "*" : "");
+        vcs_publish(v, status);
+    }
+    return NULL;
+}
+
+struct vcs *vcs_start(void) {
+    struct vcs *v = calloc(1, sizeof(struct vcs));
+    if (!v) return NULL;
+
+    v->env_next = env_copy(environ);
+    if (!v->env_next || pipe(v->notify) < 0) {
+        free(v->env_next);
+        free(v);
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(v->notify[i], F_SETFD, FD_CLOEXEC);
+        fcntl(v->notify[i], F_SETFL, O_NONBLOCK);
+    }
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->wake, NULL);
+    v->requested = true;
+    if (pthread_create(&v->thread, NULL, vcs_worker, v) != 0) {
+        close(v->notify[0]);
+        close(v->notify[1]);
+        pthread_mutex_destroy(&v->lock);
+        pthread_cond_destroy(&v->wake);
+        free(v->env_next);
+        free(v);
+        return NULL;
+    }
+    return v;
+}
+
+void vcs_stop(struct vcs *v) {
+    if (!v) return;
+    pthread_mutex_lock(&v->lock);
+    v->stop = true;
+    pthread_cond_signal(&v->wake);
+    pthread_mutex_unlock(&v->lock);
+
+    // A dirty check in a big repository can take a while, we still wait
+    // for it so the thread never outlives the shell's data
+    pthread_join(v->thread, NULL);
+    close(v->notify[0]);
+    close(v->notify[1]);
+    pthread_mutex_destroy(&v->lock);
+    pthread_cond_destroy(&v->wake);
+    free(v->env_next);
+    free(v->env);
+    free(v->git);
+    free(v);
+}
+
+void vcs_refresh(struct vcs *v) {
+    if (!v) return;
+    pthread_mutex_lock(&v->lock);
+    v->requested = true;
+    pthread_cond_signal(&v->wake);
+    pthread_mutex_unlock(&v->lock);
+}
+
+void vcs_setenv(struct vcs *v, char *const *envp) {
+    if (!v) return;
+    // Copied here so the worker never looks at the caller's array. If
+    // there is no memory it keeps the environment it has.
+    char **copy = env_copy(envp);
+    if (!copy) return;
+    pthread_mutex_lock(&v->lock);
+    char **old = v->env_next;
+    v->env_next = copy;
+    pthread_mutex_unlock(&v->lock);
+    free(old);
+}
+
+int vcs_fd(const struct vcs *v) {
+    return v ? v->notify[0] : -1;
+}
+
+unsigned vcs_get(struct vcs *v, char *buf, size_t len) {
+    if (!v) {
+        if (len) *buf = '\0';
+        return 0;
+    }
+    pthread_mutex_lock(&v->lock);
+    snprintf(buf, len, "%s", v->status);
+    unsigned gen = v->gen;
+    pthread_mutex_unlock(&v->lock);
+    return gen;
+}
+
+unsigned vcs_gen(struct vcs *v) {
+    if (!v) return 0;
+    pthread_mutex_lock(&v->lock);
+    unsigned gen = v->gen;
+    pthread_mutex_unlock(&v->lock);
+    return gen;
+}
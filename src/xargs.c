@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lab.h"
+
+extern char **environ;
+
+// POSIX asks implementations to leave this much room for the exec'd
+// program to work with, we do the same as GNU xargs
+#define XARGS_HEADROOM 2048
+
+// -P beyond this is taken as this many, the slots and the poll set grow
+// up to it as batches are started
+#define XARGS_MAX_PROCS 1024
+
+struct xargs_slot {
+    pid_t pid;
+    int pidfd;
+};
+
+struct xargs_state {
+    char **argv;         // The command line being built
+    size_t argc;         // Number of entries currently in argv
+    size_t cap;          // Capacity of argv
+    size_t fixed;        // Number of leading entries that are not items
+    size_t base;         // Bytes used by the fixed entries and terminator
+    size_t bytes;        // Bytes the current argv will use in the new image
+    size_t limit;        // Maximum value for bytes
+    long max_args;       // Maximum items per batch, 0 for no limit
+    struct xargs_slot *slots;
+    long slots_cap;
+    long max_procs;
+    long running;
+    int status;
+};
+
+static size_t arg_cost(const char *arg) {
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+size_t xargs_arg_limit(void) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) arg_max = _POSIX_ARG_MAX;
+
+    // The environment is copied into the new image along with argv
+    size_t env = sizeof(char *);
+    for (char **e = environ; *e; e++) {
+        env += arg_cost(*e);
+    }
+    if ((size_t)arg_max <= env + XARGS_HEADROOM) return 0;
+    return (size_t)arg_max - env - XARGS_HEADROOM;
+}
+
+static void xargs_note_status(struct xargs_state *st, int rval) {
+    if (rval == 0) return;
+    if (rval == 127) {
+        st->status = 127;
+    } else if (st->status == 0) {
+        st->status = 123;
+    }
+}
+
+// Wait for one of the running batches to finish and free its slot
+static void xargs_wait_one(struct xargs_state *st) {
+    long done = 0;
+    bool have_fds = true;
+
+    for (long i = 0; i < st->running; i++) {
+        if (st->slots[i].pidfd < 0) have_fds = false;
+    }
+
+    if (have_fds && st->running > 1) {
+        struct pollfd pfds[st->running];
+        for (long i = 0; i < st->running; i++) {
+            pfds[i].fd = st->slots[i].pidfd;
+            pfds[i].events = POLLIN;
+        }
+        while (poll(pfds, st->running, -1) < 0 && errno == EINTR)
+            ;
+        for (long i = 0; i < st->running; i++) {
+            if (pfds[i].revents) {
+                done = i;
+                break;
+            }
+        }
+    }
+
+    struct xargs_slot slot = st->slots[done];
+    st->slots[done] = st->slots[--st->running];
+    xargs_note_status(st, reap_process(slot.pid, slot.pidfd));
+}
+
+static void xargs_launch(struct xargs_state *st) {
+    if (st->argc == st->fixed) return;
+
+    if (st->running == st->slots_cap && st->slots_cap < st->max_procs) {
+        long cap = st->slots_cap * 2 < st->max_procs ? st->slots_cap * 2 : st->max_procs;
+        struct xargs_slot *tmp = realloc(st->slots, cap * sizeof(struct xargs_slot));
+        if (tmp) {
+            st->slots = tmp;
+            st->slots_cap = cap;
+        }
+    }
+    // Out of slots, or out of memory for more, one has to finish first
+    if (st->running == st->slots_cap) {
+        xargs_wait_one(st);
+    }
+
+    st->argv[st->argc] = NULL;
+    struct xargs_slot *slot = &st->slots[st->running];
+    slot->pid = spawn_process(st->argv, &slot->pidfd);
+    if (slot->pid < 0) {
+        fprintf(stderr, "xargs: %s: %s\n", st->argv[0], strerror(errno));
+        st->status = (errno == ENOENT) ? 127 : 126;
+    } else {
+        st->running++;
+    }
+
+    // The child has its own copy of argv now so we can recycle the items
+    for (size_t i = st->fixed; i < st->argc; i++) {
+        free(st->argv[i]);
+    }
+    st->argc = st->fixed;
+    st->bytes = st->base;
+}
+
+static int xargs_add(struct xargs_state *st, const char *item) {
+    size_t cost = arg_cost(item);
+    if (st->base + cost > st->limit) {
+        fprintf(stderr, "xargs: argument line too long\n");
+        st->status = 1;
+        return -1;
+    }
+
+    if (st->bytes + cost > st->limit ||
+        (st->max_args > 0 && (long)(st->argc - st->fixed) >= st->max_args)) {
+        xargs_launch(st);
+    }
+
+    if (st->argc + 1 >= st->cap) {
+        size_t cap = st->cap * 2;
+        char **tmp = realloc(st->argv, cap * sizeof(char *));
+        if (!tmp) return -1;
+        st->argv = tmp;
+        st->cap = cap;
+    }
+    st->argv[st->argc] = strdup(item);
+    if (!st->argv[st->argc]) return -1;
+    st->argc++;
+    st->bytes += cost;
+    return 0;
+}
+
+// A numeric option has to be a whole number of at least min, GNU xargs
+// gives up with status 1 otherwise
+static int xargs_number(int opt, const char *arg, long min, long *out) {
+    char *end;
+    errno = 0;
+    long v = strtol(arg, &end, 10);
+    if (errno || end == arg || *end) {
+        fprintf(stderr, "xargs: invalid number \"%s\" for -%c option\n", arg, opt);
+        return -1;
+    }
+    if (v < min) {
+        fprintf(stderr, "xargs: value %s for -%c option should be >= %ld\n", arg, opt, min);
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+int builtin_xargs(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    struct xargs_state st = {0};
+    const char *file = NULL;
+    char delim = '\n';
+    long max_chars = 0;
+    int opt;
+
+    st.max_procs = 1;
+
+    int argc = 0;
+    while (argv[argc]) argc++;
+
+    optind = 0;
+    while ((opt = getopt(argc, argv, "+0a:n:P:s:")) != -1) {
+        switch (opt) {
+            case '0':
+                delim = '\0';
+                break;
+            case 'a':
+                file = optarg;
+                break;
+            case 'n':
+                if (xargs_number(opt, optarg, 1, &st.max_args) < 0) return 1;
+                break;
+            case 'P':
+                if (xargs_number(opt, optarg, 0, &st.max_procs) < 0) return 1;
+                break;
+            case 's':
+                if (xargs_number(opt, optarg, 1, &max_chars) < 0) return 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: xargs [-0] [-a file] [-n max-args] "
+                        "[-P max-procs] [-s max-chars] [command [args...]]\n");
+                return 1;
+        }
+    }
+    if (st.max_procs <= 0) {
+        // Like GNU xargs, zero means run as many as possible at once
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        st.max_procs = cpus > 0 ? cpus : 1;
+    }
+    if (st.max_procs > XARGS_MAX_PROCS) st.max_procs = XARGS_MAX_PROCS;
+
+    st.limit = xargs_arg_limit();
+    if (max_chars && (size_t)max_chars < st.limit) st.limit = max_chars;
+
+    FILE *in = stdin;
+    if (file) {
+        in = fopen(file, "r");
+        if (!in) {
+            fprintf(stderr, "xargs: %s: %s\n", file, strerror(errno));
+            return 1;
+        }
+    }
+
+    st.cap = (size_t)(argc - optind) + 64;
+    st.argv = malloc(st.cap * sizeof(char *));
+    st.slots = malloc(sizeof(struct xargs_slot));
+    st.slots_cap = 1;
+    bool ok = st.argv && st.slots;
+
+    // With no command we behave like the real xargs and run echo
+    if (ok && optind == argc) {
+        ok = (st.argv[st.argc++] = strdup("echo")) != NULL;
+    }
+    for (int i = optind; ok && i < argc; i++) {
+        ok = (st.argv[st.argc++] = strdup(argv[i])) != NULL;
+    }
+    if (!ok) {
+        perror("xargs");
+        for (size_t i = 0; st.argv && i < st.argc; i++) free(st.argv[i]);
+        free(st.argv);
+        free(st.slots);
+        if (in != stdin) fclose(in);
+        return 1;
+    }
+    st.fixed = st.argc;
+    st.base = sizeof(char *);
+    for (size_t i = 0; i < st.fixed; i++) {
+        st.base += arg_cost(st.argv[i]);
+    }
+    st.bytes = st.base;
+
+    char *item = NULL;
+    size_t item_cap = 0;
+    ssize_t n;
+    while ((n = getdelim(&item, &item_cap, delim, in)) != -1) {
+        if (n > 0 && item[n - 1] == delim) item[--n] = '\0';
+        if (n == 0) continue;
+        if (xargs_add(&st, item) < 0) break;
+    }
+    free(item);
+    xargs_launch(&st);
+
+    while (st.running > 0) {
+        xargs_wait_one(&st);
+    }
+
+    if (in == stdin) {
+        clearerr(stdin);
+    } else {
+        fclose(in);
+    }
+    for (size_t i = 0; i < st.argc; i++) {
+        free(st.argv[i]);
+    }
+    free(st.argv);
+    free(st.slots);
+    return st.status;
+}
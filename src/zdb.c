@@ -0,0 +1,532 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lab.h"
+
+// The directory database is a header followed by one record per directory.
+// A record is the rank and last visit time followed by the path, a NUL and
+// padding up to a multiple of 8. Paths are never moved, a visit updates
+// the record in place through a shared mapping and a new directory is
+// appended, both under an exclusive flock so shells can share the file.
+//
+// Ranks are aged like z does it: once they add up to more than
+// ZDB_MAX_RANK each one is scaled down and the ones that drop below 1 are
+// cleared. When cleared records outnumber the live ones the live ones are
+// written to a new file that is renamed over the old one, and the old one
+// is flagged so other shells know to open the new one.
+#define ZDB_MAGIC "LABZDB\001\0"
+#define ZDB_MAGIC_LEN 8
+#define ZDB_MIN_MAP (1 << 20)
+#define ZDB_MAX_RANK 100000.0
+#define ZDB_AGE 0.99
+
+struct zdb_header {
+    char magic[ZDB_MAGIC_LEN];
+    uint32_t moved;      // Set once the file has been replaced
+    uint32_t count;      // Records in the file, cleared ones included
+    uint32_t live;       // Records with a rank
+    uint32_t unused;
+    uint64_t end;        // End of the last record
+    double total;        // Sum of all ranks
+};
+
+struct zdb_rec {
+    double rank;         // Zero once aged out or removed
+    uint32_t time;       // Last visit in seconds since the epoch
+    uint32_t len;        // Length of the path without the NUL
+};
+
+struct zdb {
+    char *path;
+    int fd;
+    char *base;          // The mapped file
+    size_t map_len;
+    uint64_t *offs;      // Offset of each record, the position is its id
+    size_t count;
+    size_t cap;
+    uint32_t *set;       // Id plus one of each record, by path hash
+    size_t set_cap;
+    size_t set_count;    // Records before this are in set
+    struct tri_index tri; // Trigram index of the lowercased paths
+    size_t tri_count;    // Records before this are in tri
+    struct zdb_match *hits;
+    size_t hits_cap;
+    char *fold;          // Scratch space for lowercasing
+    size_t fold_cap;
+};
+
+static struct zdb_header *zdb_head(const struct zdb *z) {
+    return (struct zdb_header *)z->base;
+}
+
+static struct zdb_rec *zdb_rec(const struct zdb *z, size_t id) {
+    return (struct zdb_rec *)(z->base + z->offs[id]);
+}
+
+static const char *zdb_path(const struct zdb *z, size_t id) {
+    return (const char *)(zdb_rec(z, id) + 1);
+}
+
+static size_t rec_size(size_t len) {
+    return (sizeof(struct zdb_rec) + len + 1 + 7) & ~(size_t)7;
+}
+
+static int zdb_map(struct zdb *z, size_t file_size) {
+    // Like the history log the mapping runs well past the end of the file
+    // so appends rarely need a new one
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = file_size * 2;
+    if (len < ZDB_MIN_MAP) len = ZDB_MIN_MAP;
+    len = (len + page - 1) & ~(page - 1);
+
+    void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, z->fd, 0);
+    if (base == MAP_FAILED) return -1;
+    if (z->base) munmap(z->base, z->map_len);
+    z->base = base;
+    z->map_len = len;
+    return 0;
+}
+
+// Forget the records we indexed
+static void zdb_forget(struct zdb *z) {
+    z->count = 0;
+    free(z->set);
+    z->set = NULL;
+    z->set_cap = z->set_count = 0;
+    tri_index_free(&z->tri);
+    z->tri_count = 0;
+}
+
+// Forget everything we derived from the file, for when it is replaced
+static void zdb_reset(struct zdb *z) {
+    if (z->base) munmap(z->base, z->map_len);
+    if (z->fd >= 0) close(z->fd);
+    z->base = NULL;
+    z->map_len = 0;
+    z->fd = -1;
+    zdb_forget(z);
+}
+
+// A header or record that does not fit in the file, left by a crash or
+// written by something else, would have us read past the end of it and
+// take SIGBUS. The file is cut back to the records we could index, which
+// writes the header, so this needs the exclusive lock.
+static void zdb_repair(struct zdb *z, uint64_t end) {
+    struct zdb_header *head = zdb_head(z);
+    head->count = (uint32_t)z->count;
+    head->end = end;
+    head->live = 0;
+    head->total = 0;
+    for (size_t i = 0; i < z->count; i++) {
+        const struct zdb_rec *rec = zdb_rec(z, i);
+        if (rec->rank <= 0) continue;
+        head->live++;
+        head->total += rec->rank;
+    }
+}
+
+static int zdb_open_file(struct zdb *z) {
+    struct stat st;
+    struct zdb_header head = {.magic = ZDB_MAGIC, .end = sizeof(struct zdb_header)};
+
+    z->fd = open(z->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (z->fd < 0) return -1;
+
+    // Two shells starting at once must not both write the header
+    flock(z->fd, LOCK_EX);
+    if (fstat(z->fd, &st) == 0 && st.st_size == 0) {
+        if (write(z->fd, &head, sizeof(head)) != sizeof(head)) {
+            st.st_size = -1;
+        } else {
+            st.st_size = sizeof(head);
+        }
+    }
+    flock(z->fd, LOCK_UN);
+
+    if (st.st_size < (off_t)sizeof(head) ||
+        pread(z->fd, &head, sizeof(head), 0) != sizeof(head) ||
+        memcmp(head.magic, ZDB_MAGIC, ZDB_MAGIC_LEN) != 0) {
+        fprintf(stderr, "z: %s is not a directory database\n", z->path);
+        goto fail;
+    }
+    if (zdb_map(z, st.st_size) < 0) goto fail;
+    return 0;
+
+fail:
+    close(z->fd);
+    z->fd = -1;
+    return -1;
+}
+
+// Index the records added since we last looked, by us or another shell.
+// Called with the file locked. Returns 1 if the file needs a repair and
+// repair is false, the caller then has to come back with the exclusive
+// lock.
+static int zdb_sync(struct zdb *z, bool repair) {
+    struct stat st;
+    if (fstat(z->fd, &st) < 0 || st.st_size < (off_t)sizeof(struct zdb_header)) return -1;
+
+    // Another shell may have cut the file back past what we indexed
+    struct zdb_header *head = zdb_head(z);
+    if (head->count < z->count) zdb_forget(z);
+
+    uint64_t end = head->end;
+    bool bad = end < sizeof(struct zdb_header) || end > (uint64_t)st.st_size;
+    if (bad) end = (uint64_t)st.st_size;
+    if (end > z->map_len && zdb_map(z, end) < 0) return -1;
+    head = zdb_head(z);
+
+    size_t off = z->count ? z->offs[z->count - 1] + rec_size(zdb_rec(z, z->count - 1)->len)
+                          : sizeof(struct zdb_header);
+    while (z->count < head->count) {
+        const struct zdb_rec *rec = (const struct zdb_rec *)(z->base + off);
+        if (off + sizeof(*rec) >= end || rec->len > end - off - sizeof(*rec) - 1 ||
+            ((const char *)(rec + 1))[rec->len] != '\0') {
+            bad = true;
+            break;
+        }
+        if (z->count == z->cap) {
+            size_t cap = z->cap ? z->cap * 2 : 256;
+            uint64_t *tmp = realloc(z->offs, cap * sizeof(uint64_t));
+            if (!tmp) return -1;
+            z->offs = tmp;
+            z->cap = cap;
+        }
+        z->offs[z->count++] = off;
+        off += rec_size(rec->len);
+    }
+    if (!bad) return 0;
+    if (!repair) return 1;
+    zdb_repair(z, off);
+    return 0;
+}
+
+// Lock the file and catch up with it. If it was replaced while we were
+// not looking we start over with the new one.
+static int zdb_lock(struct zdb *z, int op) {
+    for (;;) {
+        if (z->fd < 0 || flock(z->fd, op) < 0) return -1;
+        if (!zdb_head(z)->moved) break;
+        flock(z->fd, LOCK_UN);
+        zdb_reset(z);
+        if (zdb_open_file(z) < 0) return -1;
+    }
+    int rval = zdb_sync(z, op == LOCK_EX);
+    if (rval != 0) {
+        flock(z->fd, LOCK_UN);
+        // Readers only hold a shared lock, the repair is redone with the
+        // exclusive one once the other readers are gone
+        if (rval > 0) return zdb_lock(z, LOCK_EX);
+        return -1;
+    }
+    return 0;
+}
+
+static void zdb_unlock(struct zdb *z) {
+    flock(z->fd, LOCK_UN);
+}
+
+static uint32_t *set_slot(const struct zdb *z, const char *path, uint32_t hash) {
+    size_t mask = z->set_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        uint32_t *slot = &z->set[i];
+        if (*slot == 0 || strcmp(zdb_path(z, *slot - 1), path) == 0) return slot;
+    }
+}
+
+static int set_update(struct zdb *z) {
+    if (z->set_cap == 0 || z->count * 2 > z->set_cap) {
+        size_t cap = z->set_cap ? z->set_cap : 1024;
+        while (z->count * 2 > cap) cap *= 2;
+        uint32_t *set = calloc(cap, sizeof(uint32_t));
+        if (!set) return -1;
+        free(z->set);
+        z->set = set;
+        z->set_cap = cap;
+        z->set_count = 0;
+    }
+    for (; z->set_count < z->count; z->set_count++) {
+        const char *path = zdb_path(z, z->set_count);
+        *set_slot(z, path, fnv1a_str(path)) = (uint32_t)z->set_count + 1;
+    }
+    return 0;
+}
+
+static long zdb_find(struct zdb *z, const char *dir) {
+    if (set_update(z) < 0) return -1;
+    uint32_t slot = *set_slot(z, dir, fnv1a_str(dir));
+    return slot ? (long)slot - 1 : -1;
+}
+
+// Lowercase s into the scratch buffer at offset at, keeping the NUL
+static char *zdb_fold(struct zdb *z, size_t at, const char *s, size_t len) {
+    if (at + len + 1 > z->fold_cap) {
+        size_t cap = z->fold_cap ? z->fold_cap : 256;
+        while (at + len + 1 > cap) cap *= 2;
+        char *tmp = realloc(z->fold, cap);
+        if (!tmp) return NULL;
+        z->fold = tmp;
+        z->fold_cap = cap;
+    }
+    char *out = z->fold + at;
+    for (size_t i = 0; i < len; i++) {
+        out[i] = (s[i] >= 'A' && s[i] <= 'Z') ? s[i] - 'A' + 'a' : s[i];
+    }
+    out[len] = '\0';
+    return out;
+}
+
+static void tri_update(struct zdb *z) {
+    for (; z->tri_count < z->count; z->tri_count++) {
+        const struct zdb_rec *rec = zdb_rec(z, z->tri_count);
+        char *fold = zdb_fold(z, 0, (const char *)(rec + 1), rec->len);
+        if (!fold || tri_index_add(&z->tri, fold, rec->len, (uint32_t)z->tri_count) < 0) return;
+    }
+}
+
+// Write the live records to a new file and rename it over ours. Called
+// with the file locked, the flag tells other shells to reopen.
+static void zdb_compact(struct zdb *z) {
+    struct zdb_header *head = zdb_head(z);
+    size_t len = sizeof(struct zdb_header);
+    for (size_t i = 0; i < z->count; i++) {
+        if (zdb_rec(z, i)->rank > 0) len += rec_size(zdb_rec(z, i)->len);
+    }
+    char *buf = calloc(1, len);
+    if (!buf) return;
+
+    struct zdb_header *out = (struct zdb_header *)buf;
+    memcpy(out->magic, ZDB_MAGIC, ZDB_MAGIC_LEN);
+    out->total = head->total;
+    size_t off = sizeof(struct zdb_header);
+    for (size_t i = 0; i < z->count; i++) {
+        const struct zdb_rec *rec = zdb_rec(z, i);
+        if (rec->rank <= 0) continue;
+        memcpy(buf + off, rec, sizeof(*rec) + rec->len + 1);
+        off += rec_size(rec->len);
+        out->count++;
+    }
+    out->live = out->count;
+    out->end = off;
+
+    size_t tlen = strlen(z->path) + sizeof(".tmp");
+    char *tmp = malloc(tlen);
+    int fd = -1;
+    if (tmp) {
+        snprintf(tmp, tlen, "%s.tmp", z->path);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    if (fd >= 0) {
+        bool ok = write(fd, buf, len) == (ssize_t)len;
+        close(fd);
+        if (ok && rename(tmp, z->path) == 0) {
+            head->moved = 1;
+        } else {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(buf);
+}
+
+static void zdb_age(struct zdb *z) {
+    struct zdb_header *head = zdb_head(z);
+    head->total = 0;
+    head->live = 0;
+    for (size_t i = 0; i < z->count; i++) {
+        struct zdb_rec *rec = zdb_rec(z, i);
+        if (rec->rank <= 0) continue;
+        rec->rank *= ZDB_AGE;
+        if (rec->rank < 1) {
+            rec->rank = 0;
+            continue;
+        }
+        head->live++;
+        head->total += rec->rank;
+    }
+    if (head->count - head->live > head->live) zdb_compact(z);
+}
+
+struct zdb *zdb_open(const char *path) {
+    if (!path || !*path) return NULL;
+    struct zdb *z = calloc(1, sizeof(struct zdb));
+    if (!z) return NULL;
+    z->fd = -1;
+    z->path = strdup(path);
+    if (!z->path || zdb_open_file(z) < 0) {
+        zdb_close(z);
+        return NULL;
+    }
+    return z;
+}
+
+void zdb_close(struct zdb *z) {
+    if (!z) return;
+    zdb_reset(z);
+    free(z->offs);
+    free(z->hits);
+    free(z->fold);
+    free(z->path);
+    free(z);
+}
+
+int zdb_visit(struct zdb *z, const char *dir, time_t now) {
+    if (!z) return 0;
+    if (zdb_lock(z, LOCK_EX) < 0) return -1;
+
+    struct zdb_header *head = zdb_head(z);
+    long id = zdb_find(z, dir);
+    int rval = 0;
+    if (id >= 0) {
+        struct zdb_rec *rec = zdb_rec(z, (size_t)id);
+        if (rec->rank <= 0) head->live++;
+        rec->rank += 1;
+        rec->time = (uint32_t)now;
+    } else {
+        size_t len = strlen(dir);
+        size_t off = head->end;
+        size_t end = off + rec_size(len);
+        if (ftruncate(z->fd, end) < 0 || (end > z->map_len && zdb_map(z, end) < 0)) {
+            rval = -1;
+        } else {
+            head = zdb_head(z);
+            struct zdb_rec *rec = (struct zdb_rec *)(z->base + off);
+            rec->rank = 1;
+            rec->time = (uint32_t)now;
+            rec->len = (uint32_t)len;
+            memcpy(rec + 1, dir, len + 1);
+            // The header goes last, a crash before it leaves the record
+            // as unused space
+            head->end = end;
+            head->count++;
+            head->live++;
+        }
+    }
+    if (rval == 0) {
+        head->total += 1;
+        if (head->total > ZDB_MAX_RANK) zdb_age(z);
+    }
+    zdb_unlock(z);
+    return rval;
+}
+
+int zdb_remove(struct zdb *z, const char *dir) {
+    if (!z) return -1;
+    if (zdb_lock(z, LOCK_EX) < 0) return -1;
+    long id = zdb_find(z, dir);
+    int rval = -1;
+    if (id >= 0 && zdb_rec(z, (size_t)id)->rank > 0) {
+        struct zdb_header *head = zdb_head(z);
+        struct zdb_rec *rec = zdb_rec(z, (size_t)id);
+        head->total -= rec->rank;
+        head->live--;
+        rec->rank = 0;
+        rval = 0;
+    }
+    zdb_unlock(z);
+    return rval;
+}
+
+// z weighs the rank by how long ago the directory was last visited
+static double zdb_score(const struct zdb_rec *rec, time_t now) {
+    double age = (double)now - rec->time;
+    if (age < 3600) return rec->rank * 4;
+    if (age < 86400) return rec->rank * 2;
+    if (age < 604800) return rec->rank / 2;
+    return rec->rank / 4;
+}
+
+// Check that the words appear in path in order. The words are lowercase
+// and the path is compared as if it was.
+static bool path_match(const char *path, const char *words, size_t nwords) {
+    const char *p = path;
+    for (size_t i = 0; i < nwords; i++, words += strlen(words) + 1) {
+        size_t wlen = strlen(words);
+        for (;; p++) {
+            if (!*p) return false;
+            size_t j = 0;
+            while (j < wlen && p[j] && (p[j] >= 'A' && p[j] <= 'Z' ? p[j] - 'A' + 'a' : p[j]) == words[j]) {
+                j++;
+            }
+            if (j == wlen) break;
+        }
+        p += wlen;
+    }
+    return true;
+}
+
+static int hit_cmp(const void *a, const void *b) {
+    double x = ((const struct zdb_match *)a)->score;
+    double y = ((const struct zdb_match *)b)->score;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+#define ZDB_MAX_LISTS 32
+
+size_t zdb_query(struct zdb *z, char **words, time_t now, const struct zdb_match **out) {
+    *out = NULL;
+    if (!z || zdb_lock(z, LOCK_SH) < 0) return 0;
+    tri_update(z);
+
+    // Every trigram of every word must be in a matching path, walk the
+    // shortest list and check the rest with binary searches. Words too
+    // short to have a trigram are only checked by path_match.
+    const struct tri_list *lists[ZDB_MAX_LISTS];
+    size_t nlists = 0, nwords = 0, used = 0;
+    bool none = false;
+    for (; words[nwords]; nwords++) {
+        size_t len = strlen(words[nwords]);
+        char *fold = zdb_fold(z, used, words[nwords], len);
+        if (!fold) {
+            zdb_unlock(z);
+            return 0;
+        }
+        if (tri_index_plan(&z->tri, fold, len, lists, &nlists, ZDB_MAX_LISTS) < 0) none = true;
+        used += len + 1;
+    }
+
+    size_t n = 0;
+    size_t total = nlists ? lists[0]->len : z->count;
+    for (size_t k = 0; k < total && !none; k++) {
+        size_t id = nlists ? lists[0]->ids[k] : k;
+        bool all = true;
+        for (size_t j = 1; j < nlists && all; j++) {
+            all = tri_list_has(lists[j], (uint32_t)id);
+        }
+        const struct zdb_rec *rec = zdb_rec(z, id);
+        if (!all || rec->rank <= 0 || !path_match(zdb_path(z, id), z->fold, nwords)) continue;
+
+        if (n == z->hits_cap) {
+            size_t cap = z->hits_cap ? z->hits_cap * 2 : 64;
+            struct zdb_match *tmp = realloc(z->hits, cap * sizeof(struct zdb_match));
+            if (!tmp) break;
+            z->hits = tmp;
+            z->hits_cap = cap;
+        }
+        z->hits[n].path = zdb_path(z, id);
+        z->hits[n].score = zdb_score(rec, now);
+        n++;
+    }
+    zdb_unlock(z);
+
+    qsort(z->hits, n, sizeof(struct zdb_match), hit_cmp);
+    *out = z->hits;
+    return n;
+}
+
+const char *zdb_default_path(void) {
+    static char path[4096];
+    const char *env = getenv("MY_ZFILE");
+    if (env) return env;
+
+    const char *home = getenv("HOME");
+    if (!home) return NULL;
+    snprintf(path, sizeof(path), "%s/.lab_z", home);
+    return path;
+}
@@ -1,4 +1,12 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
 
@@ -134,6 +142,100 @@ void test_get_prompt_custom(void)
      unsetenv(prmpt);
 }
 
+void test_prompt_render(void)
+{
+     struct shell sh = {0};
+     char start[PATH_MAX];
+     TEST_ASSERT_NOT_NULL(getcwd(start, sizeof(start)));
+     TEST_ASSERT_EQUAL_INT(0, chdir("/usr"));
+
+     struct prompt_cache *pc = prompt_compile("[\\W \\? \\j \\E]\\\\ \\x");
+     const char *out = prompt_render(pc, &sh);
+     TEST_ASSERT_EQUAL_STRING("[usr 0 0 0ms]\\ \\x", out);
+     TEST_ASSERT_EQUAL_PTR(out, prompt_render(pc, &sh));
+
+     sh.last_status = 127;
+     sh.job_count = 2;
+     sh.last_elapsed_ns = 1500000000LL;
+     TEST_ASSERT_EQUAL_STRING("[usr 127 2 1.50s]\\ \\x", prompt_render(pc, &sh));
+
+     // The directory is only looked at again once cd says it changed
+     TEST_ASSERT_EQUAL_INT(0, chdir("/tmp"));
+     TEST_ASSERT_EQUAL_STRING("[usr 127 2 1.50s]\\ \\x", prompt_render(pc, &sh));
+     sh.cwd_gen++;
+     TEST_ASSERT_EQUAL_STRING("[tmp 127 2 1.50s]\\ \\x", prompt_render(pc, &sh));
+     prompt_free(pc);
+
+     pc = prompt_compile("\\[\\e[1m\\]>\\n");
+     TEST_ASSERT_EQUAL_STRING("\001\033[1m\002>\n", prompt_render(pc, &sh));
+     prompt_free(pc);
+     TEST_ASSERT_EQUAL_INT(0, chdir(start));
+}
+
+// Wait for the git worker to publish want, or give up after a few seconds
+static bool vcs_wait(struct vcs *v, const char *want)
+{
+     char status[VCS_MAX];
+     for (int i = 0; i < 50; i++) {
+          vcs_get(v, status, sizeof(status));
+          if (strcmp(status, want) == 0) return true;
+          struct pollfd pfd = {vcs_fd(v), POLLIN, 0};
+          if (poll(&pfd, 1, 100) > 0) {
+               char buf[16];
+               while (read(pfd.fd, buf, sizeof(buf)) > 0)
+                    ;
+          }
+     }
+     return false;
+}
+
+void test_vcs_status(void)
+{
+     char start[PATH_MAX];
+     char dir[] = "/tmp/test-lab-vcs-XXXXXX";
+     TEST_ASSERT_NOT_NULL(getcwd(start, sizeof(start)));
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+
+     // Just enough of a repository for the branch, git itself will not
+     // accept it so it never reports the tree as dirty
+     char path[PATH_MAX];
+     snprintf(path, sizeof(path), "%s/.git", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0700));
+     snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+     FILE *head = fopen(path, "w");
+     fputs("ref: refs/heads/feature/x\n", head);
+     fclose(head);
+     snprintf(path, sizeof(path), "%s/sub", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0700));
+     TEST_ASSERT_EQUAL_INT(0, chdir(path));
+
+     struct vcs *v = vcs_start();
+     TEST_ASSERT_NOT_NULL(v);
+     TEST_ASSERT_TRUE(vcs_wait(v, "feature/x"));
+
+     snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+     head = fopen(path, "w");
+     fputs("0123456789abcdef0123456789abcdef01234567\n", head);
+     fclose(head);
+     unsigned gen = vcs_gen(v);
+     vcs_refresh(v);
+     TEST_ASSERT_TRUE(vcs_wait(v, "0123456"));
+     TEST_ASSERT_NOT_EQUAL(gen, vcs_gen(v));
+
+     TEST_ASSERT_EQUAL_INT(0, chdir("/"));
+     vcs_refresh(v);
+     TEST_ASSERT_TRUE(vcs_wait(v, ""));
+     vcs_stop(v);
+
+     TEST_ASSERT_EQUAL_INT(0, chdir(start));
+     unlink(path);
+     snprintf(path, sizeof(path), "%s/.git", dir);
+     rmdir(path);
+     snprintf(path, sizeof(path), "%s/sub", dir);
+     rmdir(path);
+     rmdir(dir);
+}
+
 void test_ch_dir_home(void)
 {
      char *line = (char*) calloc(10, sizeof(char));
@@ -161,6 +263,1501 @@ void test_ch_dir_root(void)
      cmd_free(cmd);
 }
 
+static void write_items(const char *path, int count)
+{
+     FILE *f = fopen(path, "w");
+     TEST_ASSERT_NOT_NULL(f);
+     for (int i = 0; i < count; i++) {
+          fprintf(f, "item%d\n", i);
+     }
+     fclose(f);
+}
+
+void test_xargs_arg_limit(void)
+{
+     size_t limit = xargs_arg_limit();
+     TEST_ASSERT_TRUE(limit > 0);
+     TEST_ASSERT_TRUE(limit < (size_t)sysconf(_SC_ARG_MAX));
+}
+
+void test_xargs_batches(void)
+{
+     char in[] = "/tmp/test-lab-xargs-in-XXXXXX";
+     char out[] = "/tmp/test-lab-xargs-out-XXXXXX";
+     close(mkstemp(in));
+     close(mkstemp(out));
+     write_items(in, 5000);
+
+     char script[128];
+     snprintf(script, sizeof(script), "echo $# >> %s", out);
+     char *argv[] = {"xargs", "-a", in, "-s", "4096", "-P", "4",
+                     "sh", "-c", script, "sh", NULL};
+     TEST_ASSERT_EQUAL_INT(0, builtin_xargs(NULL, argv));
+
+     // Every item must be passed exactly once across several batches
+     FILE *f = fopen(out, "r");
+     TEST_ASSERT_NOT_NULL(f);
+     int batches = 0, total = 0, n;
+     while (fscanf(f, "%d", &n) == 1) {
+          batches++;
+          total += n;
+     }
+     fclose(f);
+     TEST_ASSERT_EQUAL_INT(5000, total);
+     TEST_ASSERT_TRUE(batches > 1);
+     unlink(in);
+     unlink(out);
+}
+
+void test_xargs_status(void)
+{
+     char in[] = "/tmp/test-lab-xargs-in-XXXXXX";
+     close(mkstemp(in));
+     write_items(in, 10);
+
+     char *fail[] = {"xargs", "-a", in, "-n", "3", "false", NULL};
+     TEST_ASSERT_EQUAL_INT(123, builtin_xargs(NULL, fail));
+     char *missing[] = {"xargs", "-a", in, "/no/such/command", NULL};
+     TEST_ASSERT_EQUAL_INT(127, builtin_xargs(NULL, missing));
+
+     // Counts below 1, or that are not numbers, are refused like GNU does,
+     // and a huge -P is capped instead of allocated up front
+     char *zero[] = {"xargs", "-a", in, "-n", "0", "true", NULL};
+     TEST_ASSERT_EQUAL_INT(1, builtin_xargs(NULL, zero));
+     char *negative[] = {"xargs", "-a", in, "-n", "-1", "true", NULL};
+     TEST_ASSERT_EQUAL_INT(1, builtin_xargs(NULL, negative));
+     char *junk[] = {"xargs", "-a", in, "-P", "4x", "true", NULL};
+     TEST_ASSERT_EQUAL_INT(1, builtin_xargs(NULL, junk));
+     char *many[] = {"xargs", "-a", in, "-n", "1", "-P", "99999999999", "true", NULL};
+     TEST_ASSERT_EQUAL_INT(0, builtin_xargs(NULL, many));
+     unlink(in);
+}
+
+void test_parallel_runs_everything(void)
+{
+     char dir[] = "/tmp/test-lab-parallel-XXXXXX";
+     char cmds[] = "/tmp/test-lab-parallel-cmds-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     close(mkstemp(cmds));
+
+     FILE *f = fopen(cmds, "w");
+     TEST_ASSERT_NOT_NULL(f);
+     for (int i = 0; i < 40; i++) {
+          fprintf(f, "touch %s/f%d\n", dir, i);
+     }
+     fprintf(f, "false\nfalse\n");
+     fclose(f);
+
+     char *argv[] = {"parallel", "-j", "4", cmds, NULL};
+     TEST_ASSERT_EQUAL_INT(2, builtin_parallel(NULL, argv));
+
+     char path[128];
+     for (int i = 0; i < 40; i++) {
+          snprintf(path, sizeof(path), "%s/f%d", dir, i);
+          TEST_ASSERT_EQUAL_INT(0, access(path, F_OK));
+          unlink(path);
+     }
+     rmdir(dir);
+     unlink(cmds);
+}
+
+static void *parse_loop(void *arg)
+{
+     const char *line = arg;
+     for (int i = 0; i < 20000; i++) {
+          char **argv = cmd_parse(line);
+          bool ok = argv && argv[0] && argv[1] && !argv[2] && argv[0][0] == line[0] &&
+               strcmp(argv[1], line + 2) == 0;
+          cmd_free(argv);
+          if (!ok) return (void *)1;
+     }
+     return NULL;
+}
+
+// The parallel builtin's workers parse their lines at the same time
+void test_cmd_parse_threads(void)
+{
+     static const char *lines[] = {"a one", "b two", "c three", "d four"};
+     pthread_t threads[4];
+     for (int i = 0; i < 4; i++) {
+          TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, parse_loop, (void *)lines[i]));
+     }
+     for (int i = 0; i < 4; i++) {
+          void *bad;
+          pthread_join(threads[i], &bad);
+          TEST_ASSERT_NULL(bad);
+     }
+}
+
+// Run a builtin with stdout sent to a file and return what it printed
+static char *capture_sh(builtin_fn fn, struct shell *sh, char **argv, int *status)
+{
+     char path[] = "/tmp/test-lab-out-XXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     fflush(stdout);
+     int saved = dup(STDOUT_FILENO);
+     dup2(fd, STDOUT_FILENO);
+     *status = fn(sh, argv);
+     fflush(stdout);
+     dup2(saved, STDOUT_FILENO);
+     close(saved);
+
+     off_t len = lseek(fd, 0, SEEK_END);
+     char *out = calloc(len + 1, 1);
+     pread(fd, out, len, 0);
+     close(fd);
+     unlink(path);
+     return out;
+}
+
+static char *capture(builtin_fn fn, char **argv, int *status)
+{
+     return capture_sh(fn, NULL, argv, status);
+}
+
+void test_echo(void)
+{
+     int status;
+     char *plain[] = {"echo", "hello", "world", NULL};
+     char *out = capture(builtin_echo, plain, &status);
+     TEST_ASSERT_EQUAL_INT(0, status);
+     TEST_ASSERT_EQUAL_STRING("hello world\n", out);
+     free(out);
+
+     char *flags[] = {"echo", "-ne", "a\\tb\\x41\\0101", "-x", NULL};
+     out = capture(builtin_echo, flags, &status);
+     TEST_ASSERT_EQUAL_STRING("a\tbAA -x", out);
+     free(out);
+
+     char *stop[] = {"echo", "-e", "one\\ctwo", "three", NULL};
+     out = capture(builtin_echo, stop, &status);
+     TEST_ASSERT_EQUAL_STRING("one", out);
+     free(out);
+}
+
+void test_printf(void)
+{
+     int status;
+     char *argv[] = {"printf", "%s=%05d|%-3s|%x\\n", "a", "42", "b", "255",
+                     "c", "-7", "dd", "16", NULL};
+     char *out = capture(builtin_printf, argv, &status);
+     TEST_ASSERT_EQUAL_INT(0, status);
+     TEST_ASSERT_EQUAL_STRING("a=00042|b  |ff\nc=-0007|dd |10\n", out);
+     free(out);
+
+     char *bad[] = {"printf", "%d", "abc", NULL};
+     out = capture(builtin_printf, bad, &status);
+     TEST_ASSERT_EQUAL_INT(1, status);
+     free(out);
+}
+
+void test_test_builtin(void)
+{
+     char *f1[] = {"test", "-f", "/etc/passwd", NULL};
+     TEST_ASSERT_EQUAL_INT(0, builtin_test(NULL, f1));
+     char *f2[] = {"test", "-f", "/", NULL};
+     TEST_ASSERT_EQUAL_INT(1, builtin_test(NULL, f2));
+     char *d[] = {"[", "-d", "/", "]", NULL};
+     TEST_ASSERT_EQUAL_INT(0, builtin_test(NULL, d));
+     char *eq[] = {"test", "abc", "=", "abc", NULL};
+     TEST_ASSERT_EQUAL_INT(0, builtin_test(NULL, eq));
+     char *lt[] = {"test", "3", "-lt", "2", NULL};
+     TEST_ASSERT_EQUAL_INT(1, builtin_test(NULL, lt));
+     char *neg[] = {"test", "!", "-z", "x", "-a", "1", "-ge", "1", NULL};
+     TEST_ASSERT_EQUAL_INT(0, builtin_test(NULL, neg));
+     char *paren[] = {"[", "(", "a", "=", "b", ")", "-o", "-n", "x", "]", NULL};
+     TEST_ASSERT_EQUAL_INT(0, builtin_test(NULL, paren));
+     char *op[] = {"test", "-n", NULL};
+     TEST_ASSERT_EQUAL_INT(0, builtin_test(NULL, op));
+     char *empty[] = {"test", NULL};
+     TEST_ASSERT_EQUAL_INT(1, builtin_test(NULL, empty));
+     char *bad[] = {"test", "x", "-eq", "1", NULL};
+     TEST_ASSERT_EQUAL_INT(2, builtin_test(NULL, bad));
+     char *unclosed[] = {"[", "x", NULL};
+     TEST_ASSERT_EQUAL_INT(2, builtin_test(NULL, unclosed));
+}
+
+void test_true_false_builtin(void)
+{
+     struct shell sh = {0};
+     char *t[] = {"true", NULL};
+     char *f[] = {"false", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, f));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     TEST_ASSERT_TRUE(do_builtin(&sh, t));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+}
+
+static int custom_calls;
+
+static int custom_builtin(struct shell *sh, char **argv)
+{
+     UNUSED(sh);
+     custom_calls++;
+     return argv[1] ? 7 : 0;
+}
+
+// More pieces than there are iovecs, mixing copied and referenced bytes
+void test_outbuf_iovecs(void)
+{
+     char path[] = "/tmp/test-lab-outbuf-XXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+
+     struct outbuf ob;
+     ob_init(&ob, fd);
+     char expect[256] = "";
+     for (int i = 0; i < OUTBUF_IOV / 2; i++) {
+          ob_write(&ob, "w", 1);
+          ob_ref(&ob, "R", 1);
+          strcat(expect, "wR");
+     }
+     ob_write(&ob, "abc", 3);
+     ob_write(&ob, "0123456789012345678901234567890123456789", 40);
+     ob_printf(&ob, "%d", 42);
+     strcat(expect, "abc0123456789012345678901234567890123456789" "42");
+     TEST_ASSERT_EQUAL_INT(0, ob_flush(&ob));
+
+     char got[256] = "";
+     TEST_ASSERT_EQUAL_INT((int)strlen(expect), (int)pread(fd, got, sizeof(got) - 1, 0));
+     TEST_ASSERT_EQUAL_STRING(expect, got);
+     close(fd);
+     unlink(path);
+}
+
+void test_builtin_register(void)
+{
+     struct shell sh = {0};
+     char *argv[] = {"custom", "x", NULL};
+     TEST_ASSERT_NULL(builtin_lookup("custom"));
+     TEST_ASSERT_FALSE(do_builtin(&sh, argv));
+
+     TEST_ASSERT_EQUAL_INT(0, builtin_register("custom", custom_builtin));
+     TEST_ASSERT_TRUE(do_builtin(&sh, argv));
+     TEST_ASSERT_EQUAL_INT(1, custom_calls);
+     TEST_ASSERT_EQUAL_INT(7, sh.last_status);
+
+     // Core builtins are still there and unknown commands still miss
+     TEST_ASSERT_NOT_NULL(builtin_lookup("cd"));
+     TEST_ASSERT_NOT_NULL(builtin_lookup("["));
+     TEST_ASSERT_NULL(builtin_lookup("ls"));
+     TEST_ASSERT_NULL(builtin_lookup(""));
+     TEST_ASSERT_EQUAL_INT(-1, builtin_register("", custom_builtin));
+
+     // Lots of registrations force the table to grow
+     char name[16];
+     for (int i = 0; i < 100; i++) {
+          snprintf(name, sizeof(name), "b%d", i);
+          TEST_ASSERT_EQUAL_INT(0, builtin_register(name, custom_builtin));
+     }
+     TEST_ASSERT_EQUAL_PTR(custom_builtin, builtin_lookup("b42"));
+     TEST_ASSERT_EQUAL_PTR(custom_builtin, builtin_lookup("custom"));
+}
+
+void test_exit_builtin(void)
+{
+     struct shell sh = {0};
+     char *argv[] = {"exit", "3", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, argv));
+     TEST_ASSERT_TRUE(sh.should_exit);
+     TEST_ASSERT_EQUAL_INT(3, sh.last_status);
+}
+
+void test_load_plugin(void)
+{
+     struct shell sh = {0};
+     char *load[] = {"load", EXAMPLE_PLUGIN, NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, load));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     builtin_fn hello = builtin_lookup("hello");
+     TEST_ASSERT_NOT_NULL(hello);
+     int status;
+     char *argv[] = {"hello", "world", NULL};
+     char *out = capture(hello, argv, &status);
+     TEST_ASSERT_EQUAL_INT(0, status);
+     TEST_ASSERT_EQUAL_STRING("hello world\n", out);
+     free(out);
+
+     // Shared objects that are not plugins are turned away
+     char *libc[] = {"load", "libc.so.6", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, libc));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     char *missing[] = {"load", "/no/such/plugin.so", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, missing));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+}
+
+static void hist_temp_path(char *path, size_t len)
+{
+     snprintf(path, len, "/tmp/test-lab-hist-%d-XXXXXX", (int)getpid());
+     close(mkstemp(path));
+     unlink(path);
+}
+
+static void hist_remove(const char *path)
+{
+     char idx[256];
+     snprintf(idx, sizeof(idx), "%s.idx", path);
+     unlink(path);
+     unlink(idx);
+}
+
+void test_history_persist(void)
+{
+     char path[128];
+     hist_temp_path(path, sizeof(path));
+
+     struct history *h = hist_open(path);
+     TEST_ASSERT_NOT_NULL(h);
+     TEST_ASSERT_EQUAL_INT(0, hist_count(h));
+     TEST_ASSERT_EQUAL_INT(0, hist_add(h, "ls -l"));
+     TEST_ASSERT_EQUAL_INT(0, hist_add(h, "cd /tmp"));
+     TEST_ASSERT_EQUAL_INT(0, hist_add(h, ""));
+     TEST_ASSERT_EQUAL_INT(3, hist_count(h));
+     hist_close(h);
+
+     h = hist_open(path);
+     TEST_ASSERT_EQUAL_INT(3, hist_count(h));
+     TEST_ASSERT_EQUAL_STRING("ls -l", hist_get(h, 0));
+     TEST_ASSERT_EQUAL_STRING("cd /tmp", hist_get(h, 1));
+     TEST_ASSERT_EQUAL_STRING("", hist_get(h, 2));
+     TEST_ASSERT_NULL(hist_get(h, 3));
+     hist_add(h, "echo hi");
+     hist_close(h);
+
+     // The index has one offset per record
+     char idx[256];
+     struct stat st;
+     snprintf(idx, sizeof(idx), "%s.idx", path);
+     TEST_ASSERT_EQUAL_INT(0, stat(idx, &st));
+     TEST_ASSERT_EQUAL_INT(4 * 8, st.st_size);
+
+     // Without the index the log is walked instead
+     unlink(idx);
+     h = hist_open(path);
+     TEST_ASSERT_EQUAL_INT(4, hist_count(h));
+     TEST_ASSERT_EQUAL_STRING("echo hi", hist_get(h, 3));
+     hist_close(h);
+     hist_remove(path);
+}
+
+void test_history_torn_tail(void)
+{
+     char path[128];
+     hist_temp_path(path, sizeof(path));
+
+     struct history *h = hist_open(path);
+     hist_add(h, "first");
+     hist_close(h);
+
+     // Half a record, as if a shell died in the middle of a write
+     int fd = open(path, O_WRONLY | O_APPEND);
+     TEST_ASSERT_TRUE(fd >= 0);
+     TEST_ASSERT_EQUAL_INT(12, write(fd, "\x20\0\0\0garbage!", 12));
+     close(fd);
+
+     h = hist_open(path);
+     TEST_ASSERT_EQUAL_INT(1, hist_count(h));
+     hist_add(h, "second");
+     TEST_ASSERT_EQUAL_INT(2, hist_count(h));
+     TEST_ASSERT_EQUAL_STRING("second", hist_get(h, 1));
+     hist_close(h);
+
+     h = hist_open(path);
+     TEST_ASSERT_EQUAL_INT(2, hist_count(h));
+     TEST_ASSERT_EQUAL_STRING("second", hist_get(h, 1));
+     hist_close(h);
+     hist_remove(path);
+}
+
+void test_history_memory_only(void)
+{
+     struct history *h = hist_open(NULL);
+     TEST_ASSERT_NOT_NULL(h);
+     for (int i = 0; i < 1000; i++) {
+          char line[32];
+          snprintf(line, sizeof(line), "cmd %d", i);
+          TEST_ASSERT_EQUAL_INT(0, hist_add(h, line));
+     }
+     TEST_ASSERT_EQUAL_INT(1000, hist_count(h));
+     TEST_ASSERT_EQUAL_STRING("cmd 0", hist_get(h, 0));
+     TEST_ASSERT_EQUAL_STRING("cmd 999", hist_get(h, 999));
+     hist_close(h);
+}
+
+#define HIST_WRITERS 16
+#define HIST_PER_WRITER 300
+
+void test_history_concurrent_writers(void)
+{
+     char path[128];
+     hist_temp_path(path, sizeof(path));
+     struct history *reader = hist_open(path);
+
+     pid_t pids[HIST_WRITERS];
+     for (int w = 0; w < HIST_WRITERS; w++) {
+          pids[w] = fork();
+          TEST_ASSERT_TRUE(pids[w] >= 0);
+          if (pids[w] == 0) {
+               struct history *h = hist_open(path);
+               // Mix in lines bigger than a page so writes span pages
+               char *line = malloc(9000);
+               for (int i = 0; i < HIST_PER_WRITER; i++) {
+                    int len = snprintf(line, 9000, "w%d %d ", w, i);
+                    int pad = (i % 10 == 0) ? 8000 : i % 50;
+                    memset(line + len, 'a' + w, pad);
+                    line[len + pad] = '\0';
+                    hist_add(h, line);
+               }
+               free(line);
+               hist_close(h);
+               _exit(0);
+          }
+     }
+
+     // Watch the log grow while they write, the count must only go up
+     size_t seen = 0;
+     int running = HIST_WRITERS;
+     while (running > 0) {
+          hist_sync(reader);
+          TEST_ASSERT_TRUE(hist_count(reader) >= seen);
+          seen = hist_count(reader);
+          while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0) running--;
+     }
+     hist_sync(reader);
+     TEST_ASSERT_EQUAL_INT(HIST_WRITERS * HIST_PER_WRITER, hist_count(reader));
+
+     // Every record is whole and each writer's records are all there in order
+     int next[HIST_WRITERS] = {0};
+     for (size_t i = 0; i < hist_count(reader); i++) {
+          const char *line = hist_get(reader, i);
+          int w, n, off;
+          TEST_ASSERT_EQUAL_INT(2, sscanf(line, "w%d %d %n", &w, &n, &off));
+          TEST_ASSERT_TRUE(w >= 0 && w < HIST_WRITERS);
+          TEST_ASSERT_EQUAL_INT(next[w], n);
+          next[w]++;
+          size_t pad = strlen(line + off);
+          TEST_ASSERT_EQUAL_INT((n % 10 == 0) ? 8000 : n % 50, pad);
+          TEST_ASSERT_EQUAL_INT(pad, strspn(line + off, (char[]){(char)('a' + w), 0}));
+     }
+     hist_close(reader);
+
+     // A fresh shell sees the same thing through the shared index
+     struct history *h = hist_open(path);
+     TEST_ASSERT_EQUAL_INT(HIST_WRITERS * HIST_PER_WRITER, hist_count(h));
+     hist_close(h);
+     hist_remove(path);
+}
+
+void test_history_search(void)
+{
+     struct history *h = hist_open(NULL);
+     hist_add(h, "make -C build all");
+     hist_add(h, "git status");
+     hist_add(h, "ls -la /tmp");
+     hist_add(h, "git commit -m wip");
+     hist_add(h, "tmga");
+
+     TEST_ASSERT_EQUAL_INT(3, hist_search(h, "git", hist_count(h)));
+     TEST_ASSERT_EQUAL_INT(1, hist_search(h, "git", 3));
+     TEST_ASSERT_EQUAL_INT(-1, hist_search(h, "git", 1));
+     TEST_ASSERT_EQUAL_INT(0, hist_search(h, "-C build", hist_count(h)));
+     TEST_ASSERT_EQUAL_INT(-1, hist_search(h, "svn", hist_count(h)));
+     // All the trigrams of "tmp" and "gam" are around but not in one line
+     TEST_ASSERT_EQUAL_INT(2, hist_search(h, "tmp", hist_count(h)));
+     TEST_ASSERT_EQUAL_INT(-1, hist_search(h, "mga -", hist_count(h)));
+     // Short patterns skip the index
+     TEST_ASSERT_EQUAL_INT(2, hist_search(h, "ls", hist_count(h)));
+
+     // Entries added after the index was built are found too
+     hist_add(h, "git push");
+     TEST_ASSERT_EQUAL_INT(5, hist_search(h, "git", hist_count(h)));
+     TEST_ASSERT_EQUAL_INT(5, hist_search(h, "push", hist_count(h)));
+     hist_close(h);
+}
+
+void test_history_dups(void)
+{
+     char path[64];
+     hist_temp_path(path, sizeof(path));
+
+     struct history *h = hist_open(path);
+     hist_limit(h, 0, HIST_ERASE_DUPS);
+     hist_add(h, "make all");
+     hist_add(h, "ls");
+     hist_add(h, "make all");
+     hist_add(h, "ls");
+     hist_add(h, "git status");
+     TEST_ASSERT_EQUAL_INT(3, hist_count(h));
+     TEST_ASSERT_EQUAL_INT(5, hist_records(h));
+     TEST_ASSERT_EQUAL_STRING("make all", hist_get(h, 0));
+     TEST_ASSERT_EQUAL_STRING("ls", hist_get(h, 1));
+     TEST_ASSERT_EQUAL_STRING("git status", hist_get(h, 2));
+     TEST_ASSERT_EQUAL_INT(0, hist_search(h, "make", hist_count(h)));
+
+     // Repeats are stored as references, not as new copies of the line
+     struct hist_stats st;
+     hist_stats(h, &st);
+     size_t before = st.log_bytes;
+     for (int i = 0; i < 100; i++) hist_add(h, "make all");
+     hist_stats(h, &st);
+     TEST_ASSERT_EQUAL_INT(before + 100 * 16, st.log_bytes);
+     TEST_ASSERT_EQUAL_STRING("make all", hist_get(h, 2));
+     hist_close(h);
+
+     // The log keeps every record, each reader applies its own policy
+     h = hist_open(path);
+     TEST_ASSERT_EQUAL_INT(105, hist_count(h));
+     hist_limit(h, 0, HIST_IGNORE_DUPS);
+     TEST_ASSERT_EQUAL_INT(6, hist_count(h));
+     hist_add(h, "make all");
+     TEST_ASSERT_EQUAL_INT(6, hist_count(h));
+     hist_add(h, "ls");
+     TEST_ASSERT_EQUAL_INT(7, hist_count(h));
+     hist_limit(h, 2, HIST_ERASE_DUPS);
+     TEST_ASSERT_EQUAL_INT(2, hist_count(h));
+     TEST_ASSERT_EQUAL_STRING("make all", hist_get(h, 0));
+     TEST_ASSERT_EQUAL_STRING("ls", hist_get(h, 1));
+     hist_add(h, "git status");
+     TEST_ASSERT_EQUAL_INT(2, hist_count(h));
+     TEST_ASSERT_EQUAL_STRING("ls", hist_get(h, 0));
+     TEST_ASSERT_EQUAL_INT(-1, hist_search(h, "make", hist_count(h)));
+     hist_close(h);
+     hist_remove(path);
+}
+
+void test_history_builtin(void)
+{
+     struct shell sh = {0};
+     sh.history = hist_open(NULL);
+     hist_add(sh.history, "a");
+     hist_add(sh.history, "b");
+     hist_add(sh.history, "c");
+     hist_add(sh.history, "d");
+     builtin_fn history = builtin_lookup("history");
+     int status;
+
+     char *all[] = {"history", NULL};
+     char *out = capture_sh(history, &sh, all, &status);
+     TEST_ASSERT_EQUAL_INT(0, status);
+     TEST_ASSERT_EQUAL_STRING("1: a\n2: b\n3: c\n4: d\n", out);
+     free(out);
+
+     char *tail[] = {"history", "2", NULL};
+     out = capture_sh(history, &sh, tail, &status);
+     TEST_ASSERT_EQUAL_STRING("3: c\n4: d\n", out);
+     free(out);
+
+     char *range[] = {"history", "2-3", NULL};
+     out = capture_sh(history, &sh, range, &status);
+     TEST_ASSERT_EQUAL_STRING("2: b\n3: c\n", out);
+     free(out);
+
+     char *bad[] = {"history", "3-1", NULL};
+     out = capture_sh(history, &sh, bad, &status);
+     TEST_ASSERT_EQUAL_INT(2, status);
+     free(out);
+
+     // A reader that went away stops the output with an error
+     int fds[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+     close(fds[0]);
+     void (*old)(int) = signal(SIGPIPE, SIG_IGN);
+     int saved = dup(STDOUT_FILENO);
+     dup2(fds[1], STDOUT_FILENO);
+     status = history(&sh, all);
+     dup2(saved, STDOUT_FILENO);
+     close(saved);
+     close(fds[1]);
+     signal(SIGPIPE, old);
+     TEST_ASSERT_EQUAL_INT(1, status);
+
+     hist_close(sh.history);
+}
+
+static void assert_expand(struct history *h, const char *line, const char *want)
+{
+     char *out;
+     TEST_ASSERT_EQUAL_INT(1, hist_expand(h, line, &out));
+     TEST_ASSERT_EQUAL_STRING(want, out);
+     free(out);
+}
+
+void test_history_expand(void)
+{
+     struct history *h = hist_open(NULL);
+     hist_add(h, "make -C build/release/with/a/long/path all");
+     hist_add(h, "make -C build/release/with/a/long/path/too clean");
+     hist_add(h, "git status");
+     hist_add(h, "ls -la");
+
+     assert_expand(h, "!!", "ls -la");
+     assert_expand(h, "sudo !!", "sudo ls -la");
+     assert_expand(h, "!3", "git status");
+     assert_expand(h, "!-2", "git status");
+     assert_expand(h, "!1 && !-1", "make -C build/release/with/a/long/path all && ls -la");
+     assert_expand(h, "!gi", "git status");
+     assert_expand(h, "!make", "make -C build/release/with/a/long/path/too clean");
+     assert_expand(h, "echo \\!! '!!'", "echo !! '!!'");
+
+     char *out = (char *)"unchanged";
+     TEST_ASSERT_EQUAL_INT(0, hist_expand(h, "echo hi", &out));
+     TEST_ASSERT_NULL(out);
+     TEST_ASSERT_EQUAL_INT(0, hist_expand(h, "echo ! != '!x'", &out));
+     TEST_ASSERT_EQUAL_INT(-1, hist_expand(h, "!svn", &out));
+     TEST_ASSERT_EQUAL_INT(-1, hist_expand(h, "!5", &out));
+     TEST_ASSERT_EQUAL_INT(-1, hist_expand(h, "!-5", &out));
+     TEST_ASSERT_EQUAL_INT(-1, hist_expand(h, "!0", &out));
+
+     // Entries added after the prefix index was built
+     hist_add(h, "gitk --all");
+     assert_expand(h, "!git", "gitk --all");
+     TEST_ASSERT_EQUAL_INT(2, hist_prefix(h, "git ", 4));
+     // Longer than the indexed prefix, the newest match is not the answer
+     TEST_ASSERT_EQUAL_INT(0, hist_prefix(h, "make -C build/release/with/a/long/path a", 40));
+     hist_close(h);
+}
+
+void test_zdb_rank(void)
+{
+     char path[128];
+     hist_temp_path(path, sizeof(path));
+     struct zdb *z = zdb_open(path);
+     struct zdb *other = zdb_open(path);
+     TEST_ASSERT_NOT_NULL(z);
+     TEST_ASSERT_NOT_NULL(other);
+     time_t now = 1700000000;
+
+     zdb_visit(z, "/home/u/src/Project", now - 2 * 86400);
+     zdb_visit(z, "/home/u/src/Project", now - 2 * 86400);
+     zdb_visit(z, "/home/u/src/Project", now - 2 * 86400);
+     zdb_visit(z, "/home/u/proj-notes", now - 60);
+     zdb_visit(z, "/var/log", now);
+
+     // Three old visits are worth less than one from a minute ago
+     const struct zdb_match *hits;
+     char *proj[] = {"proj", NULL};
+     TEST_ASSERT_EQUAL_INT(2, zdb_query(z, proj, now, &hits));
+     TEST_ASSERT_EQUAL_STRING("/home/u/proj-notes", hits[0].path);
+     TEST_ASSERT_EQUAL_STRING("/home/u/src/Project", hits[1].path);
+     TEST_ASSERT_TRUE(hits[0].score == 4.0);
+     TEST_ASSERT_TRUE(hits[1].score == 1.5);
+
+     // Words match in order, ignoring case, short ones without the index
+     char *order[] = {"SRC", "pro", NULL};
+     TEST_ASSERT_EQUAL_INT(1, zdb_query(z, order, now, &hits));
+     char *reversed[] = {"pro", "src", NULL};
+     TEST_ASSERT_EQUAL_INT(0, zdb_query(z, reversed, now, &hits));
+     char *shorts[] = {"v", "l", NULL};
+     TEST_ASSERT_EQUAL_INT(1, zdb_query(z, shorts, now, &hits));
+     TEST_ASSERT_EQUAL_STRING("/var/log", hits[0].path);
+     char *all[] = {NULL};
+     TEST_ASSERT_EQUAL_INT(3, zdb_query(other, all, now, &hits));
+
+     TEST_ASSERT_EQUAL_INT(0, zdb_remove(other, "/var/log"));
+     TEST_ASSERT_EQUAL_INT(-1, zdb_remove(other, "/var/log"));
+     TEST_ASSERT_EQUAL_INT(2, zdb_query(z, all, now, &hits));
+
+     // Enough visits to one directory age the rest out, the file is then
+     // compacted and the other handle follows it
+     for (int i = 0; i < 100000; i++) {
+          zdb_visit(z, "/home/u/src/Project", now);
+     }
+     TEST_ASSERT_EQUAL_INT(1, zdb_query(other, all, now, &hits));
+     TEST_ASSERT_EQUAL_STRING("/home/u/src/Project", hits[0].path);
+     TEST_ASSERT_TRUE(hits[0].score < 4 * 100000.0);
+     zdb_visit(other, "/tmp", now);
+     TEST_ASSERT_EQUAL_INT(2, zdb_query(z, all, now, &hits));
+
+     zdb_close(z);
+     zdb_close(other);
+     unlink(path);
+}
+
+// A file cut short, by a crash or anything else, is read as empty
+void test_zdb_truncated(void)
+{
+     char path[128];
+     hist_temp_path(path, sizeof(path));
+     struct zdb *z = zdb_open(path);
+     TEST_ASSERT_NOT_NULL(z);
+     zdb_visit(z, "/home/u/src/Project", 1700000000);
+     zdb_visit(z, "/var/log", 1700000000);
+     zdb_close(z);
+     // Cuts the second record in half, the first one must survive
+     TEST_ASSERT_EQUAL_INT(0, truncate(path, 100));
+
+     const struct zdb_match *hits;
+     char *all[] = {NULL};
+     z = zdb_open(path);
+     TEST_ASSERT_NOT_NULL(z);
+     TEST_ASSERT_EQUAL_INT(1, zdb_query(z, all, 1700000000, &hits));
+     TEST_ASSERT_EQUAL_STRING("/home/u/src/Project", hits[0].path);
+     TEST_ASSERT_EQUAL_INT(0, zdb_visit(z, "/tmp", 1700000000));
+     TEST_ASSERT_EQUAL_INT(2, zdb_query(z, all, 1700000000, &hits));
+     zdb_close(z);
+
+     // Nothing left that fits, the database starts over
+     TEST_ASSERT_EQUAL_INT(0, truncate(path, 60));
+     z = zdb_open(path);
+     TEST_ASSERT_NOT_NULL(z);
+     TEST_ASSERT_EQUAL_INT(0, zdb_query(z, all, 1700000000, &hits));
+     TEST_ASSERT_EQUAL_INT(0, zdb_visit(z, "/tmp", 1700000000));
+     TEST_ASSERT_EQUAL_INT(1, zdb_query(z, all, 1700000000, &hits));
+     TEST_ASSERT_EQUAL_STRING("/tmp", hits[0].path);
+     zdb_close(z);
+     unlink(path);
+}
+
+void test_dir_stack(void)
+{
+     char start[PATH_MAX];
+     char path[128];
+     char dir[] = "/tmp/test-lab-dirs-XXXXXX";
+     TEST_ASSERT_NOT_NULL(getcwd(start, sizeof(start)));
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char sub[PATH_MAX];
+     snprintf(sub, sizeof(sub), "%s/deep", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(sub, 0700));
+     TEST_ASSERT_EQUAL_INT(0, chdir("/"));
+
+     struct shell sh = {0};
+     hist_temp_path(path, sizeof(path));
+     sh.zdb = zdb_open(path);
+     builtin_fn pushd = builtin_lookup("pushd");
+     builtin_fn popd = builtin_lookup("popd");
+     builtin_fn dirs = builtin_lookup("dirs");
+     builtin_fn z = builtin_lookup("z");
+     int status;
+     char want[PATH_MAX * 3];
+
+     char *push_dir[] = {"pushd", dir, NULL};
+     char *out = capture_sh(pushd, &sh, push_dir, &status);
+     TEST_ASSERT_EQUAL_INT(0, status);
+     snprintf(want, sizeof(want), "%s /\n", dir);
+     TEST_ASSERT_EQUAL_STRING(want, out);
+     free(out);
+
+     char *push_sub[] = {"pushd", "deep", NULL};
+     out = capture_sh(pushd, &sh, push_sub, &status);
+     snprintf(want, sizeof(want), "%s %s /\n", sub, dir);
+     TEST_ASSERT_EQUAL_STRING(want, out);
+     free(out);
+
+     char *swap[] = {"pushd", NULL};
+     out = capture_sh(pushd, &sh, swap, &status);
+     snprintf(want, sizeof(want), "%s %s /\n", dir, sub);
+     TEST_ASSERT_EQUAL_STRING(want, out);
+     free(out);
+
+     char *pop[] = {"popd", NULL};
+     out = capture_sh(popd, &sh, pop, &status);
+     snprintf(want, sizeof(want), "%s /\n", sub);
+     TEST_ASSERT_EQUAL_STRING(want, out);
+     free(out);
+     TEST_ASSERT_EQUAL_UINT(4, sh.cwd_gen);
+
+     char *bad[] = {"pushd", "/nonexistent-dir", NULL};
+     out = capture_sh(pushd, &sh, bad, &status);
+     TEST_ASSERT_EQUAL_INT(1, status);
+     free(out);
+     char *show[] = {"dirs", NULL};
+     out = capture_sh(dirs, &sh, show, &status);
+     TEST_ASSERT_EQUAL_STRING(want, out);
+     free(out);
+
+     // Every directory changed to was recorded, z goes to the best one
+     char *jump[] = {"z", "deep", NULL};
+     TEST_ASSERT_EQUAL_INT(0, chdir("/"));
+     TEST_ASSERT_EQUAL_INT(0, z(&sh, jump));
+     char *cwd = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_STRING(sub, cwd);
+     free(cwd);
+     char *none[] = {"z", "no-such-directory", NULL};
+     TEST_ASSERT_EQUAL_INT(1, z(&sh, none));
+
+     // A directory that is gone is dropped and the next match used
+     TEST_ASSERT_EQUAL_INT(0, chdir("/"));
+     rmdir(sub);
+     char *test_lab[] = {"z", "test-lab-dirs", NULL};
+     TEST_ASSERT_EQUAL_INT(0, z(&sh, test_lab));
+     cwd = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_STRING(dir, cwd);
+     free(cwd);
+
+     char *clear[] = {"dirs", "-c", NULL};
+     TEST_ASSERT_EQUAL_INT(0, dirs(&sh, clear));
+     TEST_ASSERT_EQUAL_INT(1, popd(&sh, pop));
+
+     TEST_ASSERT_EQUAL_INT(0, chdir(start));
+     rmdir(dir);
+     zdb_close(sh.zdb);
+     free(sh.cwd);
+     unlink(path);
+}
+
+void test_cd_cached(void)
+{
+     char start[PATH_MAX];
+     char dir[] = "/tmp/test-lab-cd-XXXXXX";
+     char real[PATH_MAX], link[PATH_MAX], want[PATH_MAX + 2];
+     TEST_ASSERT_NOT_NULL(getcwd(start, sizeof(start)));
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     snprintf(real, sizeof(real), "%s/real", dir);
+     snprintf(link, sizeof(link), "%s/link", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(real, 0700));
+     TEST_ASSERT_EQUAL_INT(0, symlink("real", link));
+     TEST_ASSERT_EQUAL_INT(0, chdir(dir));
+
+     struct shell sh = {0};
+     sh.home = strdup(real);
+     builtin_fn cd = builtin_lookup("cd");
+     builtin_fn pwd = builtin_lookup("pwd");
+     int status;
+
+     // The path through the symlink is kept, and .. goes back through it
+     char *to_link[] = {"cd", "link", NULL};
+     TEST_ASSERT_EQUAL_INT(0, cd(&sh, to_link));
+     TEST_ASSERT_EQUAL_STRING(link, sh_cwd(&sh));
+     TEST_ASSERT_EQUAL_STRING(link, getenv("PWD"));
+     char *show[] = {"pwd", NULL};
+     char *out = capture_sh(pwd, &sh, show, &status);
+     snprintf(want, sizeof(want), "%s\n", link);
+     TEST_ASSERT_EQUAL_STRING(want, out);
+     free(out);
+     char *physical[] = {"pwd", "-P", NULL};
+     out = capture_sh(pwd, &sh, physical, &status);
+     snprintf(want, sizeof(want), "%s\n", real);
+     TEST_ASSERT_EQUAL_STRING(want, out);
+     free(out);
+
+     char *up[] = {"cd", "./..", NULL};
+     TEST_ASSERT_EQUAL_INT(0, cd(&sh, up));
+     TEST_ASSERT_EQUAL_STRING(dir, sh_cwd(&sh));
+     TEST_ASSERT_EQUAL_STRING(link, getenv("OLDPWD"));
+
+     char *back[] = {"cd", "-", NULL};
+     out = capture_sh(cd, &sh, back, &status);
+     TEST_ASSERT_EQUAL_INT(0, status);
+     snprintf(want, sizeof(want), "%s\n", link);
+     TEST_ASSERT_EQUAL_STRING(want, out);
+     free(out);
+     TEST_ASSERT_EQUAL_STRING(dir, getenv("OLDPWD"));
+
+     char *home[] = {"cd", NULL};
+     TEST_ASSERT_EQUAL_INT(0, cd(&sh, home));
+     TEST_ASSERT_EQUAL_STRING(real, sh_cwd(&sh));
+     char *missing[] = {"cd", "no-such-dir", NULL};
+     TEST_ASSERT_EQUAL_INT(1, cd(&sh, missing));
+     TEST_ASSERT_EQUAL_STRING(real, sh_cwd(&sh));
+     TEST_ASSERT_EQUAL_UINT(4, sh.cwd_gen);
+
+     TEST_ASSERT_EQUAL_INT(0, chdir(start));
+     setenv("PWD", start, 1);
+     unsetenv("OLDPWD");
+     unlink(link);
+     rmdir(real);
+     rmdir(dir);
+     free(sh.home);
+     free(sh.cwd);
+}
+
+static void make_exec(const char *dir, const char *name, mode_t mode)
+{
+     char path[PATH_MAX];
+     snprintf(path, sizeof(path), "%s/%s", dir, name);
+     int fd = open(path, O_WRONLY | O_CREAT, mode);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+}
+
+static void assert_matches(char **m, const char *want)
+{
+     // want is the replacement and the matches separated by spaces
+     char got[512] = "";
+     for (size_t i = 0; m && m[i]; i++) {
+          if (i) strcat(got, " ");
+          strcat(got, m[i]);
+          free(m[i]);
+     }
+     free(m);
+     TEST_ASSERT_EQUAL_STRING(want, got);
+}
+
+void test_completion(void)
+{
+     char a[] = "/tmp/test-lab-comp-XXXXXX";
+     char b[] = "/tmp/test-lab-comp-XXXXXX";
+     char path[128];
+     TEST_ASSERT_NOT_NULL(mkdtemp(a));
+     TEST_ASSERT_NOT_NULL(mkdtemp(b));
+     make_exec(a, "zzfoo", 0755);
+     make_exec(a, "zzbar", 0755);
+     make_exec(b, "zzfoo", 0755);
+     make_exec(b, "zzbaz", 0755);
+     make_exec(b, "zzdata", 0644);
+     snprintf(path, sizeof(path), "%s:%s:/no/such/dir", a, b);
+
+     struct completer *c = comp_start(path);
+     TEST_ASSERT_NOT_NULL(c);
+     assert_matches(comp_command(c, "zzb"), "zzba zzbar zzbaz");
+     assert_matches(comp_command(c, "zzf"), "zzfoo");
+     assert_matches(comp_command(c, "zzd"), "");
+     assert_matches(comp_command(c, "xarg"), "xargs");
+     TEST_ASSERT_EQUAL_UINT(2, comp_scans(c));
+
+     // Only a directory that changed is read again
+     comp_refresh(c, NULL);
+     comp_wait(c);
+     TEST_ASSERT_EQUAL_UINT(2, comp_scans(c));
+     make_exec(b, "zzbat", 0755);
+     comp_refresh(c, NULL);
+     comp_wait(c);
+     TEST_ASSERT_EQUAL_UINT(3, comp_scans(c));
+     assert_matches(comp_command(c, "zzba"), "zzba zzbar zzbat zzbaz");
+     comp_refresh(c, a);
+     comp_wait(c);
+     assert_matches(comp_command(c, "zzba"), "zzbar");
+
+     int jobs[] = {1, 12, 2};
+     comp_set_jobs(c, jobs, 3);
+     assert_matches(comp_jobs(c, "%1"), "%1 %1 %12");
+     assert_matches(comp_jobs(c, "%2"), "%2");
+
+     struct history *h = hist_open(NULL);
+     hist_add(h, "git commit -m msg");
+     hist_add(h, "git checkout  main");
+     comp_set_history(c, h);
+     comp_wait(c);
+     assert_matches(comp_history(c, "che"), "checkout");
+     hist_add(h, "make check");
+     // Not handed over yet
+     assert_matches(comp_history(c, "ch"), "checkout");
+     comp_set_history(c, h);
+     comp_wait(c);
+     assert_matches(comp_history(c, "ch"), "check check checkout");
+
+     // Only the newest entries count
+     for (int i = 0; i < COMP_HISTORY_LINES; i++) {
+          char line[32];
+          snprintf(line, sizeof(line), "echo w%d", i);
+          hist_add(h, line);
+     }
+     comp_set_history(c, h);
+     comp_wait(c);
+     assert_matches(comp_history(c, "che"), "");
+     assert_matches(comp_history(c, "w999"), "w999");
+     hist_close(h);
+     comp_stop(c);
+
+     const char *names[] = {"zzfoo", "zzbar", "zzbat", "zzbaz", "zzdata"};
+     for (size_t i = 0; i < 5; i++) {
+          snprintf(path, sizeof(path), "%s/%s", a, names[i]);
+          unlink(path);
+          snprintf(path, sizeof(path), "%s/%s", b, names[i]);
+          unlink(path);
+     }
+     rmdir(a);
+     rmdir(b);
+}
+
+static void assert_glob(struct glob_cache *gc, const char *root, const char *pattern,
+                        const char *want)
+{
+     // Patterns are relative to root, which is taken off the matches again
+     char full[PATH_MAX];
+     char **m;
+     size_t n;
+     snprintf(full, sizeof(full), "%s/%s", root, pattern);
+     TEST_ASSERT_EQUAL_INT(0, glob_expand(full, gc, 1, &m, &n));
+     size_t skip = strlen(root) + 1;
+     for (size_t i = 0; i < n; i++) {
+          memmove(m[i], m[i] + skip, strlen(m[i] + skip) + 1);
+     }
+     m = realloc(m, (n + 1) * sizeof(char *));
+     m[n] = NULL;
+     assert_matches(m, want);
+}
+
+void test_glob(void)
+{
+     TEST_ASSERT_TRUE(glob_match("*.c", "main.c"));
+     TEST_ASSERT_TRUE(glob_match("a*b*c", "aXbYbZc"));
+     TEST_ASSERT_TRUE(glob_match("[!a-c]?", "dz"));
+     TEST_ASSERT_TRUE(glob_match("[]x]", "]"));
+     TEST_ASSERT_TRUE(glob_match("\\*", "*"));
+     TEST_ASSERT_FALSE(glob_match("\\*", "a"));
+     TEST_ASSERT_FALSE(glob_match("*.c", "main.h"));
+     TEST_ASSERT_FALSE(glob_match("[^a]", "a"));
+     TEST_ASSERT_FALSE(glob_has_magic("plain\\*"));
+
+     char root[] = "/tmp/test-lab-glob-XXXXXX";
+     char path[PATH_MAX];
+     TEST_ASSERT_NOT_NULL(mkdtemp(root));
+     const char *dirs[] = {"src", "src/deep", "src/.git"};
+     for (size_t i = 0; i < 3; i++) {
+          snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+          TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0755));
+     }
+     const char *files[] = {"a.c", "b.h", ".hid.c", "src/x.c", "src/y.c", "src/deep/z.c",
+                            "src/.git/h.c"};
+     for (size_t i = 0; i < 7; i++) make_exec(root, files[i], 0644);
+     snprintf(path, sizeof(path), "%s/lnk", root);
+     TEST_ASSERT_EQUAL_INT(0, symlink("src", path));
+
+     // The same answers as bash -O globstar
+     struct glob_cache *gc = glob_cache_new(GLOB_CACHE_ENTRIES);
+     assert_glob(gc, root, "*", "a.c b.h lnk src");
+     assert_glob(gc, root, "?.[ch]", "a.c b.h");
+     assert_glob(gc, root, "[!a]*", "b.h lnk src");
+     assert_glob(gc, root, ".*.c", ".hid.c");
+     assert_glob(gc, root, "*/", "lnk/ src/");
+     assert_glob(gc, root, "*/*.c", "lnk/x.c lnk/y.c src/x.c src/y.c");
+     assert_glob(gc, root, "**/*.c", "a.c src/deep/z.c src/x.c src/y.c");
+     assert_glob(gc, root, "src/**", "src/ src/deep src/deep/z.c src/x.c src/y.c");
+     assert_glob(gc, root, "src/**/", "src/ src/deep/");
+     assert_glob(gc, root, "nothing*", "");
+
+     // A cached listing is read again once its directory changes
+     make_exec(root, "src/deep/w.c", 0644);
+     assert_glob(gc, root, "**/*.c", "a.c src/deep/w.c src/deep/z.c src/x.c src/y.c");
+     assert_glob(NULL, root, "**/*.c", "a.c src/deep/w.c src/deep/z.c src/x.c src/y.c");
+     glob_cache_free(gc);
+
+     char pattern[PATH_MAX];
+     snprintf(pattern, sizeof(pattern), "%s/*.h", root);
+     char *argv[] = {"ls", pattern, "none*", NULL};
+     char **out = glob_argv(NULL, argv);
+     TEST_ASSERT_NOT_NULL(out);
+     TEST_ASSERT_EQUAL_STRING("ls", out[0]);
+     TEST_ASSERT_EQUAL_STRING("b.h", out[1] + strlen(root) + 1);
+     TEST_ASSERT_EQUAL_STRING("none*", out[2]);
+     TEST_ASSERT_NULL(out[3]);
+     cmd_free(out);
+     char *plain[] = {"ls", "-l", NULL};
+     TEST_ASSERT_TRUE(glob_argv(NULL, plain) == plain);
+
+     // Escaping backslashes go, matched or not, as bash removes quotes
+     snprintf(pattern, sizeof(pattern), "%s/\\*.h", root);
+     char *escaped[] = {"echo", "\\*", "a\\ b", "none\\?*", pattern, "end\\", NULL};
+     out = glob_argv(NULL, escaped);
+     TEST_ASSERT_NOT_NULL(out);
+     TEST_ASSERT_EQUAL_STRING("*", out[1]);
+     TEST_ASSERT_EQUAL_STRING("a b", out[2]);
+     TEST_ASSERT_EQUAL_STRING("none?*", out[3]);
+     TEST_ASSERT_EQUAL_STRING("*.h", out[4] + strlen(root) + 1);
+     TEST_ASSERT_EQUAL_STRING("end\\", out[5]);
+     TEST_ASSERT_NULL(out[6]);
+     cmd_free(out);
+
+     const char *rm[] = {"src/deep/w.c", "src/.git/h.c", "src/deep/z.c", "src/x.c", "src/y.c",
+                         ".hid.c", "a.c", "b.h", "lnk"};
+     for (size_t i = 0; i < 9; i++) {
+          snprintf(path, sizeof(path), "%s/%s", root, rm[i]);
+          unlink(path);
+     }
+     for (size_t i = 3; i-- > 0;) {
+          snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+          rmdir(path);
+     }
+     rmdir(root);
+}
+
+static void glob_tree(const char *root, bool create)
+{
+     // Enough directories that a walk brings in its thread pool
+     char path[PATH_MAX];
+     static const char *files[] = {"a.c", "b.h", ".c", "c.c"};
+     for (int d = 0; d < 40; d++) {
+          for (int e = 0; e < 5; e++) {
+               snprintf(path, sizeof(path), "%s/d%d", root, d);
+               if (create && e == 0) mkdir(path, 0755);
+               snprintf(path, sizeof(path), "%s/d%d/e%d", root, d, e);
+               if (create) mkdir(path, 0755);
+               for (int f = 0; f < 4; f++) {
+                    snprintf(path, sizeof(path), "%s/d%d/e%d/%s", root, d, e, files[f]);
+                    if (create) {
+                         close(open(path, O_WRONLY | O_CREAT, 0644));
+                    } else {
+                         unlink(path);
+                    }
+               }
+               snprintf(path, sizeof(path), "%s/d%d/e%d", root, d, e);
+               if (!create) rmdir(path);
+          }
+          snprintf(path, sizeof(path), "%s/d%d", root, d);
+          if (!create) rmdir(path);
+     }
+}
+
+void test_glob_parallel(void)
+{
+     char root[] = "/tmp/test-lab-globp-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(root));
+     glob_tree(root, true);
+
+     static const char *patterns[] = {"**/*.c", "**", "*/*/", "d1*/**/?.[ch]", "**/e3/*"};
+     struct glob_cache *gc = glob_cache_new(GLOB_CACHE_ENTRIES);
+     char full[PATH_MAX];
+     for (size_t p = 0; p < 5; p++) {
+          snprintf(full, sizeof(full), "%s/%s", root, patterns[p]);
+          char **want;
+          size_t nwant;
+          TEST_ASSERT_EQUAL_INT(0, glob_expand(full, NULL, 1, &want, &nwant));
+          TEST_ASSERT_TRUE(nwant > 0);
+          // Several times over, with and without sharing the cache
+          for (int r = 0; r < 6; r++) {
+               char **got;
+               size_t ngot;
+               TEST_ASSERT_EQUAL_INT(0, glob_expand(full, r % 2 ? gc : NULL, 4, &got, &ngot));
+               TEST_ASSERT_EQUAL_UINT(nwant, ngot);
+               for (size_t i = 0; i < ngot; i++) {
+                    TEST_ASSERT_EQUAL_STRING(want[i], got[i]);
+                    free(got[i]);
+               }
+               free(got);
+          }
+          for (size_t i = 0; i < nwant; i++) free(want[i]);
+          free(want);
+     }
+     glob_cache_free(gc);
+
+     glob_tree(root, false);
+     rmdir(root);
+}
+
+static bool test_slot_used(const void *slot, uint32_t *hash)
+{
+     // Each value is its own hash
+     *hash = *(const uint32_t *)slot;
+     return *hash != 0;
+}
+
+void test_hashtab_delete(void)
+{
+     // 9 and 17 collide with 1, 15 with 7 and wraps around
+     uint32_t tab[8] = {15, 1, 9, 3, 17, 0, 0, 7};
+     hashtab_delete(tab, sizeof(uint32_t), 8, 1, test_slot_used);
+     uint32_t want[8] = {15, 9, 17, 3, 0, 0, 0, 7};
+     TEST_ASSERT_EQUAL_UINT32_ARRAY(want, tab, 8);
+
+     hashtab_delete(tab, sizeof(uint32_t), 8, 7, test_slot_used);
+     uint32_t wrapped[8] = {0, 9, 17, 3, 0, 0, 0, 15};
+     TEST_ASSERT_EQUAL_UINT32_ARRAY(wrapped, tab, 8);
+
+     TEST_ASSERT_EQUAL_UINT32(fnv1a_str("PATH"), fnv1a("PATH=/bin", 4));
+     TEST_ASSERT_EQUAL_UINT32(FNV1A_INIT, fnv1a("", 0));
+}
+
+void test_vars(void)
+{
+     extern char **environ;
+     char **saved = environ;
+     char *env[] = {"LAB_A=1", "LAB_B=two", "not valid=x", NULL};
+     struct shell sh = {0};
+     sh.vars = vars_new(env);
+     TEST_ASSERT_NOT_NULL(sh.vars);
+     TEST_ASSERT_EQUAL_STRING("two", vars_get(sh.vars, "LAB_B"));
+     TEST_ASSERT_NULL(vars_get(sh.vars, "LAB_C"));
+     TEST_ASSERT_EQUAL_INT(-1, vars_set(sh.vars, "1x", "y"));
+
+     // envp is only built again when an exported variable changes
+     char **envp = vars_envp(sh.vars);
+     TEST_ASSERT_NOT_NULL(envp[0]);
+     TEST_ASSERT_NOT_NULL(envp[1]);
+     TEST_ASSERT_NULL(envp[2]);
+     TEST_ASSERT_EQUAL_INT(0, vars_set(sh.vars, "LOCAL", "x"));
+     TEST_ASSERT_TRUE(vars_envp(sh.vars) == envp);
+     TEST_ASSERT_EQUAL_INT(0, vars_set(sh.vars, "LAB_A", "3"));
+     envp = vars_envp(sh.vars);
+     TEST_ASSERT_TRUE(strcmp(envp[0], "LAB_A=3") == 0 || strcmp(envp[1], "LAB_A=3") == 0);
+     TEST_ASSERT_EQUAL_INT(0, vars_export(sh.vars, "LATER"));
+     TEST_ASSERT_NULL(vars_envp(sh.vars)[2]);
+     TEST_ASSERT_EQUAL_INT(0, vars_set(sh.vars, "LATER", "now"));
+     TEST_ASSERT_NOT_NULL(vars_envp(sh.vars)[2]);
+
+     // Lots of changes go through compaction and growth
+     char name[32], value[32];
+     for (int i = 0; i < 5000; i++) {
+          snprintf(name, sizeof(name), "V%d", i % 300);
+          snprintf(value, sizeof(value), "value%d", i);
+          TEST_ASSERT_EQUAL_INT(0, vars_set(sh.vars, name, value));
+     }
+     TEST_ASSERT_EQUAL_STRING("value4999", vars_get(sh.vars, "V199"));
+     TEST_ASSERT_EQUAL_STRING("value4700", vars_get(sh.vars, "V200"));
+     TEST_ASSERT_EQUAL_STRING("x", vars_get(sh.vars, "LOCAL"));
+     TEST_ASSERT_EQUAL_INT(0, vars_unset(sh.vars, "V0"));
+     TEST_ASSERT_NULL(vars_get(sh.vars, "V0"));
+     TEST_ASSERT_EQUAL_STRING("value4701", vars_get(sh.vars, "V201"));
+     TEST_ASSERT_EQUAL_INT(-1, vars_unset(sh.vars, "V0"));
+
+     sh.last_status = 7;
+     sh.last_bg = 42;
+     char *word = vars_expand(&sh, "${LAB_B}s:$LAB_A/$?-$!$ \\$LOCAL $1 ${bad");
+     TEST_ASSERT_EQUAL_STRING("twos:3/7-42$ $LOCAL $1 ${bad", word);
+     free(word);
+     // An escaped backslash does not escape the $ after it
+     word = vars_expand(&sh, "\\\\$LOCAL \\\\\\$LOCAL a\\b");
+     TEST_ASSERT_EQUAL_STRING("\\\\x \\\\$LOCAL a\\b", word);
+     free(word);
+     char pid[32];
+     snprintf(pid, sizeof(pid), "%ld", (long)getpid());
+     word = vars_expand(&sh, "$$");
+     TEST_ASSERT_EQUAL_STRING(pid, word);
+     free(word);
+
+     char *argv[] = {"echo", "$NOPE", "a b$LOCAL", NULL};
+     char **out = vars_argv(&sh, argv);
+     TEST_ASSERT_EQUAL_STRING("echo", out[0]);
+     TEST_ASSERT_EQUAL_STRING("a bx", out[1]);
+     TEST_ASSERT_NULL(out[2]);
+     cmd_free(out);
+
+     // Assignments, export and unset reach environ once per command
+     sh_syncenv(&sh);
+     char **before = environ;
+     char *assign[] = {strdup("NEW=1"), strdup("LAB_B=$x"), NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, assign));
+     TEST_ASSERT_EQUAL_STRING("$x", sh_getvar(&sh, "LAB_B"));
+     TEST_ASSERT_TRUE(environ == before);
+     sh_syncenv(&sh);
+     TEST_ASSERT_EQUAL_STRING("$x", getenv("LAB_B"));
+     TEST_ASSERT_NULL(getenv("NEW"));
+     free(assign[0]);
+     free(assign[1]);
+     char *export[] = {"export", "NEW", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, export));
+     sh_syncenv(&sh);
+     TEST_ASSERT_EQUAL_STRING("1", getenv("NEW"));
+     char *unset[] = {"unset", "NEW", "LAB_A", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, unset));
+     sh_syncenv(&sh);
+     TEST_ASSERT_NULL(getenv("NEW"));
+     TEST_ASSERT_NULL(getenv("LAB_A"));
+     char *bad[] = {"export", "a-b=1", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, bad));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+
+     environ = saved;
+     vars_free(sh.vars);
+}
+
+static void assert_alias(struct aliases *al, const char *line, const char *want)
+{
+     char *got = alias_expand(al, line);
+     if (want) {
+          TEST_ASSERT_EQUAL_STRING(want, got);
+     } else {
+          TEST_ASSERT_NULL(got);
+     }
+     free(got);
+}
+
+void test_alias(void)
+{
+     struct aliases *al = alias_new();
+     TEST_ASSERT_NOT_NULL(al);
+     assert_alias(al, "ls -l", NULL);
+     TEST_ASSERT_EQUAL_INT(0, alias_set(al, "ls", "ls -F"));
+     TEST_ASSERT_EQUAL_INT(0, alias_set(al, "ll", "ls -l"));
+     TEST_ASSERT_EQUAL_INT(0, alias_set(al, "sudo", "sudo "));
+     TEST_ASSERT_EQUAL_INT(0, alias_set(al, "a", "b x"));
+     TEST_ASSERT_EQUAL_INT(0, alias_set(al, "b", "a y"));
+     TEST_ASSERT_EQUAL_INT(-1, alias_set(al, "a=b", "c"));
+
+     // ls is not expanded again inside its own value
+     assert_alias(al, "ls /tmp", "ls -F /tmp");
+     assert_alias(al, "  ll /tmp", "  ls -F -l /tmp");
+     assert_alias(al, "sudo ll", "sudo  ls -F -l");
+     assert_alias(al, "a", "a y x");
+     assert_alias(al, "echo ls", NULL);
+     assert_alias(al, "lsx", NULL);
+
+     TEST_ASSERT_EQUAL_INT(0, alias_set(al, "ll", "ls -la"));
+     TEST_ASSERT_EQUAL_STRING("ls -la", alias_get(al, "ll"));
+     TEST_ASSERT_EQUAL_INT(0, alias_remove(al, "ls"));
+     TEST_ASSERT_EQUAL_INT(-1, alias_remove(al, "ls"));
+     assert_alias(al, "ll", "ls -la");
+
+     // Enough to grow the table a few times
+     char name[16];
+     for (int i = 0; i < 1000; i++) {
+          snprintf(name, sizeof(name), "al%d", i);
+          TEST_ASSERT_EQUAL_INT(0, alias_set(al, name, "true"));
+     }
+     TEST_ASSERT_EQUAL_UINT(1004, alias_list(al, NULL, 0));
+     assert_alias(al, "al999 x", "true x");
+     alias_free(al);
+
+     // The builtins, with the value split up by the parser
+     struct shell sh = {0};
+     sh.aliases = alias_new();
+     char **argv = cmd_parse("alias gs='git status -s'");
+     TEST_ASSERT_TRUE(do_builtin(&sh, argv));
+     cmd_free(argv);
+     TEST_ASSERT_EQUAL_STRING("git status -s", alias_get(sh.aliases, "gs"));
+     char *unalias[] = {"unalias", "gs", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, unalias));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+     TEST_ASSERT_NULL(alias_get(sh.aliases, "gs"));
+     TEST_ASSERT_TRUE(do_builtin(&sh, unalias));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     alias_free(sh.aliases);
+}
+
+void test_trace(void)
+{
+     char path[] = "/tmp/test-lab-trace-XXXXXX";
+     close(mkstemp(path));
+     TEST_ASSERT_EQUAL_INT(0, trace_start(path));
+     TRACE("one");
+     TRACE("two");
+
+     // Spans from a forked child land in the same buffer
+     pid_t pid = fork();
+     if (pid == 0) {
+          TRACE("child");
+          _exit(0);
+     }
+     waitpid(pid, NULL, 0);
+     trace_flush();
+     TRACE("three");
+     trace_stop();
+     TEST_ASSERT_FALSE(trace_enabled);
+     TRACE("after");
+     TEST_ASSERT_EQUAL_UINT(0, trace_dropped());
+
+     char buf[4096];
+     int fd = open(path, O_RDONLY);
+     ssize_t n = read(fd, buf, sizeof(buf) - 1);
+     close(fd);
+     unlink(path);
+     TEST_ASSERT_TRUE(n > 0);
+     buf[n] = '\0';
+     TEST_ASSERT_EQUAL_STRING_LEN("[\n", buf, 2);
+     TEST_ASSERT_EQUAL_STRING("]\n", buf + n - 2);
+     TEST_ASSERT_NOT_NULL(strstr(buf, "\"name\":\"one\",\"ph\":\"X\""));
+     TEST_ASSERT_NOT_NULL(strstr(buf, "\"name\":\"two\""));
+     TEST_ASSERT_NOT_NULL(strstr(buf, "\"name\":\"three\""));
+     TEST_ASSERT_NULL(strstr(buf, "\"name\":\"after\""));
+     char child[64];
+     snprintf(child, sizeof(child), "\"name\":\"child\"");
+     char *c = strstr(buf, child);
+     TEST_ASSERT_NOT_NULL(c);
+     snprintf(child, sizeof(child), "\"pid\":%d,", (int)pid);
+     TEST_ASSERT_NOT_NULL(strstr(c, child));
+}
+
+void test_stats(void)
+{
+     stats_reset();
+     TEST_ASSERT_EQUAL_UINT(0, stats_percentile(STAT_FORK, 50));
+
+     // 1..1000us, so every percentile is known to within a bucket
+     for (uint64_t i = 1; i <= 1000; i++) stats_record(STAT_FORK, i * 1000);
+     TEST_ASSERT_EQUAL_UINT(1000, stats_count(STAT_FORK));
+     uint64_t p50 = stats_percentile(STAT_FORK, 50);
+     TEST_ASSERT_TRUE(p50 >= 500000 && p50 <= 500000 + 500000 / 8);
+     uint64_t p99 = stats_percentile(STAT_FORK, 99);
+     TEST_ASSERT_TRUE(p99 >= 990000 && p99 <= 1000000);
+     TEST_ASSERT_EQUAL_UINT(1000000, stats_percentile(STAT_FORK, 100));
+     TEST_ASSERT_EQUAL_UINT(1000, stats_percentile(STAT_FORK, 0));
+
+     // Small values get a bucket each and the top of the range still fits
+     stats_record(STAT_ALLOCS, 3);
+     stats_record(STAT_ALLOCS, 3);
+     stats_record(STAT_ALLOCS, 7);
+     TEST_ASSERT_EQUAL_UINT(3, stats_percentile(STAT_ALLOCS, 50));
+     TEST_ASSERT_EQUAL_UINT(7, stats_percentile(STAT_ALLOCS, 90));
+     stats_record(STAT_RUN, UINT64_MAX);
+     TEST_ASSERT_TRUE(stats_percentile(STAT_RUN, 50) == UINT64_MAX);
+
+     stats_add(STAT_COMMANDS, 2);
+     TEST_ASSERT_EQUAL_UINT(2, stats_counter(STAT_COMMANDS));
+     uint64_t allocs = stats_allocs(), bytes = stats_alloc_bytes();
+     free(strdup("x"));
+     free(malloc(8));
+     TEST_ASSERT_EQUAL_UINT(allocs + 2, stats_allocs());
+     TEST_ASSERT_EQUAL_UINT(bytes + 10, stats_alloc_bytes());
+
+     int status;
+     char *text[] = {"stats", NULL};
+     char *out = capture(builtin_stats, text, &status);
+     TEST_ASSERT_EQUAL_INT(0, status);
+     TEST_ASSERT_NOT_NULL(strstr(out, "commands         2\n"));
+     TEST_ASSERT_NOT_NULL(strstr(out, "\nfork          1000"));
+     free(out);
+
+     char *json[] = {"stats", "--json", "--reset", NULL};
+     out = capture(builtin_stats, json, &status);
+     TEST_ASSERT_EQUAL_INT(0, status);
+     TEST_ASSERT_EQUAL_STRING_LEN("{\"counters\":{\"commands\":2,", out, 25);
+     TEST_ASSERT_NOT_NULL(strstr(out, "\"allocs\":{\"unit\":\"count\",\"count\":3,\"min\":3,"
+                                      "\"max\":7,\"sum\":13,\"p50\":3,\"p90\":7,\"p99\":7,"
+                                      "\"p999\":7,\"buckets\":[[3,3,2],[7,7,1]]}"));
+     free(out);
+     TEST_ASSERT_EQUAL_UINT(0, stats_counter(STAT_COMMANDS));
+     TEST_ASSERT_EQUAL_UINT(0, stats_count(STAT_FORK));
+
+     char *bad[] = {"stats", "-x", NULL};
+     TEST_ASSERT_EQUAL_INT(2, builtin_stats(NULL, bad));
+}
+
+void test_perf(void)
+{
+     // A child that waits to be let go like the shell's, then execs
+     int go[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(go));
+     pid_t pid = fork();
+     if (pid == 0) {
+          char c;
+          close(go[1]);
+          if (read(go[0], &c, 1) < 0) _exit(1);
+          execl("/bin/sh", "sh", "-c", "sleep 0.01; sleep 0.01", (char *)NULL);
+          _exit(127);
+     }
+     close(go[0]);
+     struct perf_job pj;
+     int opened = perf_open(&pj, pid, true);
+     close(go[1]);
+     int status;
+     waitpid(pid, &status, 0);
+     TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(status));
+     perf_close(&pj);
+
+     // Whatever the machine allows, what opened is what gets reported
+     TEST_ASSERT_EQUAL_INT(opened, __builtin_popcount(pj.have));
+     if (opened < PERF_COUNTERS) TEST_ASSERT_NOT_EQUAL(0, pj.error);
+     for (int i = 0; i < PERF_COUNTERS; i++) TEST_ASSERT_EQUAL_INT(-1, pj.fds[i]);
+     if (pj.have & (1u << PERF_CONTEXT_SWITCHES)) {
+          // Both sleeps give up the CPU, and inherit counts the grandchildren
+          TEST_ASSERT_TRUE(pj.values[PERF_CONTEXT_SWITCHES] >= 2);
+     }
+
+     char path[] = "/tmp/test-lab-perf-XXXXXX";
+     int fd = mkstemp(path);
+     struct outbuf ob;
+     ob_init(&ob, fd);
+     perf_print(&ob, &pj);
+     ob_flush(&ob);
+     char buf[256] = "";
+     pread(fd, buf, sizeof(buf) - 1, 0);
+     close(fd);
+     unlink(path);
+     TEST_ASSERT_EQUAL_STRING_LEN("cycles=", buf, 7);
+     TEST_ASSERT_NOT_NULL(strstr(buf, " context-switches="));
+
+     // On the shell itself, counting right away
+     uint64_t before = stats_counter(STAT_PERF_JOBS);
+     opened = perf_open(&pj, 0, false);
+     perf_close(&pj);
+     perf_account(&pj);
+     TEST_ASSERT_EQUAL_INT(opened, __builtin_popcount(pj.have));
+     TEST_ASSERT_EQUAL_UINT(before + 1, stats_counter(STAT_PERF_JOBS));
+}
+
  int main(void) {
   UNITY_BEGIN();
   RUN_TEST(test_cmd_parse);
@@ -173,8 +1770,44 @@ void test_ch_dir_root(void)
   RUN_TEST(test_trim_white_all_whitespace);
   RUN_TEST(test_get_prompt_default);
   RUN_TEST(test_get_prompt_custom);
+  RUN_TEST(test_prompt_render);
+  RUN_TEST(test_vcs_status);
   RUN_TEST(test_ch_dir_home);
   RUN_TEST(test_ch_dir_root);
+  RUN_TEST(test_xargs_arg_limit);
+  RUN_TEST(test_xargs_batches);
+  RUN_TEST(test_xargs_status);
+  RUN_TEST(test_parallel_runs_everything);
+  RUN_TEST(test_cmd_parse_threads);
+  RUN_TEST(test_echo);
+  RUN_TEST(test_printf);
+  RUN_TEST(test_test_builtin);
+  RUN_TEST(test_true_false_builtin);
+  RUN_TEST(test_outbuf_iovecs);
+  RUN_TEST(test_builtin_register);
+  RUN_TEST(test_exit_builtin);
+  RUN_TEST(test_load_plugin);
+  RUN_TEST(test_history_persist);
+  RUN_TEST(test_history_torn_tail);
+  RUN_TEST(test_history_memory_only);
+  RUN_TEST(test_history_concurrent_writers);
+  RUN_TEST(test_history_search);
+  RUN_TEST(test_history_dups);
+  RUN_TEST(test_history_builtin);
+  RUN_TEST(test_history_expand);
+  RUN_TEST(test_zdb_rank);
+  RUN_TEST(test_zdb_truncated);
+  RUN_TEST(test_dir_stack);
+  RUN_TEST(test_cd_cached);
+  RUN_TEST(test_completion);
+  RUN_TEST(test_glob);
+  RUN_TEST(test_glob_parallel);
+  RUN_TEST(test_hashtab_delete);
+  RUN_TEST(test_vars);
+  RUN_TEST(test_alias);
+  RUN_TEST(test_trace);
+  RUN_TEST(test_stats);
+  RUN_TEST(test_perf);
 
   return UNITY_END();
  }
\ No newline at end of file